@@ -1,6 +1,16 @@
 #include <android/log.h>
+#include <time.h>
+#include <stdint.h>
 
 
 #define LOGE(...) ((void)__android_log_print(ANDROID_LOG_ERROR, "main", __VA_ARGS__))
 #define LOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, "main", __VA_ARGS__))
 #define LOGD(...) ((void)__android_log_print(ANDROID_LOG_DEBUG, "main", __VA_ARGS__))
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -91,6 +91,7 @@ void engine_handle_cmd(struct android_app* app, int32_t cmd) {
 #ifdef USE_GAME_RENDER
                 renderer->init(app->window);
                 renderer->draw();
+                display_client->display_info();
 #else
                 virtio_gpu_info.native_window = app->window;
                 create_backend_thread(&virtio_gpu_info);
@@ -144,6 +145,9 @@ void android_main(struct android_app* state) {
     std::srand(0);
 
     std::unique_ptr<Renderer> renderer(new Renderer());
+    // The activity has one window and the renderer one EGL context, made
+    // current on the client thread: only scanout 0 is shown here. The
+    // other scanouts are served on their own sockets, see README.md.
     std::unique_ptr<DisplayClient> display_client(new DisplayClient(renderer.get()));
 
     struct engine_user_data user_data = {renderer.get(), display_client.get()};
@@ -3,8 +3,11 @@ extern "C"
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
+
+#include "vdisplay_protocol.h"
 }
 
 #include "renderer.h"
@@ -181,10 +184,7 @@ void Renderer::terminate()
 {
 	initialized = false;
 
-	if (gl_ctx.cur_surf.dma_info.dmabuf_fd != 0) {
-		close(gl_ctx.cur_surf.dma_info.dmabuf_fd);
-		gl_ctx.cur_surf.dma_info.dmabuf_fd = 0;
-	}
+	release_surface();
 
 	// Delete program object
 	if (gl_ctx.programObjectExternal) {
@@ -251,9 +251,19 @@ void Renderer::vdpy_surface_set(struct surface *surf)
 
 
 	if (surf->surf_type == SURFACE_DMABUF) {
-		if (gl_ctx.cur_surf.dma_info.dmabuf_fd != 0)
-			close(gl_ctx.cur_surf.dma_info.dmabuf_fd);
+		release_surface();
 		gl_ctx.cur_surf = *surf;
+	} else if (surf->surf_type == SURFACE_PIXMAN) {
+		release_surface();
+		gl_ctx.cur_surf = *surf;
+		gl_ctx.shm_map = mmap(NULL, surf->shm_info.size, PROT_READ, MAP_SHARED,
+				      surf->shm_info.memfd, 0);
+		if (gl_ctx.shm_map == MAP_FAILED) {
+			LOGE("%s failed to map the surface: %s\n", __func__, strerror(errno));
+			gl_ctx.shm_map = NULL;
+			return;
+		}
+		gl_ctx.shm_size = surf->shm_info.size;
 	} else {
 		/* Unsupported type */
 		return;
@@ -266,11 +276,24 @@ void Renderer::vdpy_surface_set(struct surface *surf)
 		// SDL_DestroyTexture(gl_ctx.surf_tex);
 		glDeleteTextures(1, &gl_ctx.surf_tex);
 //		checkGlError2("glDeleteTextures", gl_ctx.surf_tex);
+		gl_ctx.surf_tex = 0;
 	}
 	if (surf && (surf->surf_type == SURFACE_DMABUF)) {
 		egl_create_dma_tex(&gl_ctx.surf_tex);
 	}
 
+	/* Pixels are uploaded from the mapping, then only the damage of updates */
+	if (surf->surf_type == SURFACE_PIXMAN) {
+		glGenTextures(1, &gl_ctx.surf_tex);
+		glBindTexture(GL_TEXTURE_2D, gl_ctx.surf_tex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		shm_surface_upload(0, 0, surf->width, surf->height, true);
+		return;
+	}
+
 	/* For the surf_switch, it will be updated in surface_update */
 	if (surf->surf_type == SURFACE_DMABUF) {
 		EGLImageKHR egl_img = EGL_NO_IMAGE_KHR;
@@ -329,15 +352,129 @@ void Renderer::vdpy_surface_set(struct surface *surf)
 
 }
 
-void Renderer::vdpy_surface_update()
+void Renderer::vdpy_surface_update(struct dpy_frame_timing *timing,
+				   const struct dpy_damage *damage)
 {
+	bool is_dmabuf = (gl_ctx.cur_surf.surf_type == SURFACE_DMABUF);
+
 	if (!initialized)
 		return;
 
+	if (gl_ctx.surf_tex && !is_dmabuf) {
+		if (damage && damage->width && damage->height)
+			shm_surface_upload(damage->x, damage->y, damage->width, damage->height, false);
+		else
+			shm_surface_upload(0, 0, gl_ctx.cur_surf.width, gl_ctx.cur_surf.height, false);
+	}
 	if (gl_ctx.surf_tex)
-		egl_render_copy(gl_ctx.surf_tex, NULL, true);
+		egl_render_copy(gl_ctx.surf_tex, NULL, is_dmabuf);
+	if (timing)
+		timing->draw_ns = now_ns();
 
 	eglSwapBuffers(gl_ctx.eglDisplay, gl_ctx.eglSurface);
+	if (timing)
+		timing->present_ns = now_ns();
+}
+
+/* Drops the fd and the mapping of the current surface */
+void Renderer::release_surface()
+{
+	struct surface *surf = &gl_ctx.cur_surf;
+
+	if (surf->surf_type == SURFACE_PIXMAN) {
+		if (gl_ctx.shm_map)
+			munmap(gl_ctx.shm_map, gl_ctx.shm_size);
+		gl_ctx.shm_map = NULL;
+		gl_ctx.shm_size = 0;
+		if (surf->shm_info.memfd >= 0)
+			close(surf->shm_info.memfd);
+		surf->shm_info.memfd = -1;
+	} else if (surf->dma_info.dmabuf_fd != 0) {
+		close(surf->dma_info.dmabuf_fd);
+		surf->dma_info.dmabuf_fd = 0;
+	}
+}
+
+/*
+ * Uploads a rectangle of a SURFACE_PIXMAN surface from its mapping, the
+ * whole of it if init. Memory order B,G,R,A of [ax]8r8g8b8 is GL_BGRA_EXT,
+ * r5g6b5 is GL_UNSIGNED_SHORT_5_6_5; GLES has no type for [ax]1r5g5b5, its
+ * rows are made r5g6b5 first.
+ */
+int Renderer::shm_surface_upload(uint32_t x, uint32_t y, uint32_t w, uint32_t h, bool init)
+{
+	struct surface *surf = &gl_ctx.cur_surf;
+	GLenum format, type = GL_UNSIGNED_BYTE;
+	uint32_t bpp = 4, i, j;
+	bool convert = false;
+	const char *pixel;
+	const uint16_t *src;
+	uint16_t *dst, v, g;
+	GLint row_length;
+
+	if (!gl_ctx.shm_map)
+		return -1;
+	switch (surf->surf_format) {
+	case PIXMAN_a8r8g8b8:
+	case PIXMAN_x8r8g8b8:
+		format = GL_BGRA_EXT;
+		break;
+	case PIXMAN_a8b8g8r8:
+	case PIXMAN_x8b8g8r8:
+		format = GL_RGBA;
+		break;
+	case PIXMAN_r5g6b5:
+		format = GL_RGB;
+		type = GL_UNSIGNED_SHORT_5_6_5;
+		bpp = 2;
+		break;
+	case PIXMAN_a1r5g5b5:
+	case PIXMAN_x1r5g5b5:
+		format = GL_RGB;
+		type = GL_UNSIGNED_SHORT_5_6_5;
+		bpp = 2;
+		convert = true;
+		break;
+	default:
+		LOGE("%s unsupported format 0x%x\n", __func__, surf->surf_format);
+		return -1;
+	}
+	if ((x >= surf->width) || (y >= surf->height))
+		return -1;
+	if (w > surf->width - x)
+		w = surf->width - x;
+	if (h > surf->height - y)
+		h = surf->height - y;
+	if (surf->shm_info.offset + (uint64_t)(y + h - 1) * surf->stride + (uint64_t)(x + w) * bpp >
+	    gl_ctx.shm_size)
+		return -1;
+
+	pixel = (const char *)gl_ctx.shm_map + surf->shm_info.offset +
+		(uint64_t)y * surf->stride + x * bpp;
+	row_length = surf->stride / bpp;
+	if (convert) {
+		shm_convert.resize((size_t)w * h);
+		dst = shm_convert.data();
+		for (j = 0; j < h; j++) {
+			src = (const uint16_t *)(pixel + (uint64_t)j * surf->stride);
+			for (i = 0; i < w; i++) {
+				v = src[i];
+				g = (v >> 5) & 0x1f;
+				*dst++ = ((v & 0x7c00) << 1) | (((g << 1) | (g >> 4)) << 5) | (v & 0x1f);
+			}
+		}
+		pixel = (const char *)shm_convert.data();
+		row_length = w;
+	}
+	glBindTexture(GL_TEXTURE_2D, gl_ctx.surf_tex);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, bpp);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, row_length);
+	if (init)
+		glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, format, type, pixel);
+	else
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, format, type, pixel);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+	return 0;
 }
 
 void Renderer::vdpy_set_modifier(uint64_t modifier)
@@ -5,9 +5,13 @@
 #include <EGL/eglext.h>
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
+#include <vector>
 
 #include "vdisplay.h"
 
+struct dpy_frame_timing;
+struct dpy_damage;
+
 class Renderer {
 public:
     Renderer();
@@ -34,6 +38,9 @@ public:
         struct surface cur_surf;
 	    EGLImage egl_img;
         GLuint surf_tex;
+        // mapping of the memfd of a SURFACE_PIXMAN surface
+        void *shm_map;
+        size_t shm_size;
 
         // Handle to a program object
         GLuint programObject;
@@ -49,7 +56,8 @@ public:
 
     void draw();
     void vdpy_surface_set(struct surface *surf);
-    void vdpy_surface_update();
+    void vdpy_surface_update(struct dpy_frame_timing *timing = NULL,
+                             const struct dpy_damage *damage = NULL);
     void vdpy_set_modifier(uint64_t modifier);
 private:
     typedef struct{
@@ -60,6 +68,10 @@ private:
     int egl_render_copy(GLuint src_tex,
 				   const SDL_Rect * dstrect  __attribute__((unused)), bool is_dmabuf);
     int egl_create_dma_tex(GLuint *texid);
+    void release_surface();
+    int shm_surface_upload(uint32_t x, uint32_t y, uint32_t w, uint32_t h, bool init);
+    // [ax]1r5g5b5 pixels made r5g6b5 for the upload
+    std::vector<uint16_t> shm_convert;
 
     GLuint esLoadShader ( GLenum type, const char *shaderSrc );
     GLuint esLoadProgram ( const char *vertShaderSrc, const char *fragShaderSrc );
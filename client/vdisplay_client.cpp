@@ -20,8 +20,16 @@ extern "C"
 #define SERVER_SOCK_PATH  "/data/local/ipc/virt_disp_server"
 #define CLIENT_SOCK_PATH  "/data/local/ipc/virt_disp_client"
 
-DisplayClient::DisplayClient(Renderer * rd) : client_sock(-1), force_exit(false), renderer(rd)
-{}
+DisplayClient::DisplayClient(Renderer * rd, int scanout) : client_sock(-1), force_exit(false), renderer(rd)
+{
+    // scanout 0 keeps the plain paths, scanout n is served at <path>.<n>
+    server_path = SERVER_SOCK_PATH;
+    client_path = CLIENT_SOCK_PATH;
+    if (scanout > 0) {
+        server_path += "." + to_string(scanout);
+        client_path += "." + to_string(scanout);
+    }
+}
 
 int DisplayClient::start()
 {
@@ -40,10 +48,10 @@ int DisplayClient::start()
 
     memset(&client_sockaddr, 0, sizeof(struct sockaddr_un));
     client_sockaddr.sun_family = AF_UNIX;
-    strcpy(client_sockaddr.sun_path, CLIENT_SOCK_PATH);
+    strncpy(client_sockaddr.sun_path, client_path.c_str(), sizeof(client_sockaddr.sun_path) - 1);
     len = sizeof(client_sockaddr);
 
-    ::unlink(CLIENT_SOCK_PATH);
+    ::unlink(client_path.c_str());
     ret = ::bind(client_sock, (struct sockaddr *) &client_sockaddr, len);
     if (ret == -1){
         LOGE("BIND ERROR: %s\n", strerror(errno));
@@ -101,7 +109,7 @@ int DisplayClient::connect()
 
     memset(&server_sockaddr, 0, sizeof(struct sockaddr_un));
     server_sockaddr.sun_family = AF_UNIX;
-    strcpy(server_sockaddr.sun_path, SERVER_SOCK_PATH);
+    strncpy(server_sockaddr.sun_path, server_path.c_str(), sizeof(server_sockaddr.sun_path) - 1);
 
     len = sizeof(server_sockaddr);
     ret = ::connect(client_sock, (struct sockaddr *) &server_sockaddr, len);
@@ -184,12 +192,78 @@ int DisplayClient::hotplug(int in)
     return 0;
 }
 
+/* Tell the server the window size, which the guest then renders at */
+int DisplayClient::display_info()
+{
+    int ret;
+    struct dpy_evt_header evt_hdr;
+    struct display_info info;
+    std::unique_lock<mutex> lk(sock_mtx);
+
+    if (client_sock == -1) {
+        LOGE("%s() invalid client socket", __func__);
+        return -1;
+    }
+    if (!renderer || renderer->gl_ctx.width <= 0 || renderer->gl_ctx.height <= 0)
+        return 0;
+
+    memset(&info, 0, sizeof(info));
+    info.width = renderer->gl_ctx.width;
+    info.height = renderer->gl_ctx.height;
+
+    evt_hdr.e_type = DPY_EVENT_DISPLAY_INFO;
+    evt_hdr.e_magic = DISPLAY_MAGIC_CODE;
+    evt_hdr.e_size = sizeof(info);
+    ret = _send(client_sock, &evt_hdr, sizeof(evt_hdr));
+    if (ret != sizeof(evt_hdr)) {
+        LOGE("%s() send header fail(%d vs. 0x%lx) %s", __func__, ret, (unsigned long)sizeof(evt_hdr), strerror(errno));
+        return -1;
+    }
+
+    ret = _send(client_sock, &info, sizeof(info));
+    if (ret != sizeof(info)) {
+        LOGE("%s() send body fail(%d vs. 0x%lx) %s", __func__, ret, (unsigned long)sizeof(info), strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Report when a tagged frame was drawn and presented, for the server's latency stats */
+int DisplayClient::frame_done(const struct dpy_frame_timing *timing)
+{
+    int ret;
+    struct dpy_evt_header evt_hdr;
+    std::unique_lock<mutex> lk(sock_mtx);
+
+    if (client_sock == -1) {
+        LOGE("%s() invalid client socket", __func__);
+        return -1;
+    }
+
+    evt_hdr.e_type = DPY_EVENT_FRAME_DONE;
+    evt_hdr.e_magic = DISPLAY_MAGIC_CODE;
+    evt_hdr.e_size = sizeof(*timing);
+    ret = _send(client_sock, &evt_hdr, sizeof(evt_hdr));
+    if (ret != sizeof(evt_hdr)) {
+        LOGE("%s() send header fail(%d vs. 0x%lx) %s", __func__, ret, (unsigned long)sizeof(evt_hdr), strerror(errno));
+        return -1;
+    }
+
+    ret = _send(client_sock, (void *)timing, sizeof(*timing));
+    if (ret != sizeof(*timing)) {
+        LOGE("%s() send body fail(%d vs. 0x%lx) %s", __func__, ret, (unsigned long)sizeof(*timing), strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
 void * DisplayClient::work_thread(DisplayClient *cur_ctx)
 {
     bool is_connected = false;
     int ret;
     struct dpy_evt_header msg_header;
     char buf[256];
+    struct dpy_frame_timing timing;
 
     int epollfd = epoll_create1 (0);
     if (epollfd == -1) {
@@ -219,6 +293,7 @@ void * DisplayClient::work_thread(DisplayClient *cur_ctx)
         if (!is_connected) {
             if (cur_ctx->connect() == 0) {
                 is_connected = true;
+                cur_ctx->display_info();
                 cur_ctx->hotplug(1);
             } else {
                 usleep(500000);
@@ -280,23 +355,48 @@ void * DisplayClient::work_thread(DisplayClient *cur_ctx)
                     case DPY_EVENT_SURFACE_SET:
                     {
                         struct surface * surf = (struct surface *)buf;
-                        ret = recv_fd(cur_ctx->client_sock, &surf->dma_info.dmabuf_fd);
+                        ret = recv_fd(cur_ctx->client_sock, (surf->surf_type == SURFACE_PIXMAN) ?
+                                      &surf->shm_info.memfd : &surf->dma_info.dmabuf_fd);
                         if (ret < 0) {
                             LOGE("recv_fd failed! (ret=%d)", ret);
                             break;
                         }
                         lk.unlock();
 
+                        memset(&timing, 0, sizeof(timing));
+                        timing.recv_ns = now_ns();
                         if (cur_ctx->renderer)
                             cur_ctx->renderer->vdpy_surface_set(surf);
+                        if (surf->frame_id) {
+                            timing.frame_id = surf->frame_id;
+                            timing.flags = DPY_FRAME_SET;
+                            timing.draw_ns = now_ns();
+                            timing.present_ns = timing.draw_ns;
+                            cur_ctx->frame_done(&timing);
+                        }
                         break;
                     }
                     case DPY_EVENT_SURFACE_UPDATE:
                     {
                         lk.unlock();
 
+                        /* an untagged update of a dmabuf has no body */
+                        if (msg_header.e_size < (int)sizeof(struct dpy_frame_tag)) {
+                            if (cur_ctx->renderer)
+                                cur_ctx->renderer->vdpy_surface_update();
+                            break;
+                        }
+                        /* the damage, when known, follows the tag */
+                        struct dpy_damage *damage = NULL;
+                        if (msg_header.e_size >= (int)(sizeof(struct dpy_frame_tag) + sizeof(struct dpy_damage)))
+                            damage = (struct dpy_damage *)(buf + sizeof(struct dpy_frame_tag));
+                        memset(&timing, 0, sizeof(timing));
+                        timing.frame_id = ((struct dpy_frame_tag *)buf)->frame_id;
+                        timing.recv_ns = now_ns();
                         if (cur_ctx->renderer)
-                            cur_ctx->renderer->vdpy_surface_update();
+                            cur_ctx->renderer->vdpy_surface_update(timing.frame_id ? &timing : NULL, damage);
+                        if (timing.frame_id)
+                            cur_ctx->frame_done(&timing);
                         break;
                     }
                     case DPY_EVENT_SET_MODIFIER:
@@ -307,16 +407,6 @@ void * DisplayClient::work_thread(DisplayClient *cur_ctx)
                             cur_ctx->renderer->vdpy_set_modifier(*(uint64_t *)buf);
                         break;
                     }
-                    // case DPY_EVENT_DISPLAY_INFO:
-                    // {
-                    //     lk.unlock();
-                    //     struct display_info *info = (struct display_info *)buf;
-                    //     vscr->info.xoff = info->xoff;
-                    //     vscr->info.yoff = info->yoff;
-                    //     vscr->info.width = info->width;
-                    //     vscr->info.height = info->height;
-                    //     break;
-                    // }
                     default:
                         lk.unlock();
                         break;
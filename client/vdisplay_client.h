@@ -4,19 +4,22 @@
 #include "renderer.h"
 
 #include <mutex>
+#include <string>
 #include <thread>
 
 using namespace std;
 
 class DisplayClient {
 public:
-    DisplayClient(Renderer * rd);
+    DisplayClient(Renderer * rd, int scanout = 0);
     int start();
     int stop();
     int term();
 
     int connect();
     int hotplug(int in);
+    int display_info();
+    int frame_done(const struct dpy_frame_timing *timing);
 
 private:
 
@@ -24,6 +27,8 @@ private:
     static void * work_thread(DisplayClient *cur_ctx);
     int client_sock;
     std::mutex sock_mtx;
+    string server_path;
+    string client_path;
 
     bool force_exit;
     int exit_fd;
@@ -8,9 +8,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sched.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/queue.h>
 #include <pthread.h>
 #include <signal.h>
@@ -19,27 +22,66 @@
 #include "log.h"
 #include "mevent.h"
 
-
 #define MEVENT_MAX 64
 #define MAX_EVENT_NUM 64
+#define IOTHREAD_NAME_LEN 16
+
 struct iothread_ctx {
 	pthread_t tid;
 	int epfd;
+	int stop_fd;
 	bool started;
 	pthread_mutex_t mtx;
+	char name[IOTHREAD_NAME_LEN];
+	uint64_t cpu_mask;
+	int priority;
 };
+
+/* The context shared by iothread_add()/iothread_del() users */
 static struct iothread_ctx ioctx;
 
+static void
+iothread_apply_attr(struct iothread_ctx *ctx)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+	int cpu, ret;
+
+	if (ctx->cpu_mask) {
+		CPU_ZERO(&cpus);
+		for (cpu = 0; cpu < 64; cpu++)
+			if (ctx->cpu_mask & (1ULL << cpu))
+				CPU_SET(cpu, &cpus);
+
+		/* 0 is the calling thread, which works with bionic as well */
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+			pr_err("%s: %s: failed to set affinity 0x%llx, errno %d\n", __func__,
+				ctx->name, (unsigned long long)ctx->cpu_mask, errno);
+	}
+
+	if (ctx->priority > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = ctx->priority;
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (ret)
+			pr_err("%s: %s: failed to set priority %d, error %d\n", __func__,
+				ctx->name, ctx->priority, ret);
+	}
+}
+
 static void *
 io_thread(void *arg)
 {
+	struct iothread_ctx *ctx = arg;
 	struct epoll_event eventlist[MEVENT_MAX];
 	struct iothread_mevent *aevp;
 	int i, n, status;
 	char buf[MAX_EVENT_NUM];
 
-	while(ioctx.started) {
-		n = epoll_wait(ioctx.epfd, eventlist, MEVENT_MAX, -1);
+	iothread_apply_attr(ctx);
+
+	while(ctx->started) {
+		n = epoll_wait(ctx->epfd, eventlist, MEVENT_MAX, -1);
 		if (n < 0) {
 			if (errno == EINTR)
 				pr_info("%s: exit from epoll_wait\n", __func__);
@@ -63,36 +105,104 @@ io_thread(void *arg)
 }
 
 static int
-iothread_start(void)
+iothread_start(struct iothread_ctx *ctx)
 {
-	pthread_mutex_lock(&ioctx.mtx);
+	pthread_mutex_lock(&ctx->mtx);
 
-	if (ioctx.started) {
-		pthread_mutex_unlock(&ioctx.mtx);
+	if (ctx->started) {
+		pthread_mutex_unlock(&ctx->mtx);
 		return 0;
 	}
 
-	if (pthread_create(&ioctx.tid, NULL, io_thread, NULL) != 0) {
-		pthread_mutex_unlock(&ioctx.mtx);
+	ctx->started = true;
+	if (pthread_create(&ctx->tid, NULL, io_thread, ctx) != 0) {
+		ctx->started = false;
+		pthread_mutex_unlock(&ctx->mtx);
 		pr_err("%s", "iothread create failed\r\n");
 		return -1;
 	}
-	ioctx.started = true;
-	pthread_setname_np(ioctx.tid, "iothread");
-	pthread_mutex_unlock(&ioctx.mtx);
-	pr_info("iothread started\n");
+
+	pthread_setname_np(ctx->tid, ctx->name);
+	pthread_mutex_unlock(&ctx->mtx);
+	pr_info("%s started\n", ctx->name);
+
 	return 0;
 }
 
+static int
+iothread_ctx_init(struct iothread_ctx *ctx, const char *name)
+{
+	pthread_mutexattr_t attr;
+	struct epoll_event ee;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&ctx->mtx, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	ctx->tid = 0;
+	ctx->started = false;
+	snprintf(ctx->name, sizeof(ctx->name), "%s", name);
+
+	ctx->epfd = epoll_create1(0);
+	if (ctx->epfd < 0) {
+		pr_err("%s: failed to create epoll fd, error is %d\r\n",
+			__func__, errno);
+		return -1;
+	}
+
+	/* Wakes the thread up on teardown; it carries no iothread_mevent */
+	ctx->stop_fd = eventfd(0, EFD_NONBLOCK);
+	if (ctx->stop_fd < 0) {
+		pr_err("%s: failed to create stop fd, error is %d\r\n",
+			__func__, errno);
+		close(ctx->epfd);
+		ctx->epfd = -1;
+		return -1;
+	}
+	ee.events = EPOLLIN;
+	ee.data.ptr = NULL;
+	epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->stop_fd, &ee);
+
+	return 0;
+}
+
+static void
+iothread_ctx_stop(struct iothread_ctx *ctx)
+{
+	void *jval;
+
+	if (ctx->tid > 0) {
+		pthread_mutex_lock(&ctx->mtx);
+		ctx->started = false;
+		pthread_mutex_unlock(&ctx->mtx);
+		eventfd_write(ctx->stop_fd, 1);
+		pthread_join(ctx->tid, &jval);
+		ctx->tid = 0;
+	}
+
+	if (ctx->stop_fd > 0) {
+		close(ctx->stop_fd);
+		ctx->stop_fd = -1;
+	}
+	if (ctx->epfd > 0) {
+		close(ctx->epfd);
+		ctx->epfd = -1;
+	}
+	pthread_mutex_destroy(&ctx->mtx);
+	pr_info("%s stop\n", ctx->name);
+}
+
 int
-iothread_add(int fd, struct iothread_mevent *aevt)
+iothread_ctx_add(struct iothread_ctx *ctx, int fd, struct iothread_mevent *aevt)
 {
 	struct epoll_event ee;
 	int ret;
+
 	/* Create a epoll instance before the first fd is added.*/
 	ee.events = EPOLLIN;
 	ee.data.ptr = aevt;
-	ret = epoll_ctl(ioctx.epfd, EPOLL_CTL_ADD, fd, &ee);
+	ret = epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, fd, &ee);
 	if (ret < 0) {
 		pr_err("%s: failed to add fd, error is %d\n",
 			__func__, errno);
@@ -100,7 +210,7 @@ iothread_add(int fd, struct iothread_mevent *aevt)
 	}
 
 	/* Start the iothread after the first fd is added.*/
-	ret = iothread_start();
+	ret = iothread_start(ctx);
 	if (ret < 0) {
 		pr_err("%s: failed to start iothread thread\n",
 			__func__);
@@ -109,12 +219,12 @@ iothread_add(int fd, struct iothread_mevent *aevt)
 }
 
 int
-iothread_del(int fd)
+iothread_ctx_del(struct iothread_ctx *ctx, int fd)
 {
 	int ret = 0;
 
-	if (ioctx.epfd) {
-		ret = epoll_ctl(ioctx.epfd, EPOLL_CTL_DEL, fd, NULL);
+	if (ctx->epfd) {
+		ret = epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, fd, NULL);
 		if (ret < 0)
 			pr_err("%s: failed to delete fd from epoll fd, error is %d\n",
 				__func__, errno);
@@ -122,44 +232,65 @@ iothread_del(int fd)
 	return ret;
 }
 
-void
-iothread_deinit(void)
+/**
+ * @brief Create a dedicated iothread context.
+ *
+ * The thread is started when the first fd is added and applies the
+ * requested affinity and priority to itself before polling.
+ *
+ * @param attr Name and scheduling attributes of the thread.
+ *
+ * @return Pointer to the new context, or NULL on failure.
+ */
+struct iothread_ctx *
+iothread_create(const struct iothread_attr *attr)
 {
-	void *jval;
+	struct iothread_ctx *ctx;
 
-	if (ioctx.tid > 0) {
-		pthread_mutex_lock(&ioctx.mtx);
-		ioctx.started = false;
-		pthread_mutex_unlock(&ioctx.mtx);
-		pthread_kill(ioctx.tid, SIGCONT);
-		pthread_join(ioctx.tid, &jval);
-	}
-	if (ioctx.epfd > 0) {
-		close(ioctx.epfd);
-		ioctx.epfd = -1;
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	if (iothread_ctx_init(ctx, attr->name ? attr->name : "iothread") < 0) {
+		free(ctx);
+		return NULL;
 	}
-	pthread_mutex_destroy(&ioctx.mtx);
-	pr_info("iothread stop\n");
+	ctx->cpu_mask = attr->cpu_mask;
+	ctx->priority = attr->priority;
+
+	return ctx;
+}
+
+void
+iothread_destroy(struct iothread_ctx *ctx)
+{
+	if (!ctx)
+		return;
+
+	iothread_ctx_stop(ctx);
+	free(ctx);
 }
 
 int
-iothread_init(void)
+iothread_add(int fd, struct iothread_mevent *aevt)
 {
-	pthread_mutexattr_t attr;
+	return iothread_ctx_add(&ioctx, fd, aevt);
+}
 
-	pthread_mutexattr_init(&attr);
-	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&ioctx.mtx, &attr);
-	pthread_mutexattr_destroy(&attr);
+int
+iothread_del(int fd)
+{
+	return iothread_ctx_del(&ioctx, fd);
+}
 
-	ioctx.tid = 0;
-	ioctx.started = false;
-	ioctx.epfd = epoll_create1(0);
+void
+iothread_deinit(void)
+{
+	iothread_ctx_stop(&ioctx);
+}
 
-	if (ioctx.epfd < 0) {
-		pr_err("%s: failed to create epoll fd, error is %d\r\n",
-			__func__, errno);
-		return -1;
-	}
-	return 0;
+int
+iothread_init(void)
+{
+	return iothread_ctx_init(&ioctx, "iothread");
 }
@@ -29,6 +29,12 @@
 /*
  * Micro event library for FreeBSD, designed for a single i/o thread
  * using EPOLL, and having events be persistent by default.
+ *
+ * An io_uring backend can be selected with mevent_set_backend() before
+ * mevent_init(). It arms one poll (or, for EVF_COUNTER, one 8-byte read)
+ * per event and submits re-arms together with the wait, so each loop
+ * iteration costs a single io_uring_enter(). Only the dispatch thread
+ * touches the rings; other threads queue changes and kick the loop.
  */
 #include <errno.h>
 #include <stdlib.h>
@@ -36,9 +42,15 @@
 #include <stdbool.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
+#include <sys/syscall.h>
 #include <pthread.h>
+#include <linux/io_uring.h>
 
 #include "mevent.h"
 #include "vmmapi.h"
@@ -51,10 +63,37 @@
 #define	MEV_DISABLE	3
 #define	MEV_DEL_PENDING	4
 
+#define	MEVENT_URING_ENTRIES	256
+
 static int epoll_fd;
 static pthread_t mevent_tid;
-static int mevent_pipefd[2];
+static int mevent_notify_fd;
 static pthread_mutex_t mevent_lmutex;
+static enum mevent_backend mevent_backend_req = MEVENT_BACKEND_EPOLL;
+
+static struct mevent_uring {
+	int			fd;
+	bool			multishot;
+
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	unsigned		sq_entries;
+	unsigned		sq_local_tail;
+	struct io_uring_sqe	*sqes;
+
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring;
+	size_t			sq_ring_sz;
+	void			*cq_ring;
+	size_t			cq_ring_sz;
+	size_t			sqes_sz;
+} uring = { .fd = -1 };
 
 struct mevent {
 	void			(*run)(int, enum ev_type, void *);
@@ -69,11 +108,21 @@ struct mevent {
 
 	int			closefd;
 	LIST_ENTRY(mevent)	me_list;
+
+	/* io_uring backend only */
+	int			me_enabled;
+	int			me_armed;
+	int			me_cancelling;
+	int			me_chg_queued;
+	uint64_t		me_counter;
+	LIST_ENTRY(mevent)	me_chg;
 };
 
 static LIST_HEAD(listhead, mevent) global_head;
 /* List holds the mevent node which is requested to deleted */
 static LIST_HEAD(del_listhead, mevent) del_head;
+/* Events whose io_uring requests need to be armed or cancelled */
+static LIST_HEAD(chg_listhead, mevent) chg_head;
 
 static void
 mevent_qlock(void)
@@ -93,37 +142,342 @@ is_dispatch_thread(void)
 	return (pthread_self() == mevent_tid);
 }
 
-static void
-mevent_pipe_read(int fd, enum ev_type type __attribute__((unused)), void *param __attribute__((unused)))
+static bool
+mevent_uring_active(void)
 {
-	char buf[MEVENT_MAX];
-	ssize_t status;
+	return (uring.fd >= 0);
+}
 
-	/*
-	 * Drain the pipe read side. The fd is non-blocking so this is
-	 * safe to do.
-	 */
-	do {
-		status = read(fd, buf, sizeof(buf));
-	} while (status == MEVENT_MAX);
+static void
+mevent_notify_read(int fd __attribute__((unused)), enum ev_type type __attribute__((unused)),
+		   void *param __attribute__((unused)))
+{
+	/* EVF_COUNTER: the loop has already consumed the counter */
 }
 
 /* On error, -1 is returned, else return zero */
 int
 mevent_notify(void)
 {
-	char c = 0;
-
 	/*
-	 * If calling from outside the i/o thread, write a byte on the
-	 * pipe to force the i/o thread to exit the blocking epoll call.
+	 * If calling from outside the i/o thread, signal the eventfd to
+	 * force the i/o thread out of its blocking wait.
 	 */
-	if (mevent_pipefd[1] != 0 && !is_dispatch_thread())
-		if (write(mevent_pipefd[1], &c, 1) <= 0)
+	if (mevent_notify_fd > 0 && !is_dispatch_thread())
+		if (eventfd_write(mevent_notify_fd, 1) < 0)
 			return -1;
 	return 0;
 }
 
+void
+mevent_set_backend(enum mevent_backend backend)
+{
+	mevent_backend_req = backend;
+}
+
+static int
+mevent_uring_setup(void)
+{
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, MEVENT_URING_ENTRIES, &p);
+	if (fd < 0)
+		return -1;
+
+	uring.sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring.cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring.cq_ring_sz > uring.sq_ring_sz)
+			uring.sq_ring_sz = uring.cq_ring_sz;
+		uring.cq_ring_sz = uring.sq_ring_sz;
+	}
+
+	uring.sq_ring = mmap(NULL, uring.sq_ring_sz, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (uring.sq_ring == MAP_FAILED)
+		goto close_fd;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		uring.cq_ring = uring.sq_ring;
+	} else {
+		uring.cq_ring = mmap(NULL, uring.cq_ring_sz, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (uring.cq_ring == MAP_FAILED)
+			goto unmap_sq;
+	}
+
+	uring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	uring.sqes = mmap(NULL, uring.sqes_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED)
+		goto unmap_cq;
+
+	uring.sq_head = (unsigned *)((char *)uring.sq_ring + p.sq_off.head);
+	uring.sq_tail = (unsigned *)((char *)uring.sq_ring + p.sq_off.tail);
+	uring.sq_mask = (unsigned *)((char *)uring.sq_ring + p.sq_off.ring_mask);
+	uring.sq_array = (unsigned *)((char *)uring.sq_ring + p.sq_off.array);
+	uring.sq_entries = p.sq_entries;
+	uring.sq_local_tail = *uring.sq_tail;
+
+	uring.cq_head = (unsigned *)((char *)uring.cq_ring + p.cq_off.head);
+	uring.cq_tail = (unsigned *)((char *)uring.cq_ring + p.cq_off.tail);
+	uring.cq_mask = (unsigned *)((char *)uring.cq_ring + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)((char *)uring.cq_ring + p.cq_off.cqes);
+
+	/* Multishot poll needs 5.13; cleared if the kernel rejects it */
+	uring.multishot = true;
+	uring.fd = fd;
+	return 0;
+
+unmap_cq:
+	if (uring.cq_ring != uring.sq_ring)
+		munmap(uring.cq_ring, uring.cq_ring_sz);
+unmap_sq:
+	munmap(uring.sq_ring, uring.sq_ring_sz);
+close_fd:
+	close(fd);
+	return -1;
+}
+
+static void
+mevent_uring_teardown(void)
+{
+	if (!mevent_uring_active())
+		return;
+
+	munmap(uring.sqes, uring.sqes_sz);
+	if (uring.cq_ring != uring.sq_ring)
+		munmap(uring.cq_ring, uring.cq_ring_sz);
+	munmap(uring.sq_ring, uring.sq_ring_sz);
+	close(uring.fd);
+	uring.fd = -1;
+}
+
+static int
+mevent_uring_enter(unsigned min_complete, unsigned flags)
+{
+	unsigned to_submit;
+	int ret;
+
+	__atomic_store_n(uring.sq_tail, uring.sq_local_tail, __ATOMIC_RELEASE);
+	to_submit = uring.sq_local_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+	if (!to_submit && !min_complete)
+		return 0;
+
+	ret = syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags, NULL, 0);
+	return ret;
+}
+
+static bool
+mevent_uring_reserve(unsigned n)
+{
+	unsigned head;
+
+	head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+	if (uring.sq_local_tail - head + n > uring.sq_entries) {
+		/* Full: push what we have to the kernel first */
+		mevent_uring_enter(0, 0);
+		head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+		if (uring.sq_local_tail - head + n > uring.sq_entries)
+			return false;
+	}
+	return true;
+}
+
+/* Caller must have reserved the slot */
+static struct io_uring_sqe *
+mevent_uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	idx = uring.sq_local_tail & *uring.sq_mask;
+	sqe = &uring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	uring.sq_array[idx] = idx;
+	uring.sq_local_tail++;
+
+	return sqe;
+}
+
+/* Called with mevent_lmutex held */
+static void
+mevent_uring_queue(struct mevent *mevp)
+{
+	if (!mevp->me_chg_queued) {
+		mevp->me_chg_queued = 1;
+		LIST_INSERT_HEAD(&chg_head, mevp, me_chg);
+	}
+}
+
+/*
+ * The poll half of an EVF_COUNTER chain is tagged with the low bit, which
+ * is free since mevents are malloc'ed.
+ */
+#define	MEVENT_URING_POLL_TAG	1ULL
+
+static uint64_t
+mevent_uring_cancel_key(struct mevent *mevp)
+{
+	uint64_t key = (uint64_t)(uintptr_t)mevp;
+
+	return (mevp->me_type == EVF_COUNTER) ? (key | MEVENT_URING_POLL_TAG) : key;
+}
+
+static int
+mevent_uring_arm(struct mevent *mevp)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!mevent_uring_reserve(mevp->me_type == EVF_COUNTER ? 2 : 1))
+		return -1;
+
+	sqe = mevent_uring_get_sqe();
+	sqe->fd = mevp->me_fd;
+	sqe->user_data = (uint64_t)(uintptr_t)mevp;
+
+	switch (mevp->me_type) {
+	case EVF_COUNTER:
+		/*
+		 * Reads of an O_NONBLOCK fd fail with -EAGAIN instead of
+		 * waiting, so gate the read behind a linked poll.
+		 */
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLIN;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = mevent_uring_cancel_key(mevp);
+
+		sqe = mevent_uring_get_sqe();
+		sqe->fd = mevp->me_fd;
+		sqe->user_data = (uint64_t)(uintptr_t)mevp;
+		sqe->opcode = IORING_OP_READ;
+		sqe->addr = (uint64_t)(uintptr_t)&mevp->me_counter;
+		sqe->len = sizeof(mevp->me_counter);
+		break;
+	case EVF_READ_ET:
+	case EVF_WRITE_ET:
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = (mevp->me_type == EVF_READ_ET) ? POLLIN : POLLOUT;
+		if (uring.multishot)
+			sqe->len = IORING_POLL_ADD_MULTI;
+		break;
+	default:
+		/* Level triggered: one-shot poll, re-armed after each run */
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = (mevp->me_type == EVF_WRITE) ? POLLOUT : POLLIN;
+		break;
+	}
+
+	mevp->me_armed = 1;
+	return 0;
+}
+
+static int
+mevent_uring_cancel(struct mevent *mevp)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!mevent_uring_reserve(1))
+		return -1;
+
+	/* Cancelling the poll of an EVF_COUNTER chain fails its read too */
+	sqe = mevent_uring_get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = mevent_uring_cancel_key(mevp);
+	sqe->user_data = 0;
+
+	mevp->me_cancelling = 1;
+	return 0;
+}
+
+/* Bring each queued event's in-flight request in line with its state */
+static void
+mevent_uring_apply_changes(void)
+{
+	struct mevent *mevp, *tmpp;
+	bool want;
+
+	mevent_qlock();
+	list_foreach_safe(mevp, &chg_head, me_chg, tmpp) {
+		want = mevp->me_state && mevp->me_enabled;
+
+		if (want && !mevp->me_armed) {
+			if (mevent_uring_arm(mevp) < 0)
+				break;
+		} else if (!want && mevp->me_armed && !mevp->me_cancelling) {
+			if (mevent_uring_cancel(mevp) < 0)
+				break;
+		}
+
+		LIST_REMOVE(mevp, me_chg);
+		mevp->me_chg_queued = 0;
+	}
+	mevent_qunlock();
+}
+
+static void
+mevent_uring_complete(struct mevent *mevp, int res, unsigned flags)
+{
+	if (!(flags & IORING_CQE_F_MORE)) {
+		mevp->me_armed = 0;
+		mevp->me_cancelling = 0;
+	}
+
+	if (res == -EINVAL && uring.multishot &&
+	    (mevp->me_type == EVF_READ_ET || mevp->me_type == EVF_WRITE_ET)) {
+		pr_info("mevent: io_uring multishot poll unsupported, using one-shot\n");
+		uring.multishot = false;
+	} else if (res < 0 && res != -ECANCELED && res != -EINTR && res != -EAGAIN) {
+		pr_err("mevent: io_uring request on fd %d failed: %d\n", mevp->me_fd, res);
+		mevp->me_enabled = 0;
+	} else if (res >= 0 && mevp->me_state && mevp->me_enabled) {
+		(*mevp->run)(mevp->me_fd, mevp->me_type, mevp->run_param);
+	}
+
+	if (!mevp->me_armed) {
+		mevent_qlock();
+		mevent_uring_queue(mevp);
+		mevent_qunlock();
+	}
+}
+
+static void
+mevent_uring_reap(void)
+{
+	struct io_uring_cqe *cqe;
+	struct mevent *mevp;
+	uint64_t user_data;
+	unsigned head, tail, flags;
+	int res;
+
+	head = *uring.cq_head;
+	tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &uring.cqes[head & *uring.cq_mask];
+		user_data = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+
+		/* Free the slot before running, handlers may submit */
+		head++;
+		__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+
+		/*
+		 * Cancel requests carry no mevent, and the poll half of an
+		 * EVF_COUNTER chain is always followed by its read's CQE.
+		 */
+		mevp = (struct mevent *)(uintptr_t)user_data;
+		if (mevp && !(user_data & MEVENT_URING_POLL_TAG))
+			mevent_uring_complete(mevp, res, flags);
+
+		if (head == tail)
+			tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	}
+}
+
 static int
 mevent_kq_filter(struct mevent *mevp)
 {
@@ -131,7 +485,7 @@ mevent_kq_filter(struct mevent *mevp)
 
 	retval = 0;
 
-	if (mevp->me_type == EVF_READ)
+	if (mevp->me_type == EVF_READ || mevp->me_type == EVF_COUNTER)
 		retval = EPOLLIN;
 
 	if (mevp->me_type == EVF_READ_ET)
@@ -154,9 +508,11 @@ mevent_destroy(void)
 	mevent_qlock();
 	list_foreach_safe(mevp, &global_head, me_list, tmpp) {
 		LIST_REMOVE(mevp, me_list);
-		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, mevp->me_fd, NULL);
+		if (!mevent_uring_active())
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, mevp->me_fd, NULL);
 
                if ((mevp->me_type == EVF_READ ||
+                    mevp->me_type == EVF_COUNTER ||
                     mevp->me_type == EVF_READ_ET ||
                     mevp->me_type == EVF_WRITE ||
                     mevp->me_type == EVF_WRITE_ET) &&
@@ -176,6 +532,7 @@ mevent_destroy(void)
 		LIST_REMOVE(mevp, me_list);
 
                if ((mevp->me_type == EVF_READ ||
+                    mevp->me_type == EVF_COUNTER ||
                     mevp->me_type == EVF_READ_ET ||
                     mevp->me_type == EVF_WRITE ||
                     mevp->me_type == EVF_WRITE_ET) &&
@@ -187,6 +544,7 @@ mevent_destroy(void)
 
 		free(mevp);
 	}
+	LIST_INIT(&chg_head);
 	mevent_qunlock();
 }
 
@@ -199,6 +557,10 @@ mevent_handle(struct epoll_event *kev, int numev)
 	for (i = 0; i < numev; i++) {
 		mevp = kev[i].data.ptr;
 
+		if (mevp->me_type == EVF_COUNTER &&
+		    read(mevp->me_fd, &mevp->me_counter, sizeof(mevp->me_counter)) < 0)
+			continue;
+
 		if (mevp->me_state)
 			(*mevp->run)(mevp->me_fd, mevp->me_type, mevp->run_param);
 	}
@@ -239,12 +601,23 @@ mevent_add(int tfd, enum ev_type type,
 	mevp->me_fd = tfd;
 	mevp->me_type = type;
 	mevp->me_state = 1;
+	mevp->me_enabled = 1;
 
 	mevp->run = run;
 	mevp->run_param = run_param;
 	mevp->teardown = teardown;
 	mevp->teardown_param = teardown_param;
 
+	if (mevent_uring_active()) {
+		mevent_qlock();
+		LIST_INSERT_HEAD(&global_head, mevp, me_list);
+		mevent_uring_queue(mevp);
+		mevent_qunlock();
+		mevent_notify();
+
+		return mevp;
+	}
+
 	ee.events = mevent_kq_filter(mevp);
 	ee.data.ptr = mevp;
 	ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mevp->me_fd, &ee);
@@ -281,6 +654,14 @@ mevent_enable(struct mevent *evp)
 	if (!mevp)
 		return -1;
 
+	if (mevent_uring_active()) {
+		mevent_qlock();
+		mevp->me_enabled = 1;
+		mevent_uring_queue(mevp);
+		mevent_qunlock();
+		return mevent_notify();
+	}
+
 	ee.events = mevent_kq_filter(mevp);
 	ee.data.ptr = mevp;
 	ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mevp->me_fd, &ee);
@@ -295,6 +676,14 @@ mevent_disable(struct mevent *evp)
 {
 	int ret;
 
+	if (mevent_uring_active()) {
+		mevent_qlock();
+		evp->me_enabled = 0;
+		mevent_uring_queue(evp);
+		mevent_qunlock();
+		return mevent_notify();
+	}
+
 	ret = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, evp->me_fd, NULL);
 	if (ret < 0 && errno == ENOENT)
 		ret = 0;
@@ -319,6 +708,12 @@ mevent_drain_del_list(void)
 
 	mevent_qlock();
 	list_foreach_safe(evp, &del_head, me_list, tmpp) {
+		/* Wait for the cancelled io_uring request to complete */
+		if (evp->me_armed)
+			continue;
+		if (evp->me_chg_queued)
+			LIST_REMOVE(evp, me_chg);
+
 		LIST_REMOVE(evp, me_list);
 		if (evp->closefd) {
 			close(evp->me_fd);
@@ -334,6 +729,22 @@ mevent_drain_del_list(void)
 static int
 mevent_delete_event(struct mevent *evp, int closefd)
 {
+	if (mevent_uring_active()) {
+		/*
+		 * The kernel may still hold a request pointing at evp, so it
+		 * is only freed once that has been cancelled and reaped.
+		 */
+		mevent_qlock();
+		LIST_REMOVE(evp, me_list);
+		evp->me_state = 0;
+		evp->closefd = closefd;
+		LIST_INSERT_HEAD(&del_head, evp, me_list);
+		mevent_uring_queue(evp);
+		mevent_qunlock();
+		mevent_notify();
+		return 0;
+	}
+
 	mevent_qlock();
 	LIST_REMOVE(evp, me_list);
 	mevent_qunlock();
@@ -383,6 +794,14 @@ mevent_init(void)
 	pthread_mutex_init(&mevent_lmutex, &attr);
 	pthread_mutexattr_destroy(&attr);
 
+	if (mevent_backend_req == MEVENT_BACKEND_IO_URING) {
+		if (mevent_uring_setup() == 0) {
+			pr_info("mevent: using io_uring\n");
+			return 0;
+		}
+		pr_info("mevent: io_uring unavailable (%d), using epoll\n", errno);
+	}
+
 	epoll_fd = epoll_create1(0);
 
 	if (epoll_fd >= 0)
@@ -394,56 +813,88 @@ mevent_init(void)
 void
 mevent_deinit(void)
 {
+	/* The notify eventfd is closed along with its mevent */
+	mevent_notify_fd = 0;
 	mevent_destroy();
-	close(epoll_fd);
-	if (mevent_pipefd[1] != 0)
-		close(mevent_pipefd[1]);
+	if (mevent_uring_active())
+		mevent_uring_teardown();
+	else
+		close(epoll_fd);
 
 	pthread_mutex_destroy(&mevent_lmutex);
 }
 
+static bool
+mevent_should_exit(void)
+{
+	int suspend_mode;
+
+	suspend_mode = vm_get_suspend_mode();
+	return ((suspend_mode != VM_SUSPEND_NONE) &&
+		(suspend_mode != VM_SUSPEND_SYSTEM_RESET) &&
+		(suspend_mode != VM_SUSPEND_SUSPEND));
+}
+
+static void
+mevent_uring_dispatch(void)
+{
+	int ret;
+
+	for (;;) {
+		/*
+		 * Re-arms and new requests ride along with the wait, so a
+		 * loop iteration is one system call.
+		 */
+		mevent_uring_apply_changes();
+		ret = mevent_uring_enter(1, IORING_ENTER_GETEVENTS);
+		if (ret < 0 && errno != EINTR)
+			pr_err("Error return from io_uring_enter");
+
+		mevent_uring_reap();
+		mevent_drain_del_list();
+
+		if (mevent_should_exit())
+			break;
+	}
+}
+
 void
 mevent_dispatch(void)
 {
 	struct epoll_event eventlist[MEVENT_MAX];
 
-	struct mevent *pipev;
+	struct mevent *notifyev;
 	int ret;
 
 	mevent_tid = pthread_self();
 	mevent_set_name();
 
 	/*
-	 * Open the pipe that will be used for other threads to force
-	 * the blocking kqueue call to exit by writing to it. Set the
-	 * descriptor to non-blocking.
+	 * Open the eventfd that will be used for other threads to force
+	 * the blocking wait to exit by writing to it.
 	 */
-//	ret = pipe2(mevent_pipefd, O_NONBLOCK);
-	ret = pipe(mevent_pipefd);
+	ret = eventfd(0, EFD_NONBLOCK);
 	if (ret < 0) {
-		pr_err("pipe");
+		pr_err("eventfd");
 		exit(0);
 	}
-	int flags;
-	flags = fcntl(mevent_pipefd[0], F_GETFL);
-	flags |= O_NONBLOCK;
-	fcntl(mevent_pipefd[0], F_SETFL, flags);
-	flags = fcntl(mevent_pipefd[1], F_GETFL);
-	flags |= O_NONBLOCK;
-	fcntl(mevent_pipefd[1], F_SETFL, flags);
+	mevent_notify_fd = ret;
 
 	/*
-	 * Add internal event handler for the pipe write fd
+	 * Add internal event handler for the notify eventfd
 	 */
-	pipev = mevent_add(mevent_pipefd[0], EVF_READ, mevent_pipe_read, NULL, NULL, NULL);
-	if (!pipev) {
-		pr_err("pipefd mevent_add failed\n");
+	notifyev = mevent_add(mevent_notify_fd, EVF_COUNTER, mevent_notify_read, NULL, NULL, NULL);
+	if (!notifyev) {
+		pr_err("notify fd mevent_add failed\n");
 		exit(0);
 	}
 
-	for (;;) {
-		int suspend_mode;
+	if (mevent_uring_active()) {
+		mevent_uring_dispatch();
+		return;
+	}
 
+	for (;;) {
 		/*
 		 * Block awaiting events
 		 */
@@ -458,10 +909,7 @@ mevent_dispatch(void)
 		mevent_handle(eventlist, ret);
 		mevent_drain_del_list();
 
-		suspend_mode = vm_get_suspend_mode();
-		if ((suspend_mode != VM_SUSPEND_NONE) &&
-		    (suspend_mode != VM_SUSPEND_SYSTEM_RESET) &&
-		    (suspend_mode != VM_SUSPEND_SUSPEND))
+		if (mevent_should_exit())
 			break;
 	}
 }
@@ -5,8 +5,10 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/timerfd.h>
 
 #include "vmmapi.h"
@@ -22,8 +24,399 @@
  * Please note timerfd and epoll are all Linux specific. If the code need to be
  * ported to other OS, we can modify the api with POSIX timers and sigevent
  * mechanism.
+ *
+ * CLOCK_MONOTONIC timers do not get a timerfd each. They are queued on a
+ * hierarchical timer wheel, in the style of the Linux kernel's
+ * non-cascading wheel, and a single timerfd is programmed for the
+ * earliest non-empty bucket. Level n buckets are 4^n ticks wide and a
+ * timer is placed in the first level whose range covers it, rounding its
+ * expiry up to the bucket boundary. That rounding, at most 1/16 of the
+ * remaining time, is the slack which lets timers due at nearly the same
+ * moment share one wakeup. Timers never fire early. The kernel's 8x
+ * levels, 1/8 slack, more than doubled the lateness of the benchmark
+ * below for a third fewer wakeups.
+ *
+ * Built with -DACRN_TIMER_BENCH, this file is also a benchmark of the
+ * wheel against a timerfd per timer, with hundreds of periodic timers.
  */
 
+#define TW_TICK_SHIFT		14	/* 16.4us */
+#define TW_TICK_NS		(1ULL << TW_TICK_SHIFT)
+
+#define TW_LVL_CLK_SHIFT	2
+#define TW_LVL_CLK_DIV		(1ULL << TW_LVL_CLK_SHIFT)
+#define TW_LVL_CLK_MASK		(TW_LVL_CLK_DIV - 1)
+#define TW_LVL_SHIFT(n)		((n) * TW_LVL_CLK_SHIFT)
+#define TW_LVL_GRAN(n)		(1ULL << TW_LVL_SHIFT(n))
+#define TW_LVL_START(n)		((TW_LVL_SIZE - 1) << (((n) - 1) * TW_LVL_CLK_SHIFT))
+
+#define TW_LVL_BITS		6	/* one uint64_t pending mask per level */
+#define TW_LVL_SIZE		(1ULL << TW_LVL_BITS)
+#define TW_LVL_MASK		(TW_LVL_SIZE - 1)
+#define TW_LVL_DEPTH		11	/* ~18 minutes; longer timers are requeued */
+
+#define TW_CUTOFF		TW_LVL_START(TW_LVL_DEPTH)
+#define TW_TIMEOUT_MAX		(TW_CUTOFF - TW_LVL_GRAN(TW_LVL_DEPTH - 1))
+#define TW_NEXT_MAX_DELTA	((1ULL << 40) - 1)
+
+#define TW_IDX_NONE		(-1)
+#define TW_IDX_EXPIRED		(-2)
+
+LIST_HEAD(tw_list, acrn_timer);
+
+static struct timer_wheel {
+	pthread_mutex_t mtx;
+	int users;
+	int fd;
+	struct mevent *mevp;
+
+	uint64_t clk;		/* ticks */
+	uint64_t next_expiry;	/* ticks */
+	uint64_t programmed;	/* ticks, 0 when the timerfd is disarmed */
+	uint32_t nr_timers;
+
+	uint64_t pending_map[TW_LVL_DEPTH];
+	struct tw_list vectors[TW_LVL_DEPTH * TW_LVL_SIZE];
+} wheel = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+static uint64_t
+tw_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static uint64_t
+tw_ts_to_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+}
+
+static void
+tw_ns_to_ts(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / NS_PER_SEC;
+	ts->tv_nsec = ns % NS_PER_SEC;
+}
+
+static int
+tw_calc_index(uint64_t expires, int lvl, uint64_t *bucket_expiry)
+{
+	/*
+	 * Round up so a timer armed at the edge of a tick, or truncated
+	 * by a coarse level, cannot fire early.
+	 */
+	expires = (expires + TW_LVL_GRAN(lvl)) >> TW_LVL_SHIFT(lvl);
+	*bucket_expiry = expires << TW_LVL_SHIFT(lvl);
+	return lvl * TW_LVL_SIZE + (expires & TW_LVL_MASK);
+}
+
+static int
+tw_calc_wheel_index(uint64_t expires, uint64_t clk, uint64_t *bucket_expiry)
+{
+	uint64_t delta = expires - clk;
+	int lvl;
+
+	for (lvl = 0; lvl < TW_LVL_DEPTH - 1; lvl++) {
+		if (delta < TW_LVL_START(lvl + 1))
+			return tw_calc_index(expires, lvl, bucket_expiry);
+	}
+
+	if (delta >= TW_CUTOFF)
+		expires = clk + TW_TIMEOUT_MAX;
+	return tw_calc_index(expires, TW_LVL_DEPTH - 1, bucket_expiry);
+}
+
+/* Offset from pos to the next pending bucket of the level, wrapping */
+static int
+tw_next_pending_bucket(uint64_t map, unsigned pos)
+{
+	if (pos)
+		map = (map >> pos) | (map << (TW_LVL_SIZE - pos));
+	return map ? __builtin_ctzll(map) : -1;
+}
+
+static uint64_t
+tw_next_expiry(struct timer_wheel *w)
+{
+	uint64_t clk, next, lvl_clk, tmp;
+	int lvl, pos;
+
+	next = w->clk + TW_NEXT_MAX_DELTA;
+	clk = w->clk;
+	for (lvl = 0; lvl < TW_LVL_DEPTH; lvl++) {
+		pos = tw_next_pending_bucket(w->pending_map[lvl], clk & TW_LVL_MASK);
+		lvl_clk = clk & TW_LVL_CLK_MASK;
+
+		if (pos >= 0) {
+			tmp = (clk + pos) << TW_LVL_SHIFT(lvl);
+			if (tmp < next)
+				next = tmp;
+
+			/* Nothing on an outer level can expire earlier */
+			if ((uint64_t)pos <= ((TW_LVL_CLK_DIV - lvl_clk) & TW_LVL_CLK_MASK))
+				break;
+		}
+
+		/*
+		 * The outer level is only looked at once this level wraps,
+		 * so move to its next bucket unless clk sits right on it.
+		 */
+		clk >>= TW_LVL_CLK_SHIFT;
+		clk += lvl_clk ? 1 : 0;
+	}
+
+	return next;
+}
+
+/* Called with wheel.mtx held */
+static void
+tw_program(struct timer_wheel *w)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (w->nr_timers == 0) {
+		if (w->programmed == 0)
+			return;
+		w->programmed = 0;
+	} else {
+		if (w->programmed == w->next_expiry)
+			return;
+		w->programmed = w->next_expiry;
+		tw_ns_to_ts(w->next_expiry << TW_TICK_SHIFT, &its.it_value);
+	}
+
+	if (timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		pr_err("acrn_timer: failed to program wheel timerfd\n");
+}
+
+/* Called with wheel.mtx held */
+static void
+tw_dequeue(struct timer_wheel *w, struct acrn_timer *timer)
+{
+	int idx = timer->tw_idx;
+
+	if (idx == TW_IDX_NONE)
+		return;
+
+	LIST_REMOVE(timer, tw_entry);
+	timer->tw_idx = TW_IDX_NONE;
+	w->nr_timers--;
+
+	/* A stale next_expiry only costs one spurious wakeup */
+	if (idx >= 0 && LIST_EMPTY(&w->vectors[idx]))
+		w->pending_map[idx / TW_LVL_SIZE] &= ~(1ULL << (idx % TW_LVL_SIZE));
+}
+
+/* Called with wheel.mtx held */
+static void
+tw_enqueue(struct timer_wheel *w, struct acrn_timer *timer, uint64_t now_ns)
+{
+	uint64_t expires, now, bucket_expiry;
+	int idx;
+
+	/* Skip idle ticks so the level is picked relative to now */
+	now = now_ns >> TW_TICK_SHIFT;
+	if (now > w->clk)
+		w->clk = (w->next_expiry > now) ? now : w->next_expiry;
+
+	expires = howmany(timer->tw_expires, TW_TICK_NS);
+	if (expires < w->clk)
+		expires = w->clk;
+
+	idx = tw_calc_wheel_index(expires, w->clk, &bucket_expiry);
+	LIST_INSERT_HEAD(&w->vectors[idx], timer, tw_entry);
+	w->pending_map[idx / TW_LVL_SIZE] |= 1ULL << (idx % TW_LVL_SIZE);
+	timer->tw_idx = idx;
+	w->nr_timers++;
+
+	if (bucket_expiry < w->next_expiry)
+		w->next_expiry = bucket_expiry;
+}
+
+/* Called with wheel.mtx held; moves due buckets onto the expired list */
+static void
+tw_collect_expired(struct timer_wheel *w, struct tw_list *expired)
+{
+	struct acrn_timer *timer;
+	uint64_t clk;
+	int lvl, idx;
+
+	clk = w->clk = w->next_expiry;
+	for (lvl = 0; lvl < TW_LVL_DEPTH; lvl++) {
+		idx = lvl * TW_LVL_SIZE + (clk & TW_LVL_MASK);
+		if (w->pending_map[lvl] & (1ULL << (idx % TW_LVL_SIZE))) {
+			w->pending_map[lvl] &= ~(1ULL << (idx % TW_LVL_SIZE));
+			while ((timer = LIST_FIRST(&w->vectors[idx])) != NULL) {
+				LIST_REMOVE(timer, tw_entry);
+				LIST_INSERT_HEAD(expired, timer, tw_entry);
+				timer->tw_idx = TW_IDX_EXPIRED;
+			}
+		}
+
+		/* Outer levels only have a bucket due when this one wraps */
+		if (clk & TW_LVL_CLK_MASK)
+			break;
+		clk >>= TW_LVL_CLK_SHIFT;
+	}
+}
+
+static void
+tw_handler(int fd __attribute__((unused)),
+	   enum ev_type t __attribute__((unused)),
+	   void *arg)
+{
+	struct timer_wheel *w = arg;
+	struct tw_list expired = LIST_HEAD_INITIALIZER(expired);
+	struct acrn_timer *timer;
+	void (*cb)(void *, uint64_t);
+	void *param;
+	uint64_t now_ns, now, nexp;
+
+	pthread_mutex_lock(&w->mtx);
+	now_ns = tw_now_ns();
+	now = now_ns >> TW_TICK_SHIFT;
+	w->programmed = 0;
+
+	while (w->nr_timers && now >= w->clk && now >= w->next_expiry) {
+		tw_collect_expired(w, &expired);
+		w->clk++;
+		w->next_expiry = tw_next_expiry(w);
+	}
+
+	/*
+	 * The lock is dropped around each callback, which may re-arm or
+	 * deinit any timer, including ones still on the expired list.
+	 */
+	while ((timer = LIST_FIRST(&expired)) != NULL) {
+		LIST_REMOVE(timer, tw_entry);
+		timer->tw_idx = TW_IDX_NONE;
+		w->nr_timers--;
+
+		/* Beyond the wheel's range: not due yet */
+		if (timer->tw_expires > now_ns) {
+			tw_enqueue(w, timer, now_ns);
+			continue;
+		}
+
+		nexp = 1;
+		if (timer->tw_interval) {
+			nexp += (now_ns - timer->tw_expires) / timer->tw_interval;
+			timer->tw_expires += nexp * timer->tw_interval;
+			tw_enqueue(w, timer, now_ns);
+		}
+
+		cb = timer->callback;
+		param = timer->callback_param;
+		if (cb != NULL) {
+			pthread_mutex_unlock(&w->mtx);
+			(*cb)(param, nexp);
+			pthread_mutex_lock(&w->mtx);
+		}
+	}
+
+	tw_program(w);
+	pthread_mutex_unlock(&w->mtx);
+}
+
+static int
+tw_get(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&wheel.mtx);
+	if (wheel.users == 0) {
+		wheel.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (wheel.fd < 0) {
+			ret = -1;
+			goto out;
+		}
+
+		wheel.mevp = mevent_add(wheel.fd, EVF_COUNTER, tw_handler, &wheel, NULL, NULL);
+		if (wheel.mevp == NULL) {
+			close(wheel.fd);
+			wheel.fd = -1;
+			ret = -1;
+			goto out;
+		}
+
+		wheel.clk = tw_now_ns() >> TW_TICK_SHIFT;
+		wheel.next_expiry = wheel.clk + TW_NEXT_MAX_DELTA;
+		wheel.programmed = 0;
+	}
+	wheel.users++;
+out:
+	pthread_mutex_unlock(&wheel.mtx);
+	return ret;
+}
+
+static void
+tw_put(void)
+{
+	pthread_mutex_lock(&wheel.mtx);
+	if (--wheel.users == 0) {
+		mevent_delete_close(wheel.mevp);
+		wheel.mevp = NULL;
+		wheel.fd = -1;
+	}
+	pthread_mutex_unlock(&wheel.mtx);
+}
+
+static int32_t
+tw_settime(struct acrn_timer *timer, const struct itimerspec *new_value, bool abs)
+{
+	uint64_t now_ns;
+
+	if (new_value->it_value.tv_nsec < 0 || new_value->it_value.tv_nsec >= (long)NS_PER_SEC ||
+	    new_value->it_interval.tv_nsec < 0 || new_value->it_interval.tv_nsec >= (long)NS_PER_SEC) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&wheel.mtx);
+	tw_dequeue(&wheel, timer);
+
+	/* A zero it_value disarms, as with timerfd_settime() */
+	if (new_value->it_value.tv_sec || new_value->it_value.tv_nsec) {
+		now_ns = tw_now_ns();
+		timer->tw_expires = tw_ts_to_ns(&new_value->it_value);
+		if (!abs)
+			timer->tw_expires += now_ns;
+		timer->tw_interval = tw_ts_to_ns(&new_value->it_interval);
+		tw_enqueue(&wheel, timer, now_ns);
+	}
+
+	tw_program(&wheel);
+	pthread_mutex_unlock(&wheel.mtx);
+	return 0;
+}
+
+static int32_t
+tw_gettime(struct acrn_timer *timer, struct itimerspec *cur_value)
+{
+	uint64_t now_ns;
+
+	memset(cur_value, 0, sizeof(*cur_value));
+
+	pthread_mutex_lock(&wheel.mtx);
+	if (timer->tw_idx != TW_IDX_NONE) {
+		now_ns = tw_now_ns();
+		/* Due but not yet run still reads as armed */
+		tw_ns_to_ts((timer->tw_expires > now_ns) ? (timer->tw_expires - now_ns) : 1,
+			    &cur_value->it_value);
+		tw_ns_to_ts(timer->tw_interval, &cur_value->it_interval);
+	}
+	pthread_mutex_unlock(&wheel.mtx);
+
+	return 0;
+}
+
 static void
 timer_handler(int fd __attribute__((unused)),
 		  enum ev_type t __attribute__((unused)),
@@ -69,8 +462,21 @@ acrn_timer_init(struct acrn_timer *timer, void (*cb)(void *, uint64_t),
 	}
 
 	timer->fd = -1;
-	if ((timer->clockid == CLOCK_REALTIME) ||
-			(timer->clockid == CLOCK_MONOTONIC)) {
+	timer->mevp = NULL;
+	timer->tw_idx = TW_IDX_NONE;
+
+	if (timer->clockid == CLOCK_MONOTONIC) {
+		if (tw_get() < 0) {
+			pr_err("acrn_timer wheel create failed.\n");
+			return -1;
+		}
+
+		timer->callback = cb;
+		timer->callback_param = param;
+		return 0;
+	}
+
+	if (timer->clockid == CLOCK_REALTIME) {
 		timer->fd = timerfd_create(timer->clockid,
 					TFD_NONBLOCK | TFD_CLOEXEC);
 	} else {
@@ -102,6 +508,14 @@ acrn_timer_deinit(struct acrn_timer *timer)
 		return;
 	}
 
+	if ((timer->clockid == CLOCK_MONOTONIC) && (timer->callback != NULL)) {
+		pthread_mutex_lock(&wheel.mtx);
+		tw_dequeue(&wheel, timer);
+		tw_program(&wheel);
+		pthread_mutex_unlock(&wheel.mtx);
+		tw_put();
+	}
+
 	if (timer->mevp != NULL) {
 		mevent_delete_close(timer->mevp);
 		timer->mevp = NULL;
@@ -120,6 +534,9 @@ acrn_timer_settime(struct acrn_timer *timer, const struct itimerspec *new_value)
 		return -1;
 	}
 
+	if (timer->clockid == CLOCK_MONOTONIC)
+		return tw_settime(timer, new_value, false);
+
 	return timerfd_settime(timer->fd, 0, new_value, NULL);
 }
 
@@ -132,6 +549,9 @@ acrn_timer_settime_abs(struct acrn_timer *timer,
 		return -1;
 	}
 
+	if (timer->clockid == CLOCK_MONOTONIC)
+		return tw_settime(timer, new_value, true);
+
 	return timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, new_value, NULL);
 }
 
@@ -143,5 +563,154 @@ acrn_timer_gettime(struct acrn_timer *timer, struct itimerspec *cur_value)
 		return -1;
 	}
 
+	if (timer->clockid == CLOCK_MONOTONIC)
+		return tw_gettime(timer, cur_value);
+
 	return timerfd_gettime(timer->fd, cur_value);
 }
+
+#ifdef ACRN_TIMER_BENCH
+#include <stdlib.h>
+#include <stdarg.h>
+#include <sys/resource.h>
+#include "pm.h"
+
+static bool bench_done;
+
+void
+output_log(uint8_t level __attribute__((unused)), const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+}
+
+int
+vm_get_suspend_mode(void)
+{
+	return bench_done ? VM_SUSPEND_POWEROFF : VM_SUSPEND_NONE;
+}
+
+struct bench_timer {
+	struct acrn_timer timer;
+	uint64_t first_ns;	/* CLOCK_MONOTONIC */
+	uint64_t period_ns;
+	uint64_t expirations;
+};
+
+static uint64_t bench_fires;
+static uint64_t bench_early;
+static uint64_t bench_late_ns;
+static uint64_t bench_late_max_ns;
+
+static void
+bench_cb(void *arg, uint64_t nexp)
+{
+	struct bench_timer *bt = arg;
+	uint64_t now, due;
+
+	now = tw_now_ns();
+	bt->expirations += nexp;
+	due = bt->first_ns + (bt->expirations - 1) * bt->period_ns;
+	if (now < due)
+		bench_early++;
+	else {
+		bench_late_ns += now - due;
+		if (now - due > bench_late_max_ns)
+			bench_late_max_ns = now - due;
+	}
+	bench_fires++;
+}
+
+static void
+bench_stop(void *arg __attribute__((unused)), uint64_t nexp __attribute__((unused)))
+{
+	bench_done = true;
+}
+
+static uint64_t
+bench_tv_ns(const struct timeval *tv)
+{
+	return tv->tv_sec * NS_PER_SEC + tv->tv_usec * 1000ULL;
+}
+
+/*
+ * Periods spread over 1 to 21 ms and starts over the first period, as
+ * device timers of a busy guest would be. CLOCK_REALTIME timers get a
+ * timerfd each, CLOCK_MONOTONIC ones go on the wheel.
+ */
+static void
+bench_run(int clockid, const char *name, int n, int secs)
+{
+	struct bench_timer *bts;
+	struct acrn_timer stop;
+	struct itimerspec its;
+	struct rusage r0, r1;
+	uint64_t cpu;
+	int i;
+
+	bts = calloc(n, sizeof(*bts));
+	if (!bts || mevent_init() < 0) {
+		printf("%s: can not set up\n", name);
+		exit(1);
+	}
+	bench_done = false;
+	bench_fires = bench_early = bench_late_ns = bench_late_max_ns = 0;
+
+	memset(&its, 0, sizeof(its));
+	for (i = 0; i < n; i++) {
+		bts[i].timer.clockid = clockid;
+		bts[i].period_ns = 1000000ULL + (20000000ULL * i) / n;
+		if (acrn_timer_init(&bts[i].timer, bench_cb, &bts[i]) < 0) {
+			printf("%s: timer %d can not be made\n", name, i);
+			exit(1);
+		}
+		tw_ns_to_ts(bts[i].period_ns, &its.it_interval);
+		tw_ns_to_ts(bts[i].period_ns / 2 + (bts[i].period_ns * i) % 997 / 997,
+			    &its.it_value);
+		bts[i].first_ns = tw_now_ns() + tw_ts_to_ns(&its.it_value);
+		acrn_timer_settime(&bts[i].timer, &its);
+	}
+	stop.clockid = clockid;
+	acrn_timer_init(&stop, bench_stop, NULL);
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = secs;
+	acrn_timer_settime(&stop, &its);
+
+	getrusage(RUSAGE_SELF, &r0);
+	mevent_dispatch();
+	getrusage(RUSAGE_SELF, &r1);
+
+	cpu = bench_tv_ns(&r1.ru_utime) + bench_tv_ns(&r1.ru_stime) -
+	      bench_tv_ns(&r0.ru_utime) - bench_tv_ns(&r0.ru_stime);
+	printf("%-9s %d timers, %ds: %lu callbacks, %lu wakeups, %lu ms cpu, "
+	       "lateness %lu us mean, %lu us max, %lu early\n",
+	       name, n, secs, (unsigned long)bench_fires,
+	       (unsigned long)(r1.ru_nvcsw - r0.ru_nvcsw), (unsigned long)(cpu / 1000000),
+	       (unsigned long)(bench_fires ? bench_late_ns / bench_fires / 1000 : 0),
+	       (unsigned long)(bench_late_max_ns / 1000), (unsigned long)bench_early);
+
+	acrn_timer_deinit(&stop);
+	for (i = 0; i < n; i++)
+		acrn_timer_deinit(&bts[i].timer);
+	mevent_deinit();
+	free(bts);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int n = (argc > 1) ? atoi(argv[1]) : 500;
+	int secs = (argc > 2) ? atoi(argv[2]) : 2;
+
+	if (n <= 0 || secs <= 0) {
+		printf("usage: %s [timers [seconds]]\n", argv[0]);
+		return 1;
+	}
+	bench_run(CLOCK_REALTIME, "timerfd", n, secs);
+	bench_run(CLOCK_MONOTONIC, "wheel", n, secs);
+	return 0;
+}
+#endif /* ACRN_TIMER_BENCH */
@@ -15,6 +15,7 @@
 #include <string.h>
 #include <pthread.h>
 #include <sys/mman.h>
+#include <sys/param.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <vmmapi.h>
@@ -23,14 +24,24 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <pixman.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "dm.h"
 #include "pci_core.h"
 #include "virtio.h"
+#include "mevent.h"
 #include "vdisplay.h"
 #include "console.h"
 #include "vga.h"
 #include "atomic.h"
+#include "trace_ring.h"
+#include "mem_pool.h"
+#ifdef WITH_VIRGL
+#include "virtio_gpu_virgl.h"
+#endif
 //#include "virtio_over_shmem.h"
 
 /*
@@ -46,9 +57,32 @@
 #define VIRTIO_GPU_RINGSZ	64
 #define VIRTIO_GPU_MAXSEGS	256
 
+/*
+ * Initial scratch space of a queue, for buffers that only live while one
+ * command is handled. It grows if a command needs more.
+ */
+#define VIRTIO_GPU_ARENA_SIZE	(64 * 1024)
+
+/*
+ * Blob dmabufs kept for reuse, guests recycle the same backing ranges.
+ */
+#define VIRTIO_GPU_DMABUF_CACHE_SIZE	64
+#define VIRTIO_GPU_DMABUF_HASH		64
+
+/*
+ * Host visible memory for BLOB_MEM_HOST3D blobs: a shared memory region of
+ * the transport, exported as one dmabuf. The udmabuf driver refuses larger
+ * buffers by default (udmabuf.size_limit_mb).
+ */
+#define VIRTIO_GPU_SHM_ID_HOST_VISIBLE	1
+#define VIRTIO_GPU_HOSTMEM_SIZE		(64UL * 1024 * 1024)
+#define VIRTIO_GPU_HOSTMEM_ALIGN	(2UL * 1024 * 1024)
+#define VIRTIO_GPU_HOSTMEM_PAGE		4096UL
+
 /*
  * Feature bits
  */
+#define VIRTIO_GPU_F_VIRGL		0
 #define VIRTIO_GPU_F_EDID		1
 #define VIRTIO_GPU_F_RESOURCE_UUID	2
 #define VIRTIO_GPU_F_RESOURCE_BLOB	3
@@ -60,6 +94,7 @@
  */
 #define VIRTIO_GPU_S_HOSTCAPS	(1ULL << VIRTIO_F_VERSION_1) | \
 				(1ULL << VIRTIO_GPU_F_EDID) | \
+				(1ULL << VIRTIO_GPU_F_CONTEXT_INIT) | \
 				(1ULL << VIRTIO_GPU_F_MODIFIER)
 
 
@@ -75,6 +110,7 @@
 #define VIRTIO_GPU_MAX_SCANOUTS 16
 #define VIRTIO_GPU_FLAG_FENCE (1 << 0)
 #define VIRTIO_GPU_FLAG_INFO_RING_IDX (1 << 1)
+#define VIRTIO_GPU_CONTEXT_INIT_CAPSET_ID_MASK	0xff
 #define VIRTIO_GPU_FLAG_FENCE	(1 << 0)
 #define VIRTIO_GPU_VGA_FB_SIZE	16 * MB
 #define VIRTIO_GPU_VGA_DMEMSZ	128
@@ -98,6 +134,8 @@
 #define DRM_FORMAT_ARGB8888     fourcc_code('A', 'R', '2', '4') /* [31:0] A:R:G:B 8:8:8:8 little endian */
 #define DRM_FORMAT_XBGR8888     fourcc_code('X', 'B', '2', '4') /* [31:0] x:B:G:R 8:8:8:8 little endian */
 #define DRM_FORMAT_XRGB8888     fourcc_code('X', 'R', '2', '4') /* [31:0] x:R:G:B 8:8:8:8 little endian */
+#define DRM_FORMAT_RGB565       fourcc_code('R', 'G', '1', '6') /* [15:0] R:G:B 5:6:5 little endian */
+#define DRM_FORMAT_ARGB1555     fourcc_code('A', 'R', '1', '5') /* [15:0] A:R:G:B 1:5:5:5 little endian */
 
 
 /*
@@ -131,6 +169,18 @@ enum virtio_gpu_ctrl_type {
 	VIRTIO_GPU_CMD_SET_SCANOUT_BLOB,
 	VIRTIO_GPU_CMD_SET_MODIFIER,
 
+	/* 3d commands */
+	VIRTIO_GPU_CMD_CTX_CREATE = 0x0200,
+	VIRTIO_GPU_CMD_CTX_DESTROY,
+	VIRTIO_GPU_CMD_CTX_ATTACH_RESOURCE,
+	VIRTIO_GPU_CMD_CTX_DETACH_RESOURCE,
+	VIRTIO_GPU_CMD_RESOURCE_CREATE_3D,
+	VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D,
+	VIRTIO_GPU_CMD_TRANSFER_FROM_HOST_3D,
+	VIRTIO_GPU_CMD_SUBMIT_3D,
+	VIRTIO_GPU_CMD_RESOURCE_MAP_BLOB,
+	VIRTIO_GPU_CMD_RESOURCE_UNMAP_BLOB,
+
 	/* cursor commands */
 	VIRTIO_GPU_CMD_UPDATE_CURSOR = 0x0300,
 	VIRTIO_GPU_CMD_MOVE_CURSOR,
@@ -206,6 +256,10 @@ enum virtio_gpu_formats {
 	VIRTIO_GPU_FORMAT_A8R8G8B8_UNORM = 3,
 	VIRTIO_GPU_FORMAT_X8R8G8B8_UNORM = 4,
 
+	/* 16 bpp, numbered like the others after the virgl formats */
+	VIRTIO_GPU_FORMAT_B5G5R5A1_UNORM = 5,
+	VIRTIO_GPU_FORMAT_B5G6R5_UNORM = 7,
+
 	VIRTIO_GPU_FORMAT_R8G8B8A8_UNORM = 67,
 	VIRTIO_GPU_FORMAT_X8B8G8R8_UNORM = 68,
 
@@ -226,6 +280,15 @@ struct dma_buf_info {
 	int dmabuf_fd;
 };
 
+/* A dmabuf kept for the guest ranges it was created from */
+struct virtio_gpu_dmabuf_cached {
+	struct udmabuf_create_item *items;	/* merged ranges, the key */
+	uint32_t count;
+	struct dma_buf_info *info;		/* holds one reference */
+	LIST_ENTRY(virtio_gpu_dmabuf_cached) hash_link;
+	TAILQ_ENTRY(virtio_gpu_dmabuf_cached) lru_link;
+};
+
 struct virtio_gpu_resource_2d {
 	uint32_t resource_id;
 	uint32_t width;
@@ -235,7 +298,15 @@ struct virtio_gpu_resource_2d {
 	struct iovec *iov;
 	uint32_t iovcnt;
 	bool blob;
+	uint64_t blob_size;
 	struct dma_buf_info *dma_info;
+	struct virtio_gpu_mem_entry *entries;	/* guest backing, kept for restore */
+	uint32_t nr_entries;
+	bool hostmem;		/* BLOB_MEM_HOST3D, dma_info set while mapped */
+	bool mapped;
+	uint64_t hostmem_offset;	/* in the host visible window */
+	int shm_fd;		/* memfd of the image, -1 if it is not in one */
+	uint64_t shm_size;
 	LIST_ENTRY(virtio_gpu_resource_2d) link;
 };
 
@@ -333,9 +404,12 @@ struct virtio_gpu_resource_create_blob {
 	struct virtio_gpu_ctrl_hdr hdr;
 	uint32_t resource_id;
 #define VIRTIO_GPU_BLOB_MEM_GUEST             0x0001
+#define VIRTIO_GPU_BLOB_MEM_HOST3D            0x0002
 
+#define VIRTIO_GPU_BLOB_FLAG_USE_MAPPABLE     0x0001
 #define VIRTIO_GPU_BLOB_FLAG_USE_SHAREABLE    0x0002
-	/* blob_mem/blob_id is not used */
+#define VIRTIO_GPU_BLOB_FLAG_USE_CROSS_DEVICE 0x0004
+	/* blob_id is not used */
 	uint32_t blob_mem;
 	uint32_t blob_flags;
 	uint32_t nr_entries;
@@ -347,6 +421,30 @@ struct virtio_gpu_resource_create_blob {
 	 */
 };
 
+/* VIRTIO_GPU_CMD_RESOURCE_MAP_BLOB */
+struct virtio_gpu_resource_map_blob {
+	struct virtio_gpu_ctrl_hdr hdr;
+	uint32_t resource_id;
+	uint32_t padding;
+	uint64_t offset;	/* in the host visible region */
+};
+
+#define VIRTIO_GPU_MAP_CACHE_CACHED	0x01
+
+/* VIRTIO_GPU_RESP_OK_MAP_INFO */
+struct virtio_gpu_resp_map_info {
+	struct virtio_gpu_ctrl_hdr hdr;
+	uint32_t map_info;
+	uint32_t padding;
+};
+
+/* VIRTIO_GPU_CMD_RESOURCE_UNMAP_BLOB */
+struct virtio_gpu_resource_unmap_blob {
+	struct virtio_gpu_ctrl_hdr hdr;
+	uint32_t resource_id;
+	uint32_t padding;
+};
+
 /* VIRTIO_GPU_CMD_SET_SCANOUT_BLOB */
 struct virtio_gpu_set_scanout_blob {
 	struct virtio_gpu_ctrl_hdr hdr;
@@ -369,6 +467,66 @@ struct virtio_gpu_set_modifier {
 	uint32_t padding;
 };
 
+/*
+ * Command: VIRTIO_GPU_CMD_CTX_CREATE
+ */
+struct virtio_gpu_ctx_create {
+	struct virtio_gpu_ctrl_hdr hdr;
+	uint32_t nlen;
+	uint32_t context_init;
+	char debug_name[64];
+};
+
+/*
+ * Command: VIRTIO_GPU_CMD_CTX_ATTACH_RESOURCE, VIRTIO_GPU_CMD_CTX_DETACH_RESOURCE
+ */
+struct virtio_gpu_ctx_resource {
+	struct virtio_gpu_ctrl_hdr hdr;
+	uint32_t resource_id;
+	uint32_t padding;
+};
+
+struct virtio_gpu_context {
+	uint32_t ctx_id;
+	uint32_t context_init;
+	LIST_ENTRY(virtio_gpu_context) link;
+};
+
+/*
+ * Fence timelines. A fenced command whose work is still in flight when its
+ * handler returns, i.e. a frame the display client has not presented yet,
+ * keeps its chain until that work is done; later fences on the same
+ * timeline wait behind it, fences on other timelines do not. A timeline is
+ * a (context, ring_idx) pair with VIRTIO_GPU_FLAG_INFO_RING_IDX, the global
+ * one otherwise.
+ *
+ * Chains are returned out of order, so VIRTIO_F_IN_ORDER, which would make
+ * every fence complete with its command and the timelines dead, is not
+ * offered along with VIRTIO_GPU_F_CONTEXT_INIT.
+ */
+#define VIRTIO_GPU_MAX_RINGS		64
+#define VIRTIO_GPU_RING_GLOBAL		0xffffffff
+#define VIRTIO_GPU_FENCE_TIMEOUT_MS	100	/* longest wait for the client */
+#define VIRTIO_GPU_RENDER_POLL_MS	1	/* without the renderer's fence fd */
+
+struct virtio_gpu_fence {
+	uint16_t idx;		/* head of the chain */
+	uint32_t iolen;
+	uint64_t fence_id;
+	uint32_t ctx_id;
+	uint32_t frame_ids[VDPY_MAX_NUM];	/* last frame of the command on each scanout */
+	uint64_t deadline_ns;
+	bool render;		/* the renderer has not signalled it yet */
+	TAILQ_ENTRY(virtio_gpu_fence) link;
+};
+
+struct virtio_gpu_timeline {
+	uint32_t ctx_id;
+	uint32_t ring;		/* ring_idx or VIRTIO_GPU_RING_GLOBAL */
+	TAILQ_HEAD(, virtio_gpu_fence) fences;
+	LIST_ENTRY(virtio_gpu_timeline) link;
+};
+
 enum vga_thread_status {
 	VGA_THREAD_EOL = 0,
 	VGA_THREAD_RUNNING
@@ -381,6 +539,123 @@ struct virtio_gpu_scanout {
 	pixman_image_t *cur_img;
 	struct dma_buf_info *dma_buf;
 	bool is_active;
+	bool is_blob;
+	struct virtio_gpu_set_scanout_blob blob_req;
+	uint64_t modifier;
+};
+
+/*
+ * Device state saved for restarting the backend under a live guest.
+ * Resources are described by their guest backing only; their contents are
+ * read back from it on restore.
+ */
+#define VIRTIO_GPU_CKPT_VERSION		4
+#define VIRTIO_GPU_CKPT_RES_BLOB	(1 << 0)
+#define VIRTIO_GPU_CKPT_RES_HOSTMEM	(1 << 1)	/* version 3 */
+#define VIRTIO_GPU_CKPT_RES_MAPPED	(1 << 2)	/* version 3 */
+#define VIRTIO_GPU_CKPT_SCANOUT_ACTIVE	(1 << 0)
+#define VIRTIO_GPU_CKPT_SCANOUT_BLOB	(1 << 1)
+#define VIRTIO_GPU_CKPT_FBS		3		/* framebuffers per scanout */
+#define VIRTIO_GPU_CKPT_SLACK		(64 * 1024)	/* cursors, contexts, ... */
+
+struct virtio_gpu_ckpt_hdr {
+	uint32_t version;
+	uint32_t nr_resources;
+	uint32_t scanout_num;
+	uint32_t nr_contexts;	/* version 2, 0 before */
+};
+
+struct virtio_gpu_ckpt_resource {
+	uint32_t resource_id;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;	/* VIRTIO_GPU_FORMAT_*, 0 for blobs; pixman before version 4 */
+	uint32_t flags;
+	uint32_t nr_entries;
+	uint64_t blob_size;
+	/*
+	 * nr_entries * struct virtio_gpu_mem_entry follow, contiguous ones
+	 * merged, then for a VIRTIO_GPU_CKPT_RES_MAPPED one the uint64_t
+	 * offset it is mapped at
+	 */
+};
+
+struct virtio_gpu_ckpt_scanout {
+	uint32_t resource_id;
+	uint32_t flags;
+	struct virtio_gpu_rect r;
+	uint64_t modifier;
+	struct virtio_gpu_set_scanout_blob blob_req;
+};
+
+/*
+ * Version 2 appends nr_contexts contexts, then the chains of the deferred
+ * fences. Those commands are done, a restored backend returns the chains.
+ */
+struct virtio_gpu_ckpt_context {
+	uint32_t ctx_id;
+	uint32_t context_init;
+};
+
+struct virtio_gpu_ckpt_fences {
+	uint32_t nr_fences;
+	uint32_t padding;
+	/*
+	 * nr_fences * struct virtio_gpu_ckpt_fence follow
+	 */
+};
+
+struct virtio_gpu_ckpt_fence {
+	uint32_t idx;
+	uint32_t iolen;
+};
+
+/*
+ * Per-command latency statistics, exported in the transport's statistics
+ * region. They are written only by the display thread, which runs both the
+ * control and the cursor queue: seq is odd while an update is in progress,
+ * so a reader can take a consistent snapshot. A reader resets them by
+ * bumping reset_req; they are cleared before the next command and reset_ack
+ * is set to the value seen.
+ *
+ * Latencies are in timestamp ticks (the TSC on x86, nanoseconds elsewhere),
+ * tsc_khz of them per millisecond.
+ *
+ * Version 2 appends the display's frame latency windows, copied from
+ * vdpy_get_frame_stats() before each batch of commands.
+ */
+#define VIRTIO_GPU_STATS_MAGIC		0x53555047	/* "GPUS" */
+#define VIRTIO_GPU_STATS_VERSION	2
+#define VIRTIO_GPU_STATS_BUCKETS	32
+
+/* Slots: 0 unknown, then control commands, cursor commands, udmabuf creation */
+#define VIRTIO_GPU_STATS_CTRL		1
+#define VIRTIO_GPU_STATS_CURSOR		(VIRTIO_GPU_STATS_CTRL + \
+		VIRTIO_GPU_CMD_SET_MODIFIER - VIRTIO_GPU_CMD_GET_DISPLAY_INFO + 1)
+#define VIRTIO_GPU_STATS_UDMABUF	(VIRTIO_GPU_STATS_CURSOR + \
+		VIRTIO_GPU_CMD_MOVE_CURSOR - VIRTIO_GPU_CMD_UPDATE_CURSOR + 1)
+#define VIRTIO_GPU_STATS_SLOTS		(VIRTIO_GPU_STATS_UDMABUF + 1)
+
+struct virtio_gpu_stats_slot {
+	uint32_t type;		/* command type, 0 if not a command */
+	uint32_t padding;
+	uint64_t count;
+	uint64_t errors;	/* error responses */
+	uint64_t ticks;
+	uint64_t max_ticks;
+	uint64_t bytes;		/* copied by transfers, attached as backing */
+	uint64_t hist[VIRTIO_GPU_STATS_BUCKETS];	/* log2 of ticks */
+};
+
+struct virtio_gpu_stats {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t reset_req;	/* written by readers */
+	uint32_t reset_ack;
+	uint32_t tsc_khz;
+	struct virtio_gpu_stats_slot slots[VIRTIO_GPU_STATS_SLOTS];
+	struct vdpy_frame_stats frames;
 };
 
 /*
@@ -403,16 +678,49 @@ struct virtio_gpu {
 	bool is_blob_supported;
 	int scanout_num;
 	struct virtio_gpu_scanout *gpu_scanouts;
+	struct virtio_gpu_stats *stats;
+	bool stats_attached;
+	uint32_t tsc_khz;
+	uint32_t frame_seq;
+	struct mem_arena arena[VIRTIO_GPU_QNUM];	/* reset after each chain */
+	struct mem_slab slab;		/* resources and their backing arrays */
+	int udmabuf_list_limit;
+	LIST_HEAD(,virtio_gpu_dmabuf_cached) dmabuf_hash[VIRTIO_GPU_DMABUF_HASH];
+	TAILQ_HEAD(virtio_gpu_dmabuf_lru, virtio_gpu_dmabuf_cached) dmabuf_lru;
+	int dmabuf_cached;
+	LIST_HEAD(, virtio_gpu_context) ctx_list;
+	LIST_HEAD(, virtio_gpu_timeline) timelines;
+	struct virtio_gpu_fence fences[VIRTIO_GPU_RINGSZ];
+	TAILQ_HEAD(, virtio_gpu_fence) fence_free;
+	int nr_fences;			/* deferred */
+	uint32_t frame_last[VDPY_MAX_NUM];	/* last frame tagged on each scanout */
+	uint32_t frames_done[VDPY_MAX_NUM];	/* last frame presented or dropped */
+	struct vdpy_display_bh fence_bh;
+	struct acrn_timer fence_timer;
+	void *hostmem;			/* host visible window, NULL if none */
+	uint64_t hostmem_offset;	/* of the window in the shared memory */
+	uint64_t hostmem_size;
+	struct dma_buf_info *hostmem_dmabuf;	/* the whole window, made once */
+#ifdef WITH_VIRGL
+	struct virtio_gpu_virgl *virgl;	/* 3D commands, NULL without the feature */
+	struct vdpy_display_bh virgl_bh;	/* reset or tear down the renderer */
+	bool virgl_closing;
+	pthread_mutex_t virgl_mtx;	/* virgl is cleared under it when torn down */
+	pthread_cond_t virgl_cond;
+	struct mevent *render_mevp;	/* renderer fence fd, NULL while polled */
+#endif
 };
 
 struct virtio_gpu_command {
 	struct virtio_gpu_ctrl_hdr hdr;
 	struct virtio_gpu *gpu;
 	struct virtio_vq_info *vq;
+	struct mem_arena *arena;	/* scratch of the queue */
 	struct iovec *iov;
 	uint32_t iovcnt;
 	bool finished;
 	uint32_t iolen;
+	uint64_t bytes;		/* data moved or attached, for statistics */
 };
 
 static void virtio_gpu_reset(void *vdev);
@@ -420,6 +728,14 @@ static int virtio_gpu_cfgread(void *, int, int, uint32_t *);
 static int virtio_gpu_cfgwrite(void *, int, int, uint32_t);
 static void virtio_gpu_neg_features(void *, uint64_t);
 static void virtio_gpu_set_status(void *, uint64_t);
+static int virtio_gpu_checkpoint(void *, void *, size_t);
+static void virtio_gpu_show_blob(struct virtio_gpu *gpu, struct virtio_gpu_resource_2d *r2d,
+				 struct virtio_gpu_set_scanout_blob *req, uint64_t frame_ns);
+static int virtio_gpu_restore(void *, const void *, size_t);
+static size_t virtio_gpu_checkpoint_size(void *);
+static void virtio_gpu_dmabuf_cache_flush(struct virtio_gpu *gpu);
+static void virtio_gpu_free_contexts(struct virtio_gpu *gpu);
+static void virtio_gpu_fence_reset(struct virtio_gpu *gpu);
 static void * virtio_gpu_vga_render(void *param);
 
 static struct virtio_ops virtio_gpu_ops = {
@@ -432,8 +748,156 @@ static struct virtio_ops virtio_gpu_ops = {
 	virtio_gpu_cfgwrite,		/* write PCI config */
 	virtio_gpu_neg_features,	/* apply negotiated features */
 	virtio_gpu_set_status,		/* called on guest set status */
+	virtio_gpu_checkpoint,		/* save device state */
+	virtio_gpu_restore,		/* resume from saved state */
+	virtio_gpu_checkpoint_size,	/* room the saved state needs */
 };
-static int virtio_gpu_device_cnt = 0;
+
+static inline uint64_t
+virtio_gpu_stats_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static uint32_t
+virtio_gpu_stats_calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec t0, t1;
+	uint64_t c0, c1, ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	c0 = __rdtsc();
+	usleep(10000);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	c1 = __rdtsc();
+	ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+	return ns ? (c1 - c0) * 1000000 / ns : 0;
+#else
+	return 1000000;
+#endif
+}
+
+static int
+virtio_gpu_stats_slot(uint32_t type)
+{
+	if (type >= VIRTIO_GPU_CMD_GET_DISPLAY_INFO && type <= VIRTIO_GPU_CMD_SET_MODIFIER)
+		return VIRTIO_GPU_STATS_CTRL + type - VIRTIO_GPU_CMD_GET_DISPLAY_INFO;
+	if (type >= VIRTIO_GPU_CMD_UPDATE_CURSOR && type <= VIRTIO_GPU_CMD_MOVE_CURSOR)
+		return VIRTIO_GPU_STATS_CURSOR + type - VIRTIO_GPU_CMD_UPDATE_CURSOR;
+	return 0;
+}
+
+/* Called by the display thread before it handles a batch of commands */
+static void
+virtio_gpu_stats_begin(struct virtio_gpu *gpu)
+{
+	struct virtio_gpu_stats *stats;
+	uint32_t req;
+	int i;
+
+	if (!gpu->stats_attached) {
+		gpu->stats_attached = true;
+		stats = virtio_stats_area(&gpu->base, sizeof(*stats));
+		if (!stats)
+			return;
+		stats->version = VIRTIO_GPU_STATS_VERSION;
+		stats->tsc_khz = gpu->tsc_khz;
+		for (i = 0; i < VIRTIO_GPU_STATS_CURSOR - VIRTIO_GPU_STATS_CTRL; i++)
+			stats->slots[VIRTIO_GPU_STATS_CTRL + i].type = VIRTIO_GPU_CMD_GET_DISPLAY_INFO + i;
+		for (i = 0; i < VIRTIO_GPU_STATS_UDMABUF - VIRTIO_GPU_STATS_CURSOR; i++)
+			stats->slots[VIRTIO_GPU_STATS_CURSOR + i].type = VIRTIO_GPU_CMD_UPDATE_CURSOR + i;
+		__atomic_store_n(&stats->magic, VIRTIO_GPU_STATS_MAGIC, __ATOMIC_RELEASE);
+		gpu->stats = stats;
+	}
+
+	stats = gpu->stats;
+	if (!stats)
+		return;
+
+	__atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	vdpy_get_frame_stats(gpu->vdpy_handle, &stats->frames);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+
+	req = __atomic_load_n(&stats->reset_req, __ATOMIC_ACQUIRE);
+	if (req != stats->reset_ack) {
+		__atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		for (i = 0; i < VIRTIO_GPU_STATS_SLOTS; i++) {
+			stats->slots[i].count = 0;
+			stats->slots[i].errors = 0;
+			stats->slots[i].ticks = 0;
+			stats->slots[i].max_ticks = 0;
+			stats->slots[i].bytes = 0;
+			memset(stats->slots[i].hist, 0, sizeof(stats->slots[i].hist));
+		}
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		__atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats->reset_ack, req, __ATOMIC_RELEASE);
+	}
+}
+
+static void
+virtio_gpu_stats_record(struct virtio_gpu *gpu, int slot, uint64_t start,
+			uint64_t bytes, bool error)
+{
+	struct virtio_gpu_stats *stats = gpu->stats;
+	struct virtio_gpu_stats_slot *s;
+	uint64_t ticks;
+	int bucket;
+
+	if (!stats)
+		return;
+
+	ticks = virtio_gpu_stats_now() - start;
+	bucket = ticks ? 63 - __builtin_clzll(ticks) : 0;
+	if (bucket >= VIRTIO_GPU_STATS_BUCKETS)
+		bucket = VIRTIO_GPU_STATS_BUCKETS - 1;
+
+	s = &stats->slots[slot];
+	__atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	s->count++;
+	if (error)
+		s->errors++;
+	s->ticks += ticks;
+	if (ticks > s->max_ticks)
+		s->max_ticks = ticks;
+	s->bytes += bytes;
+	s->hist[bucket]++;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+virtio_gpu_frame_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Tag a surface for frame latency tracing; frame ids skip 0 (untagged) */
+static void
+virtio_gpu_frame_tag(struct virtio_gpu *gpu, int scanout_id, struct surface *surf,
+		     uint64_t frame_ns)
+{
+	if (++gpu->frame_seq == 0)
+		gpu->frame_seq = 1;
+	surf->frame_id = gpu->frame_seq;
+	gpu->frame_last[scanout_id] = gpu->frame_seq;
+	surf->frame_ns = frame_ns;
+}
 
 static inline bool virtio_gpu_blob_supported(struct virtio_gpu *gpu)
 {
@@ -448,7 +912,7 @@ static void virtio_gpu_dmabuf_ref(struct dma_buf_info *info)
 	atomic_add_fetch(&info->ref_count, 1);
 }
 
-static void virtio_gpu_dmabuf_unref(struct dma_buf_info *info)
+static void virtio_gpu_dmabuf_unref(struct virtio_gpu *gpu, struct dma_buf_info *info)
 {
 	if (!info)
 		return;
@@ -456,8 +920,187 @@ static void virtio_gpu_dmabuf_unref(struct dma_buf_info *info)
 	if (atomic_sub_fetch(&info->ref_count, 1) == 0) {
 		if (info->dmabuf_fd > 0)
 			close(info->dmabuf_fd);
-		free(info);
+		mem_slab_free(&gpu->slab, info, sizeof(*info));
+	}
+}
+
+static int
+virtio_gpu_pools_init(struct virtio_gpu *gpu)
+{
+	int i;
+
+	if (mem_slab_init(&gpu->slab))
+		return -1;
+	for (i = 0; i < VIRTIO_GPU_QNUM; i++) {
+		if (mem_arena_init(&gpu->arena[i], VIRTIO_GPU_ARENA_SIZE)) {
+			while (i--)
+				mem_arena_deinit(&gpu->arena[i]);
+			mem_slab_deinit(&gpu->slab);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+virtio_gpu_pools_deinit(struct virtio_gpu *gpu)
+{
+	int i;
+
+	for (i = 0; i < VIRTIO_GPU_QNUM; i++)
+		mem_arena_deinit(&gpu->arena[i]);
+	mem_slab_deinit(&gpu->slab);
+}
+
+static inline struct virtio_gpu_resource_2d *
+virtio_gpu_alloc_resource(struct virtio_gpu *gpu)
+{
+	struct virtio_gpu_resource_2d *r2d;
+
+	r2d = mem_slab_zalloc(&gpu->slab, sizeof(struct virtio_gpu_resource_2d));
+	if (r2d)
+		r2d->shm_fd = -1;
+	return r2d;
+}
+
+static inline void
+virtio_gpu_free_resource(struct virtio_gpu *gpu, struct virtio_gpu_resource_2d *r2d)
+{
+	mem_slab_free(&gpu->slab, r2d, sizeof(*r2d));
+}
+
+/*
+ * The image of a 2D resource is moved into a memfd when it is first set on
+ * a scanout, so that the display client maps it once and then only gets
+ * the damage of each flush; resources that are never shown keep an
+ * ordinary image. The memfd goes with the last reference to the image. If
+ * it can not be had, the image stays an ordinary one and vdisplay copies it.
+ */
+struct virtio_gpu_shm_image {
+	int fd;
+	void *map;
+	size_t size;
+};
+
+static void
+virtio_gpu_shm_image_destroy(pixman_image_t *image __attribute__((unused)), void *data)
+{
+	struct virtio_gpu_shm_image *shm = data;
+
+	munmap(shm->map, shm->size);
+	close(shm->fd);
+	free(shm);
+}
+
+static pixman_image_t *
+virtio_gpu_image_create(struct virtio_gpu_resource_2d *r2d)
+{
+	r2d->shm_fd = -1;
+	r2d->shm_size = 0;
+	return pixman_image_create_bits(r2d->format, r2d->width, r2d->height, NULL, 0);
+}
+
+/* Moves the image of r2d, with its pixels, into a memfd */
+static void
+virtio_gpu_image_shm(struct virtio_gpu_resource_2d *r2d)
+{
+	struct virtio_gpu_shm_image *shm;
+	pixman_image_t *image;
+	uint64_t stride, size;
+
+	if ((r2d->shm_fd >= 0) || !r2d->image)
+		return;
+	stride = pixman_image_get_stride(r2d->image);
+	size = stride * r2d->height;
+	if (!size || (size > INT32_MAX))
+		return;
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm)
+		return;
+	shm->fd = memfd_create("acrn_gpu_res", MFD_CLOEXEC);
+	if (shm->fd < 0)
+		goto fail;
+	if (ftruncate(shm->fd, size) < 0)
+		goto close_fd;
+	shm->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+	if (shm->map == MAP_FAILED)
+		goto close_fd;
+	shm->size = size;
+
+	image = pixman_image_create_bits(r2d->format, r2d->width, r2d->height,
+					 shm->map, stride);
+	if (!image) {
+		virtio_gpu_shm_image_destroy(NULL, shm);
+		return;
+	}
+	pixman_image_set_destroy_function(image, virtio_gpu_shm_image_destroy, shm);
+	memcpy(shm->map, pixman_image_get_data(r2d->image), size);
+	pixman_image_unref(r2d->image);
+	r2d->image = image;
+	r2d->shm_fd = shm->fd;
+	r2d->shm_size = size;
+	return;
+
+close_fd:
+	close(shm->fd);
+fail:
+	pr_dbg("%s: no memfd for resource %d: %s\n", __func__, r2d->resource_id,
+	       strerror(errno));
+	free(shm);
+}
+
+static inline struct virtio_gpu_mem_entry *
+virtio_gpu_alloc_entries(struct virtio_gpu *gpu, uint32_t nr_entries)
+{
+	return mem_slab_zalloc(&gpu->slab, nr_entries * sizeof(struct virtio_gpu_mem_entry));
+}
+
+static inline void
+virtio_gpu_free_entries(struct virtio_gpu *gpu, struct virtio_gpu_mem_entry *entries,
+			uint32_t nr_entries)
+{
+	mem_slab_free(&gpu->slab, entries, nr_entries * sizeof(struct virtio_gpu_mem_entry));
+}
+
+static void
+virtio_gpu_free_backing(struct virtio_gpu *gpu, struct virtio_gpu_resource_2d *r2d)
+{
+	mem_slab_free(&gpu->slab, r2d->iov, r2d->iovcnt * sizeof(struct iovec));
+	r2d->iov = NULL;
+	r2d->iovcnt = 0;
+	virtio_gpu_free_entries(gpu, r2d->entries, r2d->nr_entries);
+	r2d->entries = NULL;
+	r2d->nr_entries = 0;
+}
+
+/*
+ * Maps the guest pages described by entries as the backing of r2d. The
+ * entries are owned by r2d afterwards, even on failure.
+ */
+static int
+virtio_gpu_set_backing(struct virtio_gpu *gpu, struct virtio_gpu_resource_2d *r2d,
+		       struct virtio_gpu_mem_entry *entries, uint32_t nr_entries)
+{
+	struct iovec *iov;
+	int i;
+
+	virtio_gpu_free_backing(gpu, r2d);
+	r2d->entries = entries;
+	r2d->nr_entries = nr_entries;
+
+	iov = mem_slab_alloc(&gpu->slab, nr_entries * sizeof(struct iovec));
+	if (!iov)
+		return -1;
+
+	for (i = 0; i < nr_entries; i++) {
+		iov[i].iov_base = paddr_guest2host(gpu->base.dev->vmctx,
+				entries[i].addr, entries[i].length);
+		iov[i].iov_len = entries[i].length;
 	}
+	r2d->iov = iov;
+	r2d->iovcnt = nr_entries;
+	return 0;
 }
 
 static void
@@ -486,19 +1129,24 @@ virtio_gpu_reset(void *vdev)
 				r2d->image = NULL;
 			}
 			if (r2d->blob) {
-				virtio_gpu_dmabuf_unref(r2d->dma_info);
+				virtio_gpu_dmabuf_unref(gpu, r2d->dma_info);
 				r2d->dma_info = NULL;
 				r2d->blob = false;
 			}
 			LIST_REMOVE(r2d, link);
-			if (r2d->iov) {
-				free(r2d->iov);
-				r2d->iov = NULL;
-			}
-			free(r2d);
+			virtio_gpu_free_backing(gpu, r2d);
+			virtio_gpu_free_resource(gpu, r2d);
 		}
 	}
 	LIST_INIT(&gpu->r2d_list);
+	virtio_gpu_dmabuf_cache_flush(gpu);
+	virtio_gpu_fence_reset(gpu);
+	virtio_gpu_free_contexts(gpu);
+#ifdef WITH_VIRGL
+	/* the renderer's GL context is current on the display thread */
+	if (gpu->virgl)
+		vdpy_submit_bh(gpu->vdpy_handle, &gpu->virgl_bh);
+#endif
 	gpu->vga.enable = true;
 	pthread_mutex_lock(&gpu->vga_thread_mtx);
 	if (atomic_load(&gpu->vga_thread_status) == VGA_THREAD_EOL) {
@@ -538,7 +1186,7 @@ virtio_gpu_cfgwrite(void *vdev, int offset, int size, uint32_t value)
 	if (offset == offsetof(struct virtio_gpu_config, events_clear)) {
 
 		memcpy(ptr, &value, size);
-		gpu->cfg.events_read &= ~value;
+		__atomic_and_fetch(&gpu->cfg.events_read, ~value, __ATOMIC_RELEASE);
 		gpu->cfg.events_clear &= ~value;
 	}
 	pr_err("%s: write to read-only registers.\n", __func__);
@@ -567,6 +1215,11 @@ virtio_gpu_update_resp_fence(struct virtio_gpu_ctrl_hdr *hdr,
 	if(hdr->flags & VIRTIO_GPU_FLAG_FENCE) {
 		resp->flags |= VIRTIO_GPU_FLAG_FENCE;
 		resp->fence_id = hdr->fence_id;
+		resp->ctx_id = hdr->ctx_id;
+		if (hdr->flags & VIRTIO_GPU_FLAG_INFO_RING_IDX) {
+			resp->flags |= VIRTIO_GPU_FLAG_INFO_RING_IDX;
+			resp->ring_idx = hdr->ring_idx;
+		}
 	}
 }
 
@@ -673,11 +1326,69 @@ virtio_gpu_get_pixman_format(uint32_t format)
 	case VIRTIO_GPU_FORMAT_A8B8G8R8_UNORM:
 		pr_dbg("%s: format A8B8G8R8.\n", __func__);
 		return PIXMAN_r8g8b8a8;
+	case VIRTIO_GPU_FORMAT_B5G6R5_UNORM:
+		pr_dbg("%s: format B5G6R5.\n", __func__);
+		return PIXMAN_r5g6b5;
+	case VIRTIO_GPU_FORMAT_B5G5R5A1_UNORM:
+		pr_dbg("%s: format B5G5R5A1.\n", __func__);
+		return PIXMAN_a1r5g5b5;
 	default:
 		return 0;
 	}
 }
 
+/* The virtio format of a pixman one, 0 if there is none */
+static uint32_t
+virtio_gpu_get_virtio_format(pixman_format_code_t format)
+{
+	static const uint32_t formats[] = {
+		VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM, VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM,
+		VIRTIO_GPU_FORMAT_X8R8G8B8_UNORM, VIRTIO_GPU_FORMAT_A8R8G8B8_UNORM,
+		VIRTIO_GPU_FORMAT_R8G8B8X8_UNORM, VIRTIO_GPU_FORMAT_R8G8B8A8_UNORM,
+		VIRTIO_GPU_FORMAT_X8B8G8R8_UNORM, VIRTIO_GPU_FORMAT_A8B8G8R8_UNORM,
+		VIRTIO_GPU_FORMAT_B5G6R5_UNORM, VIRTIO_GPU_FORMAT_B5G5R5A1_UNORM,
+	};
+	int i;
+
+	for (i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++)
+		if (virtio_gpu_get_pixman_format(formats[i]) == format)
+			return formats[i];
+	return 0;
+}
+
+/* A 2D image of this size can be made, and mapped by the display client */
+static bool
+virtio_gpu_2d_size_valid(uint32_t width, uint32_t height, pixman_format_code_t format)
+{
+	uint64_t stride;
+
+	if (!width || !height)
+		return false;
+	stride = (((uint64_t)width * PIXMAN_FORMAT_BPP(format) + 31) / 32) * 4;
+	return stride * height <= INT32_MAX;
+}
+
+/* The framebuffer of a SET_SCANOUT_BLOB, and the rectangle shown, fit in the blob */
+static bool
+virtio_gpu_scanout_blob_valid(struct virtio_gpu_resource_2d *r2d,
+			      const struct virtio_gpu_set_scanout_blob *req)
+{
+	pixman_format_code_t format;
+	uint64_t bpp, end;
+
+	format = virtio_gpu_get_pixman_format(req->format);
+	if (!format || !req->width || !req->height)
+		return false;
+	bpp = PIXMAN_FORMAT_BPP(format) / 8;
+	if ((uint64_t)req->r.x + req->r.width > req->width ||
+	    (uint64_t)req->r.y + req->r.height > req->height ||
+	    req->strides[0] < req->width * bpp)
+		return false;
+	end = req->offsets[0] + (uint64_t)req->strides[0] * (req->height - 1) +
+		req->width * bpp;
+	return end <= r2d->blob_size;
+}
+
 static void
 virtio_gpu_update_scanout(struct virtio_gpu *gpu, int scanout_id, int resource_id,
 			  struct virtio_gpu_rect *scan_rect)
@@ -688,7 +1399,7 @@ virtio_gpu_update_scanout(struct virtio_gpu *gpu, int scanout_id, int resource_i
 	/* as it is already checked, this is not checked again */
 	gpu_scanout = gpu->gpu_scanouts + scanout_id;
 	if (gpu_scanout->dma_buf) {
-		virtio_gpu_dmabuf_unref(gpu_scanout->dma_buf);
+		virtio_gpu_dmabuf_unref(gpu, gpu_scanout->dma_buf);
 		gpu_scanout->dma_buf = NULL;
 	}
 	if (gpu_scanout->cur_img) {
@@ -696,6 +1407,7 @@ virtio_gpu_update_scanout(struct virtio_gpu *gpu, int scanout_id, int resource_i
 		gpu_scanout->cur_img = NULL;
 	}
 	gpu_scanout->resource_id = resource_id;
+	gpu_scanout->is_blob = false;
 	r2d = virtio_gpu_find_resource_2d(gpu, resource_id);
 	if (r2d) {
 		gpu_scanout->is_active = true;
@@ -703,6 +1415,7 @@ virtio_gpu_update_scanout(struct virtio_gpu *gpu, int scanout_id, int resource_i
 			virtio_gpu_dmabuf_ref(r2d->dma_info);
 			gpu_scanout->dma_buf = r2d->dma_info;
 		} else {
+			virtio_gpu_image_shm(r2d);
 			pixman_image_ref(r2d->image);
 			gpu_scanout->cur_img = r2d->image;
 		}
@@ -732,8 +1445,18 @@ virtio_gpu_cmd_resource_create_2d(struct virtio_gpu_command *cmd)
 		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
 		goto response;
 	}
-	r2d = (struct virtio_gpu_resource_2d*)calloc(1, \
-			sizeof(struct virtio_gpu_resource_2d));
+	if (!virtio_gpu_get_pixman_format(req.format)) {
+		pr_err("%s: unsupported format %d.\n", __func__, req.format);
+		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+		goto response;
+	}
+	if (!virtio_gpu_2d_size_valid(req.width, req.height,
+				      virtio_gpu_get_pixman_format(req.format))) {
+		pr_err("%s: invalid size %dx%d.\n", __func__, req.width, req.height);
+		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+		goto response;
+	}
+	r2d = virtio_gpu_alloc_resource(cmd->gpu);
 	if (!r2d) {
 		pr_err("%s: memory allocation for r2d failed.\n", __func__);
 		resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
@@ -744,15 +1467,14 @@ virtio_gpu_cmd_resource_create_2d(struct virtio_gpu_command *cmd)
 	r2d->width = req.width;
 	r2d->height = req.height;
 	r2d->format = virtio_gpu_get_pixman_format(req.format);
-	r2d->image = pixman_image_create_bits(
-			r2d->format, r2d->width, r2d->height, NULL, 0);
+	r2d->image = virtio_gpu_image_create(r2d);
 	if (!r2d->image) {
 		pr_err("%s: could not create resource %d (%d,%d).\n",
 				__func__,
 				r2d->resource_id,
 				r2d->width,
 				r2d->height);
-		free(r2d);
+		virtio_gpu_free_resource(cmd->gpu, r2d);
 		resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
 	} else {
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
@@ -780,18 +1502,16 @@ virtio_gpu_cmd_resource_unref(struct virtio_gpu_command *cmd)
 		if (r2d->image) {
 			pixman_image_unref(r2d->image);
 			r2d->image = NULL;
+			r2d->shm_fd = -1;
 		}
 		if (r2d->blob) {
-			virtio_gpu_dmabuf_unref(r2d->dma_info);
+			virtio_gpu_dmabuf_unref(cmd->gpu, r2d->dma_info);
 			r2d->dma_info = NULL;
 			r2d->blob = false;
 		}
 		LIST_REMOVE(r2d, link);
-		if (r2d->iov) {
-			free(r2d->iov);
-			r2d->iov = NULL;
-		}
-		free(r2d);
+		virtio_gpu_free_backing(cmd->gpu, r2d);
+		virtio_gpu_free_resource(cmd->gpu, r2d);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 	} else {
 		pr_err("%s: Illegal resource id %d\n", __func__, req.resource_id);
@@ -812,7 +1532,6 @@ virtio_gpu_cmd_resource_attach_backing(struct virtio_gpu_command *cmd)
 	struct virtio_gpu_ctrl_hdr resp;
 	int i;
 	uint8_t *pbuf;
-	struct iovec *iov;
 
 	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
 	memset(&resp, 0, sizeof(resp));
@@ -835,17 +1554,8 @@ virtio_gpu_cmd_resource_attach_backing(struct virtio_gpu_command *cmd)
 	r2d = virtio_gpu_find_resource_2d(cmd->gpu, req.resource_id);
 	if (r2d) {
 		if (req.nr_entries > 0) {
-			iov = malloc(req.nr_entries * sizeof(struct iovec));
-			if (!iov) {
-				resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
-				goto exit;
-			}
-
-			r2d->iov = iov;
-			r2d->iovcnt = req.nr_entries;
-			entries = calloc(req.nr_entries, sizeof(struct virtio_gpu_mem_entry));
+			entries = virtio_gpu_alloc_entries(cmd->gpu, req.nr_entries);
 			if (!entries) {
-				free(iov);
 				resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
 				goto exit;
 			}
@@ -854,14 +1564,12 @@ virtio_gpu_cmd_resource_attach_backing(struct virtio_gpu_command *cmd)
 				memcpy(pbuf, cmd->iov[i].iov_base, cmd->iov[i].iov_len);
 				pbuf += cmd->iov[i].iov_len;
 			}
-			for (i = 0; i < req.nr_entries; i++) {
-				r2d->iov[i].iov_base = paddr_guest2host(
-						cmd->gpu->base.dev->vmctx,
-						entries[i].addr,
-						entries[i].length);
-				r2d->iov[i].iov_len = entries[i].length;
+			if (virtio_gpu_set_backing(cmd->gpu, r2d, entries, req.nr_entries)) {
+				resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+				goto exit;
 			}
-			free(entries);
+			for (i = 0; i < req.nr_entries; i++)
+				cmd->bytes += entries[i].length;
 		}
 	} else {
 		pr_err("%s: Illegal resource id %d\n", __func__, req.resource_id);
@@ -887,10 +1595,8 @@ virtio_gpu_cmd_resource_detach_backing(struct virtio_gpu_command *cmd)
 	memset(&resp, 0, sizeof(resp));
 
 	r2d = virtio_gpu_find_resource_2d(cmd->gpu, req.resource_id);
-	if (r2d && r2d->iov) {
-		free(r2d->iov);
-		r2d->iov = NULL;
-	}
+	if (r2d && !r2d->blob)
+		virtio_gpu_free_backing(cmd->gpu, r2d);
 
 	cmd->iolen = sizeof(resp);
 	resp.type = VIRTIO_GPU_RESP_OK_NODATA;
@@ -899,16 +1605,88 @@ virtio_gpu_cmd_resource_detach_backing(struct virtio_gpu_command *cmd)
 }
 
 static void
-virtio_gpu_cmd_set_scanout(struct virtio_gpu_command *cmd)
+virtio_gpu_surface_shm(struct virtio_gpu_resource_2d *r2d, struct surface *surf)
 {
-	struct virtio_gpu_set_scanout req;
-	struct virtio_gpu_resource_2d *r2d;
-	struct virtio_gpu_ctrl_hdr resp;
-	struct surface surf;
-	struct virtio_gpu *gpu;
-	struct virtio_gpu_scanout *gpu_scanout;
+	surf->shm_info.memfd = r2d->shm_fd;
+	if (r2d->shm_fd < 0)
+		return;
+	surf->shm_info.offset = (uint64_t)surf->y * surf->stride +
+		surf->x * (PIXMAN_FORMAT_BPP(r2d->format) / 8);
+	surf->shm_info.size = r2d->shm_size;
+}
+
+static void
+virtio_gpu_show_2d(struct virtio_gpu *gpu, int scanout_id,
+		   struct virtio_gpu_resource_2d *r2d, struct virtio_gpu_rect *r)
+{
+	struct surface surf;
 	int bytes_pp;
 
+	memset(&surf, 0, sizeof(surf));
+	bytes_pp = PIXMAN_FORMAT_BPP(r2d->format) / 8;
+	pixman_image_ref(r2d->image);
+	surf.pixel = pixman_image_get_data(r2d->image);
+	surf.x = r->x;
+	surf.y = r->y;
+	surf.width = r->width;
+	surf.height = r->height;
+	surf.stride = pixman_image_get_stride(r2d->image);
+	surf.surf_format = r2d->format;
+	surf.surf_type = SURFACE_PIXMAN;
+	surf.pixel = (char*)surf.pixel + bytes_pp * surf.x + surf.y * surf.stride;
+	virtio_gpu_surface_shm(r2d, &surf);
+	pr_dbg("%s: x/y/w/h=%d/%d/%d/%d stride=%d bytes_pp=%d format=0x%x pixel=0x%x\n",
+			__func__, r->x, r->y, r->width, r->height, surf.stride, bytes_pp,
+			r2d->format, surf.pixel);
+	vdpy_surface_set(gpu->vdpy_handle, scanout_id, &surf);
+	pixman_image_unref(r2d->image);
+}
+
+static inline bool
+virtio_gpu_virgl_owns(struct virtio_gpu *gpu, uint32_t resource_id)
+{
+#ifdef WITH_VIRGL
+	return gpu->virgl && virtio_gpu_virgl_has_resource(gpu->virgl, resource_id);
+#else
+	return false;
+#endif
+}
+
+/*
+ * Shows a rectangle of a renderer resource: sets the surface of the
+ * scanout, or with frame_ns updates it as a new frame.
+ */
+static int
+virtio_gpu_show_virgl(struct virtio_gpu *gpu, int scanout_id, uint32_t resource_id,
+		      struct virtio_gpu_rect *r, uint64_t frame_ns)
+{
+#ifdef WITH_VIRGL
+	struct surface surf;
+
+	if (virtio_gpu_virgl_surface(gpu->virgl, resource_id, r->x, r->y,
+				     r->width, r->height, &surf))
+		return -1;
+	if (frame_ns) {
+		virtio_gpu_frame_tag(gpu, scanout_id, &surf, frame_ns);
+		vdpy_surface_update(gpu->vdpy_handle, scanout_id, &surf);
+	} else {
+		vdpy_surface_set(gpu->vdpy_handle, scanout_id, &surf);
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static void
+virtio_gpu_cmd_set_scanout(struct virtio_gpu_command *cmd)
+{
+	struct virtio_gpu_set_scanout req;
+	struct virtio_gpu_resource_2d *r2d;
+	struct virtio_gpu_ctrl_hdr resp;
+	struct virtio_gpu *gpu;
+	struct virtio_gpu_scanout *gpu_scanout;
+
 	gpu = cmd->gpu;
 	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
 	memset(&resp, 0, sizeof(resp));
@@ -924,6 +1702,20 @@ virtio_gpu_cmd_set_scanout(struct virtio_gpu_command *cmd)
 	gpu_scanout->scanout_id = req.scanout_id;
 
 	r2d = virtio_gpu_find_resource_2d(gpu, req.resource_id);
+	if (!r2d && req.resource_id && virtio_gpu_virgl_owns(gpu, req.resource_id)) {
+		if (virtio_gpu_show_virgl(gpu, req.scanout_id, req.resource_id, &req.r, 0)) {
+			pr_err("%s: can not show resource %d\n", __func__, req.resource_id);
+			resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+		} else {
+			virtio_gpu_update_scanout(gpu, req.scanout_id, req.resource_id, &req.r);
+			gpu_scanout->is_active = true;
+			gpu->vga.enable = false;
+			resp.type = VIRTIO_GPU_RESP_OK_NODATA;
+		}
+		cmd->iolen = sizeof(resp);
+		memcpy(cmd->iov[1].iov_base, &resp, sizeof(resp));
+		return;
+	}
 	if ((req.resource_id == 0) || (r2d == NULL)) {
 		virtio_gpu_update_scanout(gpu, req.scanout_id, 0, &req.r);
 		vdpy_surface_set(gpu->vdpy_handle, req.scanout_id, NULL);
@@ -942,22 +1734,7 @@ virtio_gpu_cmd_set_scanout(struct virtio_gpu_command *cmd)
 		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
 	} else {
 		virtio_gpu_update_scanout(gpu, req.scanout_id, req.resource_id, &req.r);
-		bytes_pp = PIXMAN_FORMAT_BPP(r2d->format) / 8;
-		pixman_image_ref(r2d->image);
-		surf.pixel = pixman_image_get_data(r2d->image);
-		surf.x = req.r.x;
-		surf.y = req.r.y;
-		surf.width = req.r.width;
-		surf.height = req.r.height;
-		surf.stride = pixman_image_get_stride(r2d->image);
-		surf.surf_format = r2d->format;
-		surf.surf_type = SURFACE_PIXMAN;
-		surf.pixel = (char*)surf.pixel + bytes_pp * surf.x + surf.y * surf.stride;
-		pr_dbg("%s: x/y/w/h=%d/%d/%d/%d stride=%d bytes_pp=%d format=0x%x pixel=0x%x\n",
-				__func__, req.r.x, req.r.y,req.r.width,req.r.height, surf.stride, bytes_pp,
-				r2d->format, surf.pixel);
-		vdpy_surface_set(gpu->vdpy_handle, req.scanout_id, &surf);
-		pixman_image_unref(r2d->image);
+		virtio_gpu_show_2d(gpu, req.scanout_id, r2d, &req.r);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 	}
 
@@ -970,17 +1747,62 @@ virtio_gpu_cmd_set_scanout(struct virtio_gpu_command *cmd)
 }
 
 static void
-virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
+virtio_gpu_copy_from_backing(struct virtio_gpu_resource_2d *r2d,
+			     struct virtio_gpu_rect *r, uint64_t offset)
 {
-	struct virtio_gpu_transfer_to_host_2d req;
-	struct virtio_gpu_resource_2d *r2d;
-	struct virtio_gpu_ctrl_hdr resp;
 	uint32_t src_offset, dst_offset, stride, bpp, h;
 	pixman_format_code_t format;
 	void *img_data, *dst, *src;
 	int i, done, bytes, total;
 	int width, height;
 
+	pixman_image_ref(r2d->image);
+	stride = pixman_image_get_stride(r2d->image);
+	format = pixman_image_get_format(r2d->image);
+	bpp = PIXMAN_FORMAT_BPP(format) / 8;
+	img_data = pixman_image_get_data(r2d->image);
+	width = (r->width < r2d->width) ? r->width : r2d->width;
+	height = (r->height < r2d->height) ? r->height : r2d->height;
+	pr_dbg("%s: height=%d r2d->iovcnt=%d\n", __func__,
+			height, r2d->iovcnt);
+	for (h = 0; h < height; h++) {
+		src_offset = offset + stride * h;
+		dst_offset = (r->y + h) * stride + (r->x * bpp);
+		dst = (char*)img_data + dst_offset;
+		done = 0;
+		total = width * bpp;
+		for (i = 0; i < r2d->iovcnt; i++) {
+			if ((r2d->iov[i].iov_base == 0) || (r2d->iov[i].iov_len == 0)) {
+				pr_err("%s: (r2d->iov[i].iov_base == 0) || (r2d->iov[i].iov_len == 0)\n", __func__);
+				continue;
+			}
+
+			if (src_offset < r2d->iov[i].iov_len) {
+				src = (char*)(r2d->iov[i].iov_base) + src_offset;
+				bytes = ((total - done) < (r2d->iov[i].iov_len - src_offset)) ?
+					 (total - done) : (r2d->iov[i].iov_len - src_offset);
+				memcpy(((char*)dst + done), src, bytes);
+
+				src_offset = 0;
+				done += bytes;
+				if (done >= total) {
+					break;
+				}
+			} else {
+				src_offset -= r2d->iov[i].iov_len;
+			}
+		}
+	}
+	pixman_image_unref(r2d->image);
+}
+
+static void
+virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
+{
+	struct virtio_gpu_transfer_to_host_2d req;
+	struct virtio_gpu_resource_2d *r2d;
+	struct virtio_gpu_ctrl_hdr resp;
+
 	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
 	memset(&resp, 0, sizeof(resp));
 	virtio_gpu_update_resp_fence(&cmd->hdr, &resp);
@@ -1009,44 +1831,9 @@ virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
 		pr_err("%s: transfer bounds outside resource.\n", __func__);
 		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
 	} else {
-		pixman_image_ref(r2d->image);
-		stride = pixman_image_get_stride(r2d->image);
-		format = pixman_image_get_format(r2d->image);
-		bpp = PIXMAN_FORMAT_BPP(format) / 8;
-		img_data = pixman_image_get_data(r2d->image);
-		width = (req.r.width < r2d->width) ? req.r.width : r2d->width;
-		height = (req.r.height < r2d->height) ? req.r.height : r2d->height;
-		pr_dbg("%s: height=%d r2d->iovcnt=%d\n", __func__,
-				height, r2d->iovcnt);
-		for (h = 0; h < height; h++) {
-			src_offset = req.offset + stride * h;
-			dst_offset = (req.r.y + h) * stride + (req.r.x * bpp);
-			dst = (char*)img_data + dst_offset;
-			done = 0;
-			total = width * bpp;
-			for (i = 0; i < r2d->iovcnt; i++) {
-				if ((r2d->iov[i].iov_base == 0) || (r2d->iov[i].iov_len == 0)) {
-					pr_err("%s: (r2d->iov[i].iov_base == 0) || (r2d->iov[i].iov_len == 0)\n", __func__);
-					continue;
-				}
-
-				if (src_offset < r2d->iov[i].iov_len) {
-					src = (char*)(r2d->iov[i].iov_base) + src_offset;
-					bytes = ((total - done) < (r2d->iov[i].iov_len - src_offset)) ?
-						 (total - done) : (r2d->iov[i].iov_len - src_offset);
-					memcpy(((char*)dst + done), src, bytes);
-
-					src_offset = 0;
-					done += bytes;
-					if (done >= total) {
-						break;
-					}
-				} else {
-					src_offset -= r2d->iov[i].iov_len;
-				}
-			}
-		}
-		pixman_image_unref(r2d->image);
+		virtio_gpu_copy_from_backing(r2d, &req.r, req.offset);
+		cmd->bytes = (uint64_t)req.r.width * req.r.height *
+			(PIXMAN_FORMAT_BPP(r2d->format) / 8);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 	}
 
@@ -1094,6 +1881,25 @@ virtio_gpu_scanout_needs_flush(struct virtio_gpu *gpu,
 		return false;
 }
 
+/* The flushed rectangle within the scanout, relative to its origin */
+static void
+virtio_gpu_surface_damage(struct surface *surf, struct virtio_gpu_rect *r)
+{
+	uint64_t x1, y1, x2, y2;
+
+	x1 = MAX(r->x, surf->x);
+	y1 = MAX(r->y, surf->y);
+	x2 = MIN((uint64_t)r->x + r->width, (uint64_t)surf->x + surf->width);
+	y2 = MIN((uint64_t)r->y + r->height, (uint64_t)surf->y + surf->height);
+	memset(&surf->damage, 0, sizeof(surf->damage));
+	if ((x1 >= x2) || (y1 >= y2))
+		return;
+	surf->damage.x = x1 - surf->x;
+	surf->damage.y = y1 - surf->y;
+	surf->damage.width = x2 - x1;
+	surf->damage.height = y2 - y1;
+}
+
 static void
 virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 {
@@ -1105,13 +1911,29 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 	int i;
 	struct virtio_gpu_scanout *gpu_scanout;
 	int bytes_pp;
+	uint64_t frame_ns;
 
+	frame_ns = virtio_gpu_frame_now();
 	gpu = cmd->gpu;
 	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
 	memset(&resp, 0, sizeof(resp));
+	memset(&surf, 0, sizeof(surf));
 	virtio_gpu_update_resp_fence(&cmd->hdr, &resp);
 
 	r2d = virtio_gpu_find_resource_2d(gpu, req.resource_id);
+	if (r2d == NULL && virtio_gpu_virgl_owns(gpu, req.resource_id)) {
+		for (i = 0; i < gpu->scanout_num; i++) {
+			if (!virtio_gpu_scanout_needs_flush(gpu, i, req.resource_id, &req.r))
+				continue;
+			gpu_scanout = gpu->gpu_scanouts + i;
+			virtio_gpu_show_virgl(gpu, i, req.resource_id,
+					      &gpu_scanout->scanout_rect, frame_ns);
+		}
+		cmd->iolen = sizeof(resp);
+		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
+		memcpy(cmd->iov[1].iov_base, &resp, sizeof(resp));
+		return;
+	}
 	if (r2d == NULL) {
 		pr_err("%s: Illegal resource id %d\n", __func__,
 				req.resource_id);
@@ -1122,13 +1944,15 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 	if (r2d->blob) {
 		virtio_gpu_dmabuf_ref(r2d->dma_info);
 		for (i = 0; i < gpu->scanout_num; i++) {
-			if (!virtio_gpu_scanout_needs_flush(gpu, i, req.resource_id, &req.r))
+			if (!r2d->dma_info ||
+			    !virtio_gpu_scanout_needs_flush(gpu, i, req.resource_id, &req.r))
 				continue;
 			surf.dma_info.dmabuf_fd = r2d->dma_info->dmabuf_fd;
 			surf.surf_type = SURFACE_DMABUF;
+			virtio_gpu_frame_tag(gpu, i, &surf, frame_ns);
 			vdpy_surface_update(gpu->vdpy_handle, i, &surf);
 		}
-		virtio_gpu_dmabuf_unref(r2d->dma_info);
+		virtio_gpu_dmabuf_unref(gpu, r2d->dma_info);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 		memcpy(cmd->iov[1].iov_base, &resp, sizeof(resp));
 		return;
@@ -1148,6 +1972,9 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 		surf.surf_format = r2d->format;
 		surf.surf_type = SURFACE_PIXMAN;
 		surf.pixel = (char*)surf.pixel + bytes_pp * surf.x + surf.y * surf.stride;
+		virtio_gpu_surface_shm(r2d, &surf);
+		virtio_gpu_surface_damage(&surf, &req.r);
+		virtio_gpu_frame_tag(gpu, i, &surf, frame_ns);
 		vdpy_surface_update(gpu->vdpy_handle, i, &surf);
 	}
 	pixman_image_unref(r2d->image);
@@ -1174,63 +2001,309 @@ static int udmabuf_fd(void)
 	return udmabuf;
 }
 
+static inline uint32_t
+virtio_gpu_dmabuf_hash(struct udmabuf_create_list *list)
+{
+	uint64_t size;
+	uint32_t i;
+
+	size = 0;
+	for (i = 0; i < list->count; i++)
+		size += list->list[i].size;
+	return ((list->list[0].offset ^ (size << 20)) >> 12) % VIRTIO_GPU_DMABUF_HASH;
+}
+
+/* Returns a new reference to the dmabuf made from the same ranges, if any */
+static struct dma_buf_info *
+virtio_gpu_dmabuf_cache_get(struct virtio_gpu *gpu, struct udmabuf_create_list *list)
+{
+	struct virtio_gpu_dmabuf_cached *c;
+
+	LIST_FOREACH(c, &gpu->dmabuf_hash[virtio_gpu_dmabuf_hash(list)], hash_link) {
+		if (c->count != list->count ||
+		    memcmp(c->items, list->list, c->count * sizeof(*c->items)))
+			continue;
+		TAILQ_REMOVE(&gpu->dmabuf_lru, c, lru_link);
+		TAILQ_INSERT_HEAD(&gpu->dmabuf_lru, c, lru_link);
+		virtio_gpu_dmabuf_ref(c->info);
+		return c->info;
+	}
+	return NULL;
+}
+
+static void
+virtio_gpu_dmabuf_cache_drop(struct virtio_gpu *gpu, struct virtio_gpu_dmabuf_cached *c)
+{
+	LIST_REMOVE(c, hash_link);
+	TAILQ_REMOVE(&gpu->dmabuf_lru, c, lru_link);
+	gpu->dmabuf_cached--;
+	virtio_gpu_dmabuf_unref(gpu, c->info);
+	mem_slab_free(&gpu->slab, c->items, c->count * sizeof(*c->items));
+	mem_slab_free(&gpu->slab, c, sizeof(*c));
+}
+
+/* The cache keeps its own reference, the least recently used goes first */
+static void
+virtio_gpu_dmabuf_cache_put(struct virtio_gpu *gpu, struct udmabuf_create_list *list,
+			    struct dma_buf_info *info)
+{
+	struct virtio_gpu_dmabuf_cached *c;
+
+	if (gpu->dmabuf_cached >= VIRTIO_GPU_DMABUF_CACHE_SIZE)
+		virtio_gpu_dmabuf_cache_drop(gpu, TAILQ_LAST(&gpu->dmabuf_lru, virtio_gpu_dmabuf_lru));
+
+	c = mem_slab_alloc(&gpu->slab, sizeof(*c));
+	if (!c)
+		return;
+	c->items = mem_slab_alloc(&gpu->slab, list->count * sizeof(*c->items));
+	if (!c->items) {
+		mem_slab_free(&gpu->slab, c, sizeof(*c));
+		return;
+	}
+	memcpy(c->items, list->list, list->count * sizeof(*c->items));
+	c->count = list->count;
+	c->info = info;
+	virtio_gpu_dmabuf_ref(info);
+	LIST_INSERT_HEAD(&gpu->dmabuf_hash[virtio_gpu_dmabuf_hash(list)], c, hash_link);
+	TAILQ_INSERT_HEAD(&gpu->dmabuf_lru, c, lru_link);
+	gpu->dmabuf_cached++;
+}
+
+static void
+virtio_gpu_dmabuf_cache_flush(struct virtio_gpu *gpu)
+{
+	while (!TAILQ_EMPTY(&gpu->dmabuf_lru))
+		virtio_gpu_dmabuf_cache_drop(gpu, TAILQ_FIRST(&gpu->dmabuf_lru));
+}
+
+/*
+ * Guest pages that follow each other in the same memfd are merged into one
+ * udmabuf item, and a blob over ranges seen before gets the cached dmabuf.
+ * The creation list is scratch from arena, the returned info comes from the
+ * slab of gpu.
+ */
 static struct dma_buf_info *virtio_gpu_create_udmabuf(struct virtio_gpu *gpu,
+					struct mem_arena *arena,
 					struct virtio_gpu_mem_entry *entries,
 					int nr_entries)
 {
 	struct udmabuf_create_list *list;
+	struct udmabuf_create_item *item;
 	int udmabuf, i, dmabuf_fd;
 	struct vm_mem_region ret_region;
-	bool fail_flag;
 	struct dma_buf_info *info;
+	uint32_t count;
 
 	udmabuf = udmabuf_fd();
 	if (udmabuf < 0) {
 		return NULL;
 	}
 
-	fail_flag = false;
-	list = malloc(sizeof(*list) + sizeof(struct udmabuf_create_item) * nr_entries);
-	info = malloc(sizeof(*info));
-	if ((info == NULL) || (list == NULL)) {
-		free(list);
-		free(info);
+	list = mem_arena_alloc(arena, sizeof(*list) +
+			       sizeof(struct udmabuf_create_item) * nr_entries);
+	if (list == NULL)
 		return NULL;
-	}
+
+	count = 0;
 	for (i = 0; i < nr_entries; i++) {
 		if (vm_find_memfd_region(gpu->base.dev->vmctx,
 					entries[i].addr,
 					&ret_region) == false) {
-			fail_flag = true;
 			pr_err("%s : Failed to find memfd for %llx.\n",
 					__func__, entries[i].addr);
-			break;
+			return NULL;
 		}
-		list->list[i].memfd  = ret_region.fd;
-		list->list[i].offset = ret_region.fd_offset;
-		list->list[i].size   = entries[i].length;
+		item = count ? &list->list[count - 1] : NULL;
+		if (item && item->memfd == ret_region.fd &&
+		    item->offset + item->size == ret_region.fd_offset) {
+			item->size += entries[i].length;
+			continue;
+		}
+		item = &list->list[count++];
+		memset(item, 0, sizeof(*item));
+		item->memfd  = ret_region.fd;
+		item->offset = ret_region.fd_offset;
+		item->size   = entries[i].length;
 	}
-	list->count = nr_entries;
+	list->count = count;
 	list->flags = UDMABUF_FLAGS_CLOEXEC;
-	if (fail_flag) {
-		dmabuf_fd = -1;
-	} else {
-		dmabuf_fd = ioctl(udmabuf, UDMABUF_CREATE_LIST, list);
+	if (count == 0)
+		return NULL;
+
+	info = virtio_gpu_dmabuf_cache_get(gpu, list);
+	if (info)
+		return info;
+
+	if (count > gpu->udmabuf_list_limit) {
+		pr_err("%s : %u ranges exceed udmabuf.list_limit %d.\n",
+			__func__, count, gpu->udmabuf_list_limit);
+		return NULL;
 	}
+
+	info = mem_slab_alloc(&gpu->slab, sizeof(*info));
+	if (info == NULL)
+		return NULL;
+	dmabuf_fd = ioctl(udmabuf, UDMABUF_CREATE_LIST, list);
 	if (dmabuf_fd < 0) {
-		free(info);
-		info = NULL;
+		mem_slab_free(&gpu->slab, info, sizeof(*info));
 		pr_err("%s : Failed to create the dmabuf. %s\n",
 			__func__, strerror(errno));
+		return NULL;
 	}
-	if (info) {
-		info->dmabuf_fd = dmabuf_fd;
-		atomic_store(&info->ref_count, 1);
+	info->dmabuf_fd = dmabuf_fd;
+	atomic_store(&info->ref_count, 1);
+	virtio_gpu_dmabuf_cache_put(gpu, list, info);
+	return info;
+}
+
+/*
+ * BLOB_MEM_HOST3D blobs live in the host visible window, which the guest
+ * manages like the host visible region of virtio-pci: it picks where a blob
+ * goes when it maps it. The window is shared memory already, so mapping
+ * binds the blob to that part of it, and the blob is shown through the
+ * dmabuf of the whole window at that offset. Its contents are what the
+ * guest wrote there; they do not follow a blob mapped somewhere else.
+ */
+static bool
+virtio_gpu_hostmem_attach(struct virtio_gpu *gpu)
+{
+	if (!gpu->hostmem)
+		gpu->hostmem = virtio_shm_region(&gpu->base, VIRTIO_GPU_SHM_ID_HOST_VISIBLE,
+				&gpu->hostmem_offset, &gpu->hostmem_size);
+	return gpu->hostmem != NULL;
+}
+
+/* The window is exported once, the creation list is scratch from arena */
+static struct dma_buf_info *
+virtio_gpu_hostmem_export(struct virtio_gpu *gpu, struct mem_arena *arena)
+{
+	struct udmabuf_create_list *list;
+	struct vm_mem_region region;
+	struct dma_buf_info *info;
+	int udmabuf, dmabuf_fd;
+
+	if (gpu->hostmem_dmabuf)
+		return gpu->hostmem_dmabuf;
+
+	udmabuf = udmabuf_fd();
+	if (udmabuf < 0 ||
+	    !vm_find_memfd_region(gpu->base.dev->vmctx, gpu->hostmem_offset, &region))
+		return NULL;
+
+	list = mem_arena_alloc(arena, sizeof(*list) + sizeof(struct udmabuf_create_item));
+	if (list == NULL)
+		return NULL;
+	memset(list, 0, sizeof(*list) + sizeof(struct udmabuf_create_item));
+	list->flags = UDMABUF_FLAGS_CLOEXEC;
+	list->count = 1;
+	list->list[0].memfd = region.fd;
+	list->list[0].offset = region.fd_offset;
+	list->list[0].size = gpu->hostmem_size;
+
+	info = mem_slab_alloc(&gpu->slab, sizeof(*info));
+	if (info == NULL)
+		return NULL;
+	dmabuf_fd = ioctl(udmabuf, UDMABUF_CREATE_LIST, list);
+	if (dmabuf_fd < 0) {
+		mem_slab_free(&gpu->slab, info, sizeof(*info));
+		pr_err("%s : Failed to create the dmabuf. %s\n",
+			__func__, strerror(errno));
+		return NULL;
 	}
-	free(list);
+	info->dmabuf_fd = dmabuf_fd;
+	atomic_store(&info->ref_count, 1);
+	gpu->hostmem_dmabuf = info;
 	return info;
 }
 
+static int
+virtio_gpu_hostmem_map(struct virtio_gpu *gpu, struct mem_arena *arena,
+		       struct virtio_gpu_resource_2d *r2d, uint64_t offset)
+{
+	struct virtio_gpu_resource_2d *other;
+
+	if ((offset & (VIRTIO_GPU_HOSTMEM_PAGE - 1)) || offset > gpu->hostmem_size ||
+	    r2d->blob_size > gpu->hostmem_size - offset)
+		return -1;
+
+	LIST_FOREACH(other, &gpu->r2d_list, link) {
+		if (other->mapped && offset < other->hostmem_offset + other->blob_size &&
+		    other->hostmem_offset < offset + r2d->blob_size)
+			return -1;
+	}
+
+	if (!virtio_gpu_hostmem_export(gpu, arena))
+		return -1;
+
+	virtio_gpu_dmabuf_ref(gpu->hostmem_dmabuf);
+	r2d->dma_info = gpu->hostmem_dmabuf;
+	r2d->hostmem_offset = offset;
+	r2d->mapped = true;
+	return 0;
+}
+
+static void
+virtio_gpu_hostmem_unmap(struct virtio_gpu *gpu, struct virtio_gpu_resource_2d *r2d)
+{
+	virtio_gpu_dmabuf_unref(gpu, r2d->dma_info);
+	r2d->dma_info = NULL;
+	r2d->hostmem_offset = 0;
+	r2d->mapped = false;
+}
+
+static void
+virtio_gpu_cmd_map_blob(struct virtio_gpu_command *cmd)
+{
+	struct virtio_gpu_resource_map_blob req;
+	struct virtio_gpu_resp_map_info resp;
+	struct virtio_gpu_resource_2d *r2d;
+
+	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
+	cmd->iolen = sizeof(resp);
+	memset(&resp, 0, sizeof(resp));
+	virtio_gpu_update_resp_fence(&cmd->hdr, &resp.hdr);
+
+	r2d = virtio_gpu_find_resource_2d(cmd->gpu, req.resource_id);
+	if (r2d == NULL || !r2d->hostmem) {
+		pr_err("%s: Illegal resource id %d\n", __func__, req.resource_id);
+		resp.hdr.type = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+	} else if (r2d->mapped ||
+		   virtio_gpu_hostmem_map(cmd->gpu, cmd->arena, r2d, req.offset)) {
+		pr_err("%s: cannot map resource %d at 0x%llx\n", __func__,
+				req.resource_id, (unsigned long long)req.offset);
+		resp.hdr.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+	} else {
+		cmd->bytes = r2d->blob_size;
+		resp.hdr.type = VIRTIO_GPU_RESP_OK_MAP_INFO;
+		resp.map_info = VIRTIO_GPU_MAP_CACHE_CACHED;
+	}
+	memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+}
+
+static void
+virtio_gpu_cmd_unmap_blob(struct virtio_gpu_command *cmd)
+{
+	struct virtio_gpu_resource_unmap_blob req;
+	struct virtio_gpu_ctrl_hdr resp;
+	struct virtio_gpu_resource_2d *r2d;
+
+	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
+	cmd->iolen = sizeof(resp);
+	memset(&resp, 0, sizeof(resp));
+	virtio_gpu_update_resp_fence(&cmd->hdr, &resp);
+
+	r2d = virtio_gpu_find_resource_2d(cmd->gpu, req.resource_id);
+	if (r2d == NULL || !r2d->hostmem) {
+		pr_err("%s: Illegal resource id %d\n", __func__, req.resource_id);
+		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+	} else {
+		if (r2d->mapped)
+			virtio_gpu_hostmem_unmap(cmd->gpu, r2d);
+		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
+	}
+	memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+}
+
 static void
 virtio_gpu_cmd_create_blob(struct virtio_gpu_command *cmd)
 {
@@ -1240,7 +2313,7 @@ virtio_gpu_cmd_create_blob(struct virtio_gpu_command *cmd)
 	struct virtio_gpu_ctrl_hdr resp;
 	int i;
 	uint8_t *pbuf;
-	struct iovec *iov;
+	uint64_t start;
 
 	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
 	cmd->iolen = sizeof(resp);
@@ -1268,7 +2341,22 @@ virtio_gpu_cmd_create_blob(struct virtio_gpu_command *cmd)
 		return;
 	}
 
-	if ((req.blob_mem != VIRTIO_GPU_BLOB_MEM_GUEST) ||
+	if (req.blob_mem == VIRTIO_GPU_BLOB_MEM_HOST3D) {
+		/* only guest mapped memory can be host visible here */
+		if (!virtio_gpu_hostmem_attach(cmd->gpu) || req.nr_entries ||
+		    !(req.blob_flags & VIRTIO_GPU_BLOB_FLAG_USE_MAPPABLE) ||
+		    (req.blob_flags & ~(VIRTIO_GPU_BLOB_FLAG_USE_MAPPABLE |
+					VIRTIO_GPU_BLOB_FLAG_USE_SHAREABLE |
+					VIRTIO_GPU_BLOB_FLAG_USE_CROSS_DEVICE)) ||
+		    req.size == 0 || (req.size & (VIRTIO_GPU_HOSTMEM_PAGE - 1)) ||
+		    req.size > cmd->gpu->hostmem_size) {
+			pr_dbg("%s : invalid host blob parameter for %d.\n",
+					__func__, req.resource_id);
+			resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+			memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+			return;
+		}
+	} else if ((req.blob_mem != VIRTIO_GPU_BLOB_MEM_GUEST) ||
 		(req.blob_flags != VIRTIO_GPU_BLOB_FLAG_USE_SHAREABLE)) {
 		pr_dbg("%s : invalid create_blob parameter for %d.\n",
 				__func__, req.resource_id);
@@ -1286,8 +2374,7 @@ virtio_gpu_cmd_create_blob(struct virtio_gpu_command *cmd)
 		return;
 	}
 
-	r2d = (struct virtio_gpu_resource_2d *)calloc(1,
-			sizeof(struct virtio_gpu_resource_2d));
+	r2d = virtio_gpu_alloc_resource(cmd->gpu);
 	if (!r2d) {
 		pr_err("%s : memory allocation for r2d failed.\n", __func__);
 		resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
@@ -1295,186 +2382,1105 @@ virtio_gpu_cmd_create_blob(struct virtio_gpu_command *cmd)
 		return;
 	}
 
-	r2d->resource_id = req.resource_id;
+	r2d->resource_id = req.resource_id;
+
+	if (req.blob_mem == VIRTIO_GPU_BLOB_MEM_HOST3D) {
+		/* backed by the window once the guest maps it */
+		r2d->blob = true;
+		r2d->hostmem = true;
+		r2d->blob_size = req.size;
+	} else if (req.nr_entries > 0) {
+		entries = virtio_gpu_alloc_entries(cmd->gpu, req.nr_entries);
+		if (!entries) {
+			pr_err("%s : memory allocation for entries failed.\n", __func__);
+			virtio_gpu_free_resource(cmd->gpu, r2d);
+			resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+			memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+			return;
+		}
+		pbuf = (uint8_t *)entries;
+		for (i = 1; i < (cmd->iovcnt - 1); i++) {
+			memcpy(pbuf, cmd->iov[i].iov_base, cmd->iov[i].iov_len);
+			pbuf += cmd->iov[i].iov_len;
+		}
+		cmd->bytes = req.size;
+		if (req.size > CURSOR_BLOB_SIZE) {
+			/* Try to create the dma buf */
+			start = virtio_gpu_stats_now();
+			r2d->dma_info = virtio_gpu_create_udmabuf(cmd->gpu,
+					cmd->arena,
+					entries,
+					req.nr_entries);
+			virtio_gpu_stats_record(cmd->gpu, VIRTIO_GPU_STATS_UDMABUF, start,
+					req.size, r2d->dma_info == NULL);
+			if (r2d->dma_info == NULL) {
+				virtio_gpu_free_entries(cmd->gpu, entries, req.nr_entries);
+				virtio_gpu_free_resource(cmd->gpu, r2d);
+				resp.type = VIRTIO_GPU_RESP_ERR_UNSPEC;
+				memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+				return;
+			}
+			r2d->blob = true;
+			r2d->blob_size = req.size;
+			r2d->entries = entries;
+			r2d->nr_entries = req.nr_entries;
+		} else {
+			/* Cursor resource with 64x64 and PIXMAN_a8r8g8b8 format.
+			 * Or when it fails to create dmabuf
+			 */
+			r2d->width = 64;
+			r2d->height = 64;
+			r2d->format = PIXMAN_a8r8g8b8;
+			r2d->image = pixman_image_create_bits(
+					r2d->format, r2d->width, r2d->height, NULL, 0);
+
+			if (virtio_gpu_set_backing(cmd->gpu, r2d, entries, req.nr_entries)) {
+				virtio_gpu_free_backing(cmd->gpu, r2d);
+				pixman_image_unref(r2d->image);
+				virtio_gpu_free_resource(cmd->gpu, r2d);
+				resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+				memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+				return;
+			}
+		}
+	}
+	resp.type = VIRTIO_GPU_RESP_OK_NODATA;
+	LIST_INSERT_HEAD(&cmd->gpu->r2d_list, r2d, link);
+	memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+}
+
+static void
+virtio_gpu_cmd_set_modifier(struct virtio_gpu_command *cmd)
+{
+	struct virtio_gpu_set_modifier req;
+	struct virtio_gpu_ctrl_hdr resp;
+	struct virtio_gpu *gpu;
+
+	gpu = cmd->gpu;
+	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
+	cmd->iolen = sizeof(resp);
+	memset(&resp, 0, sizeof(resp));
+
+	if (cmd->iovcnt < 2) {
+		pr_err("%s : invalid memory entry.\n", __func__);
+		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+	} else {
+		vdpy_set_modifier(gpu->vdpy_handle, req.scanout_id, req.modifier);
+		if (req.scanout_id < gpu->scanout_num)
+			gpu->gpu_scanouts[req.scanout_id].modifier = req.modifier;
+		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
+	}
+
+	memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+	return;
+}
+
+static void
+virtio_gpu_cmd_set_scanout_blob(struct virtio_gpu_command *cmd)
+{
+	struct virtio_gpu_set_scanout_blob req;
+	struct virtio_gpu_resource_2d *r2d;
+	struct virtio_gpu_ctrl_hdr resp;
+	struct virtio_gpu *gpu;
+	struct virtio_gpu_scanout *gpu_scanout;
+	uint64_t frame_ns;
+
+	frame_ns = virtio_gpu_frame_now();
+	gpu = cmd->gpu;
+	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
+	cmd->iolen = sizeof(resp);
+	memset(&resp, 0, sizeof(resp));
+	virtio_gpu_update_resp_fence(&cmd->hdr, &resp);
+	if (cmd->gpu->vga.enable) {
+		cmd->gpu->vga.enable = false;
+	}
+	if (req.scanout_id >= gpu->scanout_num) {
+		pr_err("%s: Invalid scanout_id %d\n", req.scanout_id);
+		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_SCANOUT_ID;
+		memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+		return;
+	}
+	gpu_scanout = gpu->gpu_scanouts + req.scanout_id;
+	gpu_scanout->scanout_id = req.scanout_id;
+	if (req.resource_id == 0) {
+		virtio_gpu_update_scanout(gpu, req.scanout_id, 0, &req.r);
+		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
+		memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+		vdpy_surface_set(gpu->vdpy_handle, req.scanout_id, NULL);
+		return;
+	}
+	r2d = virtio_gpu_find_resource_2d(cmd->gpu, req.resource_id);
+	if (r2d == NULL) {
+		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+		memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+		return;
+	}
+	if (r2d->blob == false) {
+		/* Maybe the resource  is not blob, fallback to set_scanout */
+		virtio_gpu_cmd_set_scanout(cmd);
+		return;
+	}
+	if (r2d->dma_info == NULL) {
+		/* a host blob that is not mapped has no memory yet */
+		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+		memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+		return;
+	}
+	if (!virtio_gpu_scanout_blob_valid(r2d, &req)) {
+		pr_err("%s: scanout does not fit in resource %d\n", __func__, req.resource_id);
+		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+		memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+		return;
+	}
+
+	virtio_gpu_update_scanout(gpu, req.scanout_id, req.resource_id, &req.r);
+	gpu_scanout->is_blob = true;
+	memcpy(&gpu_scanout->blob_req, &req, sizeof(req));
+	virtio_gpu_show_blob(gpu, r2d, &req, frame_ns);
+	resp.type = VIRTIO_GPU_RESP_OK_NODATA;
+	memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+	return;
+}
+
+/* A non-zero frame_ns tags the surface set for frame latency tracing */
+static void
+virtio_gpu_show_blob(struct virtio_gpu *gpu, struct virtio_gpu_resource_2d *r2d,
+		     struct virtio_gpu_set_scanout_blob *req, uint64_t frame_ns)
+{
+	struct surface surf;
+	uint32_t drm_fourcc;
+	int bytes_pp;
+
+	memset(&surf, 0, sizeof(surf));
+	virtio_gpu_dmabuf_ref(r2d->dma_info);
+	surf.width = req->r.width;
+	surf.height = req->r.height;
+	surf.x = req->r.x;
+	surf.y = req->r.y;
+	surf.stride = req->strides[0];
+	surf.dma_info.dmabuf_fd = r2d->dma_info->dmabuf_fd;
+	surf.surf_type = SURFACE_DMABUF;
+	surf.surf_format = virtio_gpu_get_pixman_format(req->format);
+	bytes_pp = 4;
+	switch (req->format) {
+	case VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM:
+		drm_fourcc = DRM_FORMAT_XRGB8888;
+		break;
+	case VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM:
+		drm_fourcc = DRM_FORMAT_ARGB8888;
+		break;
+	case VIRTIO_GPU_FORMAT_R8G8B8A8_UNORM:
+		drm_fourcc = DRM_FORMAT_ABGR8888;
+		break;
+	case VIRTIO_GPU_FORMAT_R8G8B8X8_UNORM:
+		drm_fourcc = DRM_FORMAT_XBGR8888;
+		break;
+	case VIRTIO_GPU_FORMAT_B5G6R5_UNORM:
+		drm_fourcc = DRM_FORMAT_RGB565;
+		bytes_pp = 2;
+		break;
+	case VIRTIO_GPU_FORMAT_B5G5R5A1_UNORM:
+		drm_fourcc = DRM_FORMAT_ARGB1555;
+		bytes_pp = 2;
+		break;
+	default:
+		pr_err("%s : unuspported surface format %d.\n",
+			__func__, req->format);
+		drm_fourcc = DRM_FORMAT_ARGB8888;
+		break;
+	}
+	surf.dma_info.dmabuf_offset = r2d->hostmem_offset + req->offsets[0] +
+		bytes_pp * surf.x + surf.y * surf.stride;
+	surf.dma_info.surf_fourcc = drm_fourcc;
+	if (frame_ns)
+		virtio_gpu_frame_tag(gpu, req->scanout_id, &surf, frame_ns);
+	vdpy_surface_set(gpu->vdpy_handle, req->scanout_id, &surf);
+	virtio_gpu_dmabuf_unref(gpu, r2d->dma_info);
+}
+
+static int
+virtio_gpu_ckpt_put(void *buf, size_t size, size_t *off, const void *data, size_t len)
+{
+	if (len > size - *off)
+		return -1;
+	memcpy((char *)buf + *off, data, len);
+	*off += len;
+	return 0;
+}
+
+static int
+virtio_gpu_ckpt_get(const void *buf, size_t size, size_t *off, void *data, size_t len)
+{
+	if (len > size - *off)
+		return -1;
+	memcpy(data, (const char *)buf + *off, len);
+	*off += len;
+	return 0;
+}
+
+/*
+ * Backing the guest allocated in one piece is saved as one entry, so a
+ * framebuffer takes a few entries rather than one per page.
+ */
+static int
+virtio_gpu_ckpt_put_entries(void *buf, size_t size, size_t *off,
+			    const struct virtio_gpu_mem_entry *entries, uint32_t nr_entries,
+			    uint32_t *nr_saved)
+{
+	struct virtio_gpu_mem_entry e;
+	uint32_t i;
+
+	*nr_saved = 0;
+	for (i = 0; i < nr_entries; i++) {
+		e = entries[i];
+		e.padding = 0;
+		while (i + 1 < nr_entries && entries[i + 1].addr == e.addr + e.length &&
+		       entries[i + 1].length <= UINT32_MAX - e.length)
+			e.length += entries[++i].length;
+		if (virtio_gpu_ckpt_put(buf, size, off, &e, sizeof(e)))
+			return -1;
+		(*nr_saved)++;
+	}
+	return 0;
+}
+
+/*
+ * Enough for VIRTIO_GPU_CKPT_FBS of the largest screens per scanout, with
+ * no two of their pages contiguous. It only depends on the options, so a
+ * restarted backend finds the same room.
+ */
+static size_t
+virtio_gpu_checkpoint_size(void *vdev)
+{
+	struct virtio_gpu *gpu;
+	size_t size, fb;
+
+	gpu = vdev;
+	fb = sizeof(struct virtio_gpu_ckpt_resource) + sizeof(uint64_t) +
+		(VDPY_MAX_WIDTH * VDPY_MAX_HEIGHT * 4UL + 4095) / 4096 *
+		sizeof(struct virtio_gpu_mem_entry);
+	size = sizeof(struct virtio_gpu_ckpt_hdr) + sizeof(struct virtio_gpu_ckpt_fences) +
+		VIRTIO_GPU_RINGSZ * sizeof(struct virtio_gpu_ckpt_fence) + VIRTIO_GPU_CKPT_SLACK;
+	size += gpu->scanout_num * (sizeof(struct virtio_gpu_ckpt_scanout) +
+				    VIRTIO_GPU_CKPT_FBS * fb);
+	return size;
+}
+
+static int
+virtio_gpu_checkpoint(void *vdev, void *buf, size_t size)
+{
+	struct virtio_gpu *gpu;
+	struct virtio_gpu_ckpt_hdr hdr;
+	struct virtio_gpu_ckpt_resource res;
+	struct virtio_gpu_ckpt_scanout so;
+	struct virtio_gpu_ckpt_context cc;
+	struct virtio_gpu_ckpt_fences cfs;
+	struct virtio_gpu_ckpt_fence cf;
+	struct virtio_gpu_resource_2d *r2d;
+	struct virtio_gpu_scanout *gpu_scanout;
+	struct virtio_gpu_context *ctx;
+	struct virtio_gpu_timeline *tl;
+	struct virtio_gpu_fence *fence;
+	size_t off, res_off;
+	int i;
+
+	gpu = vdev;
+	if (size < sizeof(hdr))
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.version = VIRTIO_GPU_CKPT_VERSION;
+	hdr.scanout_num = gpu->scanout_num;
+	off = sizeof(hdr);
+
+	LIST_FOREACH(r2d, &gpu->r2d_list, link) {
+		memset(&res, 0, sizeof(res));
+		res.resource_id = r2d->resource_id;
+		res.width = r2d->width;
+		res.height = r2d->height;
+		res.format = r2d->blob ? 0 : virtio_gpu_get_virtio_format(r2d->format);
+		res.flags = r2d->blob ? VIRTIO_GPU_CKPT_RES_BLOB : 0;
+		if (r2d->hostmem)
+			res.flags |= VIRTIO_GPU_CKPT_RES_HOSTMEM;
+		if (r2d->mapped)
+			res.flags |= VIRTIO_GPU_CKPT_RES_MAPPED;
+		res.blob_size = r2d->blob_size;
+		res_off = off;
+		if (virtio_gpu_ckpt_put(buf, size, &off, &res, sizeof(res)) ||
+		    virtio_gpu_ckpt_put_entries(buf, size, &off, r2d->entries,
+						r2d->nr_entries, &res.nr_entries))
+			return -1;
+		memcpy((char *)buf + res_off, &res, sizeof(res));
+		if (r2d->mapped &&
+		    virtio_gpu_ckpt_put(buf, size, &off, &r2d->hostmem_offset,
+					sizeof(r2d->hostmem_offset)))
+			return -1;
+		hdr.nr_resources++;
+	}
+
+	for (i = 0; i < gpu->scanout_num; i++) {
+		gpu_scanout = gpu->gpu_scanouts + i;
+		memset(&so, 0, sizeof(so));
+		so.resource_id = gpu_scanout->resource_id;
+		if (gpu_scanout->is_active)
+			so.flags |= VIRTIO_GPU_CKPT_SCANOUT_ACTIVE;
+		if (gpu_scanout->is_blob)
+			so.flags |= VIRTIO_GPU_CKPT_SCANOUT_BLOB;
+		so.r = gpu_scanout->scanout_rect;
+		so.modifier = gpu_scanout->modifier;
+		so.blob_req = gpu_scanout->blob_req;
+		if (virtio_gpu_ckpt_put(buf, size, &off, &so, sizeof(so)))
+			return -1;
+	}
+
+	LIST_FOREACH(ctx, &gpu->ctx_list, link) {
+		cc.ctx_id = ctx->ctx_id;
+		cc.context_init = ctx->context_init;
+		if (virtio_gpu_ckpt_put(buf, size, &off, &cc, sizeof(cc)))
+			return -1;
+		hdr.nr_contexts++;
+	}
+
+	memset(&cfs, 0, sizeof(cfs));
+	cfs.nr_fences = gpu->nr_fences;
+	if (virtio_gpu_ckpt_put(buf, size, &off, &cfs, sizeof(cfs)))
+		return -1;
+	LIST_FOREACH(tl, &gpu->timelines, link) {
+		TAILQ_FOREACH(fence, &tl->fences, link) {
+			cf.idx = fence->idx;
+			cf.iolen = fence->iolen;
+			if (virtio_gpu_ckpt_put(buf, size, &off, &cf, sizeof(cf)))
+				return -1;
+		}
+	}
+
+	memcpy(buf, &hdr, sizeof(hdr));
+	return off;
+}
+
+/*
+ * The checkpoint is in memory the guest can write, so a resource is
+ * checked as its create command would be before it is made again.
+ */
+static bool
+virtio_gpu_ckpt_resource_valid(struct virtio_gpu *gpu, struct virtio_gpu_ckpt_resource *res)
+{
+	if (!res->resource_id || virtio_gpu_find_resource_2d(gpu, res->resource_id) ||
+	    (res->flags & ~(VIRTIO_GPU_CKPT_RES_BLOB | VIRTIO_GPU_CKPT_RES_HOSTMEM |
+			    VIRTIO_GPU_CKPT_RES_MAPPED)))
+		return false;
+
+	if (res->flags & VIRTIO_GPU_CKPT_RES_HOSTMEM)
+		return (res->flags & VIRTIO_GPU_CKPT_RES_BLOB) && !res->nr_entries &&
+			res->blob_size && !(res->blob_size & (VIRTIO_GPU_HOSTMEM_PAGE - 1));
+	if (res->flags & VIRTIO_GPU_CKPT_RES_MAPPED)
+		return false;
+	if (res->flags & VIRTIO_GPU_CKPT_RES_BLOB)
+		return res->nr_entries && res->blob_size;
+
+	return virtio_gpu_get_pixman_format(res->format) &&
+		virtio_gpu_2d_size_valid(res->width, res->height,
+					 virtio_gpu_get_pixman_format(res->format));
+}
+
+static int
+virtio_gpu_restore_resource(struct virtio_gpu *gpu, const void *buf, size_t size, size_t *off,
+			    uint32_t version)
+{
+	struct virtio_gpu_ckpt_resource res;
+	struct virtio_gpu_mem_entry *entries;
+	struct virtio_gpu_resource_2d *r2d;
+	struct virtio_gpu_rect r;
+	uint64_t offset;
+
+	if (virtio_gpu_ckpt_get(buf, size, off, &res, sizeof(res)) ||
+	    res.nr_entries > (size - *off) / sizeof(struct virtio_gpu_mem_entry))
+		return -1;
+	if (version < 4 && !(res.flags & VIRTIO_GPU_CKPT_RES_BLOB))
+		res.format = virtio_gpu_get_virtio_format(res.format);
+	if (!virtio_gpu_ckpt_resource_valid(gpu, &res))
+		return -1;
+
+	entries = NULL;
+	if (res.nr_entries) {
+		entries = virtio_gpu_alloc_entries(gpu, res.nr_entries);
+		if (!entries)
+			return -1;
+		virtio_gpu_ckpt_get(buf, size, off, entries,
+				    res.nr_entries * sizeof(struct virtio_gpu_mem_entry));
+	}
+	offset = 0;
+	if ((res.flags & VIRTIO_GPU_CKPT_RES_MAPPED) &&
+	    virtio_gpu_ckpt_get(buf, size, off, &offset, sizeof(offset))) {
+		virtio_gpu_free_entries(gpu, entries, res.nr_entries);
+		return -1;
+	}
+
+	r2d = virtio_gpu_alloc_resource(gpu);
+	if (!r2d) {
+		virtio_gpu_free_entries(gpu, entries, res.nr_entries);
+		return -1;
+	}
+	r2d->resource_id = res.resource_id;
+
+	if (res.flags & VIRTIO_GPU_CKPT_RES_HOSTMEM) {
+		/* the window kept what the guest wrote to it */
+		r2d->blob = true;
+		r2d->hostmem = true;
+		r2d->blob_size = res.blob_size;
+		if (!virtio_gpu_hostmem_attach(gpu) || res.blob_size > gpu->hostmem_size ||
+		    ((res.flags & VIRTIO_GPU_CKPT_RES_MAPPED) &&
+		     virtio_gpu_hostmem_map(gpu, &gpu->arena[VIRTIO_GPU_CONTROLQ], r2d, offset))) {
+			mem_arena_reset(&gpu->arena[VIRTIO_GPU_CONTROLQ]);
+			virtio_gpu_free_entries(gpu, entries, res.nr_entries);
+			virtio_gpu_free_resource(gpu, r2d);
+			return -1;
+		}
+		mem_arena_reset(&gpu->arena[VIRTIO_GPU_CONTROLQ]);
+	} else if (res.flags & VIRTIO_GPU_CKPT_RES_BLOB) {
+		/* the queues are not running yet, borrow the scratch of the control queue */
+		if (entries) {
+			r2d->dma_info = virtio_gpu_create_udmabuf(gpu,
+					&gpu->arena[VIRTIO_GPU_CONTROLQ],
+					entries, res.nr_entries);
+			mem_arena_reset(&gpu->arena[VIRTIO_GPU_CONTROLQ]);
+		}
+		if (!r2d->dma_info) {
+			virtio_gpu_free_entries(gpu, entries, res.nr_entries);
+			virtio_gpu_free_resource(gpu, r2d);
+			return -1;
+		}
+		r2d->blob = true;
+		r2d->blob_size = res.blob_size;
+		r2d->entries = entries;
+		r2d->nr_entries = res.nr_entries;
+	} else {
+		r2d->width = res.width;
+		r2d->height = res.height;
+		r2d->format = virtio_gpu_get_pixman_format(res.format);
+		r2d->image = virtio_gpu_image_create(r2d);
+		if (!r2d->image) {
+			virtio_gpu_free_entries(gpu, entries, res.nr_entries);
+			virtio_gpu_free_resource(gpu, r2d);
+			return -1;
+		}
+		/* Contents are whatever the guest last had in its backing */
+		if (entries) {
+			if (virtio_gpu_set_backing(gpu, r2d, entries, res.nr_entries)) {
+				virtio_gpu_free_backing(gpu, r2d);
+				pixman_image_unref(r2d->image);
+				virtio_gpu_free_resource(gpu, r2d);
+				return -1;
+			}
+			r.x = r.y = 0;
+			r.width = r2d->width;
+			r.height = r2d->height;
+			virtio_gpu_copy_from_backing(r2d, &r, 0);
+		}
+	}
+
+	LIST_INSERT_HEAD(&gpu->r2d_list, r2d, link);
+	return 0;
+}
+
+static int
+virtio_gpu_restore(void *vdev, const void *buf, size_t size)
+{
+	struct virtio_gpu *gpu;
+	struct virtio_gpu_ckpt_hdr hdr;
+	struct virtio_gpu_ckpt_scanout so;
+	struct virtio_gpu_ckpt_context cc;
+	struct virtio_gpu_ckpt_fences cfs;
+	struct virtio_gpu_ckpt_fence cf;
+	struct virtio_gpu_resource_2d *r2d;
+	struct virtio_gpu_scanout *gpu_scanout;
+	struct virtio_gpu_context *ctx;
+	struct virtio_vq_info *vq;
+	size_t off;
+	int i;
+
+	gpu = vdev;
+	if (size == 0)
+		return 0;
+#ifdef WITH_VIRGL
+	/* the renderer's resources and contexts are not in the checkpoint */
+	if (gpu->virgl) {
+		pr_err("%s: 3D state can not be restored.\n", __func__);
+		return -1;
+	}
+#endif
+
+	off = 0;
+	if (virtio_gpu_ckpt_get(buf, size, &off, &hdr, sizeof(hdr)) ||
+	    hdr.version == 0 || hdr.version > VIRTIO_GPU_CKPT_VERSION ||
+	    hdr.scanout_num != gpu->scanout_num) {
+		pr_err("%s: incompatible checkpoint.\n", __func__);
+		return -1;
+	}
+
+	for (i = 0; i < hdr.nr_resources; i++) {
+		if (virtio_gpu_restore_resource(gpu, buf, size, &off, hdr.version)) {
+			pr_err("%s: failed to restore resource %d.\n", __func__, i);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < gpu->scanout_num; i++) {
+		if (virtio_gpu_ckpt_get(buf, size, &off, &so, sizeof(so)))
+			return -1;
+		if (!(so.flags & VIRTIO_GPU_CKPT_SCANOUT_ACTIVE))
+			continue;
+
+		r2d = virtio_gpu_find_resource_2d(gpu, so.resource_id);
+		if (!r2d || (!!(so.flags & VIRTIO_GPU_CKPT_SCANOUT_BLOB) != r2d->blob))
+			return -1;
+		if (!r2d->blob &&
+		    ((so.r.x + so.r.width) > r2d->width ||
+		     (so.r.y + so.r.height) > r2d->height ||
+		     so.r.width > r2d->width || so.r.height > r2d->height))
+			return -1;
+		if (r2d->blob && !virtio_gpu_scanout_blob_valid(r2d, &so.blob_req))
+			return -1;
+
+		gpu_scanout = gpu->gpu_scanouts + i;
+		gpu_scanout->scanout_id = i;
+		if (so.modifier) {
+			vdpy_set_modifier(gpu->vdpy_handle, i, so.modifier);
+			gpu_scanout->modifier = so.modifier;
+		}
+		virtio_gpu_update_scanout(gpu, i, so.resource_id, &so.r);
+		if (r2d->blob && !r2d->dma_info) {
+			/* a host blob unmapped while shown */
+			gpu_scanout->is_blob = true;
+			gpu_scanout->blob_req = so.blob_req;
+		} else if (r2d->blob) {
+			so.blob_req.scanout_id = i;
+			gpu_scanout->is_blob = true;
+			gpu_scanout->blob_req = so.blob_req;
+			virtio_gpu_show_blob(gpu, r2d, &so.blob_req, 0);
+		} else {
+			virtio_gpu_show_2d(gpu, i, r2d, &so.r);
+		}
+		gpu->vga.enable = false;
+	}
+
+	if (hdr.version < 2)
+		return 0;
+
+	for (i = 0; i < hdr.nr_contexts; i++) {
+		if (virtio_gpu_ckpt_get(buf, size, &off, &cc, sizeof(cc)))
+			return -1;
+		ctx = mem_slab_alloc(&gpu->slab, sizeof(*ctx));
+		if (!ctx)
+			return -1;
+		ctx->ctx_id = cc.ctx_id;
+		ctx->context_init = cc.context_init;
+		LIST_INSERT_HEAD(&gpu->ctx_list, ctx, link);
+	}
+
+	/*
+	 * The transport resumes taking chains at used->idx, which does not
+	 * count the deferred ones: return them and skip over them.
+	 */
+	if (virtio_gpu_ckpt_get(buf, size, &off, &cfs, sizeof(cfs)))
+		return -1;
+	vq = &gpu->vq[VIRTIO_GPU_CONTROLQ];
+	for (i = 0; i < cfs.nr_fences; i++) {
+		if (virtio_gpu_ckpt_get(buf, size, &off, &cf, sizeof(cf)) ||
+		    cf.idx >= vq->qsize)
+			return -1;
+		vq->last_avail++;
+		vq_relchain(vq, cf.idx, cf.iolen);
+	}
+
+	return 0;
+}
+/*
+ * A display was plugged, unplugged or resized, from the display server
+ * thread, -1 if it may be any. The EDID blob of BAR2 is the one of the VGA
+ * head, scanout 0, and is made again for its new preferred mode; the other
+ * scanouts give theirs with GET_EDID. VIRTIO_GPU_EVENT_DISPLAY then has the
+ * driver ask for the display info and the EDIDs.
+ */
+void triger_hotplug(void *data, int scanout_id)
+{
+	struct virtio_gpu *gpu = (struct virtio_gpu *)data;
+	uint8_t edid[VIRTIO_GPU_EDID_SIZE];
+
+	if (scanout_id <= 0) {
+		memset(edid, 0, sizeof(edid));
+		vdpy_get_edid(gpu->vdpy_handle, 0, edid, sizeof(edid));
+		memcpy(gpu->edid, edid, sizeof(edid));
+	}
+	__atomic_or_fetch(&gpu->cfg.events_read, VIRTIO_GPU_EVENT_DISPLAY, __ATOMIC_RELEASE);
+	virtio_config_changed(&gpu->base);
+}
+
+static struct virtio_gpu_context *
+virtio_gpu_find_context(struct virtio_gpu *gpu, uint32_t ctx_id)
+{
+	struct virtio_gpu_context *ctx;
+
+	LIST_FOREACH(ctx, &gpu->ctx_list, link) {
+		if (ctx->ctx_id == ctx_id)
+			return ctx;
+	}
+	return NULL;
+}
+
+static void
+virtio_gpu_cmd_ctx_create(struct virtio_gpu_command *cmd)
+{
+	struct virtio_gpu_ctx_create req;
+	struct virtio_gpu_ctrl_hdr resp;
+	struct virtio_gpu_context *ctx;
+	struct virtio_gpu *gpu;
+
+	gpu = cmd->gpu;
+	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
+	memset(&resp, 0, sizeof(resp));
+	virtio_gpu_update_resp_fence(&cmd->hdr, &resp);
+
+	if (req.hdr.ctx_id == 0 || virtio_gpu_find_context(gpu, req.hdr.ctx_id)) {
+		pr_err("%s: invalid context id %d\n", __func__, req.hdr.ctx_id);
+		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_CONTEXT_ID;
+	} else if (!(gpu->base.negotiated_caps & (1ULL << VIRTIO_GPU_F_CONTEXT_INIT)) &&
+		   req.context_init) {
+		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+	} else if (req.context_init & VIRTIO_GPU_CONTEXT_INIT_CAPSET_ID_MASK) {
+		/* no capsets are offered */
+		pr_err("%s: unsupported capset %d\n", __func__,
+			req.context_init & VIRTIO_GPU_CONTEXT_INIT_CAPSET_ID_MASK);
+		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+	} else {
+		ctx = mem_slab_alloc(&gpu->slab, sizeof(*ctx));
+		if (!ctx) {
+			resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+		} else {
+			ctx->ctx_id = req.hdr.ctx_id;
+			ctx->context_init = req.context_init;
+			LIST_INSERT_HEAD(&gpu->ctx_list, ctx, link);
+			resp.type = VIRTIO_GPU_RESP_OK_NODATA;
+		}
+	}
+
+	cmd->iolen = sizeof(resp);
+	memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+}
+
+static void
+virtio_gpu_cmd_ctx_destroy(struct virtio_gpu_command *cmd)
+{
+	struct virtio_gpu_ctrl_hdr resp;
+	struct virtio_gpu_context *ctx;
+
+	memset(&resp, 0, sizeof(resp));
+	virtio_gpu_update_resp_fence(&cmd->hdr, &resp);
+
+	/* fences still pending on its rings complete as usual */
+	ctx = virtio_gpu_find_context(cmd->gpu, cmd->hdr.ctx_id);
+	if (ctx) {
+		LIST_REMOVE(ctx, link);
+		mem_slab_free(&cmd->gpu->slab, ctx, sizeof(*ctx));
+		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
+	} else {
+		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_CONTEXT_ID;
+	}
+
+	cmd->iolen = sizeof(resp);
+	memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+}
+
+/* Resources are not per context in 2D, only the ids are checked */
+static void
+virtio_gpu_cmd_ctx_resource(struct virtio_gpu_command *cmd)
+{
+	struct virtio_gpu_ctx_resource req;
+	struct virtio_gpu_ctrl_hdr resp;
+
+	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
+	memset(&resp, 0, sizeof(resp));
+	virtio_gpu_update_resp_fence(&cmd->hdr, &resp);
+
+	if (!virtio_gpu_find_context(cmd->gpu, req.hdr.ctx_id))
+		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_CONTEXT_ID;
+	else if (!virtio_gpu_find_resource_2d(cmd->gpu, req.resource_id))
+		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+	else
+		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
+
+	cmd->iolen = sizeof(resp);
+	memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+}
+
+static void
+virtio_gpu_free_contexts(struct virtio_gpu *gpu)
+{
+	struct virtio_gpu_context *ctx;
+
+	while ((ctx = LIST_FIRST(&gpu->ctx_list)) != NULL) {
+		LIST_REMOVE(ctx, link);
+		mem_slab_free(&gpu->slab, ctx, sizeof(*ctx));
+	}
+}
+
+static struct virtio_gpu_timeline *
+virtio_gpu_timeline_find(struct virtio_gpu *gpu, uint32_t ctx_id, uint32_t ring, bool create)
+{
+	struct virtio_gpu_timeline *tl;
+
+	if (ring == VIRTIO_GPU_RING_GLOBAL ||
+	    !(gpu->base.negotiated_caps & (1ULL << VIRTIO_GPU_F_CONTEXT_INIT)) ||
+	    ring >= VIRTIO_GPU_MAX_RINGS) {
+		ctx_id = 0;
+		ring = VIRTIO_GPU_RING_GLOBAL;
+	}
+
+	LIST_FOREACH(tl, &gpu->timelines, link) {
+		if (tl->ctx_id == ctx_id && tl->ring == ring)
+			return tl;
+	}
+	if (!create)
+		return NULL;
+
+	tl = mem_slab_alloc(&gpu->slab, sizeof(*tl));
+	if (!tl)
+		return NULL;
+	tl->ctx_id = ctx_id;
+	tl->ring = ring;
+	TAILQ_INIT(&tl->fences);
+	LIST_INSERT_HEAD(&gpu->timelines, tl, link);
+	return tl;
+}
+
+static inline struct virtio_gpu_timeline *
+virtio_gpu_timeline_get(struct virtio_gpu *gpu, struct virtio_gpu_ctrl_hdr *hdr, bool create)
+{
+	if (hdr->flags & VIRTIO_GPU_FLAG_INFO_RING_IDX)
+		return virtio_gpu_timeline_find(gpu, hdr->ctx_id, hdr->ring_idx, create);
+	return virtio_gpu_timeline_find(gpu, 0, VIRTIO_GPU_RING_GLOBAL, create);
+}
+
+static void
+virtio_gpu_fence_arm(struct virtio_gpu *gpu, uint64_t delay_ns)
+{
+	struct itimerspec ts;
+
+	memset(&ts, 0, sizeof(ts));
+	ts.it_value.tv_sec = delay_ns / 1000000000ULL;
+	ts.it_value.tv_nsec = delay_ns % 1000000000ULL;
+	if (ts.it_value.tv_sec == 0 && ts.it_value.tv_nsec == 0)
+		ts.it_value.tv_nsec = 1;
+	acrn_timer_settime(&gpu->fence_timer, &ts);
+}
+
+/* Frame ids wrap and skip 0; a is done if it is not after b */
+static inline bool
+virtio_gpu_frame_done(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) <= 0;
+}
+
+/* Whether the frames of a fence are all done, on every scanout */
+static bool
+virtio_gpu_fence_frames_done(struct virtio_gpu *gpu, struct virtio_gpu_fence *fence)
+{
+	int i;
+
+	for (i = 0; i < gpu->scanout_num; i++) {
+		if (fence->frame_ids[i] &&
+		    !virtio_gpu_frame_done(fence->frame_ids[i],
+					   __atomic_load_n(&gpu->frames_done[i], __ATOMIC_ACQUIRE)))
+			return false;
+	}
+	return true;
+}
+
+#ifdef WITH_VIRGL
+/* From the event loop: the renderer signalled fences, see virtio_gpu_fence_bh() */
+static void
+virtio_gpu_render_ready(int fd __attribute__((unused)),
+			enum ev_type t __attribute__((unused)), void *arg)
+{
+	struct virtio_gpu *gpu = arg;
 
-	if (req.nr_entries > 0) {
-		entries = calloc(req.nr_entries, sizeof(struct virtio_gpu_mem_entry));
-		if (!entries) {
-			pr_err("%s : memory allocation for entries failed.\n", __func__);
-			free(r2d);
-			resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
-			memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
-			return;
-		}
-		pbuf = (uint8_t *)entries;
-		for (i = 1; i < (cmd->iovcnt - 1); i++) {
-			memcpy(pbuf, cmd->iov[i].iov_base, cmd->iov[i].iov_len);
-			pbuf += cmd->iov[i].iov_len;
-		}
-		if (req.size > CURSOR_BLOB_SIZE) {
-			/* Try to create the dma buf */
-			r2d->dma_info = virtio_gpu_create_udmabuf(cmd->gpu,
-					entries,
-					req.nr_entries);
-			if (r2d->dma_info == NULL) {
-				free(entries);
-				resp.type = VIRTIO_GPU_RESP_ERR_UNSPEC;
-				memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
-				return;
-			}
-			r2d->blob = true;
-		} else {
-			/* Cursor resource with 64x64 and PIXMAN_a8r8g8b8 format.
-			 * Or when it fails to create dmabuf
-			 */
-			r2d->width = 64;
-			r2d->height = 64;
-			r2d->format = PIXMAN_a8r8g8b8;
-			r2d->image = pixman_image_create_bits(
-					r2d->format, r2d->width, r2d->height, NULL, 0);
+	vdpy_submit_bh(gpu->vdpy_handle, &gpu->fence_bh);
+}
 
-			iov = malloc(req.nr_entries * sizeof(struct iovec));
-			if (!iov) {
-				free(entries);
-				free(r2d);
-				resp.type = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
-				memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
-				return;
-			}
-			r2d->iov = iov;
-
-			r2d->iovcnt = req.nr_entries;
-			for (i = 0; i < req.nr_entries; i++) {
-				r2d->iov[i].iov_base = paddr_guest2host(
-						cmd->gpu->base.dev->vmctx,
-						entries[i].addr,
-						entries[i].length);
-				r2d->iov[i].iov_len = entries[i].length;
-			}
-		}
+/*
+ * Watches the renderer's fence fd once the renderer is started, on the
+ * display thread. Returns false if its fences are to be polled.
+ */
+static bool
+virtio_gpu_render_watch(struct virtio_gpu *gpu)
+{
+	int fd;
 
-		free(entries);
-	}
-	resp.type = VIRTIO_GPU_RESP_OK_NODATA;
-	LIST_INSERT_HEAD(&cmd->gpu->r2d_list, r2d, link);
-	memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+	if (gpu->render_mevp)
+		return true;
+	if (!gpu->virgl)
+		return false;
+	fd = virtio_gpu_virgl_poll_fd(gpu->virgl);
+	if (fd < 0)
+		return false;
+	gpu->render_mevp = mevent_add(fd, EVF_COUNTER, virtio_gpu_render_ready, gpu,
+				      NULL, NULL);
+	return gpu->render_mevp != NULL;
 }
 
 static void
-virtio_gpu_cmd_set_modifier(struct virtio_gpu_command *cmd)
+virtio_gpu_render_unwatch(struct virtio_gpu *gpu)
 {
-	struct virtio_gpu_set_modifier req;
-	struct virtio_gpu_ctrl_hdr resp;
-	struct virtio_gpu *gpu;
+	if (gpu->render_mevp) {
+		mevent_delete(gpu->render_mevp);
+		gpu->render_mevp = NULL;
+	}
+}
+#else
+static inline bool
+virtio_gpu_render_watch(struct virtio_gpu *gpu __attribute__((unused)))
+{
+	return false;
+}
+#endif
 
-	gpu = cmd->gpu;
-	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
-	cmd->iolen = sizeof(resp);
-	memset(&resp, 0, sizeof(resp));
+/*
+ * Keeps the chain of a fenced command if its fence can not complete yet:
+ * its frames are still with the clients, the renderer has not signalled it,
+ * or an earlier fence on its timeline is pending. Returns NULL when the
+ * chain is to be released now.
+ */
+static struct virtio_gpu_fence *
+virtio_gpu_fence_defer(struct virtio_gpu *gpu, struct virtio_gpu_ctrl_hdr *hdr,
+		       uint16_t idx, uint32_t iolen, const uint32_t *frame_ids, bool render)
+{
+	struct virtio_gpu_timeline *tl;
+	struct virtio_gpu_fence *fence;
 
-	if (cmd->iovcnt < 2) {
-		pr_err("%s : invalid memory entry.\n", __func__);
-		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
-	} else {
-		vdpy_set_modifier(gpu->vdpy_handle, req.scanout_id, req.modifier);
-		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
+	tl = virtio_gpu_timeline_get(gpu, hdr, false);
+	if (!frame_ids && !render && (!tl || TAILQ_EMPTY(&tl->fences)))
+		return NULL;
+	/* there are at most as many as the queue has chains */
+	fence = TAILQ_FIRST(&gpu->fence_free);
+	if (!fence)
+		return NULL;
+	if (!tl) {
+		tl = virtio_gpu_timeline_get(gpu, hdr, true);
+		if (!tl)
+			return NULL;
 	}
 
-	memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
-	return;
+	TAILQ_REMOVE(&gpu->fence_free, fence, link);
+	fence->idx = idx;
+	fence->iolen = iolen;
+	fence->fence_id = hdr->fence_id;
+	fence->ctx_id = hdr->ctx_id;
+	if (frame_ids)
+		memcpy(fence->frame_ids, frame_ids, sizeof(fence->frame_ids));
+	else
+		memset(fence->frame_ids, 0, sizeof(fence->frame_ids));
+	fence->render = render;
+	fence->deadline_ns = virtio_gpu_frame_now() +
+		VIRTIO_GPU_FENCE_TIMEOUT_MS * 1000000ULL;
+	TAILQ_INSERT_TAIL(&tl->fences, fence, link);
+	if (render) {
+		if (!virtio_gpu_render_watch(gpu))
+			virtio_gpu_fence_arm(gpu, VIRTIO_GPU_RENDER_POLL_MS * 1000000ULL);
+	} else if (gpu->nr_fences == 0)
+		virtio_gpu_fence_arm(gpu, VIRTIO_GPU_FENCE_TIMEOUT_MS * 1000000ULL);
+	gpu->nr_fences++;
+	return fence;
 }
 
+#ifdef WITH_VIRGL
+/*
+ * From virtio_gpu_virgl_poll(): the renderer is done with fence_id and the
+ * fences before it on the timeline. Renderer fences are 32 bit on the
+ * global timeline, so they are compared the way frame ids are.
+ */
 static void
-virtio_gpu_cmd_set_scanout_blob(struct virtio_gpu_command *cmd)
+virtio_gpu_render_fence(void *data, uint32_t ctx_id, uint32_t ring, uint64_t fence_id)
 {
-	struct virtio_gpu_set_scanout_blob req;
-	struct virtio_gpu_resource_2d *r2d;
-	struct virtio_gpu_ctrl_hdr resp;
-	struct surface surf;
-	uint32_t drm_fourcc;
-	struct virtio_gpu *gpu;
-	struct virtio_gpu_scanout *gpu_scanout;
-	int bytes_pp;
+	struct virtio_gpu *gpu = data;
+	struct virtio_gpu_timeline *tl;
+	struct virtio_gpu_fence *fence;
 
-	gpu = cmd->gpu;
-	memset(&surf, 0, sizeof(surf));
-	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
-	cmd->iolen = sizeof(resp);
-	memset(&resp, 0, sizeof(resp));
-	virtio_gpu_update_resp_fence(&cmd->hdr, &resp);
-	if (cmd->gpu->vga.enable) {
-		cmd->gpu->vga.enable = false;
-	}
-	if (req.scanout_id >= gpu->scanout_num) {
-		pr_err("%s: Invalid scanout_id %d\n", req.scanout_id);
-		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_SCANOUT_ID;
-		memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+	tl = virtio_gpu_timeline_find(gpu, ctx_id, ring, false);
+	if (!tl)
 		return;
+	TAILQ_FOREACH(fence, &tl->fences, link) {
+		if (fence->render &&
+		    (int32_t)((uint32_t)fence->fence_id - (uint32_t)fence_id) <= 0)
+			fence->render = false;
 	}
-	gpu_scanout = gpu->gpu_scanouts + req.scanout_id;
-	gpu_scanout->scanout_id = req.scanout_id;
-	if (req.resource_id == 0) {
-		virtio_gpu_update_scanout(gpu, req.scanout_id, 0, &req.r);
-		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
-		memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
-		vdpy_surface_set(gpu->vdpy_handle, req.scanout_id, NULL);
-		return;
+}
+#endif
+
+/*
+ * Completes the fences that are done, on each timeline up to the first that
+ * is not. Runs on the display thread like the control queue.
+ */
+static void
+virtio_gpu_fence_bh(void *data)
+{
+	struct virtio_gpu *gpu;
+	struct virtio_vq_info *vq;
+	struct virtio_gpu_timeline *tl, *next;
+	struct virtio_gpu_fence *fence;
+	TAILQ_HEAD(, virtio_gpu_fence) ready;
+	uint64_t now, wait;
+	bool render;
+
+	gpu = data;
+	vq = &gpu->vq[VIRTIO_GPU_CONTROLQ];
+#ifdef WITH_VIRGL
+	if (gpu->virgl)
+		virtio_gpu_virgl_poll(gpu->virgl);
+#endif
+	render = false;
+	now = virtio_gpu_frame_now();
+	wait = 0;
+	TAILQ_INIT(&ready);
+
+	for (tl = LIST_FIRST(&gpu->timelines); tl; tl = next) {
+		next = LIST_NEXT(tl, link);
+		while ((fence = TAILQ_FIRST(&tl->fences)) != NULL) {
+			if (fence->render) {
+				render = true;
+				break;
+			}
+			if (!virtio_gpu_fence_frames_done(gpu, fence) &&
+			    fence->deadline_ns > now) {
+				if (!wait || fence->deadline_ns - now < wait)
+					wait = fence->deadline_ns - now;
+				break;
+			}
+			TAILQ_REMOVE(&tl->fences, fence, link);
+			TAILQ_INSERT_TAIL(&ready, fence, link);
+			gpu->nr_fences--;
+		}
+		if (TAILQ_EMPTY(&tl->fences)) {
+			LIST_REMOVE(tl, link);
+			mem_slab_free(&gpu->slab, tl, sizeof(*tl));
+		}
 	}
-	r2d = virtio_gpu_find_resource_2d(cmd->gpu, req.resource_id);
-	if (r2d == NULL) {
-		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
-		memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
+	if (render && !virtio_gpu_render_watch(gpu) &&
+	    (!wait || wait > VIRTIO_GPU_RENDER_POLL_MS * 1000000ULL))
+		wait = VIRTIO_GPU_RENDER_POLL_MS * 1000000ULL;
+	if (wait)
+		virtio_gpu_fence_arm(gpu, wait);
+	if (TAILQ_EMPTY(&ready))
 		return;
+
+	/* the checkpoint must not list chains the guest has got back */
+	virtio_checkpoint(&gpu->base);
+	while ((fence = TAILQ_FIRST(&ready)) != NULL) {
+		TAILQ_REMOVE(&ready, fence, link);
+		vq_relchain(vq, fence->idx, fence->iolen);
+		TRACE_2L(TRACE_GPU_FENCE, fence->fence_id, fence->ctx_id);
+		TAILQ_INSERT_TAIL(&gpu->fence_free, fence, link);
 	}
-	if (r2d->blob == false) {
-		/* Maybe the resource  is not blob, fallback to set_scanout */
-		virtio_gpu_cmd_set_scanout(cmd);
+	vq_endchains(vq, 0);
+}
+
+/* From the display server or a display lane, see vdpy_frame_notify() */
+static void
+virtio_gpu_frame_presented(void *data, int scanout_id, uint32_t frame_id)
+{
+	struct virtio_gpu *gpu = data;
+	uint32_t done;
+
+	if (scanout_id < 0 || scanout_id >= gpu->scanout_num)
 		return;
+	done = __atomic_load_n(&gpu->frames_done[scanout_id], __ATOMIC_RELAXED);
+	do {
+		if (virtio_gpu_frame_done(frame_id, done))
+			return;
+	} while (!__atomic_compare_exchange_n(&gpu->frames_done[scanout_id], &done, frame_id,
+					      false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	/*
+	 * Frames are queued from the control queue, on the display thread,
+	 * so the bottom half runs after the command that made the frame and
+	 * finds the fence waiting for it.
+	 */
+	vdpy_submit_bh(gpu->vdpy_handle, &gpu->fence_bh);
+}
+
+static void
+virtio_gpu_fence_timeout(void *data, uint64_t nexp __attribute__((unused)))
+{
+	struct virtio_gpu *gpu = data;
+
+	vdpy_submit_bh(gpu->vdpy_handle, &gpu->fence_bh);
+}
+
+/* Forget the deferred fences, their chains go away with the queue */
+static void
+virtio_gpu_fence_reset(struct virtio_gpu *gpu)
+{
+	struct virtio_gpu_timeline *tl;
+	struct virtio_gpu_fence *fence;
+
+	while ((tl = LIST_FIRST(&gpu->timelines)) != NULL) {
+		while ((fence = TAILQ_FIRST(&tl->fences)) != NULL) {
+			TAILQ_REMOVE(&tl->fences, fence, link);
+			TAILQ_INSERT_TAIL(&gpu->fence_free, fence, link);
+		}
+		LIST_REMOVE(tl, link);
+		mem_slab_free(&gpu->slab, tl, sizeof(*tl));
 	}
+	gpu->nr_fences = 0;
+}
 
-	virtio_gpu_update_scanout(gpu, req.scanout_id, req.resource_id, &req.r);
-	virtio_gpu_dmabuf_ref(r2d->dma_info);
-	surf.width = req.r.width;
-	surf.height = req.r.height;
-	surf.x = req.r.x;
-	surf.y = req.r.y;
-	surf.stride = req.strides[0];
-	surf.dma_info.dmabuf_fd = r2d->dma_info->dmabuf_fd;
-	surf.surf_type = SURFACE_DMABUF;
-	bytes_pp = 4;
-	switch (req.format) {
-	case VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM:
-		drm_fourcc = DRM_FORMAT_XRGB8888;
-		break;
-	case VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM:
-		drm_fourcc = DRM_FORMAT_ARGB8888;
-		break;
-	case VIRTIO_GPU_FORMAT_R8G8B8A8_UNORM:
-		drm_fourcc = DRM_FORMAT_ABGR8888;
-		break;
-	case VIRTIO_GPU_FORMAT_R8G8B8X8_UNORM:
-		drm_fourcc = DRM_FORMAT_XBGR8888;
-		break;
-	default:
-		pr_err("%s : unuspported surface format %d.\n",
-			__func__, req.format);
-		drm_fourcc = DRM_FORMAT_ARGB8888;
-		break;
+/* The frames a command made on each scanout, NULL if none */
+static uint32_t *
+virtio_gpu_cmd_frames(struct virtio_gpu *gpu, uint32_t frame_seq, uint32_t *frame_ids)
+{
+	int i;
+
+	if (gpu->frame_seq == frame_seq)
+		return NULL;
+	memset(frame_ids, 0, sizeof(uint32_t) * VDPY_MAX_NUM);
+	for (i = 0; i < gpu->scanout_num; i++) {
+		if (!virtio_gpu_frame_done(gpu->frame_last[i], frame_seq))
+			frame_ids[i] = gpu->frame_last[i];
 	}
-	surf.dma_info.dmabuf_offset = req.offsets[0] + bytes_pp * surf.x + surf.y * surf.stride;
-	surf.dma_info.surf_fourcc = drm_fourcc;
-	vdpy_surface_set(gpu->vdpy_handle, req.scanout_id, &surf);
-	resp.type = VIRTIO_GPU_RESP_OK_NODATA;
-	memcpy(cmd->iov[cmd->iovcnt - 1].iov_base, &resp, sizeof(resp));
-	virtio_gpu_dmabuf_unref(r2d->dma_info);
-	return;
+	return frame_ids;
 }
-void triger_hotplug(void *data)
+
+/* Hands the command to the renderer if it is a 3D one */
+static bool
+virtio_gpu_cmd_virgl(struct virtio_gpu_command *cmd, bool *render)
 {
-	struct virtio_gpu *gpu = (struct virtio_gpu *)data;
-	gpu->cfg.events_read = VIRTIO_GPU_EVENT_DISPLAY;
-	//write_config(&gpu->base,0,4);
-	virtio_config_changed(&gpu->base);
+#ifdef WITH_VIRGL
+	if (cmd->gpu->virgl)
+		return virtio_gpu_virgl_command(cmd->gpu->virgl, cmd->iov, cmd->iovcnt,
+						&cmd->iolen, render);
+#endif
+	return false;
+}
+
+/* A completed chain of the control queue, not yet given back */
+struct virtio_gpu_done {
+	uint16_t idx;
+	uint32_t iolen;
+};
+
+/*
+ * The device state is saved once per batch, before the guest can see any
+ * of its commands completed, so a restarted backend never misses a change
+ * it acknowledged.
+ */
+static void
+virtio_gpu_ctrl_release(struct virtio_gpu *gpu, struct virtio_vq_info *vq,
+			struct virtio_gpu_done *done, int ndone, bool dirty)
+{
+	int i;
+
+	if (dirty)
+		virtio_checkpoint(&gpu->base);
+	for (i = 0; i < ndone; i++)
+		vq_relchain_inorder(vq, done[i].idx, done[i].iolen); /* Release the chain */
 }
 
 static void
@@ -1487,34 +3493,55 @@ virtio_gpu_ctrl_bh(void *data)
 	uint16_t flags[VIRTIO_GPU_MAXSEGS];
 	int n;
 	uint16_t idx;
+	bool changed, render, dirty;
+	uint64_t start;
+	uint32_t frame_seq, frame_ids[VDPY_MAX_NUM];
+	struct virtio_gpu_ctrl_hdr *resp;
+	struct virtio_gpu_fence *fence;
+	struct virtio_gpu_done done[VIRTIO_GPU_RINGSZ];
+	int ndone;
 
 	vq = (struct virtio_vq_info *)data;
 	vdev = (struct virtio_gpu *)(vq->base);
 	cmd.gpu = vdev;
+	cmd.arena = &vdev->arena[VIRTIO_GPU_CONTROLQ];
 	cmd.iolen = 0;
+	dirty = false;
+	ndone = 0;
+	virtio_gpu_stats_begin(vdev);
 
 	while (vq_has_descs(vq)) {
 		n = vq_getchain(vq, &idx, iov, VIRTIO_GPU_MAXSEGS, flags);
 		if (n < 0) {
 			pr_err("virtio-gpu: invalid descriptors\n");
-			return;
+			break;
 		}
 		if (n == 0) {
 			pr_err("virtio-gpu: get no available descriptors\n");
-			return;
+			break;
 		}
 
 		cmd.iovcnt = n;
 		cmd.iov = iov;
 		memcpy(&cmd.hdr, iov[0].iov_base,
 			sizeof(struct virtio_gpu_ctrl_hdr));
-
-		switch (cmd.hdr.type) {
+		cmd.bytes = 0;
+		frame_seq = vdev->frame_seq;
+		start = virtio_gpu_stats_now();
+		TRACE_4I(TRACE_GPU_CMD_BEGIN, cmd.hdr.type, cmd.hdr.ctx_id, cmd.hdr.flags, 0);
+
+		changed = true;
+		render = false;
+		if (virtio_gpu_cmd_virgl(&cmd, &render))
+			changed = false;	/* the renderer's state is not saved */
+		else switch (cmd.hdr.type) {
 		case VIRTIO_GPU_CMD_GET_EDID:
 			virtio_gpu_cmd_get_edid(&cmd);
+			changed = false;
 			break;
 		case VIRTIO_GPU_CMD_GET_DISPLAY_INFO:
 			virtio_gpu_cmd_get_display_info(&cmd);
+			changed = false;
 			break;
 		case VIRTIO_GPU_CMD_RESOURCE_CREATE_2D:
 			virtio_gpu_cmd_resource_create_2d(&cmd);
@@ -1533,9 +3560,11 @@ virtio_gpu_ctrl_bh(void *data)
 			break;
 		case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D:
 			virtio_gpu_cmd_transfer_to_host_2d(&cmd);
+			changed = false;
 			break;
 		case VIRTIO_GPU_CMD_RESOURCE_FLUSH:
 			virtio_gpu_cmd_resource_flush(&cmd);
+			changed = false;
 			break;
 		case VIRTIO_GPU_CMD_RESOURCE_CREATE_BLOB:
 			if (!virtio_gpu_blob_supported(vdev)) {
@@ -1554,17 +3583,90 @@ virtio_gpu_ctrl_bh(void *data)
 		case VIRTIO_GPU_CMD_SET_MODIFIER:
 			virtio_gpu_cmd_set_modifier(&cmd);
 			break;
+		case VIRTIO_GPU_CMD_RESOURCE_MAP_BLOB:
+			if (!virtio_gpu_blob_supported(vdev)) {
+				virtio_gpu_cmd_unspec(&cmd);
+				break;
+			}
+			virtio_gpu_cmd_map_blob(&cmd);
+			break;
+		case VIRTIO_GPU_CMD_RESOURCE_UNMAP_BLOB:
+			if (!virtio_gpu_blob_supported(vdev)) {
+				virtio_gpu_cmd_unspec(&cmd);
+				break;
+			}
+			virtio_gpu_cmd_unmap_blob(&cmd);
+			break;
+		case VIRTIO_GPU_CMD_CTX_CREATE:
+			virtio_gpu_cmd_ctx_create(&cmd);
+			break;
+		case VIRTIO_GPU_CMD_CTX_DESTROY:
+			virtio_gpu_cmd_ctx_destroy(&cmd);
+			break;
+		case VIRTIO_GPU_CMD_CTX_ATTACH_RESOURCE:
+		case VIRTIO_GPU_CMD_CTX_DETACH_RESOURCE:
+			virtio_gpu_cmd_ctx_resource(&cmd);
+			changed = false;
+			break;
 		default:
 			pr_dbg("%s unknown type %d\n", __func__, cmd.hdr.type);
 			virtio_gpu_cmd_unspec(&cmd);
+			changed = false;
 			break;
 		}
 
-		vq_relchain(vq, idx, cmd.iolen); /* Release the chain */
+		resp = cmd.iov[cmd.iovcnt - 1].iov_base;
+		virtio_gpu_stats_record(vdev, virtio_gpu_stats_slot(cmd.hdr.type), start,
+					cmd.bytes, resp->type >= VIRTIO_GPU_RESP_ERR_UNSPEC);
+		TRACE_4I(TRACE_GPU_CMD_END, cmd.hdr.type, resp->type, (uint32_t)cmd.bytes, 0);
+
+		fence = NULL;
+		if (resp->flags & VIRTIO_GPU_FLAG_FENCE)
+			fence = virtio_gpu_fence_defer(vdev, &cmd.hdr, idx, cmd.iolen,
+					virtio_gpu_cmd_frames(vdev, frame_seq, frame_ids), render);
+
+		if (changed || fence)
+			dirty = true;
+		if (!fence) {
+			done[ndone].idx = idx;
+			done[ndone].iolen = cmd.iolen;
+			if (++ndone == VIRTIO_GPU_RINGSZ) {
+				virtio_gpu_ctrl_release(vdev, vq, done, ndone, dirty);
+				dirty = false;
+				ndone = 0;
+			}
+			if (resp->flags & VIRTIO_GPU_FLAG_FENCE)
+				TRACE_2L(TRACE_GPU_FENCE, resp->fence_id, resp->ctx_id);
+		}
+		mem_arena_reset(cmd.arena);
 	}
+	virtio_gpu_ctrl_release(vdev, vq, done, ndone, dirty);
 	vq_endchains(vq, 1);	/* Generate interrupt if appropriate. */
 }
 
+#ifdef WITH_VIRGL
+/* Resets the renderer, or destroys it once the device goes away */
+static void
+virtio_gpu_virgl_bh(void *data)
+{
+	struct virtio_gpu *gpu = data;
+
+	if (!gpu->virgl)
+		return;
+	/* the renderer's fence fd goes with it */
+	virtio_gpu_render_unwatch(gpu);
+	if (__atomic_load_n(&gpu->virgl_closing, __ATOMIC_ACQUIRE)) {
+		virtio_gpu_virgl_destroy(gpu->virgl);
+		pthread_mutex_lock(&gpu->virgl_mtx);
+		gpu->virgl = NULL;
+		pthread_cond_signal(&gpu->virgl_cond);
+		pthread_mutex_unlock(&gpu->virgl_mtx);
+	} else {
+		virtio_gpu_virgl_reset(gpu->virgl);
+	}
+}
+#endif
+
 static void
 virtio_gpu_notify_controlq(void *vdev, struct virtio_vq_info *vq __attribute__((unused)))
 {
@@ -1625,25 +3727,30 @@ virtio_gpu_cursor_bh(void *data)
 	struct iovec iov[VIRTIO_GPU_MAXSEGS];
 	int n;
 	uint16_t idx;
+	uint64_t start;
 
 	vq = (struct virtio_vq_info *)data;
 	vdev = (struct virtio_gpu *)(vq->base);
 	cmd.gpu = vdev;
+	cmd.arena = &vdev->arena[VIRTIO_GPU_CURSORQ];
 	cmd.iolen = 0;
+	virtio_gpu_stats_begin(vdev);
 
 	while (vq_has_descs(vq)) {
 		n = vq_getchain(vq, &idx, iov, VIRTIO_GPU_MAXSEGS, NULL);
 		if (n < 0) {
 			pr_err("virtio-gpu: invalid descriptors\n");
-			return;
+			break;
 		}
 		if (n == 0) {
 			pr_err("virtio-gpu: get no available descriptors\n");
-			return;
+			break;
 		}
 		cmd.iovcnt = n;
 		cmd.iov = iov;
 		memcpy(&hdr, iov[0].iov_base, sizeof(hdr));
+		start = virtio_gpu_stats_now();
+		TRACE_4I(TRACE_GPU_CMD_BEGIN, hdr.type, hdr.ctx_id, hdr.flags, 0);
 		switch (hdr.type) {
 		case VIRTIO_GPU_CMD_UPDATE_CURSOR:
 			virtio_gpu_cmd_update_cursor(&cmd);
@@ -1654,8 +3761,11 @@ virtio_gpu_cursor_bh(void *data)
 		default:
 			break;
 		}
+		virtio_gpu_stats_record(vdev, virtio_gpu_stats_slot(hdr.type), start, 0, false);
+		TRACE_4I(TRACE_GPU_CMD_END, hdr.type, 0, 0, 0);
 
-		vq_relchain(vq, idx, cmd.iolen); /* Release the chain */
+		vq_relchain_inorder(vq, idx, cmd.iolen); /* Release the chain */
+		mem_arena_reset(cmd.arena);
 	}
 	vq_endchains(vq, 1);	/* Generate interrupt if appropriate. */
 }
@@ -1724,18 +3834,13 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts __attribute_
 	struct virtio_gpu *gpu;
 	pthread_mutexattr_t attr;
 	int rc = 0;
+	int i;
 	struct display_info info;
 	int prot;
 	struct virtio_pci_cap cap;
 	struct virtio_pci_notify_cap notify;
 	struct virtio_pci_cfg_cap cfg;
 
-	if (virtio_gpu_device_cnt) {
-		pr_err("%s: only 1 virtio-gpu device can be created.\n", __func__);
-		return -1;
-	}
-	virtio_gpu_device_cnt++;
-
 	/* allocate the virtio-gpu device */
 	gpu = calloc(1, sizeof(struct virtio_gpu));
 	if (!gpu) {
@@ -1763,6 +3868,24 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts __attribute_
 		return rc;
 	}
 
+	if (virtio_gpu_pools_init(gpu)) {
+		pr_err("%s: out of memory for the command pools\n", __func__);
+		pthread_mutex_destroy(&gpu->mtx);
+		free(gpu);
+		return -1;
+	}
+	TAILQ_INIT(&gpu->dmabuf_lru);
+	TAILQ_INIT(&gpu->fence_free);
+	for (i = 0; i < VIRTIO_GPU_RINGSZ; i++)
+		TAILQ_INSERT_TAIL(&gpu->fence_free, &gpu->fences[i], link);
+	if (acrn_timer_init(&gpu->fence_timer, virtio_gpu_fence_timeout, gpu) < 0) {
+		pr_err("%s: failed to create the fence timer\n", __func__);
+		virtio_gpu_pools_deinit(gpu);
+		pthread_mutex_destroy(&gpu->mtx);
+		free(gpu);
+		return -1;
+	}
+
 	/* register the virtio_gpu_ops to virtio framework */
 	virtio_linkup(&gpu->base,
 			&virtio_gpu_ops,
@@ -1773,8 +3896,17 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts __attribute_
 
 	gpu->scanout_num = 1;
 	gpu->vdpy_handle = vdpy_init(&gpu->scanout_num);
+	if (gpu->vdpy_handle <= 0) {
+		pr_err("%s: failed to create the virtual display\n", __func__);
+		acrn_timer_deinit(&gpu->fence_timer);
+		virtio_gpu_pools_deinit(gpu);
+		pthread_mutex_destroy(&gpu->mtx);
+		free(gpu);
+		return -1;
+	}
 
-	triger_init(triger_hotplug,gpu);
+	triger_init(gpu->vdpy_handle, triger_hotplug, gpu);
+	vdpy_frame_notify(gpu->vdpy_handle, virtio_gpu_frame_presented, gpu);
 
 	gpu->base.mtx = &gpu->mtx;
 	gpu->base.device_caps = VIRTIO_GPU_S_HOSTCAPS;
@@ -1786,14 +3918,17 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts __attribute_
 	gpu->gpu_scanouts = calloc(gpu->scanout_num, sizeof(struct virtio_gpu_scanout));
 	if (gpu->gpu_scanouts == NULL) {
 		pr_err("%s: out of memory for gpu_scanouts\n", __func__);
+		acrn_timer_deinit(&gpu->fence_timer);
+		virtio_gpu_pools_deinit(gpu);
 		free(gpu);
 		return -1;
 	}
 
+	gpu->tsc_khz = virtio_gpu_stats_calibrate();
+
 	if (vm_allow_dmabuf(gpu->base.dev->vmctx)) {
 		FILE *fp;
 		char buf[16];
-		int list_limit;
 
 		gpu->is_blob_supported = true;
 		/* Now the memfd is used by default and it
@@ -1807,21 +3942,29 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts __attribute_
 			memset(buf, 0, sizeof(buf));
 			rc = fread(buf, sizeof(buf), 1, fp);
 			fclose(fp);
-			list_limit = atoi(buf);
-			if (list_limit < 4096) {
-				pr_info("udmabuf.list_limit=%d in kernel is too small. "
-					"Please add udmabuf.list_limit=4096 in kernel "
-					"boot option to use GPU zero-copy.\n",
-					list_limit);
+			gpu->udmabuf_list_limit = atoi(buf);
+			if (gpu->udmabuf_list_limit <= 0) {
+				pr_info("udmabuf.list_limit=%d in kernel disables "
+					"GPU zero-copy.\n", gpu->udmabuf_list_limit);
 				gpu->is_blob_supported = false;
+			} else if (gpu->udmabuf_list_limit < 4096) {
+				/* adjacent guest pages are merged, most blobs still fit */
+				pr_info("udmabuf.list_limit=%d in kernel is small, "
+					"blobs backed by more ranges are refused. "
+					"Add udmabuf.list_limit=4096 in kernel boot option "
+					"to lift it.\n", gpu->udmabuf_list_limit);
 			}
 		} else {
 			pr_info("Zero-copy is disabled. Please check that "
 				"CONFIG_UDMABUF is enabled in the kernel config.\n");
 			gpu->is_blob_supported = false;
 		}
-		if (gpu->is_blob_supported)
+		if (gpu->is_blob_supported) {
 			gpu->base.device_caps |= (1ULL << VIRTIO_GPU_F_RESOURCE_BLOB);
+			/* the window for host blobs, found at their first use */
+			virtio_shm_region_request(&gpu->base, VIRTIO_GPU_SHM_ID_HOST_VISIBLE,
+					VIRTIO_GPU_HOSTMEM_SIZE, VIRTIO_GPU_HOSTMEM_ALIGN);
+		}
 	}
 
 	/* set queue size */
@@ -1835,6 +3978,8 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts __attribute_
 	gpu->ctrl_bh.data = &gpu->vq[VIRTIO_GPU_CONTROLQ];
 	gpu->cursor_bh.task_cb = virtio_gpu_cursor_bh;
 	gpu->cursor_bh.data = &gpu->vq[VIRTIO_GPU_CURSORQ];
+	gpu->fence_bh.task_cb = virtio_gpu_fence_bh;
+	gpu->fence_bh.data = gpu;
 	gpu->vga_bh.task_cb = virtio_gpu_vga_bh;
 	gpu->vga_bh.data = gpu;
 
@@ -1844,6 +3989,20 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts __attribute_
 	gpu->cfg.num_scanouts = gpu->scanout_num;
 	gpu->cfg.num_capsets = 0;
 
+#ifdef WITH_VIRGL
+	gpu->virgl = virtio_gpu_virgl_create(ctx, virtio_gpu_render_fence, gpu);
+	if (gpu->virgl) {
+		gpu->virgl_bh.task_cb = virtio_gpu_virgl_bh;
+		gpu->virgl_bh.data = gpu;
+		pthread_mutex_init(&gpu->virgl_mtx, NULL);
+		pthread_cond_init(&gpu->virgl_cond, NULL);
+		gpu->base.device_caps |= (1ULL << VIRTIO_GPU_F_VIRGL);
+		gpu->cfg.num_capsets = virtio_gpu_virgl_num_capsets();
+	} else {
+		pr_err("%s: out of memory for the renderer, 3D is disabled\n", __func__);
+	}
+#endif
+
 	/* config the device id and vendor id according to spec */
 	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_GPU);
 	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
@@ -1938,6 +4097,7 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts __attribute_
 	gpu->vga.surf.stride = 0;
 	gpu->vga.surf.height = 0;
 	gpu->vga.surf.pixel = 0;
+	gpu->vga.surf.shm_info.memfd = -1;
 	atomic_store(&gpu->vga_thread_status, VGA_THREAD_RUNNING);
 	pthread_create(&gpu->vga.tid, NULL, virtio_gpu_vga_render, (void*)gpu);
 
@@ -1981,7 +4141,7 @@ virtio_gpu_deinit(struct vmctx *ctx __attribute__((unused)), struct pci_vdev *de
 				gpu_scanout->cur_img = NULL;
 			}
 			if (gpu_scanout->dma_buf) {
-				virtio_gpu_dmabuf_unref(gpu_scanout->dma_buf);
+				virtio_gpu_dmabuf_unref(gpu, gpu_scanout->dma_buf);
 				gpu_scanout->dma_buf = NULL;
 			}
 			gpu_scanout->is_active = false;
@@ -1999,24 +4159,52 @@ virtio_gpu_deinit(struct vmctx *ctx __attribute__((unused)), struct pci_vdev *de
 				r2d->image = NULL;
 			}
 			if (r2d->blob) {
-				virtio_gpu_dmabuf_unref(r2d->dma_info);
+				virtio_gpu_dmabuf_unref(gpu, r2d->dma_info);
 				r2d->dma_info = NULL;
 				r2d->blob = false;
 			}
 			LIST_REMOVE(r2d, link);
-			if (r2d->iov) {
-				free(r2d->iov);
-				r2d->iov = NULL;
-			}
-			free(r2d);
+			virtio_gpu_free_backing(gpu, r2d);
+			virtio_gpu_free_resource(gpu, r2d);
 		}
 	}
 
+	virtio_gpu_dmabuf_cache_flush(gpu);
+	virtio_gpu_dmabuf_unref(gpu, gpu->hostmem_dmabuf);
+	gpu->hostmem_dmabuf = NULL;
+	vdpy_frame_notify(gpu->vdpy_handle, NULL, NULL);
+	acrn_timer_deinit(&gpu->fence_timer);
+	virtio_gpu_fence_reset(gpu);
+	virtio_gpu_free_contexts(gpu);
+#ifdef WITH_VIRGL
+	if (gpu->virgl) {
+		bool queued, left;
+
+		/*
+		 * Torn down where it runs, by the next run of virgl_bh; the
+		 * bottom halves queued before it have run by then too.
+		 */
+		__atomic_store_n(&gpu->virgl_closing, true, __ATOMIC_RELEASE);
+		queued = vdpy_submit_bh(gpu->vdpy_handle, &gpu->virgl_bh) ||
+			(__atomic_load_n(&gpu->virgl_bh.bh_flag, __ATOMIC_ACQUIRE) & ACRN_BH_PENDING);
+		pthread_mutex_lock(&gpu->virgl_mtx);
+		while (queued && gpu->virgl)
+			pthread_cond_wait(&gpu->virgl_cond, &gpu->virgl_mtx);
+		left = (gpu->virgl != NULL);
+		pthread_mutex_unlock(&gpu->virgl_mtx);
+		if (left) {
+			pr_err("%s: no display thread, the renderer is left\n", __func__);
+		} else {
+			pthread_cond_destroy(&gpu->virgl_cond);
+			pthread_mutex_destroy(&gpu->virgl_mtx);
+		}
+	}
+#endif
 	vdpy_deinit(gpu->vdpy_handle);
+	virtio_gpu_pools_deinit(gpu);
 
 	pthread_mutex_destroy(&gpu->mtx);
 	free(gpu);
-	virtio_gpu_device_cnt--;
 }
 
 uint64_t
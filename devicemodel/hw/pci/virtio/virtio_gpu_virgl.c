@@ -0,0 +1,806 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * virtio-gpu 3D commands through virglrenderer
+ *
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <linux/virtio_gpu.h>
+#include <pixman.h>
+#include <virglrenderer.h>
+
+#include "dm.h"
+#include "log.h"
+#include "vdisplay.h"
+#include "virtio_gpu_virgl.h"
+
+#ifndef VIRTIO_GPU_CAPSET_VENUS
+#define VIRTIO_GPU_CAPSET_VENUS		4
+#endif
+
+/* The 16 bpp formats, not in the virtio-gpu header */
+#define VIRTIO_GPU_VIRGL_FORMAT_B5G5R5A1_UNORM	5
+#define VIRTIO_GPU_VIRGL_FORMAT_B5G6R5_UNORM	7
+
+/* Backing of a resource, a guest with more entries is broken */
+#define VIRTIO_GPU_VIRGL_MAX_ENTRIES	16384
+
+/* SUBMIT_3D stream, guests flush theirs long before that */
+#define VIRTIO_GPU_VIRGL_MAX_CMDBUF	(4U << 20)
+
+struct virtio_gpu_virgl_resource {
+	uint32_t resource_id;
+	struct iovec *iov;		/* guest backing, NULL if none */
+	int iovcnt;
+	int dmabuf_fd;			/* exported texture, -1 if not yet */
+	int dmabuf_stride;
+	int dmabuf_offset;
+	bool no_export;			/* the renderer cannot export it */
+	void *pixels;			/* read back texture otherwise */
+	size_t pixels_size;
+	LIST_ENTRY(virtio_gpu_virgl_resource) link;
+};
+
+struct virtio_gpu_virgl {
+	struct vmctx *ctx;
+	virtio_gpu_virgl_fence_cb fence_cb;
+	void *data;
+	bool started;
+	bool failed;			/* do not try to start again */
+	bool venus;
+	LIST_HEAD(, virtio_gpu_virgl_resource) resources;
+	void *cmdbuf;			/* SUBMIT_3D streams, grown as needed */
+	size_t cmdbuf_size;
+};
+
+/* A command being handled, like struct virtio_gpu_command */
+struct virtio_gpu_virgl_cmd {
+	struct virtio_gpu_virgl *vg;
+	struct virtio_gpu_ctrl_hdr hdr;
+	struct iovec *iov;
+	int iovcnt;
+	uint32_t iolen;
+};
+
+static const uint32_t virtio_gpu_virgl_capsets[] = {
+	VIRTIO_GPU_CAPSET_VIRGL,
+	VIRTIO_GPU_CAPSET_VIRGL2,
+#ifdef VIRGL_RENDERER_VENUS
+	VIRTIO_GPU_CAPSET_VENUS,
+#endif
+};
+
+#define VIRTIO_GPU_VIRGL_NUM_CAPSETS \
+	(int)(sizeof(virtio_gpu_virgl_capsets) / sizeof(virtio_gpu_virgl_capsets[0]))
+
+static void
+virtio_gpu_virgl_write_fence(void *cookie, uint32_t fence)
+{
+	struct virtio_gpu_virgl *vg = cookie;
+
+	vg->fence_cb(vg->data, 0, VIRTIO_GPU_VIRGL_RING_GLOBAL, fence);
+}
+
+static void
+virtio_gpu_virgl_write_context_fence(void *cookie, uint32_t ctx_id, uint32_t ring_idx,
+				     uint64_t fence_id)
+{
+	struct virtio_gpu_virgl *vg = cookie;
+
+	vg->fence_cb(vg->data, ctx_id, ring_idx, fence_id);
+}
+
+static struct virgl_renderer_callbacks virtio_gpu_virgl_cbs = {
+	.version = 3,
+	.write_fence = virtio_gpu_virgl_write_fence,
+	.write_context_fence = virtio_gpu_virgl_write_context_fence,
+};
+
+/*
+ * The renderer makes its EGL context current on the calling thread, so it
+ * is started from the display thread, by the first command. Its sync
+ * thread waits for the GL fences and signals them on the poll fd; the fence
+ * callbacks still come from virgl_renderer_poll(), on the display thread.
+ */
+static bool
+virtio_gpu_virgl_start(struct virtio_gpu_virgl *vg)
+{
+	int flags;
+
+	if (vg->started || vg->failed)
+		return vg->started;
+
+	flags = VIRGL_RENDERER_USE_EGL | VIRGL_RENDERER_USE_SURFACELESS |
+		VIRGL_RENDERER_USE_GLES | VIRGL_RENDERER_THREAD_SYNC;
+#ifdef VIRGL_RENDERER_VENUS
+	if (virgl_renderer_init(vg, flags | VIRGL_RENDERER_VENUS |
+				VIRGL_RENDERER_RENDER_SERVER, &virtio_gpu_virgl_cbs) == 0) {
+		vg->started = true;
+		vg->venus = true;
+		pr_info("virglrenderer started with venus\n");
+		return true;
+	}
+#endif
+	if (virgl_renderer_init(vg, flags, &virtio_gpu_virgl_cbs)) {
+		pr_err("%s: failed to start virglrenderer\n", __func__);
+		vg->failed = true;
+		return false;
+	}
+	vg->started = true;
+	pr_info("virglrenderer started\n");
+	return true;
+}
+
+static struct virtio_gpu_virgl_resource *
+virtio_gpu_virgl_find(struct virtio_gpu_virgl *vg, uint32_t resource_id)
+{
+	struct virtio_gpu_virgl_resource *res;
+
+	LIST_FOREACH(res, &vg->resources, link) {
+		if (res->resource_id == resource_id)
+			return res;
+	}
+	return NULL;
+}
+
+static void
+virtio_gpu_virgl_detach(struct virtio_gpu_virgl_resource *res)
+{
+	struct iovec *iov;
+	int iovcnt;
+
+	if (!res->iov)
+		return;
+	virgl_renderer_resource_detach_iov(res->resource_id, &iov, &iovcnt);
+	free(res->iov);
+	res->iov = NULL;
+	res->iovcnt = 0;
+}
+
+/* Forgets the resource, the renderer's side is up to the caller */
+static void
+virtio_gpu_virgl_free(struct virtio_gpu_virgl_resource *res)
+{
+	LIST_REMOVE(res, link);
+	if (res->dmabuf_fd >= 0)
+		close(res->dmabuf_fd);
+	free(res->iov);
+	free(res->pixels);
+	free(res);
+}
+
+/* Copies from the request descriptors, which are all but the last one */
+static size_t
+virtio_gpu_virgl_copy(struct virtio_gpu_virgl_cmd *cmd, size_t offset, void *buf, size_t len)
+{
+	size_t done, n;
+	int i;
+
+	done = 0;
+	for (i = 0; i < cmd->iovcnt - 1 && done < len; i++) {
+		if (offset >= cmd->iov[i].iov_len) {
+			offset -= cmd->iov[i].iov_len;
+			continue;
+		}
+		n = cmd->iov[i].iov_len - offset;
+		if (n > len - done)
+			n = len - done;
+		memcpy((char *)buf + done, (char *)cmd->iov[i].iov_base + offset, n);
+		done += n;
+		offset = 0;
+	}
+	return done;
+}
+
+static bool
+virtio_gpu_virgl_req(struct virtio_gpu_virgl_cmd *cmd, void *req, size_t size)
+{
+	return virtio_gpu_virgl_copy(cmd, 0, req, size) == size;
+}
+
+static void
+virtio_gpu_virgl_resp(struct virtio_gpu_virgl_cmd *cmd, struct virtio_gpu_ctrl_hdr *resp,
+		      uint32_t type, size_t size)
+{
+	struct iovec *iov = &cmd->iov[cmd->iovcnt - 1];
+
+	resp->type = type;
+	if (cmd->hdr.flags & VIRTIO_GPU_FLAG_FENCE) {
+		resp->flags |= VIRTIO_GPU_FLAG_FENCE;
+		resp->fence_id = cmd->hdr.fence_id;
+		resp->ctx_id = cmd->hdr.ctx_id;
+		if (cmd->hdr.flags & VIRTIO_GPU_FLAG_INFO_RING_IDX) {
+			resp->flags |= VIRTIO_GPU_FLAG_INFO_RING_IDX;
+			resp->ring_idx = cmd->hdr.ring_idx;
+		}
+	}
+	if (size > iov->iov_len) {
+		pr_err("%s: response of %zu bytes does not fit\n", __func__, size);
+		return;
+	}
+	memcpy(iov->iov_base, resp, size);
+	cmd->iolen = size;
+}
+
+static void
+virtio_gpu_virgl_nodata(struct virtio_gpu_virgl_cmd *cmd, uint32_t type)
+{
+	struct virtio_gpu_ctrl_hdr resp;
+
+	memset(&resp, 0, sizeof(resp));
+	virtio_gpu_virgl_resp(cmd, &resp, type, sizeof(resp));
+}
+
+static void
+virtio_gpu_virgl_get_capset_info(struct virtio_gpu_virgl_cmd *cmd)
+{
+	struct virtio_gpu_get_capset_info req;
+	struct virtio_gpu_resp_capset_info resp;
+	uint32_t id, max_ver, max_size;
+
+	if (!virtio_gpu_virgl_req(cmd, &req, sizeof(req)) ||
+	    req.capset_index >= VIRTIO_GPU_VIRGL_NUM_CAPSETS) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER);
+		return;
+	}
+
+	/* a capset the renderer did not start with reports a size of 0 */
+	id = virtio_gpu_virgl_capsets[req.capset_index];
+	virgl_renderer_get_cap_set(id, &max_ver, &max_size);
+	memset(&resp, 0, sizeof(resp));
+	resp.capset_id = id;
+	resp.capset_max_version = max_ver;
+	resp.capset_max_size = max_size;
+	virtio_gpu_virgl_resp(cmd, &resp.hdr, VIRTIO_GPU_RESP_OK_CAPSET_INFO, sizeof(resp));
+}
+
+static void
+virtio_gpu_virgl_get_capset(struct virtio_gpu_virgl_cmd *cmd)
+{
+	struct virtio_gpu_get_capset req;
+	struct virtio_gpu_resp_capset *resp;
+	uint32_t max_ver, max_size;
+
+	if (!virtio_gpu_virgl_req(cmd, &req, sizeof(req))) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER);
+		return;
+	}
+	virgl_renderer_get_cap_set(req.capset_id, &max_ver, &max_size);
+	if (max_size == 0 || req.capset_version > max_ver) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER);
+		return;
+	}
+
+	resp = calloc(1, sizeof(*resp) + max_size);
+	if (!resp) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY);
+		return;
+	}
+	virgl_renderer_fill_caps(req.capset_id, req.capset_version, resp->capset_data);
+	virtio_gpu_virgl_resp(cmd, &resp->hdr, VIRTIO_GPU_RESP_OK_CAPSET,
+			      sizeof(*resp) + max_size);
+	free(resp);
+}
+
+static void
+virtio_gpu_virgl_ctx_create(struct virtio_gpu_virgl_cmd *cmd)
+{
+	struct virtio_gpu_ctx_create req;
+	int ret;
+
+	if (!virtio_gpu_virgl_req(cmd, &req, sizeof(req)) || req.hdr.ctx_id == 0) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_INVALID_CONTEXT_ID);
+		return;
+	}
+	if (req.nlen > sizeof(req.debug_name))
+		req.nlen = sizeof(req.debug_name);
+
+	if (req.context_init)
+		ret = virgl_renderer_context_create_with_flags(req.hdr.ctx_id,
+				req.context_init, req.nlen, req.debug_name);
+	else
+		ret = virgl_renderer_context_create(req.hdr.ctx_id, req.nlen, req.debug_name);
+	if (ret) {
+		pr_err("%s: failed to create context %d: %d\n", __func__, req.hdr.ctx_id, ret);
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_UNSPEC);
+		return;
+	}
+	virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_OK_NODATA);
+}
+
+static void
+virtio_gpu_virgl_ctx_resource(struct virtio_gpu_virgl_cmd *cmd)
+{
+	struct virtio_gpu_ctx_resource req;
+
+	if (!virtio_gpu_virgl_req(cmd, &req, sizeof(req))) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER);
+		return;
+	}
+	if (req.hdr.type == VIRTIO_GPU_CMD_CTX_ATTACH_RESOURCE)
+		virgl_renderer_ctx_attach_resource(req.hdr.ctx_id, req.resource_id);
+	else
+		virgl_renderer_ctx_detach_resource(req.hdr.ctx_id, req.resource_id);
+	virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_OK_NODATA);
+}
+
+static void
+virtio_gpu_virgl_create_3d(struct virtio_gpu_virgl_cmd *cmd)
+{
+	struct virtio_gpu_resource_create_3d req;
+	struct virgl_renderer_resource_create_args args;
+	struct virtio_gpu_virgl_resource *res;
+	int ret;
+
+	if (!virtio_gpu_virgl_req(cmd, &req, sizeof(req))) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER);
+		return;
+	}
+	if (req.resource_id == 0 || virtio_gpu_virgl_find(cmd->vg, req.resource_id)) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID);
+		return;
+	}
+
+	res = calloc(1, sizeof(*res));
+	if (!res) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY);
+		return;
+	}
+
+	memset(&args, 0, sizeof(args));
+	args.handle = req.resource_id;
+	args.target = req.target;
+	args.format = req.format;
+	args.bind = req.bind;
+	args.width = req.width;
+	args.height = req.height;
+	args.depth = req.depth;
+	args.array_size = req.array_size;
+	args.last_level = req.last_level;
+	args.nr_samples = req.nr_samples;
+	args.flags = req.flags;
+	ret = virgl_renderer_resource_create(&args, NULL, 0);
+	if (ret) {
+		pr_err("%s: failed to create resource %d: %d\n", __func__, req.resource_id, ret);
+		free(res);
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_UNSPEC);
+		return;
+	}
+
+	res->resource_id = req.resource_id;
+	res->dmabuf_fd = -1;
+	LIST_INSERT_HEAD(&cmd->vg->resources, res, link);
+	virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_OK_NODATA);
+}
+
+static void
+virtio_gpu_virgl_submit_3d(struct virtio_gpu_virgl_cmd *cmd)
+{
+	struct virtio_gpu_virgl *vg = cmd->vg;
+	struct virtio_gpu_cmd_submit req;
+	void *buf;
+	int ret;
+
+	if (!virtio_gpu_virgl_req(cmd, &req, sizeof(req)) || (req.size & 3) ||
+	    req.size > VIRTIO_GPU_VIRGL_MAX_CMDBUF) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER);
+		return;
+	}
+	if (req.size > vg->cmdbuf_size) {
+		buf = realloc(vg->cmdbuf, req.size);
+		if (!buf) {
+			virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY);
+			return;
+		}
+		vg->cmdbuf = buf;
+		vg->cmdbuf_size = req.size;
+	}
+	if (virtio_gpu_virgl_copy(cmd, sizeof(req), vg->cmdbuf, req.size) != req.size) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER);
+		return;
+	}
+
+	ret = virgl_renderer_submit_cmd(vg->cmdbuf, req.hdr.ctx_id, req.size / 4);
+	if (ret) {
+		pr_err("%s: context %d rejected its commands: %d\n", __func__,
+			req.hdr.ctx_id, ret);
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER);
+		return;
+	}
+	virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_OK_NODATA);
+}
+
+/* Both directions go through the attached backing */
+static void
+virtio_gpu_virgl_transfer_3d(struct virtio_gpu_virgl_cmd *cmd)
+{
+	struct virtio_gpu_transfer_host_3d req;
+	struct virgl_box box;
+	int ret;
+
+	if (!virtio_gpu_virgl_req(cmd, &req, sizeof(req))) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER);
+		return;
+	}
+	box.x = req.box.x;
+	box.y = req.box.y;
+	box.z = req.box.z;
+	box.w = req.box.w;
+	box.h = req.box.h;
+	box.d = req.box.d;
+	if (req.hdr.type == VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D)
+		ret = virgl_renderer_transfer_write_iov(req.resource_id, req.hdr.ctx_id,
+				req.level, req.stride, req.layer_stride, &box, req.offset, NULL, 0);
+	else
+		ret = virgl_renderer_transfer_read_iov(req.resource_id, req.hdr.ctx_id,
+				req.level, req.stride, req.layer_stride, &box, req.offset, NULL, 0);
+	virtio_gpu_virgl_nodata(cmd, ret ? VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER :
+				VIRTIO_GPU_RESP_OK_NODATA);
+}
+
+static void
+virtio_gpu_virgl_transfer_2d(struct virtio_gpu_virgl_cmd *cmd)
+{
+	struct virtio_gpu_transfer_to_host_2d req;
+	struct virgl_box box;
+	int ret;
+
+	if (!virtio_gpu_virgl_req(cmd, &req, sizeof(req))) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER);
+		return;
+	}
+	box.x = req.r.x;
+	box.y = req.r.y;
+	box.z = 0;
+	box.w = req.r.width;
+	box.h = req.r.height;
+	box.d = 1;
+	ret = virgl_renderer_transfer_write_iov(req.resource_id, 0, 0, 0, 0, &box,
+			req.offset, NULL, 0);
+	virtio_gpu_virgl_nodata(cmd, ret ? VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER :
+				VIRTIO_GPU_RESP_OK_NODATA);
+}
+
+static void
+virtio_gpu_virgl_attach_backing(struct virtio_gpu_virgl_cmd *cmd,
+				struct virtio_gpu_virgl_resource *res)
+{
+	struct virtio_gpu_resource_attach_backing req;
+	struct virtio_gpu_mem_entry entry;
+	struct iovec *iov;
+	size_t offset;
+	int i;
+
+	if (!virtio_gpu_virgl_req(cmd, &req, sizeof(req)) || req.nr_entries == 0 ||
+	    req.nr_entries > VIRTIO_GPU_VIRGL_MAX_ENTRIES || res->iov) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER);
+		return;
+	}
+
+	iov = calloc(req.nr_entries, sizeof(*iov));
+	if (!iov) {
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY);
+		return;
+	}
+	offset = sizeof(req);
+	for (i = 0; i < req.nr_entries; i++, offset += sizeof(entry)) {
+		if (virtio_gpu_virgl_copy(cmd, offset, &entry, sizeof(entry)) != sizeof(entry))
+			break;
+		iov[i].iov_base = paddr_guest2host(cmd->vg->ctx, entry.addr, entry.length);
+		iov[i].iov_len = entry.length;
+		if (!iov[i].iov_base)
+			break;
+	}
+	if (i < req.nr_entries ||
+	    virgl_renderer_resource_attach_iov(req.resource_id, iov, req.nr_entries)) {
+		free(iov);
+		virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER);
+		return;
+	}
+	res->iov = iov;
+	res->iovcnt = req.nr_entries;
+	virtio_gpu_virgl_nodata(cmd, VIRTIO_GPU_RESP_OK_NODATA);
+}
+
+/* Resource commands carry the id first, except TRANSFER_TO_HOST_2D */
+static uint32_t
+virtio_gpu_virgl_resource_id(struct virtio_gpu_virgl_cmd *cmd)
+{
+	struct virtio_gpu_transfer_to_host_2d transfer;
+	uint32_t resource_id;
+
+	if (cmd->hdr.type == VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D) {
+		if (!virtio_gpu_virgl_req(cmd, &transfer, sizeof(transfer)))
+			return 0;
+		return transfer.resource_id;
+	}
+	if (virtio_gpu_virgl_copy(cmd, sizeof(cmd->hdr), &resource_id,
+				  sizeof(resource_id)) != sizeof(resource_id))
+		return 0;
+	return resource_id;
+}
+
+bool
+virtio_gpu_virgl_command(struct virtio_gpu_virgl *vg, struct iovec *iov, int iovcnt,
+			 uint32_t *iolen, bool *fenced)
+{
+	struct virtio_gpu_virgl_cmd cmd;
+	struct virtio_gpu_virgl_resource *res;
+	int ret;
+
+	*fenced = false;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.vg = vg;
+	cmd.iov = iov;
+	cmd.iovcnt = iovcnt;
+	if (iovcnt < 2 || !virtio_gpu_virgl_req(&cmd, &cmd.hdr, sizeof(cmd.hdr)))
+		return false;
+
+	res = NULL;
+	switch (cmd.hdr.type) {
+	case VIRTIO_GPU_CMD_GET_CAPSET_INFO:
+	case VIRTIO_GPU_CMD_GET_CAPSET:
+	case VIRTIO_GPU_CMD_CTX_CREATE:
+	case VIRTIO_GPU_CMD_CTX_DESTROY:
+	case VIRTIO_GPU_CMD_CTX_ATTACH_RESOURCE:
+	case VIRTIO_GPU_CMD_CTX_DETACH_RESOURCE:
+	case VIRTIO_GPU_CMD_RESOURCE_CREATE_3D:
+	case VIRTIO_GPU_CMD_SUBMIT_3D:
+	case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D:
+	case VIRTIO_GPU_CMD_TRANSFER_FROM_HOST_3D:
+		break;
+	case VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING:
+	case VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING:
+	case VIRTIO_GPU_CMD_RESOURCE_UNREF:
+	case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D:
+		/* only for the renderer's resources, the rest are 2D ones */
+		res = virtio_gpu_virgl_find(vg, virtio_gpu_virgl_resource_id(&cmd));
+		if (!res)
+			return false;
+		break;
+	default:
+		return false;
+	}
+
+	if (!virtio_gpu_virgl_start(vg)) {
+		virtio_gpu_virgl_nodata(&cmd, VIRTIO_GPU_RESP_ERR_UNSPEC);
+		*iolen = cmd.iolen;
+		return true;
+	}
+
+	switch (cmd.hdr.type) {
+	case VIRTIO_GPU_CMD_GET_CAPSET_INFO:
+		virtio_gpu_virgl_get_capset_info(&cmd);
+		break;
+	case VIRTIO_GPU_CMD_GET_CAPSET:
+		virtio_gpu_virgl_get_capset(&cmd);
+		break;
+	case VIRTIO_GPU_CMD_CTX_CREATE:
+		virtio_gpu_virgl_ctx_create(&cmd);
+		break;
+	case VIRTIO_GPU_CMD_CTX_DESTROY:
+		virgl_renderer_context_destroy(cmd.hdr.ctx_id);
+		virtio_gpu_virgl_nodata(&cmd, VIRTIO_GPU_RESP_OK_NODATA);
+		break;
+	case VIRTIO_GPU_CMD_CTX_ATTACH_RESOURCE:
+	case VIRTIO_GPU_CMD_CTX_DETACH_RESOURCE:
+		virtio_gpu_virgl_ctx_resource(&cmd);
+		break;
+	case VIRTIO_GPU_CMD_RESOURCE_CREATE_3D:
+		virtio_gpu_virgl_create_3d(&cmd);
+		break;
+	case VIRTIO_GPU_CMD_SUBMIT_3D:
+		virtio_gpu_virgl_submit_3d(&cmd);
+		break;
+	case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D:
+	case VIRTIO_GPU_CMD_TRANSFER_FROM_HOST_3D:
+		virtio_gpu_virgl_transfer_3d(&cmd);
+		break;
+	case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D:
+		virtio_gpu_virgl_transfer_2d(&cmd);
+		break;
+	case VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING:
+		virtio_gpu_virgl_attach_backing(&cmd, res);
+		break;
+	case VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING:
+		virtio_gpu_virgl_detach(res);
+		virtio_gpu_virgl_nodata(&cmd, VIRTIO_GPU_RESP_OK_NODATA);
+		break;
+	case VIRTIO_GPU_CMD_RESOURCE_UNREF:
+		virtio_gpu_virgl_detach(res);
+		virgl_renderer_resource_unref(res->resource_id);
+		virtio_gpu_virgl_free(res);
+		virtio_gpu_virgl_nodata(&cmd, VIRTIO_GPU_RESP_OK_NODATA);
+		break;
+	}
+
+	/* the command completes when the work it queued is done */
+	if (cmd.hdr.flags & VIRTIO_GPU_FLAG_FENCE) {
+		if (cmd.hdr.flags & VIRTIO_GPU_FLAG_INFO_RING_IDX)
+			ret = virgl_renderer_context_create_fence(cmd.hdr.ctx_id, 0,
+					cmd.hdr.ring_idx, cmd.hdr.fence_id);
+		else
+			ret = virgl_renderer_create_fence(cmd.hdr.fence_id, cmd.hdr.ctx_id);
+		*fenced = (ret == 0);
+	}
+	*iolen = cmd.iolen;
+	return true;
+}
+
+bool
+virtio_gpu_virgl_has_resource(struct virtio_gpu_virgl *vg, uint32_t resource_id)
+{
+	return virtio_gpu_virgl_find(vg, resource_id) != NULL;
+}
+
+/* The formats of render targets, virgl numbers them like virtio-gpu */
+static pixman_format_code_t
+virtio_gpu_virgl_pixman_format(uint32_t format)
+{
+	switch (format) {
+	case VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM:
+		return PIXMAN_x8r8g8b8;
+	case VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM:
+		return PIXMAN_a8r8g8b8;
+	case VIRTIO_GPU_FORMAT_R8G8B8X8_UNORM:
+		return PIXMAN_x8b8g8r8;
+	case VIRTIO_GPU_FORMAT_R8G8B8A8_UNORM:
+		return PIXMAN_a8b8g8r8;
+	case VIRTIO_GPU_VIRGL_FORMAT_B5G6R5_UNORM:
+		return PIXMAN_r5g6b5;
+	case VIRTIO_GPU_VIRGL_FORMAT_B5G5R5A1_UNORM:
+		return PIXMAN_a1r5g5b5;
+	default:
+		return 0;
+	}
+}
+
+int
+virtio_gpu_virgl_surface(struct virtio_gpu_virgl *vg, uint32_t resource_id,
+			 uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+			 struct surface *surf)
+{
+	struct virtio_gpu_virgl_resource *res;
+	struct virgl_renderer_resource_info info;
+	pixman_format_code_t format;
+	struct virgl_box box;
+	struct iovec iov;
+	uint32_t stride, bpp;
+	size_t size;
+	void *pixels;
+	int fd, dmabuf_stride, dmabuf_offset;
+
+	res = virtio_gpu_virgl_find(vg, resource_id);
+	if (!res || !vg->started || virgl_renderer_resource_get_info(resource_id, &info))
+		return -1;
+	if (x + width > info.width || y + height > info.height)
+		return -1;
+
+	memset(surf, 0, sizeof(*surf));
+	surf->x = x;
+	surf->y = y;
+	surf->width = width;
+	surf->height = height;
+
+	if (res->dmabuf_fd < 0 && !res->no_export) {
+		if (virgl_renderer_get_fd_for_texture2(info.tex_id, &fd, &dmabuf_stride,
+						       &dmabuf_offset) == 0) {
+			res->dmabuf_fd = fd;
+			res->dmabuf_stride = dmabuf_stride;
+			res->dmabuf_offset = dmabuf_offset;
+		} else {
+			pr_info("%s: resource %d is not exportable, reading it back\n",
+				__func__, resource_id);
+			res->no_export = true;
+		}
+	}
+	format = virtio_gpu_virgl_pixman_format(info.virgl_format);
+	bpp = format ? PIXMAN_FORMAT_BPP(format) / 8 : 4;
+	if (res->dmabuf_fd >= 0) {
+		surf->surf_type = SURFACE_DMABUF;
+		surf->surf_format = format;
+		surf->stride = res->dmabuf_stride;
+		surf->dma_info.dmabuf_fd = res->dmabuf_fd;
+		surf->dma_info.surf_fourcc = info.drm_fourcc;
+		surf->dma_info.dmabuf_offset = res->dmabuf_offset +
+			y * res->dmabuf_stride + x * bpp;
+		return 0;
+	}
+
+	if (!format)
+		return -1;
+	stride = (info.width * bpp + 3) & ~3U;
+	size = (size_t)stride * info.height;
+	if (size > res->pixels_size) {
+		pixels = realloc(res->pixels, size);
+		if (!pixels)
+			return -1;
+		res->pixels = pixels;
+		res->pixels_size = size;
+	}
+
+	box.x = x;
+	box.y = y;
+	box.z = 0;
+	box.w = width;
+	box.h = height;
+	box.d = 1;
+	iov.iov_base = res->pixels;
+	iov.iov_len = size;
+	if (virgl_renderer_transfer_read_iov(resource_id, 0, 0, stride, 0, &box,
+					     (uint64_t)y * stride + x * bpp, &iov, 1))
+		return -1;
+
+	surf->surf_type = SURFACE_PIXMAN;
+	surf->shm_info.memfd = -1;
+	surf->surf_format = format;
+	surf->bpp = bpp * 8;
+	surf->stride = stride;
+	surf->pixel = (char *)res->pixels + y * stride + x * bpp;
+	return 0;
+}
+
+void
+virtio_gpu_virgl_poll(struct virtio_gpu_virgl *vg)
+{
+	if (vg->started)
+		virgl_renderer_poll();
+}
+
+/* Venus contexts retire their fences on a thread of their own, not on it */
+int
+virtio_gpu_virgl_poll_fd(struct virtio_gpu_virgl *vg)
+{
+	if (!vg->started || vg->venus)
+		return -1;
+	return virgl_renderer_get_poll_fd();
+}
+
+int
+virtio_gpu_virgl_num_capsets(void)
+{
+	return VIRTIO_GPU_VIRGL_NUM_CAPSETS;
+}
+
+struct virtio_gpu_virgl *
+virtio_gpu_virgl_create(struct vmctx *ctx, virtio_gpu_virgl_fence_cb fence_cb, void *data)
+{
+	struct virtio_gpu_virgl *vg;
+
+	vg = calloc(1, sizeof(*vg));
+	if (!vg)
+		return NULL;
+	vg->ctx = ctx;
+	vg->fence_cb = fence_cb;
+	vg->data = data;
+	LIST_INIT(&vg->resources);
+	return vg;
+}
+
+/* Drops every resource and context, from the display thread */
+void
+virtio_gpu_virgl_reset(struct virtio_gpu_virgl *vg)
+{
+	struct virtio_gpu_virgl_resource *res;
+
+	while ((res = LIST_FIRST(&vg->resources)) != NULL)
+		virtio_gpu_virgl_free(res);
+	if (vg->started)
+		virgl_renderer_reset();
+}
+
+void
+virtio_gpu_virgl_destroy(struct virtio_gpu_virgl *vg)
+{
+	virtio_gpu_virgl_reset(vg);
+	if (vg->started)
+		virgl_renderer_cleanup(vg);
+	free(vg->cmdbuf);
+	free(vg);
+}
@@ -0,0 +1,67 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * virtio-gpu 3D commands through virglrenderer
+ *
+ */
+#ifndef __VIRTIO_GPU_VIRGL_H__
+#define __VIRTIO_GPU_VIRGL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include "vdisplay.h"
+
+/*
+ * VIRTIO_GPU_F_VIRGL support, built into acrn-virtio-gpu-virgl with
+ * WITH_VIRGL. virglrenderer renders in a surfaceless EGL context of its
+ * own, so it needs no window system and runs on Mesa llvmpipe where there
+ * is no GPU.
+ *
+ * The renderer owns the resources created by RESOURCE_CREATE_3D, the 3D
+ * contexts and the capsets; 2D and blob resources stay with virtio-gpu.
+ * Everything here runs on the display thread, which is also where the
+ * renderer's GL context is current: it is set up by the first command.
+ *
+ * Fenced commands get a renderer fence. The renderer reports it done from
+ * virtio_gpu_virgl_poll(), through the fence callback, with ring
+ * VIRTIO_GPU_VIRGL_RING_GLOBAL for fences that are not on a context ring.
+ * virtio_gpu_virgl_poll_fd() is an eventfd that counts the fences signalled
+ * since, -1 if the renderer is not started or can only be polled.
+ */
+#define VIRTIO_GPU_VIRGL_RING_GLOBAL	0xffffffff
+
+struct virtio_gpu_virgl;
+struct vmctx;
+
+typedef void (*virtio_gpu_virgl_fence_cb)(void *data, uint32_t ctx_id, uint32_t ring,
+					  uint64_t fence_id);
+
+struct virtio_gpu_virgl *virtio_gpu_virgl_create(struct vmctx *ctx,
+		virtio_gpu_virgl_fence_cb fence_cb, void *data);
+void virtio_gpu_virgl_destroy(struct virtio_gpu_virgl *vg);
+void virtio_gpu_virgl_reset(struct virtio_gpu_virgl *vg);
+int virtio_gpu_virgl_num_capsets(void);
+
+/*
+ * Handles the command if it is the renderer's: returns true with the
+ * response written and *iolen set, and *fenced if a renderer fence now
+ * stands for the command.
+ */
+bool virtio_gpu_virgl_command(struct virtio_gpu_virgl *vg, struct iovec *iov, int iovcnt,
+			      uint32_t *iolen, bool *fenced);
+bool virtio_gpu_virgl_has_resource(struct virtio_gpu_virgl *vg, uint32_t resource_id);
+
+/*
+ * What to show of a renderer resource: its texture exported as a dmabuf,
+ * or, if the renderer cannot export it, the pixels of the rectangle read
+ * back into a buffer the resource keeps.
+ */
+int virtio_gpu_virgl_surface(struct virtio_gpu_virgl *vg, uint32_t resource_id,
+			     uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+			     struct surface *surf);
+void virtio_gpu_virgl_poll(struct virtio_gpu_virgl *vg);
+int virtio_gpu_virgl_poll_fd(struct virtio_gpu_virgl *vg);
+
+#endif /* __VIRTIO_GPU_VIRGL_H__ */
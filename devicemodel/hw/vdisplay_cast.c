@@ -0,0 +1,463 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Remote cast of the screens, over the TCP control socket
+ *
+ * A receiver connects to the control port and sends DPY_EVENT_START_CAST
+ * with a dpy_cast_req. The screen then gets a sender thread, which waits
+ * for the screen to change, hashes its tiles (see vdisplay_damage.h),
+ * deflates those that changed since the last frame sent and writes them
+ * to the socket.
+ *
+ * The lane of the screen only marks it changed, so a slow link never holds
+ * up the screen or its sink: the updates that come while a frame is being
+ * written fold into the next one, and the frame rate falls to what the link
+ * carries. max_fps caps it further.
+ *
+ * misc/debug_tools/acrn_cast is a receiver.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <linux/dma-buf.h>
+#include <zlib.h>
+
+#include "log.h"
+#include "vdisplay.h"
+#include "vdisplay_protocol.h"
+#include "vdisplay_sink.h"
+#include "vdisplay_damage.h"
+
+#define CAST_POLL_MS    100
+
+struct cast_screen {
+    TAILQ_ENTRY(cast_screen) link;
+    int handle;
+    int scanout_id;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t tid;
+    int sock;                   /* of the receiver, -1 if none */
+    uint64_t min_interval_ns;
+    /* the surface set last, its fd a dup */
+    bool has_surface;
+    bool new_surface;           /* the receiver does not have it yet */
+    struct surface surf;
+    bool dirty;
+    uint32_t updates;
+    /* sender thread only */
+    struct vdpy_tiles tiles;
+    uint8_t *raw;
+    size_t raw_cap;
+    uint8_t *z;
+    size_t z_cap;
+    uint32_t seq;
+    uint64_t last_ns;
+    uint64_t log_ns;
+    uint32_t frames;
+    uint64_t raw_bytes;
+    uint64_t z_bytes;
+};
+
+static TAILQ_HEAD(cast_list, cast_screen) cast_screens = TAILQ_HEAD_INITIALIZER(cast_screens);
+static pthread_mutex_t cast_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+cast_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int *
+cast_surface_fd(struct surface *surf)
+{
+    if (surf->surf_type == SURFACE_PIXMAN)
+        return &surf->shm_info.memfd;
+    return &surf->dma_info.dmabuf_fd;
+}
+
+/* Writes all of buf, unless the receiver is detached meanwhile */
+static int
+cast_write(struct cast_screen *scr, int fd, const void *buf, size_t len, int flags)
+{
+    const uint8_t *p = buf;
+    struct pollfd pfd;
+    ssize_t ret;
+
+    while (len) {
+        if (__atomic_load_n(&scr->sock, __ATOMIC_ACQUIRE) != fd)
+            return -1;
+        ret = send(fd, p, len, flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (ret > 0) {
+            p += ret;
+            len -= ret;
+            continue;
+        }
+        if ((ret < 0) && (errno == EINTR))
+            continue;
+        if ((ret < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+            return -1;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        poll(&pfd, 1, CAST_POLL_MS);
+    }
+    return 0;
+}
+
+static int
+cast_send(struct cast_screen *scr, int fd, int type, const void *body, int body_size,
+          const void *data, int data_size)
+{
+    struct dpy_evt_header hdr;
+
+    hdr.e_type = type;
+    hdr.e_magic = DISPLAY_MAGIC_CODE;
+    hdr.e_size = body_size + data_size;
+    if (cast_write(scr, fd, &hdr, sizeof(hdr), MSG_MORE) ||
+        cast_write(scr, fd, body, body_size, data_size ? MSG_MORE : 0))
+        return -1;
+    return data_size ? cast_write(scr, fd, data, data_size, 0) : 0;
+}
+
+static int
+cast_reserve(uint8_t **buf, size_t *cap, size_t size)
+{
+    uint8_t *p;
+
+    if (size <= *cap)
+        return 0;
+    p = realloc(*buf, size);
+    if (!p)
+        return -1;
+    *buf = p;
+    *cap = size;
+    return 0;
+}
+
+/*
+ * Deflates the tiles that changed into z. A new surface has all of them
+ * changed already; otherwise it is hashed again first. Returns the number
+ * of tiles, 0 if none changed or -1.
+ */
+static int
+cast_encode(struct cast_screen *scr, bool rescan, struct dpy_cast_tiles *hdr, uLongf *z_len)
+{
+    struct vdpy_tiles *t = &scr->tiles;
+    struct dma_buf_sync sync;
+    uint32_t i, count, tx, ty, tw, th, y;
+    const uint8_t *src;
+    uint32_t *index;
+    uint8_t *dst;
+    size_t size;
+
+    if (rescan && (vdpy_tiles_update(t, NULL) < 0))
+        return -1;
+    if (!t->map || !t->dirty)
+        return -1;
+
+    count = 0;
+    size = 0;
+    for (i = 0; i < t->cols * t->rows; i++) {
+        if (!t->dirty[i])
+            continue;
+        tx = i % t->cols;
+        ty = i / t->cols;
+        tw = MIN(VDPY_TILE, t->width - tx * VDPY_TILE);
+        th = MIN(VDPY_TILE, t->height - ty * VDPY_TILE);
+        size += sizeof(*index) + (size_t)tw * th * t->bpp;
+        count++;
+    }
+    if (!count)
+        return 0;
+    *z_len = compressBound(size);
+    if (cast_reserve(&scr->raw, &scr->raw_cap, size) ||
+        cast_reserve(&scr->z, &scr->z_cap, *z_len))
+        return -1;
+
+    if (t->dmabuf_fd >= 0) {
+        sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+        ioctl(t->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+    index = (uint32_t *)scr->raw;
+    dst = scr->raw + count * sizeof(*index);
+    for (i = 0; i < t->cols * t->rows; i++) {
+        if (!t->dirty[i])
+            continue;
+        *index++ = i;
+        tx = i % t->cols;
+        ty = i / t->cols;
+        tw = MIN(VDPY_TILE, t->width - tx * VDPY_TILE) * t->bpp;
+        th = MIN(VDPY_TILE, t->height - ty * VDPY_TILE);
+        src = (const uint8_t *)t->map + t->offset +
+              (size_t)ty * VDPY_TILE * t->stride + tx * VDPY_TILE * t->bpp;
+        for (y = 0; y < th; y++, src += t->stride, dst += tw)
+            memcpy(dst, src, tw);
+    }
+    if (t->dmabuf_fd >= 0) {
+        sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+        ioctl(t->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+
+    if (compress2(scr->z, z_len, scr->raw, size, Z_BEST_SPEED) != Z_OK)
+        return -1;
+    hdr->scanout_id = scr->scanout_id;
+    hdr->seq = ++scr->seq;
+    hdr->count = count;
+    hdr->raw_size = size;
+    return count;
+}
+
+static void
+cast_log(struct cast_screen *scr, uint64_t now)
+{
+    uint32_t updates;
+
+    if (!scr->log_ns)
+        scr->log_ns = now;
+    if (now - scr->log_ns < VDPY_FRAME_WINDOW_NS)
+        return;
+
+    pthread_mutex_lock(&scr->mutex);
+    updates = scr->updates;
+    scr->updates = 0;
+    pthread_mutex_unlock(&scr->mutex);
+    pr_info("vdpy %d.%d: cast %u frames for %u updates, %lu kB/s, deflated to %lu%%\n",
+            scr->handle, scr->scanout_id, scr->frames, updates,
+            scr->z_bytes * 1000000 / (now - scr->log_ns),
+            scr->raw_bytes ? scr->z_bytes * 100 / scr->raw_bytes : 0);
+    scr->log_ns = now;
+    scr->frames = 0;
+    scr->raw_bytes = scr->z_bytes = 0;
+}
+
+static void *
+cast_thread(void *data)
+{
+    struct cast_screen *scr = (struct cast_screen *)data;
+    struct dpy_cast_surface cs;
+    struct dpy_cast_tiles ct;
+    uint64_t now, wait_ns;
+    bool new_surface;
+    uLongf z_len;
+    int fd, ret;
+
+    pthread_mutex_lock(&scr->mutex);
+    while (scr->sock >= 0) {
+        if (!scr->dirty || !scr->has_surface) {
+            pthread_cond_wait(&scr->cond, &scr->mutex);
+            continue;
+        }
+        now = cast_now_ns();
+        if (scr->last_ns && (now - scr->last_ns < scr->min_interval_ns)) {
+            wait_ns = scr->min_interval_ns - (now - scr->last_ns);
+            pthread_mutex_unlock(&scr->mutex);
+            usleep(wait_ns / 1000);
+            pthread_mutex_lock(&scr->mutex);
+            continue;
+        }
+        scr->dirty = false;
+        fd = scr->sock;
+        new_surface = scr->new_surface;
+        if (new_surface) {
+            scr->new_surface = false;
+            vdpy_tiles_set(&scr->tiles, &scr->surf);
+            cs.scanout_id = scr->scanout_id;
+            cs.width = scr->tiles.width;
+            cs.height = scr->tiles.height;
+            cs.bpp = scr->tiles.bpp;
+            cs.format = scr->surf.surf_format;
+            cs.tile = VDPY_TILE;
+        }
+        pthread_mutex_unlock(&scr->mutex);
+
+        if (new_surface)
+            cast_send(scr, fd, DPY_EVENT_CAST_SURFACE, &cs, sizeof(cs), NULL, 0);
+        ret = cast_encode(scr, !new_surface, &ct, &z_len);
+        if ((ret > 0) &&
+            !cast_send(scr, fd, DPY_EVENT_CAST_TILES, &ct, sizeof(ct), scr->z, z_len)) {
+            scr->frames++;
+            scr->raw_bytes += ct.raw_size;
+            scr->z_bytes += z_len;
+        }
+        scr->last_ns = now;
+        cast_log(scr, cast_now_ns());
+
+        pthread_mutex_lock(&scr->mutex);
+    }
+    pthread_mutex_unlock(&scr->mutex);
+    return NULL;
+}
+
+/* Called with cast_mutex held */
+static bool
+cast_stop(struct cast_screen *scr)
+{
+    pthread_mutex_lock(&scr->mutex);
+    if (scr->sock < 0) {
+        pthread_mutex_unlock(&scr->mutex);
+        return false;
+    }
+    __atomic_store_n(&scr->sock, -1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&scr->cond);
+    pthread_mutex_unlock(&scr->mutex);
+    pthread_join(scr->tid, NULL);
+
+    vdpy_tiles_release(&scr->tiles);
+    free(scr->raw);
+    free(scr->z);
+    scr->raw = scr->z = NULL;
+    scr->raw_cap = scr->z_cap = 0;
+    pr_info("vdpy %d.%d: cast stopped\n", scr->handle, scr->scanout_id);
+    return true;
+}
+
+int
+vdpy_cast_attach(int sock, const struct dpy_cast_req *req)
+{
+    struct cast_screen *scr;
+    char name[16];
+
+    pthread_mutex_lock(&cast_mutex);
+    TAILQ_FOREACH(scr, &cast_screens, link)
+        if (scr->scanout_id == (int)req->scanout_id)
+            break;
+    if (!scr) {
+        pthread_mutex_unlock(&cast_mutex);
+        pr_err("%s: no screen %u to cast\n", __func__, req->scanout_id);
+        return -1;
+    }
+    cast_stop(scr);
+
+    pthread_mutex_lock(&scr->mutex);
+    scr->sock = sock;
+    scr->min_interval_ns = req->max_fps ? 1000000000ULL / req->max_fps : 0;
+    scr->new_surface = scr->dirty = scr->has_surface;
+    scr->updates = 0;
+    pthread_mutex_unlock(&scr->mutex);
+    scr->seq = 0;
+    scr->last_ns = scr->log_ns = 0;
+    scr->frames = 0;
+    scr->raw_bytes = scr->z_bytes = 0;
+    vdpy_tiles_init(&scr->tiles, "cast", scr->handle, scr->scanout_id);
+    scr->tiles.track = true;
+    if (pthread_create(&scr->tid, NULL, cast_thread, scr)) {
+        scr->sock = -1;
+        pthread_mutex_unlock(&cast_mutex);
+        pr_err("%s: can not start the cast of screen %u\n", __func__, req->scanout_id);
+        return -1;
+    }
+    snprintf(name, sizeof(name), "acrn_cast%d_%d", scr->handle, scr->scanout_id);
+    pthread_setname_np(scr->tid, name);
+    pthread_mutex_unlock(&cast_mutex);
+
+    pr_info("vdpy %d.%d: cast to socket %d, at most %u fps\n", scr->handle,
+            scr->scanout_id, sock, req->max_fps);
+    return 0;
+}
+
+bool
+vdpy_cast_detach(int sock)
+{
+    struct cast_screen *scr;
+    bool found = false;
+
+    pthread_mutex_lock(&cast_mutex);
+    TAILQ_FOREACH(scr, &cast_screens, link)
+        if (scr->sock == sock)
+            found = cast_stop(scr) || found;
+    pthread_mutex_unlock(&cast_mutex);
+    return found;
+}
+
+static void *
+cast_open(int handle, int scanout_id, const char *args __attribute__((unused)))
+{
+    struct cast_screen *scr;
+
+    scr = calloc(1, sizeof(*scr));
+    if (!scr)
+        return NULL;
+    scr->handle = handle;
+    scr->scanout_id = scanout_id;
+    scr->sock = -1;
+    pthread_mutex_init(&scr->mutex, NULL);
+    pthread_cond_init(&scr->cond, NULL);
+
+    pthread_mutex_lock(&cast_mutex);
+    TAILQ_INSERT_TAIL(&cast_screens, scr, link);
+    pthread_mutex_unlock(&cast_mutex);
+    return scr;
+}
+
+static void
+cast_close(void *priv)
+{
+    struct cast_screen *scr = (struct cast_screen *)priv;
+
+    pthread_mutex_lock(&cast_mutex);
+    cast_stop(scr);
+    TAILQ_REMOVE(&cast_screens, scr, link);
+    pthread_mutex_unlock(&cast_mutex);
+
+    if (scr->has_surface)
+        close(*cast_surface_fd(&scr->surf));
+    pthread_mutex_destroy(&scr->mutex);
+    pthread_cond_destroy(&scr->cond);
+    free(scr);
+}
+
+static int
+cast_surface_set(void *priv, struct surface *surf, struct dpy_frame_timing *t __attribute__((unused)))
+{
+    struct cast_screen *scr = (struct cast_screen *)priv;
+    int fd;
+
+    fd = dup(*cast_surface_fd(surf));
+    pthread_mutex_lock(&scr->mutex);
+    if (scr->has_surface)
+        close(*cast_surface_fd(&scr->surf));
+    scr->surf = *surf;
+    *cast_surface_fd(&scr->surf) = fd;
+    scr->has_surface = (fd >= 0);
+    scr->new_surface = scr->dirty = scr->has_surface;
+    pthread_cond_signal(&scr->cond);
+    pthread_mutex_unlock(&scr->mutex);
+    return 0;
+}
+
+static int
+cast_surface_update(void *priv, struct surface *surf __attribute__((unused)),
+                    uint64_t sent_ns __attribute__((unused)),
+                    struct dpy_frame_timing *t __attribute__((unused)))
+{
+    struct cast_screen *scr = (struct cast_screen *)priv;
+
+    pthread_mutex_lock(&scr->mutex);
+    scr->dirty = true;
+    scr->updates++;
+    pthread_cond_signal(&scr->cond);
+    pthread_mutex_unlock(&scr->mutex);
+    return 0;
+}
+
+const struct vdpy_sink_ops vdpy_sink_cast = {
+    .name = "cast",
+    .open = cast_open,
+    .close = cast_close,
+    .surface_set = cast_surface_set,
+    .surface_update = cast_surface_update,
+};
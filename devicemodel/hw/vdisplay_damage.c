@@ -0,0 +1,375 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Damage of full frame updates, from tile hashes
+ *
+ * A frame is read row by row, as the memory lies, and each row adds its
+ * part of every tile to the hash of that tile. With SSE4.2 the hash is a
+ * CRC32C, 8 bytes per instruction, in four chains per tile row that the CPU
+ * runs side by side. Without it, a multiply-xor hash does the same job.
+ *
+ * Built with -DVDPY_DAMAGE_BENCH, this file is also a benchmark of the pass
+ * on a 3840x2160 frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "log.h"
+#include "vdisplay.h"
+#include "vdisplay_damage.h"
+
+#define VDPY_TILES_4K_PIXELS	(3840ULL * 2160ULL)
+
+typedef uint32_t (*tiles_hash_fn)(uint32_t h, const uint8_t *p, size_t len);
+
+static tiles_hash_fn tiles_hash;
+static const char *tiles_hash_name;
+
+static uint64_t
+tiles_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t
+tiles_hash_soft(uint32_t h, const uint8_t *p, size_t len)
+{
+    uint64_t w, x = h;
+
+    for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+        memcpy(&w, p, sizeof(w));
+        x = (x ^ w) * 0x100000001b3ULL;
+    }
+    for (; len; p++, len--)
+        x = (x ^ *p) * 0x100000001b3ULL;
+    return (uint32_t)(x ^ (x >> 32));
+}
+
+#if defined(__x86_64__)
+/* four chains of every fourth word, as one crc32 waits for the one before */
+__attribute__((target("sse4.2")))
+static uint32_t
+tiles_hash_crc32c(uint32_t h, const uint8_t *p, size_t len)
+{
+    uint64_t w[4], x0 = h, x1 = 0, x2 = 0, x3 = 0;
+
+    for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+        memcpy(w, p, sizeof(w));
+        x0 = _mm_crc32_u64(x0, w[0]);
+        x1 = _mm_crc32_u64(x1, w[1]);
+        x2 = _mm_crc32_u64(x2, w[2]);
+        x3 = _mm_crc32_u64(x3, w[3]);
+    }
+    x0 = _mm_crc32_u64(x0, x1 | (x2 << 32));
+    x0 = _mm_crc32_u64(x0, x3);
+    for (; len >= sizeof(w[0]); p += sizeof(w[0]), len -= sizeof(w[0])) {
+        memcpy(w, p, sizeof(w[0]));
+        x0 = _mm_crc32_u64(x0, w[0]);
+    }
+    for (; len; p++, len--)
+        x0 = _mm_crc32_u8((uint32_t)x0, *p);
+    return (uint32_t)x0;
+}
+#endif
+
+static void
+tiles_hash_select(void)
+{
+    if (tiles_hash)
+        return;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        tiles_hash = tiles_hash_crc32c;
+        tiles_hash_name = "crc32c";
+        return;
+    }
+#endif
+    tiles_hash = tiles_hash_soft;
+    tiles_hash_name = "soft";
+}
+
+bool
+vdpy_tiles_enabled(void)
+{
+    const char *env = getenv("VDPY_TILE_DAMAGE");
+
+    if (!env || !atoi(env))
+        return false;
+    tiles_hash_select();
+    pr_info("vdpy: damage of full updates from %dx%d tile hashes (%s)\n",
+            VDPY_TILE, VDPY_TILE, tiles_hash_name);
+    return true;
+}
+
+void
+vdpy_tiles_init(struct vdpy_tiles *t, const char *name, int handle, int scanout_id)
+{
+    memset(t, 0, sizeof(*t));
+    t->name = name;
+    t->handle = handle;
+    t->scanout_id = scanout_id;
+    t->dmabuf_fd = -1;
+}
+
+void
+vdpy_tiles_release(struct vdpy_tiles *t)
+{
+    if (t->map)
+        munmap(t->map, t->map_size);
+    if (t->dmabuf_fd >= 0)
+        close(t->dmabuf_fd);
+    free(t->hash);
+    free(t->dirty);
+    t->map = NULL;
+    t->map_size = 0;
+    t->dmabuf_fd = -1;
+    t->hash = NULL;
+    t->dirty = NULL;
+    t->cols = t->rows = 0;
+}
+
+/*
+ * Hashes all the tiles of a frame into hash[] and returns how many differ
+ * from what was there, with their bounding rectangle in *damage.
+ */
+static uint32_t
+tiles_diff(struct vdpy_tiles *t, const uint8_t *pixels, struct surface *damage)
+{
+    uint32_t *cur = t->hash + t->cols * t->rows;
+    uint32_t x1 = UINT32_MAX, y1 = UINT32_MAX, x2 = 0, y2 = 0;
+    uint32_t row_bytes, tile_bytes, last_bytes;
+    uint32_t tx, ty, y, y_end, changed = 0;
+    const uint8_t *row;
+
+    tile_bytes = VDPY_TILE * t->bpp;
+    row_bytes = t->width * t->bpp;
+    last_bytes = row_bytes - (t->cols - 1) * tile_bytes;
+    for (ty = 0; ty < t->rows; ty++) {
+        for (tx = 0; tx < t->cols; tx++)
+            cur[tx] = ~0U;
+        y_end = (ty + 1) * VDPY_TILE;
+        if (y_end > t->height)
+            y_end = t->height;
+        for (y = ty * VDPY_TILE; y < y_end; y++) {
+            row = pixels + (size_t)y * t->stride;
+            for (tx = 0; tx < t->cols - 1; tx++)
+                cur[tx] = tiles_hash(cur[tx], row + tx * tile_bytes, tile_bytes);
+            cur[tx] = tiles_hash(cur[tx], row + tx * tile_bytes, last_bytes);
+        }
+        for (tx = 0; tx < t->cols; tx++) {
+            if (t->dirty)
+                t->dirty[ty * t->cols + tx] = 0;
+            if (!t->invalid && (cur[tx] == t->hash[ty * t->cols + tx]))
+                continue;
+            if (t->dirty)
+                t->dirty[ty * t->cols + tx] = 1;
+            t->hash[ty * t->cols + tx] = cur[tx];
+            changed++;
+            x1 = (tx < x1) ? tx : x1;
+            x2 = (tx + 1 > x2) ? tx + 1 : x2;
+            y1 = (ty < y1) ? ty : y1;
+            y2 = ty + 1;
+        }
+    }
+    t->invalid = false;
+    if (changed && damage) {
+        damage->damage.x = x1 * VDPY_TILE;
+        damage->damage.y = y1 * VDPY_TILE;
+        damage->damage.width = ((x2 * VDPY_TILE > t->width) ? t->width : x2 * VDPY_TILE) -
+                               damage->damage.x;
+        damage->damage.height = ((y2 * VDPY_TILE > t->height) ? t->height : y2 * VDPY_TILE) -
+                                damage->damage.y;
+    }
+    return changed;
+}
+
+/* One pass over the mapped surface; -1 if there is none */
+static int
+tiles_scan(struct vdpy_tiles *t, struct surface *damage)
+{
+    struct dma_buf_sync sync;
+    uint64_t start, now;
+    uint32_t changed;
+
+    if (!t->map || !t->hash)
+        return -1;
+
+    start = tiles_now_ns();
+    if (t->dmabuf_fd >= 0) {
+        sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+        ioctl(t->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+    changed = tiles_diff(t, (const uint8_t *)t->map + t->offset, damage);
+    if (t->dmabuf_fd >= 0) {
+        sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+        ioctl(t->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+    now = tiles_now_ns();
+
+    t->frames++;
+    t->pixels += (uint64_t)t->width * t->height;
+    t->hash_ns += now - start;
+    t->changed += changed;
+    t->tiles += t->cols * t->rows;
+    if (!t->log_ns)
+        t->log_ns = now;
+    if (now - t->log_ns >= VDPY_FRAME_WINDOW_NS) {
+        pr_info("vdpy %d.%d: %s tile hash %lu frames, %lu us per 4K frame, %lu%% tiles changed\n",
+                t->handle, t->scanout_id, t->name, t->frames,
+                t->hash_ns * VDPY_TILES_4K_PIXELS / t->pixels / 1000,
+                t->changed * 100 / t->tiles);
+        t->log_ns = now;
+        t->frames = t->pixels = t->hash_ns = t->changed = t->tiles = 0;
+    }
+    return changed ? 1 : 0;
+}
+
+/*
+ * Maps a surface set and hashes it, as what the next updates differ from.
+ * All its tiles count as changed.
+ */
+void
+vdpy_tiles_set(struct vdpy_tiles *t, struct surface *surf)
+{
+    off_t size;
+    int fd;
+
+    tiles_hash_select();
+    vdpy_tiles_release(t);
+    t->width = surf->width;
+    t->height = surf->height;
+    t->stride = surf->stride;
+    t->bpp = PIXMAN_FORMAT_BPP(surf->surf_format) / 8;
+    if (surf->surf_type == SURFACE_DMABUF) {
+        fd = surf->dma_info.dmabuf_fd;
+        t->offset = surf->dma_info.dmabuf_offset;
+        if (!t->bpp)
+            t->bpp = 4;     /* a dmabuf without a format is 32 bit */
+    } else {
+        fd = surf->shm_info.memfd;
+        t->offset = surf->shm_info.offset;
+    }
+    if (!t->width || !t->height || (t->width * t->bpp > t->stride))
+        return;
+
+    size = lseek(fd, 0, SEEK_END);
+    if ((size <= 0) || (t->offset + (uint64_t)t->stride * t->height > (uint64_t)size)) {
+        pr_dbg("%s: surface does not fit in its buffer\n", __func__);
+        return;
+    }
+    t->map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (t->map == MAP_FAILED) {
+        pr_dbg("%s: can not map the surface %s\n", __func__, strerror(errno));
+        t->map = NULL;
+        return;
+    }
+    t->map_size = size;
+    if (surf->surf_type == SURFACE_DMABUF)
+        t->dmabuf_fd = dup(fd);
+
+    t->cols = (t->width + VDPY_TILE - 1) / VDPY_TILE;
+    t->rows = (t->height + VDPY_TILE - 1) / VDPY_TILE;
+    /* with a row of scratch hashes at the end */
+    t->hash = calloc(t->cols * (t->rows + 1), sizeof(*t->hash));
+    if (t->track)
+        t->dirty = calloc(t->cols * t->rows, sizeof(*t->dirty));
+    if (!t->hash || (t->track && !t->dirty)) {
+        vdpy_tiles_release(t);
+        return;
+    }
+    t->invalid = true;
+    tiles_scan(t, NULL);
+}
+
+int
+vdpy_tiles_update(struct vdpy_tiles *t, struct surface *surf)
+{
+    return tiles_scan(t, surf);
+}
+
+#ifdef VDPY_DAMAGE_BENCH
+#include <stdarg.h>
+
+void
+output_log(uint8_t level, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+/*
+ * Hashes a 3840x2160 XRGB frame in which one pixel changes each time, as
+ * the pass reads the whole frame whatever changed.
+ */
+static void
+bench_run(struct vdpy_tiles *t, uint8_t *pixels, const char *name)
+{
+    struct surface damage;
+    const int n = 100;
+    uint64_t start, ns;
+    uint32_t changed = 0;
+    int i;
+
+    tiles_diff(t, pixels, NULL);
+    start = tiles_now_ns();
+    for (i = 0; i < n; i++) {
+        pixels[(size_t)(i * 17 % t->height) * t->stride + (i * 61 % t->width) * t->bpp] ^= 1;
+        changed += tiles_diff(t, pixels, &damage);
+    }
+    ns = (tiles_now_ns() - start) / n;
+    printf("%-8s %6lu us per 4K frame, %.1f GB/s, %u of %u tiles changed\n", name,
+           ns / 1000, (double)t->stride * t->height / ns, changed / n, t->cols * t->rows);
+}
+
+int
+main(void)
+{
+    struct vdpy_tiles t;
+    uint8_t *pixels;
+    size_t size, i;
+
+    vdpy_tiles_init(&t, "bench", 0, 0);
+    t.width = 3840;
+    t.height = 2160;
+    t.bpp = 4;
+    t.stride = t.width * t.bpp;
+    t.cols = (t.width + VDPY_TILE - 1) / VDPY_TILE;
+    t.rows = (t.height + VDPY_TILE - 1) / VDPY_TILE;
+    size = (size_t)t.stride * t.height;
+    pixels = malloc(size);
+    t.hash = calloc(t.cols * (t.rows + 1), sizeof(*t.hash));
+    if (!pixels || !t.hash)
+        return 1;
+    for (i = 0; i < size; i++)
+        pixels[i] = (uint8_t)((i * 2654435761U) >> 24);
+
+    tiles_hash = tiles_hash_soft;
+    bench_run(&t, pixels, "soft");
+    tiles_hash = NULL;
+    tiles_hash_select();
+    if (tiles_hash != tiles_hash_soft)
+        bench_run(&t, pixels, tiles_hash_name);
+    free(t.hash);
+    free(pixels);
+    return 0;
+}
+#endif
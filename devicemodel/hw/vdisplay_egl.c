@@ -42,8 +42,6 @@
 	} \
 }
 
-#define VDPY_MAX_WIDTH 3840
-#define VDPY_MAX_HEIGHT 2160
 #define VDPY_DEFAULT_WIDTH 1024
 #define VDPY_DEFAULT_HEIGHT 768
 #define VDPY_MIN_WIDTH 640
@@ -1391,9 +1389,9 @@ vdpy_create_vscreen_window(struct vscreen *vscr)
 	return 0;
 }
 static void *triger_data;
-void (*triger)(void *data);
+void (*triger)(void *data, int scanout_id);
 
-void triger_init(void (*func)(void *data), void *data)
+void triger_init(int handle __attribute__((unused)), void (*func)(void *data, int scanout_id), void *data)
 {
 	triger_data = data;
 	triger = func;
@@ -0,0 +1,416 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Headless display sink
+ *
+ * Consumes the frames of a screen in the backend itself, so that frame
+ * throughput can be measured without the display client or a GPU:
+ *
+ *   VDPY_SINK=headless[:hz=<n>][,checksum][,ring=<slots>]
+ *
+ * A frame is acknowledged as soon as it is consumed, or at the next tick
+ * of a simulated refresh of <n> Hz. With checksum, each frame is hashed
+ * and the hash logged. With ring, each frame is also copied into a memfd
+ * ring of <slots> frames, which stays open so that a reader can find it
+ * through /proc/<pid>/fd.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+
+#include "log.h"
+#include "vdisplay.h"
+#include "vdisplay_protocol.h"
+#include "vdisplay_sink.h"
+
+#define HEADLESS_RING_MAGIC	0x52484456	/* "VDHR" */
+#define HEADLESS_RING_MAX	64
+#define HEADLESS_LOG_NS		(5 * 1000000000ULL)
+#define HEADLESS_PAGE		4096
+
+/* At the start of the ring memfd, the frames follow at data_offset */
+struct headless_ring_head {
+    uint32_t magic;
+    uint32_t slots;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t format;            /* pixman format */
+    uint64_t data_offset;
+    uint64_t slot_size;
+    uint32_t head;              /* frames written, the newest is (head - 1) % slots */
+    uint32_t pad;
+    struct {
+        uint32_t frame_id;
+        uint32_t pad;
+        uint64_t checksum;
+        uint64_t present_ns;
+    } meta[HEADLESS_RING_MAX];
+};
+
+struct headless_screen {
+    int handle;
+    int scanout_id;
+    uint32_t hz;
+    uint64_t period_ns;         /* 0 to acknowledge right away */
+    bool checksum;
+    uint32_t ring_slots;
+
+    /* the surface set last, if it could be mapped */
+    void *map;
+    size_t map_size;
+    int dmabuf_fd;              /* -1 for a memfd, which needs no sync */
+    uint64_t offset;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t bpp;
+    uint32_t format;
+
+    int ring_fd;
+    struct headless_ring_head *ring;
+    size_t ring_size;
+
+    uint64_t log_ns;
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t sum;
+    uint64_t cursor_moves;
+};
+
+static inline uint64_t
+headless_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+headless_parse(struct headless_screen *scr, const char *args)
+{
+    char *str, *tmp, *opts;
+    int val;
+
+    if (!args)
+        return;
+    opts = tmp = strdup(args);
+    if (!opts)
+        return;
+    while ((str = strsep(&tmp, ",")) != NULL) {
+        if (sscanf(str, "hz=%d", &val) == 1 && val > 0) {
+            scr->hz = val;
+            scr->period_ns = 1000000000ULL / val;
+        } else if (!strcmp(str, "checksum"))
+            scr->checksum = true;
+        else if (sscanf(str, "ring=%d", &val) == 1 && val > 0)
+            scr->ring_slots = (val > HEADLESS_RING_MAX) ? HEADLESS_RING_MAX : val;
+        else if (*str)
+            pr_err("%s: unknown option %s\n", __func__, str);
+    }
+    free(opts);
+}
+
+static void *
+headless_open(int handle, int scanout_id, const char *args)
+{
+    struct headless_screen *scr;
+
+    scr = calloc(1, sizeof(*scr));
+    if (!scr)
+        return NULL;
+    scr->handle = handle;
+    scr->scanout_id = scanout_id;
+    scr->dmabuf_fd = -1;
+    scr->ring_fd = -1;
+    headless_parse(scr, args);
+    pr_info("headless display %d.%d: refresh %u Hz (0: none), checksum %s, ring of %u frames\n",
+            handle, scanout_id, scr->hz, scr->checksum ? "on" : "off", scr->ring_slots);
+    return scr;
+}
+
+static void
+headless_unmap(struct headless_screen *scr)
+{
+    if (scr->map)
+        munmap(scr->map, scr->map_size);
+    scr->map = NULL;
+    if (scr->dmabuf_fd >= 0)
+        close(scr->dmabuf_fd);
+    scr->dmabuf_fd = -1;
+}
+
+static void
+headless_ring_free(struct headless_screen *scr)
+{
+    if (scr->ring)
+        munmap(scr->ring, scr->ring_size);
+    scr->ring = NULL;
+    if (scr->ring_fd >= 0)
+        close(scr->ring_fd);
+    scr->ring_fd = -1;
+}
+
+static void
+headless_close(void *priv)
+{
+    struct headless_screen *scr = priv;
+
+    headless_unmap(scr);
+    headless_ring_free(scr);
+    free(scr);
+}
+
+/* A ring for frames of the surface just set, if it needs another one */
+static void
+headless_ring_alloc(struct headless_screen *scr)
+{
+    uint64_t slot_size, data_offset;
+    size_t size;
+    int fd;
+
+    slot_size = (uint64_t)scr->stride * scr->height;
+    data_offset = (sizeof(struct headless_ring_head) + HEADLESS_PAGE - 1) & ~(uint64_t)(HEADLESS_PAGE - 1);
+    size = data_offset + slot_size * scr->ring_slots;
+    if (scr->ring && (scr->ring->slot_size == slot_size)) {
+        scr->ring->width = scr->width;
+        scr->ring->height = scr->height;
+        scr->ring->stride = scr->stride;
+        scr->ring->format = scr->format;
+        return;
+    }
+
+    headless_ring_free(scr);
+    fd = memfd_create("acrn_vdpy_headless", MFD_CLOEXEC);
+    if (fd < 0) {
+        pr_err("%s: memfd_create failed %s\n", __func__, strerror(errno));
+        return;
+    }
+    if (ftruncate(fd, size) < 0) {
+        pr_err("%s: failed to size the ring %s\n", __func__, strerror(errno));
+        close(fd);
+        return;
+    }
+    scr->ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (scr->ring == MAP_FAILED) {
+        pr_err("%s: failed to map the ring %s\n", __func__, strerror(errno));
+        scr->ring = NULL;
+        close(fd);
+        return;
+    }
+    scr->ring_fd = fd;
+    scr->ring_size = size;
+    scr->ring->slots = scr->ring_slots;
+    scr->ring->width = scr->width;
+    scr->ring->height = scr->height;
+    scr->ring->stride = scr->stride;
+    scr->ring->format = scr->format;
+    scr->ring->data_offset = data_offset;
+    scr->ring->slot_size = slot_size;
+    __atomic_store_n(&scr->ring->magic, HEADLESS_RING_MAGIC, __ATOMIC_RELEASE);
+}
+
+/*
+ * Keeps a mapping of the surface. A dmabuf the CPU can not map, say one
+ * of GPU memory, is still taken, only its pixels are not looked at.
+ */
+static void
+headless_map(struct headless_screen *scr, struct surface *surf)
+{
+    off_t size;
+    int fd;
+
+    headless_unmap(scr);
+    scr->width = surf->width;
+    scr->height = surf->height;
+    scr->stride = surf->stride;
+    scr->format = surf->surf_format;
+    scr->bpp = PIXMAN_FORMAT_BPP(surf->surf_format) / 8;
+    if (surf->surf_type == SURFACE_DMABUF) {
+        fd = surf->dma_info.dmabuf_fd;
+        scr->offset = surf->dma_info.dmabuf_offset;
+    } else {
+        fd = surf->shm_info.memfd;
+        scr->offset = surf->shm_info.offset;
+    }
+    if (surf->surf_type == SURFACE_DMABUF && !scr->bpp)
+        scr->bpp = 4;       /* a dmabuf without a format is 32 bit */
+
+    size = lseek(fd, 0, SEEK_END);
+    if ((size <= 0) || (scr->offset + (uint64_t)scr->stride * scr->height > (uint64_t)size)) {
+        pr_dbg("%s: surface does not fit in its buffer\n", __func__);
+        return;
+    }
+    scr->map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (scr->map == MAP_FAILED) {
+        pr_dbg("%s: can not map the surface %s\n", __func__, strerror(errno));
+        scr->map = NULL;
+        return;
+    }
+    scr->map_size = size;
+    if (surf->surf_type == SURFACE_DMABUF)
+        scr->dmabuf_fd = dup(fd);
+
+    if (scr->ring_slots)
+        headless_ring_alloc(scr);
+}
+
+static uint64_t
+headless_hash(uint64_t h, const uint8_t *p, size_t len)
+{
+    uint64_t w;
+
+    for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+        memcpy(&w, p, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+    }
+    for (; len; p++, len--)
+        h = (h ^ *p) * 0x100000001b3ULL;
+    return h;
+}
+
+/* Reads the frame as a client would: hashes it, copies it to the ring */
+static void
+headless_consume(struct headless_screen *scr, uint32_t frame_id)
+{
+    struct dma_buf_sync sync;
+    const uint8_t *src;
+    uint8_t *dst;
+    size_t row;
+    uint32_t i, slot;
+    uint64_t h;
+
+    if (!scr->map)
+        return;
+    scr->bytes += (uint64_t)scr->stride * scr->height;
+    if (!scr->checksum && !scr->ring)
+        return;
+
+    if (scr->dmabuf_fd >= 0) {
+        sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+        ioctl(scr->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+    src = (const uint8_t *)scr->map + scr->offset;
+    row = (size_t)scr->width * scr->bpp;
+    if (row > scr->stride)
+        row = scr->stride;
+    h = 0xcbf29ce484222325ULL;
+    dst = NULL;
+    slot = 0;
+    if (scr->ring) {
+        slot = scr->ring->head % scr->ring->slots;
+        dst = (uint8_t *)scr->ring + scr->ring->data_offset + slot * scr->ring->slot_size;
+    }
+    for (i = 0; i < scr->height; i++, src += scr->stride) {
+        if (scr->checksum)
+            h = headless_hash(h, src, row);
+        if (dst) {
+            memcpy(dst, src, row);
+            dst += scr->stride;
+        }
+    }
+    if (scr->dmabuf_fd >= 0) {
+        sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+        ioctl(scr->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+
+    if (scr->checksum)
+        scr->sum = h;
+    if (scr->ring) {
+        scr->ring->meta[slot].frame_id = frame_id;
+        scr->ring->meta[slot].checksum = scr->checksum ? h : 0;
+        scr->ring->meta[slot].present_ns = headless_now_ns();
+        __atomic_store_n(&scr->ring->head, scr->ring->head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Waits for the next tick of the simulated refresh, phase locked to 0 */
+static void
+headless_vsync(struct headless_screen *scr)
+{
+    struct timespec ts;
+    uint64_t next;
+
+    if (!scr->period_ns)
+        return;
+    next = (headless_now_ns() / scr->period_ns + 1) * scr->period_ns;
+    ts.tv_sec = next / 1000000000ULL;
+    ts.tv_nsec = next % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void
+headless_log(struct headless_screen *scr, uint64_t now)
+{
+    if (!scr->log_ns) {
+        scr->log_ns = now;
+        return;
+    }
+    if (now - scr->log_ns < HEADLESS_LOG_NS)
+        return;
+    pr_info("headless display %d.%d: %llu frames, %llu KiB, %llu cursor moves in %llu ms, "
+            "checksum %016llx\n", scr->handle, scr->scanout_id,
+            (unsigned long long)scr->frames, (unsigned long long)(scr->bytes >> 10),
+            (unsigned long long)__atomic_exchange_n(&scr->cursor_moves, 0, __ATOMIC_RELAXED),
+            (unsigned long long)((now - scr->log_ns) / 1000000),
+            (unsigned long long)scr->sum);
+    scr->frames = 0;
+    scr->bytes = 0;
+    scr->log_ns = now;
+}
+
+static int
+headless_surface_set(void *priv, struct surface *surf, struct dpy_frame_timing *t)
+{
+    struct headless_screen *scr = priv;
+
+    t->recv_ns = headless_now_ns();
+    headless_map(scr, surf);
+    t->draw_ns = headless_now_ns();
+    t->present_ns = t->draw_ns;
+    t->flags = DPY_FRAME_SET;
+    return 1;
+}
+
+static int
+headless_surface_update(void *priv, struct surface *surf, uint64_t sent_ns __attribute__((unused)),
+                        struct dpy_frame_timing *t)
+{
+    struct headless_screen *scr = priv;
+
+    t->recv_ns = headless_now_ns();
+    headless_consume(scr, surf->frame_id);
+    t->draw_ns = headless_now_ns();
+    headless_vsync(scr);
+    t->present_ns = headless_now_ns();
+    scr->frames++;
+    headless_log(scr, t->present_ns);
+    return 1;
+}
+
+static void
+headless_cursor_move(void *priv, uint32_t x __attribute__((unused)),
+                     uint32_t y __attribute__((unused)))
+{
+    struct headless_screen *scr = priv;
+
+    __atomic_add_fetch(&scr->cursor_moves, 1, __ATOMIC_RELAXED);
+}
+
+const struct vdpy_sink_ops vdpy_sink_headless = {
+    .name = "headless",
+    .open = headless_open,
+    .close = headless_close,
+    .surface_set = headless_surface_set,
+    .surface_update = headless_surface_update,
+    .cursor_move = headless_cursor_move,
+};
@@ -7,6 +7,8 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/param.h>
 #include <netinet/in.h>
 
 // #include <SDL.h>
@@ -19,12 +21,13 @@
 #include "log.h"
 #include "vdisplay.h"
 #include "vdisplay_protocol.h"
+#include "vdisplay_sink.h"
+#include "vdisplay_damage.h"
 #include "atomic.h"
 #include "timer.h"
+#include "trace_ring.h"
 
 
-#define VDPY_MAX_WIDTH 3840
-#define VDPY_MAX_HEIGHT 2160
 #define VDPY_DEFAULT_WIDTH 1920
 #define VDPY_DEFAULT_HEIGHT 1080
 #define VDPY_MIN_WIDTH 640
@@ -51,8 +54,44 @@ typedef struct{
   short w, h;
 } SDL_Rect;
 
+/* A tagged frame sent to the client and not acknowledged yet */
+struct vdpy_frame_pending {
+    uint32_t frame_id;
+    bool is_set;
+    uint64_t flush_ns;
+    uint64_t sent_ns;
+};
+
+#define VDPY_FRAMES_PENDING 32
+
+/*
+ * What a screen has yet to send to its client. The display thread only
+ * queues here; the lane thread of the screen does the sending, so a client
+ * that reads slowly holds up its own screen and nothing else. A surface or
+ * frame that is not sent yet is replaced by a newer one.
+ */
+struct vdpy_lane {
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool exit;
+    bool has_modifier;
+    uint64_t modifier;
+    bool has_set;
+    struct surface set;         /* its fd is a dup owned by the lane */
+    bool has_update;
+    struct surface update;
+    uint32_t skipped;           /* last tagged frame that can not be sent */
+    uint32_t dropped;           /* frames replaced before they were sent */
+    struct vdpy_tiles tiles;    /* lane thread only */
+};
+
+struct vdpy_instance;
+
 struct vscreen {
+    // the mode offered to the guest, the client's size once it has told it
     struct display_info info;
+    pthread_mutex_t info_mutex;
     int pscreen_id;
     SDL_Rect pscreen_rect;
     bool is_fullscreen;
@@ -76,14 +115,56 @@ struct vscreen {
     // EGLImage egl_img;
     /* Record the update_time that is activated from guest_vm */
     struct timespec last_time;
+    /* each screen is a display of its own, with its own client */
+    struct vdpy_instance *inst;
+    int scanout_id;
+    pthread_mutex_t client_mutex;
+    int client_sock;
+    int server_sock;
+    char sock_path[108];
+    // frames sent to the client, under the frame_mutex of the instance
+    struct vdpy_frame_pending frames[VDPY_FRAMES_PENDING];
+    uint32_t frames_head;
+    uint32_t frames_tail;
+    struct vdpy_lane lane;
+    // state of the screen in the sink, see vdisplay_sink.h
+    void *sink_priv;
+    void *cast_priv;
+    // memfd copy of pixel surfaces that come without one, display thread only
+    int shadow_fd;
+    void *shadow;
+    size_t shadow_size;
 };
 
-static struct display {
-    struct state s;
+/*
+ * One instance per vdpy_init() caller, i.e. per virtio-gpu device. Each
+ * instance has its own screens, and each screen its own client connection
+ * and lane thread; the display thread, the socket server thread and the UI
+ * timer are shared by all of them.
+ */
+struct vdpy_instance {
+    int handle;
     struct vscreen *vscrs;
     int vscrs_num;
+    void (*hotplug_cb)(void *data, int scanout_id);
+    void *hotplug_data;
+    // protect the pending frames of the screens and the frame statistics
+    pthread_mutex_t frame_mutex;
+    struct vdpy_frame_stats frame_stats;
+    void (*frame_cb)(void *data, int scanout_id, uint32_t frame_id);
+    void *frame_data;
+    // frame_cb calls in progress, made without frame_mutex
+    int frame_reports;
+    pthread_cond_t frame_cond;
+};
+
+#define VDPY_MAX_INSTANCES 8
+
+static struct display {
+    struct state s;
     pthread_t tid;
     pthread_t server_tid;
+    int epollfd;
     /* Add one UI_timer(33ms) to render the buffers from guest_vm */
     struct acrn_timer ui_timer;
     struct vdpy_display_bh ui_timer_bh;
@@ -91,8 +172,15 @@ static struct display {
     pthread_mutex_t vdisplay_mutex;
     // receive the signal that request is submitted
     pthread_cond_t  vdisplay_signal;
-    pthread_mutex_t client_mutex;
     TAILQ_HEAD(display_list, vdpy_display_bh) request_list;
+    // protect the instance table
+    pthread_mutex_t inst_mutex;
+    struct vdpy_instance *insts[VDPY_MAX_INSTANCES];
+    // where frames go, from VDPY_SINK on the first vdpy_init()
+    const struct vdpy_sink_ops *sink;
+    const char *sink_args;
+    // damage of full updates from tile hashes, VDPY_TILE_DAMAGE=1
+    bool tile_damage;
     /* add the below two fields for calling eglAPI directly */
     // bool egl_dmabuf_supported;
     // SDL_GLContext eglContext;
@@ -110,6 +198,8 @@ static struct display {
     .s.is_wayland = false,
     .s.is_x11 = false,
     .s.n_connect = 0,
+    .epollfd = -1,
+    .inst_mutex = PTHREAD_MUTEX_INITIALIZER,
     // .eglDisplay = EGL_NO_DISPLAY,
     // .eglContext = EGL_NO_CONTEXT,
     // .eglSurface = EGL_NO_SURFACE
@@ -120,6 +210,10 @@ static struct control {
     pthread_t ctl_server_tid;
 }  vctl;
 
+/* geometry from vdpy_parse_cmd_option(), applied by the next vdpy_init() */
+static struct vscreen vscr_opts[VSCREEN_MAX_NUM];
+static int vscr_opts_num;
+
 typedef enum {
     ESTT = 1, // Established Timings I & II
     STDT,    // Standard Timings
@@ -584,20 +678,43 @@ vdpy_edid_generate(uint8_t *edid, size_t size, struct edid_info *info)
     }
 }
 
+static struct vdpy_instance *
+vdpy_get_instance(int handle)
+{
+    if ((handle <= 0) || (handle > VDPY_MAX_INSTANCES))
+        return NULL;
+
+    return vdpy.insts[handle - 1];
+}
+
+static struct vscreen *
+vdpy_get_vscreen(int handle, int scanout_id)
+{
+    struct vdpy_instance *inst;
+
+    inst = vdpy_get_instance(handle);
+    if (!inst || (scanout_id < 0) || (scanout_id >= inst->vscrs_num))
+        return NULL;
+    return inst->vscrs + scanout_id;
+}
+
 void
 vdpy_get_edid(int handle, int scanout_id, uint8_t *edid, size_t size)
 {
     struct edid_info edid_info;
+    struct vdpy_instance *inst;
     struct vscreen *vscr;
 
-    if (scanout_id >= vdpy.vscrs_num)
-        return;
-
-    vscr = vdpy.vscrs + scanout_id;
+    inst = vdpy_get_instance(handle);
+    if (inst) {
+        if (scanout_id >= inst->vscrs_num)
+            return;
 
-    if (handle == vdpy.s.n_connect) {
+        vscr = inst->vscrs + scanout_id;
+        pthread_mutex_lock(&vscr->info_mutex);
         edid_info.prefx = vscr->info.width;
         edid_info.prefy = vscr->info.height;
+        pthread_mutex_unlock(&vscr->info_mutex);
         edid_info.maxx = VDPY_MAX_WIDTH;
         edid_info.maxy = VDPY_MAX_HEIGHT;
     } else {
@@ -617,18 +734,18 @@ vdpy_get_edid(int handle, int scanout_id, uint8_t *edid, size_t size)
 void
 vdpy_get_display_info(int handle, int scanout_id, struct display_info *info)
 {
+    struct vdpy_instance *inst;
     struct vscreen *vscr;
 
-    if (scanout_id >= vdpy.vscrs_num)
-        return;
-
-    vscr = vdpy.vscrs + scanout_id;
+    inst = vdpy_get_instance(handle);
+    if (inst) {
+        if (scanout_id >= inst->vscrs_num)
+            return;
 
-    if (handle == vdpy.s.n_connect) {
-        info->xoff = vscr->info.xoff;
-        info->yoff = vscr->info.yoff;
-        info->width = vscr->info.width;
-        info->height = vscr->info.height;
+        vscr = inst->vscrs + scanout_id;
+        pthread_mutex_lock(&vscr->info_mutex);
+        *info = vscr->info;
+        pthread_mutex_unlock(&vscr->info_mutex);
     } else {
         info->xoff = 0;
         info->yoff = 0;
@@ -743,14 +860,49 @@ sdl_gl_display_init(void)
 {
     return;
 }
+void triger_init(int handle, void (*func)(void *data, int scanout_id), void *data)
+{
+    struct vdpy_instance *inst;
+
+    inst = vdpy_get_instance(handle);
+    if (!inst)
+        return;
+
+    inst->hotplug_data = data;
+    inst->hotplug_cb = func;
+}
+
+void vdpy_frame_notify(int handle, void (*func)(void *data, int scanout_id, uint32_t frame_id),
+                       void *data)
+{
+    struct vdpy_instance *inst;
 
-static void *triger_data;
-void (*triger)(void *data);
+    inst = vdpy_get_instance(handle);
+    if (!inst)
+        return;
+
+    pthread_mutex_lock(&inst->frame_mutex);
+    inst->frame_data = data;
+    inst->frame_cb = func;
+    /* the old one may still be running on a lane */
+    while (inst->frame_reports)
+        pthread_cond_wait(&inst->frame_cond, &inst->frame_mutex);
+    pthread_mutex_unlock(&inst->frame_mutex);
+}
 
-void triger_init(void (*func)(void *data), void *data)
+static void
+vdpy_hotplug_all(void)
 {
-    triger_data = data;
-    triger = func;
+    struct vdpy_instance *inst;
+    int i;
+
+    pthread_mutex_lock(&vdpy.inst_mutex);
+    for (i = 0; i < VDPY_MAX_INSTANCES; i++) {
+        inst = vdpy.insts[i];
+        if (inst && inst->hotplug_cb)
+            inst->hotplug_cb(inst->hotplug_data, -1);
+    }
+    pthread_mutex_unlock(&vdpy.inst_mutex);
 }
 
 static void *
@@ -760,25 +912,6 @@ vdpy_sdl_display_thread(void *data __attribute__((unused)))
     struct vdpy_display_bh *bh;
     struct itimerspec ui_timer_spec;
 
-    struct vscreen *vscr;
-    int i;
-
-    for (i = 0; i < vdpy.vscrs_num; i++) {
-        vscr = vdpy.vscrs + i;
-
-        vdpy_calibrate_vscreen_geometry(vscr);
-
-        if (vdpy_create_vscreen_window(vscr)) {
-            goto sdl_fail;
-        }
-
-        vscr->info.xoff = vscr->org_x;
-        vscr->info.yoff = vscr->org_y;
-        vscr->info.width = vscr->guest_width;
-        vscr->info.height = vscr->guest_height;
-
-        clock_gettime(CLOCK_MONOTONIC, &vscr->last_time);
-    }
     sdl_gl_display_init();
     pthread_mutex_init(&vdpy.vdisplay_mutex, NULL);
     pthread_cond_init(&vdpy.vdisplay_signal, NULL);
@@ -816,7 +949,9 @@ vdpy_sdl_display_thread(void *data __attribute__((unused)))
 
             TAILQ_REMOVE(&vdpy.request_list, bh, link);
 
+            TRACE_2L(TRACE_BH_RUN, (uintptr_t)bh, (uintptr_t)bh->task_cb);
             bh->task_cb(bh->data);
+            TRACE_2L(TRACE_BH_DONE, (uintptr_t)bh, (uintptr_t)bh->task_cb);
 
             if (atomic_load(&bh->bh_flag) & ACRN_BH_FREE) {
                 free(bh);
@@ -835,50 +970,6 @@ vdpy_sdl_display_thread(void *data __attribute__((unused)))
     pthread_mutex_destroy(&vdpy.vdisplay_mutex);
     pthread_cond_destroy(&vdpy.vdisplay_signal);
 
-    // for (i = 0; i < vdpy.vscrs_num; i++) {
-    //     vscr = vdpy.vscrs + i;
-    //     if (vscr->img) {
-    //         pixman_image_unref(vscr->img);
-    //         vscr->img = NULL;
-    //     }
-        /* Continue to thread cleanup */
-        // if (vscr->surf_tex) {
-        //     // SDL_DestroyTexture(vscr->surf_tex);
-        //     glDeleteTextures(1, &vscr->surf_tex);
-        //     checkGlError2("glDeleteTextures", vscr->surf_tex);
-        //     vscr->surf_tex = 0;
-        // }
-        // if (vscr->cur_tex) {
-        //     // SDL_DestroyTexture(vscr->cur_tex);
-        //     glDeleteTextures(1, &vscr->cur_tex);
-        //     checkGlError2("glDeleteTextures", vscr->cur_tex);
-        //     vscr->cur_tex = 0;
-        // }
-
-        // if (vdpy.egl_dmabuf_supported && (vscr->egl_img != EGL_NO_IMAGE_KHR))
-        //     vdpy.gl_ops.eglDestroyImageKHR(vdpy.eglDisplay,
-        //                 vscr->egl_img);
-    // }
-
-sdl_fail:
-    for (i = 0; i < vdpy.vscrs_num; i++) {
-        vscr = vdpy.vscrs + i;
-        // if (vscr->bogus_tex) {
-        //     // SDL_DestroyTexture(vscr->bogus_tex);
-        //     glDeleteTextures(1, &vscr->bogus_tex);
-        //     checkGlError2("glDeleteTextures", vscr->bogus_tex);
-        //     vscr->bogus_tex = 0;
-        // }
-        // if (vscr->renderer) {
-        //     SDL_DestroyRenderer(vscr->renderer);
-        //     vscr->renderer = NULL;
-        // }
-        // if (vscr->win) {
-        //     SDL_DestroyWindow(vscr->win);
-        //     vscr->win = NULL;
-        // }
-    }
-
     /* This is used to workaround the TLS issue of libEGL + libGLdispatch
      * after unloading library.
      */
@@ -891,7 +982,7 @@ static inline int _send(int fd, void* dt, int len)
     char * data= (char *)dt;
     int ret, sent_bytes = 0;
     do {
-        ret = send(fd, data + sent_bytes, len - sent_bytes, 0);
+        ret = send(fd, data + sent_bytes, len - sent_bytes, MSG_NOSIGNAL);
         if (ret <= 0) {
             if (errno != EAGAIN)
                 pr_err("_send fail (%d vs. %d) %s!", ret, len - sent_bytes, strerror(errno));
@@ -927,13 +1018,20 @@ static inline int _recv(int fd, void* dt, int len)
 }
 
 #define SERVER_SOCK_PATH  "/data/local/ipc/virt_disp_server"
-static int client_sock = -1;
-static inline int client_send(int e_type, void *data, int len)
+
+/* epoll data of the shared server thread: instance handle, screen and socket fd */
+#define VDPY_EPOLL_DATA(handle, scanout, fd) \
+    (((uint64_t)(handle) << 40) | ((uint64_t)(scanout) << 32) | (uint32_t)(fd))
+#define VDPY_EPOLL_HANDLE(data) ((int)((data) >> 40))
+#define VDPY_EPOLL_SCANOUT(data) ((int)(((data) >> 32) & 0xff))
+#define VDPY_EPOLL_FD(data) ((int)((data) & 0xffffffff))
+
+static inline int client_send(struct vscreen *vscr, int e_type, void *data, int len)
 {
     int ret;
     struct dpy_evt_header evt_hdr;
 
-    if (client_sock == -1) {
+    if (vscr->client_sock == -1) {
         pr_info("%s() invalid sock", __func__);
         return -1;
     }
@@ -941,14 +1039,15 @@ static inline int client_send(int e_type, void *data, int len)
     evt_hdr.e_type = e_type;
     evt_hdr.e_magic = DISPLAY_MAGIC_CODE;
     evt_hdr.e_size = len;
-    ret = _send(client_sock, &evt_hdr, sizeof(evt_hdr));
+    TRACE_4I(TRACE_DPY_SEND, vscr->inst->handle, e_type, len, vscr->scanout_id);
+    ret = _send(vscr->client_sock, &evt_hdr, sizeof(evt_hdr));
     if (ret != sizeof(evt_hdr)) {
         pr_err("%s() send header fail(%d vs. %d) %s", __func__, ret, sizeof(evt_hdr), strerror(errno));
         return -1;
     }
 
     if (data && (len > 0)) {
-        ret = _send(client_sock, data, len);
+        ret = _send(vscr->client_sock, data, len);
         if (ret != len) {
             pr_err("%s() send body fail(%d vs. %d) %s", __func__, ret, len, strerror(errno));
             return -1;
@@ -957,7 +1056,7 @@ static inline int client_send(int e_type, void *data, int len)
     return 0;
 }
 
-static inline int client_send_fd(int fd)
+static inline int client_send_fd(struct vscreen *vscr, int fd)
 {
     int ret;
     struct msghdr msg = {};
@@ -966,7 +1065,7 @@ static inline int client_send_fd(int fd)
     char cmsgbuf[CMSG_SPACE(sizeof(int))];
     struct cmsghdr *cmptr;
 
-    if (client_sock == -1) {
+    if (vscr->client_sock == -1) {
         return -1;
     }
 
@@ -984,7 +1083,7 @@ static inline int client_send_fd(int fd)
     *((int*)CMSG_DATA(cmptr)) = fd;
 
     do {
-        ret = sendmsg(client_sock, &msg, 0);
+        ret = sendmsg(vscr->client_sock, &msg, MSG_NOSIGNAL);
     } while ((ret <= 0) && (errno == EAGAIN));
 
     if (ret <= 0) {
@@ -993,6 +1092,202 @@ static inline int client_send_fd(int fd)
     return ret;
 }
 
+static inline uint64_t vdpy_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Start a new window once the current one is VDPY_FRAME_WINDOW_NS old */
+static void vdpy_frame_roll(struct vdpy_frame_stats *stats, uint64_t now)
+{
+    if (stats->cur.start_ns && (now - stats->cur.start_ns < VDPY_FRAME_WINDOW_NS))
+        return;
+
+    if (stats->cur.start_ns) {
+        stats->cur.end_ns = now;
+        stats->last = stats->cur;
+    }
+    memset(&stats->cur, 0, sizeof(stats->cur));
+    stats->cur.start_ns = now;
+}
+
+static void vdpy_frame_stage(struct vdpy_frame_window *win, int stage, uint64_t from, uint64_t to)
+{
+    uint64_t us;
+    int bucket;
+
+    us = (to > from) ? (to - from) / 1000 : 0;
+    bucket = us ? 63 - __builtin_clzll(us) : 0;
+    if (bucket >= VDPY_FRAME_BUCKETS)
+        bucket = VDPY_FRAME_BUCKETS - 1;
+
+    win->sum_us[stage] += us;
+    if (us > win->max_us[stage])
+        win->max_us[stage] = (us > UINT32_MAX) ? UINT32_MAX : us;
+    win->hist[stage][bucket]++;
+}
+
+/*
+ * Called without frame_mutex, and never from the display thread: frame_cb
+ * submits a bottom half under the vdisplay mutex, which the display thread
+ * holds while it takes frame_mutex for the stats.
+ */
+static void vdpy_frame_report(struct vscreen *vscr, uint32_t frame_id)
+{
+    struct vdpy_instance *inst = vscr->inst;
+    void (*func)(void *data, int scanout_id, uint32_t frame_id);
+    void *data;
+
+    if (!frame_id)
+        return;
+    pthread_mutex_lock(&inst->frame_mutex);
+    func = inst->frame_cb;
+    data = inst->frame_data;
+    if (func)
+        inst->frame_reports++;
+    pthread_mutex_unlock(&inst->frame_mutex);
+    if (!func)
+        return;
+
+    func(data, vscr->scanout_id, frame_id);
+    pthread_mutex_lock(&inst->frame_mutex);
+    if (--inst->frame_reports == 0)
+        pthread_cond_broadcast(&inst->frame_cond);
+    pthread_mutex_unlock(&inst->frame_mutex);
+}
+
+/*
+ * Record a tagged frame handed to the client, or a drop if it could not be
+ * sent. When the client falls VDPY_FRAMES_PENDING frames behind, the oldest
+ * one is given up on.
+ */
+static void vdpy_frame_sent(struct vscreen *vscr, struct surface *surf, bool is_set,
+                            uint64_t sent_ns, bool sent)
+{
+    struct vdpy_instance *inst = vscr->inst;
+    struct vdpy_frame_stats *stats = &inst->frame_stats;
+    struct vdpy_frame_pending *f;
+    uint32_t report = 0;
+
+    pthread_mutex_lock(&inst->frame_mutex);
+    vdpy_frame_roll(stats, sent_ns);
+    if (!sent) {
+        stats->cur.dropped++;
+        pthread_mutex_unlock(&inst->frame_mutex);
+        vdpy_frame_report(vscr, surf->frame_id);
+        return;
+    }
+    if (vscr->frames_head - vscr->frames_tail == VDPY_FRAMES_PENDING) {
+        stats->cur.dropped++;
+        report = vscr->frames[vscr->frames_tail % VDPY_FRAMES_PENDING].frame_id;
+        vscr->frames_tail++;
+    }
+    f = &vscr->frames[vscr->frames_head++ % VDPY_FRAMES_PENDING];
+    f->frame_id = surf->frame_id;
+    f->is_set = is_set;
+    f->flush_ns = surf->frame_ns;
+    f->sent_ns = sent_ns;
+    pthread_mutex_unlock(&inst->frame_mutex);
+    vdpy_frame_report(vscr, report);
+}
+
+/*
+ * The client presented a frame. Frames sent before it that were never
+ * acknowledged are lost to a reconnect or skipped, and count as dropped.
+ */
+static void vdpy_frame_done(struct vscreen *vscr, struct dpy_frame_timing *t)
+{
+    struct vdpy_instance *inst = vscr->inst;
+    struct vdpy_frame_stats *stats = &inst->frame_stats;
+    struct vdpy_frame_window *win;
+    struct vdpy_frame_pending *f;
+    uint32_t i, report;
+
+    pthread_mutex_lock(&inst->frame_mutex);
+    for (i = vscr->frames_tail; i != vscr->frames_head; i++)
+        if (vscr->frames[i % VDPY_FRAMES_PENDING].frame_id == t->frame_id)
+            break;
+    if (i == vscr->frames_head) {
+        /* already given up on */
+        pthread_mutex_unlock(&inst->frame_mutex);
+        return;
+    }
+
+    vdpy_frame_roll(stats, vdpy_now_ns());
+    win = &stats->cur;
+    win->dropped += i - vscr->frames_tail;
+    vscr->frames_tail = i + 1;
+
+    f = &vscr->frames[i % VDPY_FRAMES_PENDING];
+    if (f->is_set || (t->flags & DPY_FRAME_SET)) {
+        vdpy_frame_stage(win, VDPY_FRAME_SET, f->flush_ns, t->draw_ns);
+    } else {
+        win->frames++;
+        vdpy_frame_stage(win, VDPY_FRAME_SERVER, f->flush_ns, f->sent_ns);
+        vdpy_frame_stage(win, VDPY_FRAME_DELIVER, f->sent_ns, t->recv_ns);
+        vdpy_frame_stage(win, VDPY_FRAME_DRAW, t->recv_ns, t->draw_ns);
+        vdpy_frame_stage(win, VDPY_FRAME_PRESENT, t->draw_ns, t->present_ns);
+        vdpy_frame_stage(win, VDPY_FRAME_TOTAL, f->flush_ns, t->present_ns);
+    }
+    report = f->frame_id;
+    pthread_mutex_unlock(&inst->frame_mutex);
+    vdpy_frame_report(vscr, report);
+}
+
+/* The client went away, nothing pending will be presented */
+static void vdpy_frame_flush(struct vscreen *vscr)
+{
+    struct vdpy_instance *inst = vscr->inst;
+    uint32_t report = 0;
+
+    pthread_mutex_lock(&inst->frame_mutex);
+    inst->frame_stats.cur.dropped += vscr->frames_head - vscr->frames_tail;
+    if (vscr->frames_head != vscr->frames_tail)
+        report = vscr->frames[(vscr->frames_head - 1) % VDPY_FRAMES_PENDING].frame_id;
+    vscr->frames_tail = vscr->frames_head;
+    pthread_mutex_unlock(&inst->frame_mutex);
+    vdpy_frame_report(vscr, report);
+}
+
+/*
+ * A tagged update that changed nothing is reported without being sent,
+ * unless frames sent before it are still pending: its report would cover
+ * them before the client has presented them.
+ */
+static bool vdpy_frame_unchanged(struct vscreen *vscr, uint32_t frame_id)
+{
+    struct vdpy_instance *inst = vscr->inst;
+
+    pthread_mutex_lock(&inst->frame_mutex);
+    if (vscr->frames_head != vscr->frames_tail) {
+        pthread_mutex_unlock(&inst->frame_mutex);
+        return false;
+    }
+    vdpy_frame_roll(&inst->frame_stats, vdpy_now_ns());
+    inst->frame_stats.cur.unchanged++;
+    pthread_mutex_unlock(&inst->frame_mutex);
+    /* frame_cb takes the vdisplay mutex, see vdpy_frame_report() */
+    vdpy_frame_report(vscr, frame_id);
+    return true;
+}
+
+/* Frames replaced in the lane, or that could not be sent at all */
+static void vdpy_frame_lost(struct vscreen *vscr, uint32_t dropped, uint32_t skipped)
+{
+    struct vdpy_instance *inst = vscr->inst;
+
+    pthread_mutex_lock(&inst->frame_mutex);
+    vdpy_frame_roll(&inst->frame_stats, vdpy_now_ns());
+    inst->frame_stats.cur.dropped += dropped;
+    if (skipped)
+        inst->frame_stats.cur.dropped++;
+    pthread_mutex_unlock(&inst->frame_mutex);
+    vdpy_frame_report(vscr, skipped);
+}
+
 static inline void close_client(int epollfd, int cs)
 {
     struct epoll_event event;
@@ -1005,28 +1300,293 @@ static inline void close_client(int epollfd, int cs)
     close(cs);
 }
 
+static void
+vdpy_accept_client(struct vscreen *vscr)
+{
+    struct sockaddr_un client_sockaddr;
+    struct epoll_event event;
+    int new_client_sock, flags;
+    socklen_t len;
+
+    // Accept incoming connection
+    len = sizeof (client_sockaddr);
+    new_client_sock = accept (vscr->server_sock, (struct sockaddr*)&client_sockaddr, &len);
+    if (new_client_sock == -1) {
+        pr_err("ACCEPT ERROR: %s\n", strerror(errno));
+        return;
+    }
+
+    flags = fcntl(new_client_sock, F_GETFL, 0);
+    fcntl(new_client_sock, F_SETFL, flags | O_NONBLOCK);
+    // Close previous client connect, and remove listener
+    pthread_mutex_lock(&vscr->client_mutex);
+    if (vscr->client_sock != -1) {
+        close_client(vdpy.epollfd, vscr->client_sock);
+        vscr->client_sock = -1;
+        vdpy_frame_flush(vscr);
+    }
+
+    vscr->client_sock = new_client_sock;
+    if (vscr->set_modifier)
+        client_send(vscr, DPY_EVENT_SET_MODIFIER, &vscr->modifier, sizeof(vscr->modifier));
+
+    // Add new listener
+    event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP;
+    event.data.u64 = VDPY_EPOLL_DATA(vscr->inst->handle, vscr->scanout_id, vscr->client_sock);
+    if (epoll_ctl(vdpy.epollfd, EPOLL_CTL_ADD, vscr->client_sock, &event) == -1) {
+        pr_err("EPOLL_CTL_ADD client %d fail!", vscr->client_sock);
+    }
+    pthread_mutex_unlock(&vscr->client_mutex);
+}
+
+/*
+ * The client told the size of its window: offer it to the guest as the
+ * preferred mode, so that frames come at the size they are shown and the
+ * client does not scale them. A geometry=WxH option pins the mode.
+ */
+static void
+vdpy_display_resize(struct vscreen *vscr, struct display_info *info)
+{
+    struct vdpy_instance *inst = vscr->inst;
+    bool changed;
+
+    if (vscr_opts_num && !vscr->is_fullscreen)
+        return;
+    if ((info->width < VDPY_MIN_WIDTH) || (info->width > VDPY_MAX_WIDTH) ||
+        (info->height < VDPY_MIN_HEIGHT) || (info->height > VDPY_MAX_HEIGHT)) {
+        pr_err("%s: client size %ux%u of screen %d is out of range\n", __func__,
+               info->width, info->height, vscr->scanout_id);
+        return;
+    }
+
+    pthread_mutex_lock(&vscr->info_mutex);
+    changed = (vscr->info.width != info->width) || (vscr->info.height != info->height);
+    vscr->info.width = info->width;
+    vscr->info.height = info->height;
+    pthread_mutex_unlock(&vscr->info_mutex);
+    if (!changed)
+        return;
+
+    pr_info("%s: screen %d of display %d is now %ux%u\n", __func__, vscr->scanout_id,
+            inst->handle, info->width, info->height);
+    // the guest asks for the display info and the EDID again
+    if (inst->hotplug_cb != NULL)
+        (*inst->hotplug_cb)(inst->hotplug_data, vscr->scanout_id);
+}
+
+static void
+vdpy_handle_client(struct vscreen *vscr, uint32_t events)
+{
+    struct vdpy_instance *inst = vscr->inst;
+    struct dpy_evt_header msg_header;
+    char buf[256];
+    int ret;
+
+    if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+        pr_err("poll client error: 0x%x", events);
+        pthread_mutex_lock(&vscr->client_mutex);
+        close_client(vdpy.epollfd, vscr->client_sock);
+        vscr->client_sock = -1;
+        pthread_mutex_unlock(&vscr->client_mutex);
+        vdpy_frame_flush(vscr);
+        return;
+    }
+    pthread_mutex_lock(&vscr->client_mutex);
+    ret = _recv(vscr->client_sock, &msg_header, sizeof(msg_header));
+    if (ret != sizeof(msg_header)) {
+        pr_err("recv event header fail (%d vs. %d) %s!", ret, sizeof(msg_header), strerror(errno));
+
+        pthread_mutex_unlock(&vscr->client_mutex);
+        return;
+    }
+
+    if (msg_header.e_magic != DISPLAY_MAGIC_CODE) {
+        // data error, clear receive buffer
+        pr_err("recv data err!");
+
+        pthread_mutex_unlock(&vscr->client_mutex);
+        return;
+    }
+
+    if (msg_header.e_size > sizeof(buf)) {
+        pr_err("recv event body too large (%d)!", msg_header.e_size);
+
+        pthread_mutex_unlock(&vscr->client_mutex);
+        return;
+    }
+
+    if (msg_header.e_size > 0) {
+        ret = _recv(vscr->client_sock, buf, msg_header.e_size);
+        if (ret != msg_header.e_size) {
+            pr_err("recv event body fail (%d vs. %d) %s!", ret, msg_header.e_size, strerror(errno));
+
+            pthread_mutex_unlock(&vscr->client_mutex);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&vscr->client_mutex);
+
+    switch (msg_header.e_type) {
+        case DPY_EVENT_DISPLAY_INFO:
+        {
+            if (msg_header.e_size >= sizeof(struct display_info))
+                vdpy_display_resize(vscr, (struct display_info *)buf);
+            break;
+        }
+        case DPY_EVENT_FRAME_DONE:
+        {
+            if (msg_header.e_size >= sizeof(struct dpy_frame_timing))
+                vdpy_frame_done(vscr, (struct dpy_frame_timing *)buf);
+            break;
+        }
+        case DPY_EVENT_HOTPLUG:
+        {
+            int is_in = *(int *)buf;
+            if (inst->hotplug_cb != NULL) {
+                    (*inst->hotplug_cb)(inst->hotplug_data, vscr->scanout_id);
+            }
+            if (!is_in) {
+                pthread_mutex_lock(&vscr->client_mutex);
+                close_client(vdpy.epollfd, vscr->client_sock);
+                vscr->client_sock = -1;
+                pthread_mutex_unlock(&vscr->client_mutex);
+                vdpy_frame_flush(vscr);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/*
+ * One thread serves the sockets of every screen of every instance; the
+ * epoll data tells which screen and socket an event belongs to.
+ */
 static void *
 vdpy_display_server_thread(void *data __attribute__((unused)))
 {
-    struct vscreen *vscr = vdpy.vscrs;
+    struct vdpy_instance *inst;
+    struct vscreen *vscr;
+    struct epoll_event events[10];
+    int fd, i, scanout, numEvents;
 
-    int ret;
+    pr_info("display server thread is created\n");
+
+    while (1) {
+        numEvents = epoll_wait(vdpy.epollfd, events, 10, -1);
+        if (numEvents == -1) {
+            if (errno == EINTR)
+                continue;
+            perror ("epoll_wait");
+            break;
+        }
+
+        for (i = 0; i < numEvents; i++) {
+            pthread_mutex_lock(&vdpy.inst_mutex);
+            inst = vdpy_get_instance(VDPY_EPOLL_HANDLE(events[i].data.u64));
+            scanout = VDPY_EPOLL_SCANOUT(events[i].data.u64);
+            fd = VDPY_EPOLL_FD(events[i].data.u64);
+            vscr = (inst && (scanout < inst->vscrs_num)) ? inst->vscrs + scanout : NULL;
+            if (vscr && (fd == vscr->server_sock))
+                vdpy_accept_client(vscr);
+            else if (vscr && (fd == vscr->client_sock))
+                vdpy_handle_client(vscr, events[i].events);
+            pthread_mutex_unlock(&vdpy.inst_mutex);
+        }
+    }
+
+    return NULL;
+}
+
+static int
+vdpy_vscreen_listen(struct vscreen *vscr)
+{
     struct sockaddr_un server_sockaddr;
-    struct sockaddr_un client_sockaddr;
+    struct epoll_event event;
+    char base[sizeof(vscr->sock_path) - 4];
+    socklen_t len;
+    mode_t mask;
+    int ret, flags;
+
+    memset(&server_sockaddr, 0, sizeof(struct sockaddr_un));
+    vscr->server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (vscr->server_sock == -1){
+        pr_err("SOCKET ERROR: %s\n", strerror(errno));
+        return -1;
+    }
+
+    flags = fcntl(vscr->server_sock, F_GETFL, 0);
+    fcntl(vscr->server_sock, F_SETFL, flags | O_NONBLOCK);
+
+    /*
+     * The first screen of the first instance keeps the well-known path of
+     * the display client; other instances add _<n>, other screens .<n>.
+     */
+    if (vscr->inst->handle == 1)
+        snprintf(base, sizeof(base), "%s", SERVER_SOCK_PATH);
+    else
+        snprintf(base, sizeof(base), "%s_%d", SERVER_SOCK_PATH, vscr->inst->handle - 1);
+    if (vscr->scanout_id == 0)
+        snprintf(vscr->sock_path, sizeof(vscr->sock_path), "%s", base);
+    else
+        snprintf(vscr->sock_path, sizeof(vscr->sock_path), "%s.%d", base, vscr->scanout_id);
+
+    server_sockaddr.sun_family = AF_UNIX;
+    snprintf(server_sockaddr.sun_path, sizeof(server_sockaddr.sun_path), "%s", vscr->sock_path);
+    len = sizeof(server_sockaddr);
+
+    unlink(vscr->sock_path);
+
+    mask = umask(0);
+    ret = bind(vscr->server_sock, (struct sockaddr *) &server_sockaddr, len);
+    umask(mask);
+    if (ret == -1){
+        pr_err("BIND ERROR: %s\n", strerror(errno));
+        goto close_socket;
+    }
+
+    ret = listen(vscr->server_sock, 10);
+    if (ret == -1){
+        pr_err("LISTEN ERROR: %s\n", strerror(errno));
+        goto close_socket;
+    }
+
+    event.events = EPOLLIN;
+    event.data.u64 = VDPY_EPOLL_DATA(vscr->inst->handle, vscr->scanout_id, vscr->server_sock);
+    if (epoll_ctl(vdpy.epollfd, EPOLL_CTL_ADD, vscr->server_sock, &event) == -1) {
+        pr_err ("EPOLL_CTL_ADD server %d fail", vscr->server_sock);
+        goto close_socket;
+    }
+
+    pr_info("display %d screen %d listens on %s\n", vscr->inst->handle,
+            vscr->scanout_id, vscr->sock_path);
+    return 0;
+
+close_socket:
+    close(vscr->server_sock);
+    vscr->server_sock = -1;
+    return -1;
+}
+
+static void *
+vdpy_control_server_thread(void *data __attribute__((unused)))
+{
+    int ret;
+    struct sockaddr_in server_sockaddr;
+    struct sockaddr_in client_sockaddr;
     char buf[256];
     int server_sock = -1, new_client_sock;
     socklen_t len;
-    client_sock = -1;
+    int client_sock = -1;
 
     int epollfd;
     struct epoll_event event, events[10];
 
     struct dpy_evt_header msg_header;
 
-    pr_info("%s() -1\n", __func__);
-
-    memset(&server_sockaddr, 0, sizeof(struct sockaddr_un));
-    server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&server_sockaddr, 0, sizeof(struct sockaddr_in));
+    server_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (server_sock == -1){
         pr_err("SOCKET ERROR: %s\n", strerror(errno));
         return NULL;
@@ -1036,197 +1596,13 @@ vdpy_display_server_thread(void *data __attribute__((unused)))
     flags = fcntl(server_sock, F_GETFL, 0);
     fcntl(server_sock, F_SETFL, flags | O_NONBLOCK);
 
-    pr_info("%s() -2\n", __func__);
-    server_sockaddr.sun_family = AF_UNIX;
-    strcpy(server_sockaddr.sun_path, SERVER_SOCK_PATH);
+    server_sockaddr.sin_family = AF_INET;
+    server_sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_sockaddr.sin_port = htons(SERVER_PORT);
+    // strcpy(server_sockaddr.sun_path, SERVER_SOCK_PATH);
     len = sizeof(server_sockaddr);
 
-    pr_info("%s() -3\n", __func__);
-    unlink(SERVER_SOCK_PATH);
-
-    mode_t mask = 0;
-    mask = umask(0);
-    ret = bind(server_sock, (struct sockaddr *) &server_sockaddr, len);
-    umask(mask);
-    if (ret == -1){
-        pr_err("BIND ERROR: %s\n", strerror(errno));
-        goto close_sockets;
-    }
-
-    ret = listen(server_sock, 10);
-    if (ret == -1){
-        pr_err("LISTEN ERROR: %s\n", strerror(errno));
-        goto close_sockets;
-    }
-
-    epollfd = epoll_create1(0);
-    if (epollfd == -1) {
-        pr_err ("epoll_create1");
-        goto close_sockets;
-    }
-
-    event.events = EPOLLIN;
-    event.data.fd = server_sock;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, server_sock, &event) == -1) {
-        pr_err ("EPOLL_CTL_ADD server %d fail", server_sock);
-        goto close_epoll_fd;
-    }
-
-    pr_info("display server thread is created\n");
-
-    while (1) {
-        int numEvents = epoll_wait(epollfd, events, 5, -1);
-        if (numEvents == -1) {
-            perror ("epoll_wait");
-            goto close_epoll_fd;
-        }
-
-        for (int i = 0; i < numEvents; i++) {
-            if (events[i].data.fd == server_sock) {
-                // Accept incoming connection
-                len = sizeof (client_sockaddr);
-                new_client_sock = accept (server_sock, (struct sockaddr*)&client_sockaddr, &len);
-
-                int flags;
-                flags = fcntl(new_client_sock, F_GETFL, 0);
-                fcntl(new_client_sock, F_SETFL, flags | O_NONBLOCK);
-                // Close previous client connect, and remove listener
-                pthread_mutex_lock(&vdpy.client_mutex);
-                if (client_sock != -1) {
-                    close_client(epollfd, client_sock);
-                    client_sock = -1;
-                }
-
-                client_sock = new_client_sock;
-                if (vscr->set_modifier)
-                    client_send(DPY_EVENT_SET_MODIFIER, &vscr->modifier, sizeof(vscr->modifier));
-
-                // Add new listener
-                event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP;
-                event.data.fd = client_sock;
-                if (epoll_ctl(epollfd, EPOLL_CTL_ADD, client_sock, &event) == -1) {
-                    pr_err("EPOLL_CTL_ADD client %d fail!", client_sock);
-                }
-                pthread_mutex_unlock(&vdpy.client_mutex);
-            } else if (events[i].data.fd == client_sock) {
-                if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
-                    pr_err("poll client error: 0x%x", events[i].events);
-                    pthread_mutex_lock(&vdpy.client_mutex);
-                    close_client(epollfd, client_sock);
-                    client_sock = -1;
-                    pthread_mutex_unlock(&vdpy.client_mutex);
-                    continue;
-                }
-                pthread_mutex_lock(&vdpy.client_mutex);
-                ret = _recv(client_sock, &msg_header, sizeof(msg_header));
-                if (ret != sizeof(msg_header)) {
-                    pr_err("recv event header fail (%d vs. %d) %s!", ret, sizeof(msg_header), strerror(errno));
-
-                    pthread_mutex_unlock(&vdpy.client_mutex);
-                    continue;
-                }
-
-                if (msg_header.e_magic != DISPLAY_MAGIC_CODE) {
-                    // data error, clear receive buffer
-                    pr_err("recv data err!");
-
-                    pthread_mutex_unlock(&vdpy.client_mutex);
-                    continue;
-                }
-
-                if (msg_header.e_size > 0) {
-                    ret = _recv(client_sock, buf, msg_header.e_size);
-                    if (ret != msg_header.e_size) {
-                        pr_err("recv event body fail (%d vs. %d) %s!", ret, msg_header.e_size, strerror(errno));
-
-                        pthread_mutex_unlock(&vdpy.client_mutex);
-                        continue;
-                    }
-                }
-                pthread_mutex_unlock(&vdpy.client_mutex);
-
-                switch (msg_header.e_type) {
-                    case DPY_EVENT_DISPLAY_INFO:
-                    {
-                        struct display_info *info = (struct display_info *)buf;
-                        vscr->info.xoff = info->xoff;
-                        vscr->info.yoff = info->yoff;
-                        vscr->info.width = info->width;
-                        vscr->info.height = info->height;
-                        break;
-                    }
-                    case DPY_EVENT_HOTPLUG:
-                    {
-                        int is_in = *(int *)buf;
-                        if (triger != NULL) {
-                                (*triger)(triger_data);
-                        }
-                        if (!is_in) {
-                            pthread_mutex_lock(&vdpy.client_mutex);
-                            close_client(epollfd, client_sock);
-                            client_sock = -1;
-                            pthread_mutex_unlock(&vdpy.client_mutex);
-                        }
-                        break;
-                    }
-                    default:
-                        break;
-                }
-            }
-        }
-    }
-
-close_epoll_fd:
-    if (epollfd != -1) {
-        close(epollfd);
-    }
-
-close_sockets:
-    if (server_sock != -1) {
-        shutdown(server_sock, SHUT_RDWR);
-        close(server_sock);
-    }
-    if (client_sock != -1) {
-        shutdown(client_sock, SHUT_RDWR);
-        close(client_sock);
-    }
-    return NULL;
-}
-
-static void *
-vdpy_control_server_thread(void *data __attribute__((unused)))
-{
-    int ret;
-    struct sockaddr_in server_sockaddr;
-    struct sockaddr_in client_sockaddr;
-    char buf[256];
-    int server_sock = -1, new_client_sock;
-    socklen_t len;
-    int client_sock = -1;
-
-    int epollfd;
-    struct epoll_event event, events[10];
-
-    struct dpy_evt_header msg_header;
-
-    memset(&server_sockaddr, 0, sizeof(struct sockaddr_in));
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock == -1){
-        pr_err("SOCKET ERROR: %s\n", strerror(errno));
-        return NULL;
-    }
-
-    int flags;
-    flags = fcntl(server_sock, F_GETFL, 0);
-    fcntl(server_sock, F_SETFL, flags | O_NONBLOCK);
-
-    server_sockaddr.sin_family = AF_INET;
-    server_sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_sockaddr.sin_port = htons(SERVER_PORT);
-    // strcpy(server_sockaddr.sun_path, SERVER_SOCK_PATH);
-    len = sizeof(server_sockaddr);
-
-    // unlink(SERVER_SOCK_PATH);
+    // unlink(SERVER_SOCK_PATH);
 
     mode_t mask = 0;
     mask = umask(0);
@@ -1277,6 +1653,7 @@ vdpy_control_server_thread(void *data __attribute__((unused)))
                 // Close previous client connect, and remove listener
                 pthread_mutex_lock(&vctl.client_mutex);
                 if (client_sock != -1) {
+                    vdpy_cast_detach(client_sock);
                     close_client(epollfd, client_sock);
                     client_sock = -1;
                 }
@@ -1297,6 +1674,7 @@ vdpy_control_server_thread(void *data __attribute__((unused)))
                 if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
                     pr_err("poll client error: 0x%x", events[i].events);
                     pthread_mutex_lock(&vctl.client_mutex);
+                    vdpy_cast_detach(client_sock);
                     close_client(epollfd, client_sock);
                     client_sock = -1;
                     pthread_mutex_unlock(&vctl.client_mutex);
@@ -1334,14 +1712,19 @@ vdpy_control_server_thread(void *data __attribute__((unused)))
                 switch (msg_header.e_type) {
                     case DPY_EVENT_START_CAST:
                     {
+                        /* with a request, the frames go to this socket */
+                        if (msg_header.e_size >= (int)sizeof(struct dpy_cast_req)) {
+                            vdpy_cast_attach(client_sock, (struct dpy_cast_req *)buf);
+                            break;
+                        }
                         system("am start -n com.intel.virtio_gpu_backend/android.app.NativeActivity");
                         break;
                     }
                     case DPY_EVENT_STOP_CAST:
                     {
-                        if (triger != NULL) {
-                            (*triger)(triger_data);
-                         }
+                        if (vdpy_cast_detach(client_sock))
+                            break;
+                        vdpy_hotplug_all();
                         system("am force-stop com.intel.virtio_gpu_backend");
                         break;
                     }
@@ -1363,43 +1746,28 @@ close_sockets:
         close(server_sock);
     }
     if (client_sock != -1) {
+        vdpy_cast_detach(client_sock);
         shutdown(client_sock, SHUT_RDWR);
         close(client_sock);
     }
     return NULL;
 }
-
-int
-vdpy_init(int *num_vscreens)
+/*
+ * Start the threads shared by all instances. Called with inst_mutex held
+ * by the first vdpy_init().
+ */
+static int
+vdpy_start_shared_threads(void)
 {
     int err, count;
-    struct vscreen *vscr;
-
-    if (vdpy.s.n_connect) {
-        return 0;
-    }
-
 
     pthread_mutex_init(&vctl.client_mutex, NULL);
     err = pthread_create(&vctl.ctl_server_tid, NULL, vdpy_control_server_thread, &vctl);
     if (err) {
         pr_err("Failed to create the ctl_server_thread.\n");
-        return 0;
-    }
-    pthread_setname_np(vctl.ctl_server_tid, "acrn_ctl_server");
-
-
-    // only support 1 physical screen now
-    vdpy.vscrs_num = 1;
-    vdpy.vscrs = calloc(VSCREEN_MAX_NUM, sizeof(struct vscreen));
-    if (!vdpy.vscrs) {
-        pr_err("%s, memory allocation for vscrs failed.", __func__);
         return -1;
     }
-
-    vscr = &vdpy.vscrs[0];
-    vscr->is_fullscreen = false;
-    vscr->pscreen_id = 0;
+    pthread_setname_np(vctl.ctl_server_tid, "acrn_ctl_server");
 
     /* start one vdpy_sdl_display_thread to handle the 3D request
      * in this dedicated thread. Otherwise the libSDL + 3D doesn't
@@ -1408,15 +1776,20 @@ vdpy_init(int *num_vscreens)
     err = pthread_create(&vdpy.tid, NULL, vdpy_sdl_display_thread, &vdpy);
     if (err) {
         pr_err("Failed to create the sdl_display_thread.\n");
-        return 0;
+        return -1;
     }
     pthread_setname_np(vdpy.tid, "acrn_vdisplay");
 
-    pthread_mutex_init(&vdpy.client_mutex, NULL);
+    vdpy.epollfd = epoll_create1(0);
+    if (vdpy.epollfd == -1) {
+        pr_err ("epoll_create1");
+        return -1;
+    }
+
     err = pthread_create(&vdpy.server_tid, NULL, vdpy_display_server_thread, &vdpy);
     if (err) {
         pr_err("Failed to create the sdl_display_thread.\n");
-        return 0;
+        return -1;
     }
     pthread_setname_np(vdpy.server_tid, "acrn_dpy_server");
 
@@ -1432,61 +1805,660 @@ vdpy_init(int *num_vscreens)
         pr_err("display_thread is not ready.\n");
     }
 
+    return 0;
+}
+
+/* The fd that goes with a surface set: its dmabuf or the memfd of its pixels */
+static inline int *
+vdpy_surface_fd(struct surface *surf)
+{
+    if (surf->surf_type == SURFACE_PIXMAN)
+        return &surf->shm_info.memfd;
+    return &surf->dma_info.dmabuf_fd;
+}
+
+/* The default sink: the display client on the socket of the screen */
+static void *
+vdpy_socket_open(int handle, int scanout_id, const char *args __attribute__((unused)))
+{
+    struct vscreen *vscr;
+
+    vscr = vdpy_get_vscreen(handle, scanout_id);
+    if (!vscr || vdpy_vscreen_listen(vscr))
+        return NULL;
+    return vscr;
+}
+
+static void
+vdpy_socket_set_modifier(void *priv, uint64_t modifier)
+{
+    client_send((struct vscreen *)priv, DPY_EVENT_SET_MODIFIER, &modifier, sizeof(modifier));
+}
+
+static int
+vdpy_socket_surface_set(void *priv, struct surface *surf,
+                        struct dpy_frame_timing *t __attribute__((unused)))
+{
+    struct vscreen *vscr = (struct vscreen *)priv;
+    bool sent;
+
+    sent = !client_send(vscr, DPY_EVENT_SURFACE_SET, surf, sizeof(*surf));
+    sent = (client_send_fd(vscr, *vdpy_surface_fd(surf)) > 0) && sent;
+    return sent ? 0 : -1;
+}
+
+static int
+vdpy_socket_surface_update(void *priv, struct surface *surf, uint64_t sent_ns,
+                           struct dpy_frame_timing *t __attribute__((unused)))
+{
+    struct vscreen *vscr = (struct vscreen *)priv;
+    struct {
+        struct dpy_frame_tag tag;
+        struct dpy_damage damage;
+    } body;
+
+    bool has_damage = (surf->surf_type == SURFACE_PIXMAN) ||
+                      (surf->damage.width && surf->damage.height);
+
+    if (!surf->frame_id && !has_damage)
+        return client_send(vscr, DPY_EVENT_SURFACE_UPDATE, NULL, 0);
+
+    body.tag.frame_id = surf->frame_id;
+    body.tag.scanout_id = vscr->scanout_id;
+    body.tag.flush_ns = surf->frame_ns;
+    body.tag.sent_ns = sent_ns;
+    body.damage.x = surf->damage.x;
+    body.damage.y = surf->damage.y;
+    body.damage.width = surf->damage.width;
+    body.damage.height = surf->damage.height;
+    return client_send(vscr, DPY_EVENT_SURFACE_UPDATE, &body,
+                       has_damage ? sizeof(body) : sizeof(body.tag));
+}
+
+static const struct vdpy_sink_ops vdpy_sink_socket = {
+    .name = "socket",
+    .open = vdpy_socket_open,
+    .set_modifier = vdpy_socket_set_modifier,
+    .surface_set = vdpy_socket_surface_set,
+    .surface_update = vdpy_socket_surface_update,
+};
+
+/* Sends what was queued for a screen, in order: modifier, surface, frame */
+static void *
+vdpy_lane_thread(void *data)
+{
+    struct vscreen *vscr = (struct vscreen *)data;
+    struct vdpy_lane *lane = &vscr->lane;
+    const struct vdpy_sink_ops *sink = vdpy.sink;
+    struct dpy_frame_timing set_t, update_t;
+    struct surface set, update;
+    bool has_modifier, has_set, has_update;
+    uint32_t dropped, skipped;
+    uint64_t modifier, sent_ns;
+    int set_ret, update_ret;
+
+    pthread_mutex_lock(&lane->mutex);
+    while (!lane->exit) {
+        if (!lane->has_modifier && !lane->has_set && !lane->has_update &&
+            !lane->skipped && !lane->dropped) {
+            pthread_cond_wait(&lane->cond, &lane->mutex);
+            continue;
+        }
+        has_modifier = lane->has_modifier;
+        modifier = lane->modifier;
+        has_set = lane->has_set;
+        set = lane->set;
+        has_update = lane->has_update;
+        update = lane->update;
+        dropped = lane->dropped;
+        skipped = lane->skipped;
+        lane->has_modifier = lane->has_set = lane->has_update = false;
+        lane->dropped = lane->skipped = 0;
+        pthread_mutex_unlock(&lane->mutex);
+
+        /* a full update is hashed for its damage, off the display thread */
+        if (has_set && vdpy.tile_damage)
+            vdpy_tiles_set(&lane->tiles, &set);
+        if (has_update && vdpy.tile_damage && !update.damage.width &&
+            !vdpy_tiles_update(&lane->tiles, &update) && !has_set &&
+            (!update.frame_id || vdpy_frame_unchanged(vscr, update.frame_id)))
+            has_update = false;
+
+        set_ret = update_ret = -1;
+        memset(&set_t, 0, sizeof(set_t));
+        memset(&update_t, 0, sizeof(update_t));
+        pthread_mutex_lock(&vscr->client_mutex);
+        if (has_modifier && sink->set_modifier)
+            sink->set_modifier(vscr->sink_priv, modifier);
+        if (has_set) {
+            set_ret = sink->surface_set(vscr->sink_priv, &set, &set_t);
+            if (vscr->cast_priv)
+                vdpy_sink_cast.surface_set(vscr->cast_priv, &set, NULL);
+            if (set.frame_id)
+                vdpy_frame_sent(vscr, &set, true, vdpy_now_ns(), set_ret >= 0);
+            close(*vdpy_surface_fd(&set));
+        }
+        if (has_update) {
+            sent_ns = vdpy_now_ns();
+            update_ret = sink->surface_update(vscr->sink_priv, &update, sent_ns, &update_t);
+            if (vscr->cast_priv)
+                vdpy_sink_cast.surface_update(vscr->cast_priv, &update, sent_ns, NULL);
+            if (update.frame_id)
+                vdpy_frame_sent(vscr, &update, false, sent_ns, update_ret >= 0);
+        }
+        pthread_mutex_unlock(&vscr->client_mutex);
+        /* a sink that presented the frame itself also acknowledges it */
+        if (has_set && set.frame_id && (set_ret > 0)) {
+            set_t.frame_id = set.frame_id;
+            vdpy_frame_done(vscr, &set_t);
+        }
+        if (has_update && update.frame_id && (update_ret > 0)) {
+            update_t.frame_id = update.frame_id;
+            vdpy_frame_done(vscr, &update_t);
+        }
+        if (dropped || skipped)
+            vdpy_frame_lost(vscr, dropped, skipped);
+
+        pthread_mutex_lock(&lane->mutex);
+    }
+    pthread_mutex_unlock(&lane->mutex);
+    return NULL;
+}
+
+/*
+ * Called with the lane locked. A frame that replaces one not sent yet
+ * takes over its tag if it has none, so that the older frame is still
+ * reported once this one is; otherwise the older one is only counted as
+ * dropped, the newer report covers it.
+ */
+static void
+vdpy_lane_replace(struct vdpy_lane *lane, struct surface *old, struct surface *surf)
+{
+    if (!old->frame_id)
+        return;
+    if (!surf->frame_id) {
+        surf->frame_id = old->frame_id;
+        surf->frame_ns = old->frame_ns;
+    } else {
+        lane->dropped++;
+    }
+}
+
+static void
+vdpy_lane_set(struct vscreen *vscr, struct surface *surf)
+{
+    struct vdpy_lane *lane = &vscr->lane;
+    struct surface set = *surf;
+
+    *vdpy_surface_fd(&set) = dup(*vdpy_surface_fd(surf));
+    if (*vdpy_surface_fd(&set) < 0) {
+        pr_err("%s: dup failed %s\n", __func__, strerror(errno));
+        return;
+    }
+
+    pthread_mutex_lock(&lane->mutex);
+    if (lane->has_update) {
+        /* the new surface is shown as a whole */
+        vdpy_lane_replace(lane, &lane->update, &set);
+        lane->has_update = false;
+    }
+    if (lane->has_set) {
+        vdpy_lane_replace(lane, &lane->set, &set);
+        close(*vdpy_surface_fd(&lane->set));
+    }
+    lane->set = set;
+    lane->has_set = true;
+    pthread_cond_signal(&lane->cond);
+    pthread_mutex_unlock(&lane->mutex);
+}
+
+/* Damage of an update that also stands for an older one, not sent yet */
+static void
+vdpy_damage_union(struct surface *surf, struct surface *old)
+{
+    uint32_t x1, y1, x2, y2;
+
+    if (!surf->damage.width || !surf->damage.height)
+        return;
+    if (!old->damage.width || !old->damage.height) {
+        memset(&surf->damage, 0, sizeof(surf->damage));
+        return;
+    }
+    x1 = MIN(surf->damage.x, old->damage.x);
+    y1 = MIN(surf->damage.y, old->damage.y);
+    x2 = MAX(surf->damage.x + surf->damage.width, old->damage.x + old->damage.width);
+    y2 = MAX(surf->damage.y + surf->damage.height, old->damage.y + old->damage.height);
+    surf->damage.x = x1;
+    surf->damage.y = y1;
+    surf->damage.width = x2 - x1;
+    surf->damage.height = y2 - y1;
+}
+
+static void
+vdpy_lane_update(struct vscreen *vscr, struct surface *surf)
+{
+    struct vdpy_lane *lane = &vscr->lane;
+    struct surface update = *surf;
+
+    pthread_mutex_lock(&lane->mutex);
+    if (lane->has_update) {
+        vdpy_lane_replace(lane, &lane->update, &update);
+        vdpy_damage_union(&update, &lane->update);
+    }
+    lane->update = update;
+    lane->has_update = true;
+    pthread_cond_signal(&lane->cond);
+    pthread_mutex_unlock(&lane->mutex);
+}
+
+static int
+vdpy_lane_start(struct vscreen *vscr)
+{
+    struct vdpy_lane *lane = &vscr->lane;
+    char name[16];
+
+    pthread_mutex_init(&lane->mutex, NULL);
+    pthread_cond_init(&lane->cond, NULL);
+    vdpy_tiles_init(&lane->tiles, "damage", vscr->inst->handle, vscr->scanout_id);
+    lane->exit = false;
+    if (pthread_create(&lane->tid, NULL, vdpy_lane_thread, vscr)) {
+        pr_err("Failed to create the lane of screen %d.\n", vscr->scanout_id);
+        pthread_mutex_destroy(&lane->mutex);
+        pthread_cond_destroy(&lane->cond);
+        return -1;
+    }
+    snprintf(name, sizeof(name), "acrn_lane%d_%d", vscr->inst->handle, vscr->scanout_id);
+    pthread_setname_np(lane->tid, name);
+    return 0;
+}
+
+static void
+vdpy_lane_stop(struct vscreen *vscr)
+{
+    struct vdpy_lane *lane = &vscr->lane;
+
+    pthread_mutex_lock(&lane->mutex);
+    lane->exit = true;
+    pthread_cond_signal(&lane->cond);
+    pthread_mutex_unlock(&lane->mutex);
+    /* fails a send to a client that stopped reading */
+    if (vscr->client_sock != -1)
+        shutdown(vscr->client_sock, SHUT_RDWR);
+    pthread_join(lane->tid, NULL);
+
+    if (lane->has_set)
+        close(*vdpy_surface_fd(&lane->set));
+    lane->has_set = lane->has_update = false;
+    vdpy_tiles_release(&lane->tiles);
+    pthread_mutex_destroy(&lane->mutex);
+    pthread_cond_destroy(&lane->cond);
+}
+
+/* Closes what a screen opened, from its listening socket on */
+static void
+vdpy_vscreen_close(struct vscreen *vscr)
+{
+    if (vscr->sink_priv && vdpy.sink->close)
+        vdpy.sink->close(vscr->sink_priv);
+    vscr->sink_priv = NULL;
+    if (vscr->cast_priv)
+        vdpy_sink_cast.close(vscr->cast_priv);
+    vscr->cast_priv = NULL;
+    pthread_mutex_lock(&vscr->client_mutex);
+    if (vscr->client_sock != -1) {
+        close_client(vdpy.epollfd, vscr->client_sock);
+        vscr->client_sock = -1;
+    }
+    pthread_mutex_unlock(&vscr->client_mutex);
+    if (vscr->server_sock != -1) {
+        epoll_ctl(vdpy.epollfd, EPOLL_CTL_DEL, vscr->server_sock, NULL);
+        close(vscr->server_sock);
+        vscr->server_sock = -1;
+        unlink(vscr->sock_path);
+    }
+    if (vscr->shadow) {
+        munmap(vscr->shadow, vscr->shadow_size);
+        close(vscr->shadow_fd);
+        vscr->shadow = NULL;
+    }
+    pthread_mutex_destroy(&vscr->client_mutex);
+    pthread_mutex_destroy(&vscr->info_mutex);
+}
+
+/* VDPY_SINK=<name>[:<args>], the display client if unset */
+static void
+vdpy_sink_select(void)
+{
+    static const struct vdpy_sink_ops *sinks[] = {
+        &vdpy_sink_socket,
+        &vdpy_sink_headless,
+    };
+    const char *env, *sep;
+    size_t len;
+    int i;
+
+    vdpy.sink = &vdpy_sink_socket;
+    vdpy.sink_args = NULL;
+    env = getenv("VDPY_SINK");
+    if (!env || !*env)
+        return;
+
+    sep = strchr(env, ':');
+    len = sep ? (size_t)(sep - env) : strlen(env);
+    for (i = 0; i < (int)(sizeof(sinks) / sizeof(sinks[0])); i++) {
+        if ((strlen(sinks[i]->name) == len) && !strncmp(sinks[i]->name, env, len)) {
+            vdpy.sink = sinks[i];
+            vdpy.sink_args = sep ? sep + 1 : NULL;
+            pr_info("%s: frames go to the %s sink\n", __func__, vdpy.sink->name);
+            return;
+        }
+    }
+    pr_err("%s: unknown sink %s, using the display client\n", __func__, env);
+}
+
+/*
+ * Screens of an instance, from the geometry options or else VDPY_SCANOUTS
+ * screens of the default size.
+ */
+static int
+vdpy_vscreens_num(void)
+{
+    const char *env;
+    int num;
+
+    if (vscr_opts_num)
+        return vscr_opts_num;
+
+    env = getenv("VDPY_SCANOUTS");
+    num = env ? atoi(env) : 1;
+    if (num < 1)
+        num = 1;
+    if (num > VSCREEN_MAX_NUM)
+        num = VSCREEN_MAX_NUM;
+    return num;
+}
+
+int
+vdpy_init(int *num_vscreens)
+{
+    struct vdpy_instance *inst;
+    struct vscreen *vscr;
+    int i, slot;
+
+    pthread_mutex_lock(&vdpy.inst_mutex);
+
+    if ((vdpy.epollfd == -1) && vdpy_start_shared_threads()) {
+        pthread_mutex_unlock(&vdpy.inst_mutex);
+        return 0;
+    }
+    if (!vdpy.sink) {
+        vdpy_sink_select();
+        vdpy.tile_damage = vdpy_tiles_enabled();
+    }
+
+    for (slot = 0; slot < VDPY_MAX_INSTANCES; slot++)
+        if (!vdpy.insts[slot])
+            break;
+    if (slot == VDPY_MAX_INSTANCES) {
+        pr_err("%s: at most %d displays are supported\n", __func__, VDPY_MAX_INSTANCES);
+        pthread_mutex_unlock(&vdpy.inst_mutex);
+        return 0;
+    }
+
+    inst = calloc(1, sizeof(*inst));
+    if (!inst) {
+        pthread_mutex_unlock(&vdpy.inst_mutex);
+        return 0;
+    }
+    inst->vscrs = calloc(VSCREEN_MAX_NUM, sizeof(struct vscreen));
+    if (!inst->vscrs) {
+        pr_err("%s, memory allocation for vscrs failed.", __func__);
+        free(inst);
+        pthread_mutex_unlock(&vdpy.inst_mutex);
+        return 0;
+    }
+    inst->handle = slot + 1;
+    pthread_mutex_init(&inst->frame_mutex, NULL);
+    pthread_cond_init(&inst->frame_cond, NULL);
+
+    inst->vscrs_num = vdpy_vscreens_num();
+    for (i = 0; i < inst->vscrs_num; i++) {
+        vscr = inst->vscrs + i;
+        if (vscr_opts_num)
+            *vscr = vscr_opts[i];
+        else {
+            vscr->is_fullscreen = false;
+            vscr->pscreen_id = 0;
+        }
+        vscr->inst = inst;
+        vscr->scanout_id = i;
+        vscr->client_sock = -1;
+        vscr->server_sock = -1;
+        pthread_mutex_init(&vscr->client_mutex, NULL);
+        pthread_mutex_init(&vscr->info_mutex, NULL);
+
+        vdpy_calibrate_vscreen_geometry(vscr);
+        vdpy_create_vscreen_window(vscr);
+
+        vscr->info.xoff = vscr->org_x;
+        vscr->info.yoff = vscr->org_y;
+        vscr->info.width = vscr->guest_width;
+        vscr->info.height = vscr->guest_height;
+
+        clock_gettime(CLOCK_MONOTONIC, &vscr->last_time);
+    }
+
+    vdpy.insts[slot] = inst;
+    for (i = 0; i < inst->vscrs_num; i++) {
+        vscr = inst->vscrs + i;
+        vscr->sink_priv = vdpy.sink->open(inst->handle, i, vdpy.sink_args);
+        if (!vscr->sink_priv) {
+            vdpy_vscreen_close(vscr);
+            break;
+        }
+        vscr->cast_priv = vdpy_sink_cast.open(inst->handle, i, NULL);
+        if (vdpy_lane_start(vscr)) {
+            vdpy_vscreen_close(vscr);
+            break;
+        }
+    }
+    if (i < inst->vscrs_num) {
+        vdpy.insts[slot] = NULL;
+        while (i-- > 0) {
+            vdpy_lane_stop(inst->vscrs + i);
+            vdpy_vscreen_close(inst->vscrs + i);
+        }
+        pthread_mutex_destroy(&inst->frame_mutex);
+        pthread_cond_destroy(&inst->frame_cond);
+        free(inst->vscrs);
+        free(inst);
+        pthread_mutex_unlock(&vdpy.inst_mutex);
+        return 0;
+    }
+
     vdpy.s.n_connect++;
+    pthread_mutex_unlock(&vdpy.inst_mutex);
+
     if (num_vscreens)
-        *num_vscreens = vdpy.vscrs_num;
-    return vdpy.s.n_connect;
+        *num_vscreens = inst->vscrs_num;
+    return inst->handle;
+}
+
+/* A tagged frame that is never sent is done as far as the sender is concerned */
+static void vdpy_frame_skip(struct vscreen *vscr, struct surface *surf)
+{
+    if (!vscr || !surf || !surf->frame_id)
+        return;
+
+    /* reported from the lane, the display thread can not take a report */
+    pthread_mutex_lock(&vscr->lane.mutex);
+    vscr->lane.skipped = surf->frame_id;
+    pthread_cond_signal(&vscr->lane.cond);
+    pthread_mutex_unlock(&vscr->lane.mutex);
+}
+
+/*
+ * A pixel surface whose pixels are not in a memfd is copied into one the
+ * screen keeps, so the client still maps it once and gets the damage of
+ * each update. The memfd is made again, and set again, when it is too small.
+ */
+static int
+vdpy_shadow_copy(struct vscreen *vscr, struct surface *surf, struct surface *shadow, bool set)
+{
+    uint32_t bpp, stride, x, y, w, h, i;
+    size_t size;
+    int fd;
+    void *map;
+
+    bpp = PIXMAN_FORMAT_BPP(surf->surf_format) / 8;
+    stride = (surf->width * bpp + 3) & ~3U;
+    size = (size_t)stride * surf->height;
+    if (!surf->pixel || !bpp || !size)
+        return -1;
+    if (!set && (!vscr->shadow || (size > vscr->shadow_size)))
+        return -1;
+
+    if (set && (size > vscr->shadow_size)) {
+        fd = memfd_create("acrn_vdpy_shadow", MFD_CLOEXEC);
+        if (fd < 0) {
+            pr_err("%s: memfd_create failed %s\n", __func__, strerror(errno));
+            return -1;
+        }
+        if (ftruncate(fd, size) < 0) {
+            pr_err("%s: failed to size the shadow %s\n", __func__, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            pr_err("%s: failed to map the shadow %s\n", __func__, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        /* the client holds its own reference to the old one */
+        if (vscr->shadow) {
+            munmap(vscr->shadow, vscr->shadow_size);
+            close(vscr->shadow_fd);
+        }
+        vscr->shadow_fd = fd;
+        vscr->shadow = map;
+        vscr->shadow_size = size;
+    }
+
+    x = 0;
+    y = 0;
+    w = surf->width;
+    h = surf->height;
+    if (!set && surf->damage.width && surf->damage.height) {
+        x = MIN(surf->damage.x, surf->width);
+        y = MIN(surf->damage.y, surf->height);
+        w = MIN(surf->damage.width, surf->width - x);
+        h = MIN(surf->damage.height, surf->height - y);
+    }
+    for (i = y; i < y + h; i++)
+        memcpy((char *)vscr->shadow + (size_t)i * stride + x * bpp,
+               (char *)surf->pixel + (size_t)i * surf->stride + x * bpp, (size_t)w * bpp);
+
+    *shadow = *surf;
+    shadow->pixel = NULL;
+    shadow->stride = stride;
+    shadow->shm_info.memfd = vscr->shadow_fd;
+    shadow->shm_info.offset = 0;
+    shadow->shm_info.size = vscr->shadow_size;
+    return 0;
 }
 
-void vdpy_surface_set(int handle __attribute__((unused)), int scanout_id __attribute__((unused)), struct surface *surf __attribute__((unused)))
+void vdpy_surface_set(int handle, int scanout_id, struct surface *surf)
 {
-    if (!surf || (surf->surf_type != SURFACE_DMABUF)) {
-        pr_err("%s Only dma buf is supported!", __func__);
+    struct surface shadow;
+    struct vscreen *vscr;
+
+    vscr = vdpy_get_vscreen(handle, scanout_id);
+    if (!vscr)
         return;
+
+    if (!surf || ((surf->surf_type != SURFACE_DMABUF) && (surf->surf_type != SURFACE_PIXMAN))) {
+        pr_err("%s: unsupported surface!", __func__);
+        vdpy_frame_skip(vscr, surf);
+        return;
+    }
+    if ((surf->surf_type == SURFACE_PIXMAN) && (surf->shm_info.memfd < 0)) {
+        if (vdpy_shadow_copy(vscr, surf, &shadow, true)) {
+            vdpy_frame_skip(vscr, surf);
+            return;
+        }
+        surf = &shadow;
     }
 
-    pthread_mutex_lock(&vdpy.client_mutex);
-    client_send(DPY_EVENT_SURFACE_SET, surf, sizeof(struct surface));
-    client_send_fd(surf->dma_info.dmabuf_fd);
-    pthread_mutex_unlock(&vdpy.client_mutex);
+    vdpy_lane_set(vscr, surf);
 }
 
-void vdpy_surface_update(int handle __attribute__((unused)), int scanout_id __attribute__((unused)), struct surface *surf)
+void vdpy_surface_update(int handle, int scanout_id, struct surface *surf)
 {
-    if (!surf || (surf->surf_type != SURFACE_DMABUF)) {
-        pr_err("%s Only dma buf is supported!", __func__);
+    struct surface shadow;
+    struct vscreen *vscr;
+
+    vscr = vdpy_get_vscreen(handle, scanout_id);
+    if (!vscr)
         return;
+
+    if (!surf || ((surf->surf_type != SURFACE_DMABUF) && (surf->surf_type != SURFACE_PIXMAN))) {
+        pr_err("%s: unsupported surface!", __func__);
+        vdpy_frame_skip(vscr, surf);
+        return;
+    }
+    if ((surf->surf_type == SURFACE_PIXMAN) && (surf->shm_info.memfd < 0)) {
+        if (vdpy_shadow_copy(vscr, surf, &shadow, false)) {
+            vdpy_frame_skip(vscr, surf);
+            return;
+        }
+        surf = &shadow;
     }
 
-    pthread_mutex_lock(&vdpy.client_mutex);
-    client_send(DPY_EVENT_SURFACE_UPDATE, NULL, 0);
-    pthread_mutex_unlock(&vdpy.client_mutex);
+    vdpy_lane_update(vscr, surf);
+}
+
+int
+vdpy_get_frame_stats(int handle, struct vdpy_frame_stats *stats)
+{
+    struct vdpy_instance *inst;
+
+    inst = vdpy_get_instance(handle);
+    if (!inst || !stats)
+        return -1;
+
+    pthread_mutex_lock(&inst->frame_mutex);
+    vdpy_frame_roll(&inst->frame_stats, vdpy_now_ns());
+    *stats = inst->frame_stats;
+    pthread_mutex_unlock(&inst->frame_mutex);
+    return 0;
 }
 
 void
-vdpy_set_modifier(int handle __attribute__((unused)), int scanout_id, uint64_t modifier)
+vdpy_set_modifier(int handle, int scanout_id, uint64_t modifier)
 {
     struct vscreen *vscr;
 
-    if (scanout_id >= vdpy.vscrs_num) {
+    vscr = vdpy_get_vscreen(handle, scanout_id);
+    if (!vscr)
         return;
-    }
 
-    vscr = vdpy.vscrs + scanout_id;
+    /* sent ahead of the surfaces that use it */
+    pthread_mutex_lock(&vscr->lane.mutex);
     vscr->modifier = modifier;
     vscr->set_modifier = true;
-
-    pthread_mutex_lock(&vdpy.client_mutex);
-    client_send(DPY_EVENT_SET_MODIFIER, &modifier, sizeof(modifier));
-    pthread_mutex_unlock(&vdpy.client_mutex);
+    vscr->lane.modifier = modifier;
+    vscr->lane.has_modifier = true;
+    pthread_cond_signal(&vscr->lane.cond);
+    pthread_mutex_unlock(&vscr->lane.mutex);
 }
 
 bool vdpy_submit_bh(int handle, struct vdpy_display_bh *bh_task)
 {
     bool bh_ok = false;
 
-    if (handle != vdpy.s.n_connect) {
-        pr_info("%s handle != vdpy.s.n_connect\n", __func__);
+    if (!vdpy_get_instance(handle)) {
+        pr_info("%s invalid handle %d\n", __func__, handle);
         return bh_ok;
     }
 
@@ -1502,24 +2474,58 @@ bool vdpy_submit_bh(int handle, struct vdpy_display_bh *bh_task)
         TAILQ_INSERT_TAIL(&vdpy.request_list, bh_task, link);
         bh_ok = true;
     }
+    TRACE_2L(TRACE_BH_SUBMIT, handle, (uintptr_t)bh_task);
     pthread_cond_signal(&vdpy.vdisplay_signal);
     pthread_mutex_unlock(&vdpy.vdisplay_mutex);
 
     return bh_ok;
 }
 
-void vdpy_cursor_define(int handle __attribute__((unused)), int scanout_id __attribute__((unused)), struct cursor *cur __attribute__((unused)))
+/* The display client draws no cursor, other sinks may */
+void vdpy_cursor_define(int handle, int scanout_id, struct cursor *cur)
 {
-    return;
+    struct vscreen *vscr;
+
+    vscr = vdpy_get_vscreen(handle, scanout_id);
+    if (vscr && vscr->sink_priv && vdpy.sink->cursor_define)
+        vdpy.sink->cursor_define(vscr->sink_priv, cur);
 }
 
-void vdpy_cursor_move(int handle __attribute__((unused)), int scanout_id __attribute__((unused)), uint32_t x __attribute__((unused)), uint32_t y __attribute__((unused)))
+void vdpy_cursor_move(int handle, int scanout_id, uint32_t x, uint32_t y)
 {
-    return;
+    struct vscreen *vscr;
+
+    vscr = vdpy_get_vscreen(handle, scanout_id);
+    if (vscr && vscr->sink_priv && vdpy.sink->cursor_move)
+        vdpy.sink->cursor_move(vscr->sink_priv, x, y);
 }
 
-int vdpy_deinit(int handle __attribute__((unused)))
-{return 0;}
+int vdpy_deinit(int handle)
+{
+    struct vdpy_instance *inst;
+    int i;
+
+    pthread_mutex_lock(&vdpy.inst_mutex);
+    inst = vdpy_get_instance(handle);
+    if (!inst) {
+        pthread_mutex_unlock(&vdpy.inst_mutex);
+        return -1;
+    }
+    vdpy.insts[handle - 1] = NULL;
+    vdpy.s.n_connect--;
+
+    for (i = 0; i < inst->vscrs_num; i++) {
+        vdpy_lane_stop(inst->vscrs + i);
+        vdpy_vscreen_close(inst->vscrs + i);
+    }
+    pthread_mutex_unlock(&vdpy.inst_mutex);
+
+    pthread_mutex_destroy(&inst->frame_mutex);
+    pthread_cond_destroy(&inst->frame_cond);
+    free(inst->vscrs);
+    free(inst);
+    return 0;
+}
 
 int
 gfx_ui_init()
@@ -1535,12 +2541,17 @@ int vdpy_parse_cmd_option(const char *opts)
     struct vscreen *vscr;
 
     error = 0;
-    vdpy.vscrs = calloc(VSCREEN_MAX_NUM, sizeof(struct vscreen));
-    vdpy.vscrs_num = 0;
+    memset(vscr_opts, 0, sizeof(vscr_opts));
+    vscr_opts_num = 0;
 
     stropts = strdup(opts);
     while ((str = strsep(&stropts, ",")) != NULL) {
-        vscr = vdpy.vscrs + vdpy.vscrs_num;
+        if (vscr_opts_num >= VSCREEN_MAX_NUM) {
+            pr_err("%d virtual displays are too many that acrn-dm can't support!\n", vscr_opts_num);
+            break;
+        }
+
+        vscr = vscr_opts + vscr_opts_num;
         tmp = strcasestr(str, "geometry=");
         if (str && strcasestr(str, "geometry=fullscreen")) {
             snum = sscanf(tmp, "geometry=fullscreen:%d", &vscr->pscreen_id);
@@ -1554,7 +2565,7 @@ int vdpy_parse_cmd_option(const char *opts)
             vscr->is_fullscreen = true;
             pr_info("virtual display: fullscreen on monitor %d.\n",
                     vscr->pscreen_id);
-            vdpy.vscrs_num++;
+            vscr_opts_num++;
         } else if (str && strcasestr(str, "geometry=")) {
             snum = sscanf(tmp, "geometry=%dx%d+%d+%d",
                     &vscr->guest_width, &vscr->guest_height,
@@ -1568,12 +2579,7 @@ int vdpy_parse_cmd_option(const char *opts)
             vscr->pscreen_id = 0;
             pr_info("virtual display: windowed on monitor %d.\n",
                     vscr->pscreen_id);
-            vdpy.vscrs_num++;
-        }
-
-        if (vdpy.vscrs_num > VSCREEN_MAX_NUM) {
-            pr_err("%d virtual displays are too many that acrn-dm can't support!\n");
-            break;
+            vscr_opts_num++;
         }
     }
     free(stropts);
@@ -7,14 +7,37 @@
 #ifndef	_iothread_CTX_H_
 #define	_iothread_CTX_H_
 
+#include <stdint.h>
+
 struct iothread_mevent {
 	void (*run)(void *);
 	void *arg;
 	int fd;
 };
+
+struct iothread_ctx;
+
+/*
+ * Scheduling attributes of a dedicated iothread.
+ *
+ * cpu_mask: CPUs the thread may run on, bit N for CPU N; 0 leaves the
+ *           affinity inherited from the creator.
+ * priority: SCHED_FIFO priority; 0 keeps the default policy.
+ */
+struct iothread_attr {
+	const char *name;
+	uint64_t cpu_mask;
+	int priority;
+};
+
 int iothread_add(int fd, struct iothread_mevent *aevt);
 int iothread_del(int fd);
 int iothread_init(void);
 void iothread_deinit(void);
 
+struct iothread_ctx *iothread_create(const struct iothread_attr *attr);
+int iothread_ctx_add(struct iothread_ctx *ctx, int fd, struct iothread_mevent *aevt);
+int iothread_ctx_del(struct iothread_ctx *ctx, int fd);
+void iothread_destroy(struct iothread_ctx *ctx);
+
 #endif
@@ -46,11 +46,23 @@ void output_log(uint8_t level, const char *fmt, ...);
 #define pr_prefix
 #endif
 
-#define pr_err(...) output_log(LOG_ERROR, pr_prefix __VA_ARGS__)
-#define pr_warn(...) output_log(LOG_WARNING, pr_prefix __VA_ARGS__)
-#define pr_notice(...) output_log(LOG_NOTICE, pr_prefix __VA_ARGS__)
-#define pr_info(...) output_log(LOG_INFO, pr_prefix __VA_ARGS__)
-#define pr_dbg(...) output_log(LOG_DEBUG, pr_prefix __VA_ARGS__)
+/*
+ * Messages above LOG_COMPILE_LEVEL are compiled out, the arguments are
+ * still type checked. The others are filtered at run time by the level
+ * from --logger_setting.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL	LOG_INFO
+#endif
+
+#define pr_log(level, ...) \
+	(((level) <= LOG_COMPILE_LEVEL) ? output_log(level, pr_prefix __VA_ARGS__) : (void)0)
+
+#define pr_err(...) pr_log(LOG_ERROR, __VA_ARGS__)
+#define pr_warn(...) pr_log(LOG_WARNING, __VA_ARGS__)
+#define pr_notice(...) pr_log(LOG_NOTICE, __VA_ARGS__)
+#define pr_info(...) pr_log(LOG_INFO, __VA_ARGS__)
+#define pr_dbg(...) pr_log(LOG_DEBUG, __VA_ARGS__)
 
 #undef error
 #define error(x, y, ...) output_log(LOG_ERROR, pr_prefix __VA_ARGS__)
@@ -35,7 +35,13 @@ enum ev_type {
 	EVF_READ_ET,
 	EVF_WRITE_ET,
 	EVF_TIMER,		/* Not supported yet */
-	EVF_SIGNAL		/* Not supported yet */
+	EVF_SIGNAL,		/* Not supported yet */
+	EVF_COUNTER		/* eventfd/timerfd, counter read before run */
+};
+
+enum mevent_backend {
+	MEVENT_BACKEND_EPOLL,
+	MEVENT_BACKEND_IO_URING,
 };
 
 struct mevent;
@@ -49,6 +55,7 @@ int	mevent_delete(struct mevent *evp);
 int	mevent_delete_close(struct mevent *evp);
 int	mevent_notify(void);
 
+void	mevent_set_backend(enum mevent_backend backend);
 void	mevent_dispatch(void);
 int	mevent_init(void);
 void	mevent_deinit(void);
@@ -8,13 +8,23 @@
 
 #include <time.h>  // for struct itimerspec
 #include <sys/param.h>
+#include <sys/queue.h>
 
+/*
+ * CLOCK_MONOTONIC timers share one timerfd through a timer wheel; the
+ * tw_* fields belong to it. CLOCK_REALTIME timers keep a timerfd each.
+ */
 struct acrn_timer {
 	int32_t fd;
 	int32_t clockid;
 	struct mevent *mevp;
 	void (*callback)(void *, uint64_t);
 	void *callback_param;
+
+	LIST_ENTRY(acrn_timer) tw_entry;
+	int32_t tw_idx;
+	uint64_t tw_expires;	/* ns, CLOCK_MONOTONIC */
+	uint64_t tw_interval;	/* ns, 0 for one-shot */
 };
 
 int32_t
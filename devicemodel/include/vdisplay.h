@@ -14,6 +14,9 @@
 #include "dm.h"
 
 #define VDPY_MAX_NUM 4
+/* largest screen, advertised in the EDID */
+#define VDPY_MAX_WIDTH 3840
+#define VDPY_MAX_HEIGHT 2160
 
 typedef void (*bh_task_func)(void *data);
 
@@ -71,6 +74,25 @@ struct surface {
 		uint32_t surf_fourcc;
 		uint32_t dmabuf_offset;
 	} dma_info;
+	/*
+	 * SURFACE_PIXMAN: the pixels are also in a memfd, which the display
+	 * client maps when the surface is set. An update then only carries
+	 * the damage, relative to (x, y); an empty damage is all of it.
+	 */
+	struct {
+		int memfd;		/* -1 if the pixels are not in a memfd */
+		uint64_t offset;	/* of the pixel at (x, y) */
+		uint64_t size;
+	} shm_info;
+	struct {
+		uint32_t x;
+		uint32_t y;
+		uint32_t width;
+		uint32_t height;
+	} damage;
+	/* frame tracing: 0 if untagged, CLOCK_MONOTONIC ns of the guest command */
+	uint32_t frame_id;
+	uint64_t frame_ns;
 };
 
 struct cursor {
@@ -86,6 +108,41 @@ struct cursor {
 	void *data;
 };
 
+/*
+ * Frame latency, from the guest command that produced a frame to the client
+ * presenting it, split in stages. Histograms are log2 of microseconds and
+ * cover a rolling window: "cur" fills up for VDPY_FRAME_WINDOW_NS and then
+ * replaces "last".
+ */
+enum vdpy_frame_stage {
+	VDPY_FRAME_SERVER = 0,	/* guest command -> sent to the client */
+	VDPY_FRAME_DELIVER,	/* sent -> read by the client */
+	VDPY_FRAME_DRAW,	/* read -> copy rendered */
+	VDPY_FRAME_PRESENT,	/* rendered -> eglSwapBuffers returned */
+	VDPY_FRAME_TOTAL,	/* guest command -> presented */
+	VDPY_FRAME_SET,		/* guest set scanout -> surface imported */
+	VDPY_FRAME_STAGES
+};
+
+#define VDPY_FRAME_BUCKETS	20
+#define VDPY_FRAME_WINDOW_NS	(5 * 1000000000ULL)
+
+struct vdpy_frame_window {
+	uint64_t start_ns;
+	uint64_t end_ns;
+	uint32_t frames;	/* presented */
+	uint32_t dropped;	/* sent or queued but never presented */
+	uint32_t unchanged;	/* not sent, tile hashes found nothing new */
+	uint64_t sum_us[VDPY_FRAME_STAGES];
+	uint32_t max_us[VDPY_FRAME_STAGES];
+	uint32_t hist[VDPY_FRAME_STAGES][VDPY_FRAME_BUCKETS];
+};
+
+struct vdpy_frame_stats {
+	struct vdpy_frame_window last;
+	struct vdpy_frame_window cur;
+};
+
 int vdpy_parse_cmd_option(const char *opts);
 int gfx_ui_init();
 int vdpy_init(int *num_vscreens);
@@ -99,8 +156,18 @@ void vdpy_surface_update(int handle, int scanout_id, struct surface *surf);
 void vdpy_cursor_define(int handle, int scanout_id, struct cursor *cur);
 void vdpy_cursor_move(int handle, int scanout_id, uint32_t x, uint32_t y);
 
-void triger_init(void (*func)(void *data), void *data);
+/* func is told the scanout that changed, or -1 when all may have */
+void triger_init(int handle, void (*func)(void *data, int scanout_id), void *data);
+/*
+ * Called once a tagged frame was presented by the client of its screen or
+ * given up on, from whichever thread found out but never the display
+ * thread. The frames of a screen are reported in the order they were sent,
+ * a report covers every frame of the screen before it.
+ */
+void vdpy_frame_notify(int handle, void (*func)(void *data, int scanout_id, uint32_t frame_id),
+		       void *data);
 
 bool vdpy_submit_bh(int handle, struct vdpy_display_bh *bh);
 void vdpy_get_edid(int handle, int scanout_id, uint8_t *edid, size_t size);
+int vdpy_get_frame_stats(int handle, struct vdpy_frame_stats *stats);
 #endif /* _VDISPLAY_H_ */
@@ -0,0 +1,68 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Damage of full frame updates, from tile hashes
+ *
+ */
+#ifndef _VDISPLAY_DAMAGE_H_
+#define _VDISPLAY_DAMAGE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vdisplay.h"
+
+/*
+ * Blob guests flush whole scanouts. With VDPY_TILE_DAMAGE=1, the lane of a
+ * screen keeps a mapping of the surface set last and a hash of each of its
+ * VDPY_TILE x VDPY_TILE tiles. An update that comes without damage is
+ * hashed again: the tiles whose hash changed give its damage, as their
+ * bounding rectangle, and an update with none changed need not be shown.
+ *
+ * Tiles are hashed with CRC32C where the CPU has it. The cost is logged
+ * every VDPY_FRAME_WINDOW_NS, scaled to a 3840x2160 frame.
+ *
+ * The remote cast keeps tiles of its own, with track set: dirty[] then
+ * tells which tiles the last pass found changed.
+ */
+#define VDPY_TILE	64
+
+struct vdpy_tiles {
+	const char *name;	/* of the user, in the log */
+	int handle;
+	int scanout_id;
+	bool track;
+	/* mapping of the surface */
+	void *map;
+	size_t map_size;
+	int dmabuf_fd;		/* -1 for a memfd, which needs no sync */
+	uint64_t offset;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t bpp;
+	/* hashes of the last frame, cols x rows */
+	uint32_t cols;
+	uint32_t rows;
+	uint32_t *hash;
+	uint8_t *dirty;		/* cols x rows, with track */
+	bool invalid;		/* all tiles change in the next pass */
+	/* cost, since the last log */
+	uint64_t log_ns;
+	uint64_t frames;
+	uint64_t pixels;
+	uint64_t hash_ns;
+	uint64_t changed;
+	uint64_t tiles;
+};
+
+bool vdpy_tiles_enabled(void);
+void vdpy_tiles_init(struct vdpy_tiles *t, const char *name, int handle, int scanout_id);
+void vdpy_tiles_set(struct vdpy_tiles *t, struct surface *surf);
+/*
+ * 1 if damage was found and set in surf, which may be NULL, 0 if nothing
+ * changed, -1 if unknown
+ */
+int vdpy_tiles_update(struct vdpy_tiles *t, struct surface *surf);
+void vdpy_tiles_release(struct vdpy_tiles *t);
+
+#endif /* _VDISPLAY_DAMAGE_H_ */
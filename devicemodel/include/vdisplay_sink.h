@@ -0,0 +1,55 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Display sinks: where the frames of a virtual screen go
+ *
+ */
+#ifndef _VDISPLAY_SINK_H_
+#define _VDISPLAY_SINK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vdisplay.h"
+#include "vdisplay_protocol.h"
+
+/*
+ * One sink serves all the screens of the process; VDPY_SINK selects it,
+ * as "<name>[:<args>]". The default sink is the socket of the display
+ * client; the headless sink consumes the frames itself, so that the
+ * backend can be measured without the client or a GPU.
+ *
+ * open() makes the state of a screen. The set, update and modifier calls
+ * of a screen come in order from its lane thread, never the display
+ * thread; the fd of a surface set is only valid during the call. The
+ * cursor calls come from the display thread.
+ *
+ * surface_set() and surface_update() return -1 if the frame could not be
+ * delivered, 0 if it was and the client acknowledges it later, or 1 if it
+ * was presented already and *t tells when.
+ */
+struct vdpy_sink_ops {
+	const char *name;
+	void *(*open)(int handle, int scanout_id, const char *args);
+	void (*close)(void *priv);
+	void (*set_modifier)(void *priv, uint64_t modifier);
+	int (*surface_set)(void *priv, struct surface *surf, struct dpy_frame_timing *t);
+	int (*surface_update)(void *priv, struct surface *surf, uint64_t sent_ns,
+			      struct dpy_frame_timing *t);
+	void (*cursor_define)(void *priv, struct cursor *cur);
+	void (*cursor_move)(void *priv, uint32_t x, uint32_t y);
+};
+
+extern const struct vdpy_sink_ops vdpy_sink_headless;
+
+/*
+ * The remote cast is opened on every screen next to the sink, and gets its
+ * surface calls too, with t NULL. It sends only while a receiver that sent
+ * DPY_EVENT_START_CAST on the control socket is attached.
+ */
+extern const struct vdpy_sink_ops vdpy_sink_cast;
+
+int vdpy_cast_attach(int sock, const struct dpy_cast_req *req);
+/* false if nothing was cast to sock */
+bool vdpy_cast_detach(int sock);
+
+#endif /* _VDISPLAY_SINK_H_ */
@@ -248,6 +248,13 @@ enum {
 #define VIRTIO_CONFIG_S_NEEDS_RESET	0x40
 #endif
 
+/*
+ * VIRTIO_F_IN_ORDER is only available in recent virtio_config.h
+ */
+#ifndef VIRTIO_F_IN_ORDER
+#define VIRTIO_F_IN_ORDER		35
+#endif
+
 /*
  * Bits in VIRTIO_PCI_ISR.  These apply only if not using MSI-X.
  *
@@ -401,6 +408,12 @@ struct virtio_ops {
 				/**< to apply negotiated features */
 	void    (*set_status)(void *, uint64_t);
 				/**< called to set device status */
+	int	(*checkpoint)(void *, void *, size_t);
+				/**< to save device state, returns bytes used */
+	int	(*restore)(void *, const void *, size_t);
+				/**< to resume from state saved by checkpoint */
+	size_t	(*checkpoint_size)(void *);
+				/**< bytes checkpoint may need, fixed for the options */
 };
 
 #define	VQ_ALLOC	0x01	/* set once we have a pfn */
@@ -447,6 +460,12 @@ struct virtio_vq_info {
 	uint16_t save_used;	/**< saved used->idx; see vq_endchains */
 	uint16_t msix_idx;	/**< MSI-X index, or VIRTIO_MSI_NO_VECTOR */
 
+	uint16_t inorder_cnt;	/**< chains released but not yet published */
+	uint16_t inorder_id;	/**< head of the last chain in the batch */
+	uint32_t inorder_len;	/**< I/O length of the last chain */
+
+	uint64_t batch_start;	/**< when the batch's first chain was taken, ns */
+
 	uint32_t pfn;		/**< PFN of virt queue (not shifted!) */
 	struct virtio_iothread viothrd;
 
@@ -559,6 +578,75 @@ virtio_config_changed(struct virtio_base *vb)
 	}
 }
 
+/**
+ * @brief Save transport and device state so that a restarted backend can
+ * resume without resetting the device.
+ *
+ * Provided by the transport. Devices with a checkpoint callback call it
+ * after changing state the callback saves, before returning the request
+ * that changed it; the callback runs from within this call.
+ *
+ * @param vb Pointer to struct virtio_base.
+ *
+ * @return None
+ */
+void virtio_checkpoint(struct virtio_base *vb);
+
+/**
+ * @brief Account a batch of chains completed by vq_endchains().
+ *
+ * Provided by the transport, which exports the numbers as statistics.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param chains Number of chains completed in the batch.
+ * @param ns Time since the first chain of the batch was taken, 0 if unknown.
+ *
+ * @return None
+ */
+void virtio_stats_batch(struct virtio_vq_info *vq, uint16_t chains, uint64_t ns);
+
+/**
+ * @brief Get room for device statistics in the region the transport exports.
+ *
+ * Provided by the transport. The area is only available once the device has
+ * been attached, so devices look it up from their queue handlers.
+ *
+ * @param vb Pointer to struct virtio_base.
+ * @param size Bytes needed.
+ *
+ * @return Zeroed area of size bytes, or NULL if statistics are not exported.
+ */
+void *virtio_stats_area(struct virtio_base *vb, size_t size);
+
+/**
+ * @brief Ask for a shared memory region of the device.
+ *
+ * Provided by the transport. Called from the device init function, after
+ * virtio_linkup(); the region is placed once the device is initialized.
+ *
+ * @param vb Pointer to struct virtio_base.
+ * @param id Device specific shmid the frontend knows the region by.
+ * @param size Bytes needed, a multiple of align.
+ * @param align Alignment of the region in the shared memory, a power of 2.
+ *
+ * @return 0 on success, -1 if no more regions can be asked for.
+ */
+int virtio_shm_region_request(struct virtio_base *vb, uint8_t id, uint64_t size, uint64_t align);
+
+/**
+ * @brief Get a shared memory region asked for with virtio_shm_region_request().
+ *
+ * Provided by the transport.
+ *
+ * @param vb Pointer to struct virtio_base.
+ * @param id Device specific shmid of the region.
+ * @param offset Where the region starts, from the start of the shared memory.
+ * @param size Bytes in the region.
+ *
+ * @return Mapping of the region, or NULL if it did not fit or was not asked for.
+ */
+void *virtio_shm_region(struct virtio_base *vb, uint8_t id, uint64_t *offset, uint64_t *size);
+
 struct iovec;
 
 /**
@@ -681,6 +769,23 @@ void vq_retchain(struct virtio_vq_info *vq);
  */
 void vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen);
 
+/**
+ * @brief Return specified request chain to the guest for a device that
+ * completes chains strictly in the order they were made available.
+ *
+ * If VIRTIO_F_IN_ORDER has been negotiated, the used ring is not touched
+ * here; the batch is published with a single used element by
+ * vq_endchains(). Otherwise this is equivalent to vq_relchain().
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param idx Pointer to available ring position, returned by vq_getchain().
+ * @param iolen Number of data bytes to be returned to frontend.
+ *
+ * @return None
+ */
+void vq_relchain_inorder(struct virtio_vq_info *vq, uint16_t idx,
+		uint32_t iolen);
+
 /**
  * @brief Driver has finished processing "available" chains and calling
  * vq_relchain on each one.
@@ -5,16 +5,15 @@
 
 #include <log.h>
 #include <pci_core.h>
+#include <virtio.h>
 #include <vmmapi.h>
 #include <pm.h>
 
 #include "shmem.h"
+#include "irq_coalesce.h"
 #include "virtio_over_shmem.h"
 #include "utils.h"
-
-#ifdef ANDROID
-#include <android/log.h>
-#endif
+#include "log_ring.h"
 
 bool is_winvm = false;
 bool stdio_in_use = false;
@@ -31,16 +30,12 @@ void vm_set_suspend_mode(enum vm_suspend_how how)
 	suspend_mode = how;
 }
 
-void output_log(uint8_t level __attribute__((unused)), const char *fmt, ...)
+void output_log(uint8_t level, const char *fmt, ...)
 {
 	va_list args;
 
 	va_start(args, fmt);
-#ifdef ANDROID
-    __android_log_vprint (ANDROID_LOG_INFO, "backend" , fmt, args);
-#else
-	vprintf(fmt, args);
-#endif
+	log_ring_vprint(level, fmt, args);
 	va_end(args);
 }
 
@@ -92,19 +87,50 @@ vm_find_memfd_region(struct vmctx *ctx, vm_paddr_t gpa, struct vm_mem_region *re
 
 void pci_generate_msix_config(struct pci_vdev *dev, int index)
 {
-	struct shmem_info *info = (struct shmem_info *)dev->vmctx;
-
-	virtio_header->config_event= 1;
-	virtio_header->config[0] = 0x1;
+	struct vos_instance *vi = (struct vos_instance *)dev->vmctx;
+	struct shmem_info *info = &vi->shmem_info;
+
+	vi->header->config_event= 1;
+	vi->header->config[0] = 0x1;
+	if (index >= 0 && index < VOS_STATS_MAX_VECTORS) {
+		VOS_STAT_ADD(vi, irqs_raised[index], 1);
+		VOS_STAT_ADD(vi, doorbells_sent[index], 1);
+	}
 	__sync_synchronize();
 	info->ops->notify_peer(info, index);
 }
 
+void virtio_checkpoint(struct virtio_base *vb)
+{
+	vos_checkpoint_save((struct vos_instance *)vb->dev->vmctx, true);
+}
+
+void virtio_stats_batch(struct virtio_vq_info *vq, uint16_t chains, uint64_t ns)
+{
+	vos_stats_batch((struct vos_instance *)vq->base->dev->vmctx, vq->num, chains, ns);
+}
+
+void *virtio_stats_area(struct virtio_base *vb, size_t size)
+{
+	return vos_stats_dev_area((struct vos_instance *)vb->dev->vmctx, size);
+}
+
+int virtio_shm_region_request(struct virtio_base *vb, uint8_t id, uint64_t size, uint64_t align)
+{
+	return vos_shm_region_request((struct vos_instance *)vb->dev->vmctx, id, size, align);
+}
+
+void *virtio_shm_region(struct virtio_base *vb, uint8_t id, uint64_t *offset, uint64_t *size)
+{
+	return vos_shm_region((struct vos_instance *)vb->dev->vmctx, id, offset, size);
+}
+
 void pci_generate_msix(struct pci_vdev *dev, int index)
 {
-	struct shmem_info *info = (struct shmem_info *)dev->vmctx;
+	struct vos_instance *vi = (struct vos_instance *)dev->vmctx;
 
-	virtio_header->queue_event = 1;
-	__sync_synchronize();
-	info->ops->notify_peer(info, index);
+	vi->header->queue_event = 1;
+	if (index >= 0 && index < VOS_STATS_MAX_VECTORS)
+		VOS_STAT_ADD(vi, irqs_raised[index], 1);
+	irq_coalesce_raise(&vi->irqc, &vi->shmem_info, index);
 }
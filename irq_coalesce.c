@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <log.h>
+#include <timer.h>
+
+#include "irq_coalesce.h"
+
+/* the device whose doorbell the current thread is handling, if any */
+static __thread struct irq_coalesce *pass_irqc;
+
+static void count_rung(struct irq_coalesce *irqc, int vector)
+{
+	if (irqc->rung && vector >= 0 && vector < IRQ_COALESCE_MAX_VECTORS)
+		__atomic_fetch_add(&irqc->rung[vector], 1, __ATOMIC_RELAXED);
+}
+
+static void ring_locked(struct irq_coalesce *irqc, int vector)
+{
+	irqc->pending[vector] = 0;
+	count_rung(irqc, vector);
+	irqc->info->ops->notify_peer(irqc->info, vector);
+}
+
+static bool due_locked(struct irq_coalesce *irqc, int vector)
+{
+	return irqc->params.max_delay_us == 0 ||
+		irqc->pending[vector] >= irqc->params.max_pending;
+}
+
+static void arm_timer_locked(struct irq_coalesce *irqc)
+{
+	struct itimerspec ts;
+
+	if (irqc->timer_armed)
+		return;
+
+	memset(&ts, 0, sizeof(ts));
+	ts.it_value.tv_sec = irqc->params.max_delay_us / 1000000;
+	ts.it_value.tv_nsec = (irqc->params.max_delay_us % 1000000) * 1000;
+	if (acrn_timer_settime(&irqc->timer, &ts) == 0) {
+		irqc->timer_armed = true;
+	} else {
+		/* Never sit on an interrupt without a timer to release it */
+		pr_err("%s: failed to arm flush timer\n", __func__);
+		for (int i = 0; i < IRQ_COALESCE_MAX_VECTORS; i++)
+			if (irqc->pending[i])
+				ring_locked(irqc, i);
+	}
+}
+
+static void flush_locked(struct irq_coalesce *irqc, bool all)
+{
+	bool barrier = false, deferred = false;
+
+	for (int i = 0; i < IRQ_COALESCE_MAX_VECTORS; i++) {
+		if (irqc->pending[i] == 0)
+			continue;
+
+		if (!all && !due_locked(irqc, i)) {
+			deferred = true;
+			continue;
+		}
+
+		if (!barrier) {
+			__sync_synchronize();
+			barrier = true;
+		}
+		ring_locked(irqc, i);
+	}
+
+	if (deferred)
+		arm_timer_locked(irqc);
+}
+
+static void flush_timer_handler(void *arg, uint64_t nexp __attribute__((unused)))
+{
+	struct irq_coalesce *irqc = arg;
+
+	pthread_mutex_lock(&irqc->mtx);
+	irqc->timer_armed = false;
+	flush_locked(irqc, true);
+	pthread_mutex_unlock(&irqc->mtx);
+}
+
+int irq_coalesce_init(struct irq_coalesce *irqc, struct shmem_info *info,
+		      const struct irq_coalesce_params *params)
+{
+	memset(irqc, 0, sizeof(*irqc));
+	pthread_mutex_init(&irqc->mtx, NULL);
+
+	irqc->info = info;
+	irqc->params = *params;
+	if (irqc->params.max_pending == 0)
+		irqc->params.max_pending = 1;
+
+	if (irqc->params.max_delay_us) {
+		irqc->timer.clockid = CLOCK_MONOTONIC;
+		if (acrn_timer_init(&irqc->timer, flush_timer_handler, irqc) < 0) {
+			pr_err("%s: failed to create flush timer, coalescing limited to dispatch passes\n",
+			       __func__);
+			irqc->params.max_delay_us = 0;
+		}
+	}
+	irqc->active = true;
+
+	pr_info("Interrupt coalescing: max delay %u us, max pending %u\n",
+		irqc->params.max_delay_us, irqc->params.max_pending);
+	return 0;
+}
+
+void irq_coalesce_deinit(struct irq_coalesce *irqc)
+{
+	pthread_mutex_lock(&irqc->mtx);
+	if (irqc->active) {
+		flush_locked(irqc, true);
+		if (irqc->params.max_delay_us)
+			acrn_timer_deinit(&irqc->timer);
+		irqc->active = false;
+	}
+	pthread_mutex_unlock(&irqc->mtx);
+	pthread_mutex_destroy(&irqc->mtx);
+}
+
+void irq_coalesce_begin_pass(struct irq_coalesce *irqc)
+{
+	pass_irqc = irqc;
+}
+
+void irq_coalesce_end_pass(struct irq_coalesce *irqc)
+{
+	pass_irqc = NULL;
+
+	pthread_mutex_lock(&irqc->mtx);
+	if (irqc->active)
+		flush_locked(irqc, false);
+	pthread_mutex_unlock(&irqc->mtx);
+}
+
+/*
+ * Caller has already updated the shared header for this interrupt; the
+ * barrier ordering those stores before the doorbell is issued here.
+ */
+void irq_coalesce_raise(struct irq_coalesce *irqc, struct shmem_info *info, int vector)
+{
+	pthread_mutex_lock(&irqc->mtx);
+
+	if (!irqc->active || vector < 0 || vector >= IRQ_COALESCE_MAX_VECTORS) {
+		pthread_mutex_unlock(&irqc->mtx);
+		count_rung(irqc, vector);
+		__sync_synchronize();
+		info->ops->notify_peer(info, vector);
+		return;
+	}
+
+	irqc->pending[vector]++;
+	if (pass_irqc != irqc) {
+		if (due_locked(irqc, vector)) {
+			__sync_synchronize();
+			ring_locked(irqc, vector);
+		} else {
+			arm_timer_locked(irqc);
+		}
+	}
+
+	pthread_mutex_unlock(&irqc->mtx);
+}
+
+void irq_coalesce_flush(struct irq_coalesce *irqc)
+{
+	pthread_mutex_lock(&irqc->mtx);
+	if (irqc->active)
+		flush_locked(irqc, true);
+	pthread_mutex_unlock(&irqc->mtx);
+}
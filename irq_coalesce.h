@@ -0,0 +1,47 @@
+#ifndef __BACKENDS_IRQ_COALESCE_H__
+#define __BACKENDS_IRQ_COALESCE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <timer.h>
+
+#include "shmem.h"
+
+#define IRQ_COALESCE_MAX_VECTORS	8
+
+/*
+ * Doorbell coalescing policy, applied per vector. With the defaults (both
+ * zero) a doorbell is rung as soon as an interrupt is raised, except that
+ * interrupts raised while a doorbell from the frontend is being handled are
+ * merged into one doorbell per vector at the end of that dispatch pass.
+ */
+struct irq_coalesce_params {
+	uint32_t max_delay_us;	/* longest time an interrupt may be held back */
+	uint32_t max_pending;	/* ring right away once this many are pending */
+};
+
+/* Per-device coalescing state, one for each shared memory region */
+struct irq_coalesce {
+	pthread_mutex_t mtx;
+	struct shmem_info *info;
+	struct irq_coalesce_params params;
+	struct acrn_timer timer;
+	bool active;
+	bool timer_armed;
+	uint32_t pending[IRQ_COALESCE_MAX_VECTORS];
+	uint64_t *rung;		/* per-vector doorbell counts, optional */
+};
+
+int irq_coalesce_init(struct irq_coalesce *irqc, struct shmem_info *info,
+		      const struct irq_coalesce_params *params);
+void irq_coalesce_deinit(struct irq_coalesce *irqc);
+
+void irq_coalesce_begin_pass(struct irq_coalesce *irqc);
+void irq_coalesce_end_pass(struct irq_coalesce *irqc);
+
+void irq_coalesce_raise(struct irq_coalesce *irqc, struct shmem_info *info, int vector);
+void irq_coalesce_flush(struct irq_coalesce *irqc);
+
+#endif  /* __BACKENDS_IRQ_COALESCE_H__ */
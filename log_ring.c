@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <log.h>
+#include <dm_string.h>
+
+#include "log_ring.h"
+
+#ifdef ANDROID
+#include <android/log.h>
+#endif
+
+#define LOG_RING_SLOTS		64	/* power of 2 */
+#define LOG_RING_MAX		64
+#define LOG_RATE_SITES		8
+#define LOG_RATE_WINDOW_NS	1000000000ULL
+#define LOG_IDLE_WAIT_NS	100000000ULL
+
+struct log_record {
+	uint64_t seq;
+	uint8_t level;
+	char msg[MAX_ONE_LOG_SIZE];
+};
+
+/*
+ * Single producer, single consumer: the owning thread moves tail, the
+ * logger moves head. A ring outlives its thread and is handed to the next
+ * new one, records left in it are still drained.
+ */
+struct log_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t dropped;
+	bool busy;
+	struct log_record recs[LOG_RING_SLOTS];
+};
+
+/* a call site seen recently by this thread, for rate limiting */
+struct log_site {
+	const char *fmt;
+	uint64_t start;
+	uint32_t count;
+	uint32_t suppressed;
+};
+
+static __thread struct {
+	struct log_ring *ring;
+	bool attached;
+	unsigned int next_site;
+	struct log_site sites[LOG_RATE_SITES];
+} log_self;
+
+/* --logger_setting console,level=N */
+static uint8_t log_level = DEFAULT_LOG_LEVEL;
+
+static struct log_ring *rings[LOG_RING_MAX];
+static int nr_rings;
+static pthread_mutex_t rings_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t rings_key;
+static pthread_once_t rings_once = PTHREAD_ONCE_INIT;
+
+static uint64_t log_seq;
+static bool log_running;
+static int log_sleeping;
+static pthread_t log_tid;
+/* one drainer at a time: the logger, or the exit handler */
+static pthread_mutex_t drain_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wake_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t
+log_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+log_sink(uint8_t level, const char *msg)
+{
+#ifdef ANDROID
+	int prio = (level <= LOG_ERROR) ? ANDROID_LOG_ERROR :
+		   (level <= LOG_WARNING) ? ANDROID_LOG_WARN :
+		   (level <= LOG_INFO) ? ANDROID_LOG_INFO : ANDROID_LOG_DEBUG;
+
+	__android_log_write(prio, "backend", msg);
+#else
+	(void)level;
+	fputs(msg, stdout);
+#endif
+}
+
+static void
+log_ring_release(void *arg)
+{
+	struct log_ring *ring = arg;
+
+	pthread_mutex_lock(&rings_mtx);
+	ring->busy = false;
+	pthread_mutex_unlock(&rings_mtx);
+}
+
+static void
+log_ring_key_init(void)
+{
+	if (pthread_key_create(&rings_key, log_ring_release))
+		fprintf(stderr, "%s: failed to create the thread key\n", __func__);
+}
+
+static struct log_ring *
+log_ring_attach(void)
+{
+	struct log_ring *ring = NULL;
+	int i;
+
+	log_self.attached = true;
+	pthread_once(&rings_once, log_ring_key_init);
+
+	pthread_mutex_lock(&rings_mtx);
+	for (i = 0; i < nr_rings; i++) {
+		if (!rings[i]->busy) {
+			ring = rings[i];
+			break;
+		}
+	}
+	if (!ring && nr_rings < LOG_RING_MAX) {
+		ring = calloc(1, sizeof(*ring));
+		if (ring)
+			rings[nr_rings] = ring;
+		/* the logger reads nr_rings without the lock */
+		if (ring)
+			__atomic_store_n(&nr_rings, nr_rings + 1, __ATOMIC_RELEASE);
+	}
+	if (ring)
+		ring->busy = true;
+	pthread_mutex_unlock(&rings_mtx);
+
+	if (ring)
+		pthread_setspecific(rings_key, ring);
+	log_self.ring = ring;
+	return ring;
+}
+
+/*
+ * Let at most LOG_RATE_BURST messages per window through for each call
+ * site, told apart by their format string. *suppressed returns how many
+ * were held back in the window that just ended.
+ */
+static bool
+log_rate_check(const char *fmt, uint32_t *suppressed)
+{
+	struct log_site *site = NULL;
+	uint64_t now = log_now_ns();
+	int i;
+
+	*suppressed = 0;
+	for (i = 0; i < LOG_RATE_SITES; i++) {
+		if (log_self.sites[i].fmt == fmt) {
+			site = &log_self.sites[i];
+			break;
+		}
+	}
+	if (!site) {
+		site = &log_self.sites[log_self.next_site++ % LOG_RATE_SITES];
+		memset(site, 0, sizeof(*site));
+		site->fmt = fmt;
+		site->start = now;
+	}
+
+	if (now - site->start >= LOG_RATE_WINDOW_NS) {
+		*suppressed = site->suppressed;
+		site->start = now;
+		site->count = 0;
+		site->suppressed = 0;
+	}
+	if (site->count >= LOG_RATE_BURST) {
+		site->suppressed++;
+		return false;
+	}
+	site->count++;
+	return true;
+}
+
+static void
+log_ring_wake(void)
+{
+	if (!__atomic_load_n(&log_sleeping, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&wake_mtx);
+	pthread_cond_signal(&wake_cond);
+	pthread_mutex_unlock(&wake_mtx);
+}
+
+static void
+log_ring_emit(struct log_ring *ring, uint8_t level, const char *fmt, va_list args)
+{
+	struct log_record *rec;
+	uint32_t tail = ring->tail;
+
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = &ring->recs[tail & (LOG_RING_SLOTS - 1)];
+	vsnprintf(rec->msg, sizeof(rec->msg), fmt, args);
+	rec->level = level;
+	rec->seq = __atomic_fetch_add(&log_seq, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+	log_ring_wake();
+}
+
+static void
+log_ring_note(struct log_ring *ring, uint8_t level, const char *fmt, ...)
+{
+	char msg[MAX_ONE_LOG_SIZE];
+	va_list args;
+
+	va_start(args, fmt);
+	if (ring) {
+		log_ring_emit(ring, level, fmt, args);
+	} else {
+		vsnprintf(msg, sizeof(msg), fmt, args);
+		log_sink(level, msg);
+	}
+	va_end(args);
+}
+
+void
+log_ring_vprint(uint8_t level, const char *fmt, va_list args)
+{
+	struct log_ring *ring = NULL;
+	char msg[MAX_ONE_LOG_SIZE];
+	uint32_t suppressed;
+
+	if (level > log_level)
+		return;
+	if (!log_rate_check(fmt, &suppressed))
+		return;
+
+	if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+		ring = log_self.ring;
+		if (!ring && !log_self.attached)
+			ring = log_ring_attach();
+	}
+
+	if (suppressed)
+		log_ring_note(ring, level, "log: %u more like \"%.64s\" suppressed\n",
+			      suppressed, fmt);
+
+	if (ring) {
+		log_ring_emit(ring, level, fmt, args);
+	} else {
+		vsnprintf(msg, sizeof(msg), fmt, args);
+		log_sink(level, msg);
+	}
+}
+
+/* Write out everything buffered, oldest first across all rings */
+static int
+log_ring_drain(void)
+{
+	struct log_ring *ring, *next;
+	struct log_record *rec;
+	char msg[64];
+	uint32_t dropped, head;
+	int i, n, drained = 0;
+
+	pthread_mutex_lock(&drain_mtx);
+	n = __atomic_load_n(&nr_rings, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		dropped = __atomic_exchange_n(&rings[i]->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped) {
+			snprintf(msg, sizeof(msg), "log: %u messages dropped\n", dropped);
+			log_sink(LOG_WARNING, msg);
+		}
+	}
+
+	for (;;) {
+		next = NULL;
+		for (i = 0; i < n; i++) {
+			ring = rings[i];
+			head = ring->head;
+			if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+				continue;
+			if (!next || ring->recs[head & (LOG_RING_SLOTS - 1)].seq <
+				     next->recs[next->head & (LOG_RING_SLOTS - 1)].seq)
+				next = ring;
+		}
+		if (!next)
+			break;
+
+		rec = &next->recs[next->head & (LOG_RING_SLOTS - 1)];
+		log_sink(rec->level, rec->msg);
+		__atomic_store_n(&next->head, next->head + 1, __ATOMIC_RELEASE);
+		drained++;
+	}
+	pthread_mutex_unlock(&drain_mtx);
+	return drained;
+}
+
+static bool
+log_ring_pending(void)
+{
+	int i, n = __atomic_load_n(&nr_rings, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < n; i++)
+		if (rings[i]->head != __atomic_load_n(&rings[i]->tail, __ATOMIC_SEQ_CST))
+			return true;
+	return false;
+}
+
+static void *
+log_ring_thread(void *arg __attribute__((unused)))
+{
+	struct timespec ts;
+	uint64_t ns;
+
+	pthread_setname_np(pthread_self(), "logger");
+	while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+		if (log_ring_drain())
+			continue;
+
+		pthread_mutex_lock(&wake_mtx);
+		__atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+		if (!log_ring_pending() && __atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ns = ts.tv_nsec + LOG_IDLE_WAIT_NS;
+			ts.tv_sec += ns / 1000000000ULL;
+			ts.tv_nsec = ns % 1000000000ULL;
+			pthread_cond_timedwait(&wake_cond, &wake_mtx, &ts);
+		}
+		__atomic_store_n(&log_sleeping, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&wake_mtx);
+	}
+	log_ring_drain();
+	return NULL;
+}
+
+static void
+log_ring_atexit(void)
+{
+	log_ring_drain();
+}
+
+int
+log_ring_start(void)
+{
+	static bool atexit_done;
+
+	if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+		return 0;
+
+	__atomic_store_n(&log_running, true, __ATOMIC_RELEASE);
+	if (pthread_create(&log_tid, NULL, log_ring_thread, NULL)) {
+		__atomic_store_n(&log_running, false, __ATOMIC_RELEASE);
+		fprintf(stderr, "%s: failed to start the logger thread\n", __func__);
+		return -1;
+	}
+	if (!atexit_done) {
+		atexit(log_ring_atexit);
+		atexit_done = true;
+	}
+	return 0;
+}
+
+void
+log_ring_stop(void)
+{
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&log_running, false, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&wake_mtx);
+	pthread_cond_signal(&wake_cond);
+	pthread_mutex_unlock(&wake_mtx);
+	pthread_join(log_tid, NULL);
+	log_ring_drain();
+}
+
+/*
+ * --logger_setting: console,level=4
+ * Same syntax as acrn-dm; the backend only has the console logger.
+ */
+int
+init_logger_setting(const char *opt)
+{
+	char *orig, *str, *elem, *name, *level;
+	uint32_t lvl_val;
+	int error = 0;
+
+	orig = str = strdup(opt);
+	if (!str) {
+		fprintf(stderr, "%s: strdup returns NULL\n", __func__);
+		return -1;
+	}
+
+	for (elem = strsep(&str, ";"); elem != NULL; elem = strsep(&str, ";")) {
+		name = strsep(&elem, ",");
+		level = elem;
+
+		if (!level || (strncmp(level, "level=", 6) != 0) ||
+		    (dm_strtoui(level + 6, &level, 10, &lvl_val))) {
+			fprintf(stderr, "logger setting param error: %s, please check!\n", opt);
+			error = -1;
+			break;
+		}
+
+		if (strcmp(name, "console") != 0) {
+			fprintf(stderr, "there is no logger: %s found in the backend, please check!\n", name);
+			error = -1;
+			break;
+		}
+		log_level = (uint8_t)lvl_val;
+	}
+
+	free(orig);
+	return error;
+}
+
+void
+deinit_loggers(void)
+{
+	log_ring_stop();
+}
@@ -0,0 +1,23 @@
+#ifndef __BACKENDS_LOG_RING_H__
+#define __BACKENDS_LOG_RING_H__
+
+#include <stdint.h>
+#include <stdarg.h>
+
+/*
+ * Asynchronous logging behind output_log(). A thread formats its message
+ * into its own ring and goes on; the logger thread drains all rings in the
+ * order the messages were logged and writes them out. Messages logged while
+ * the logger is not running are written directly.
+ *
+ * Each call site may log LOG_RATE_BURST messages per second per thread, the
+ * rest are counted and reported as suppressed. A full ring drops messages
+ * and the drop is reported as well.
+ */
+#define LOG_RATE_BURST		10
+
+int log_ring_start(void);
+void log_ring_stop(void);
+void log_ring_vprint(uint8_t level, const char *fmt, va_list args);
+
+#endif	/* __BACKENDS_LOG_RING_H__ */
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <log.h>
+
+#include "mem_pool.h"
+
+struct mem_arena_spill {
+	struct mem_arena_spill *next;
+	size_t size;
+	char data[] __attribute__((aligned(MEM_ARENA_ALIGN)));
+};
+
+struct mem_slab_chunk {
+	struct mem_slab_chunk *next;
+	size_t size;
+	char data[] __attribute__((aligned(MEM_ARENA_ALIGN)));
+};
+
+struct mem_slab_free {
+	struct mem_slab_free *next;
+};
+
+static inline size_t
+mem_align(size_t size)
+{
+	return (size + MEM_ARENA_ALIGN - 1) & ~((size_t)MEM_ARENA_ALIGN - 1);
+}
+
+int
+mem_arena_init(struct mem_arena *arena, size_t size)
+{
+	memset(arena, 0, sizeof(*arena));
+	size = mem_align(size);
+	if (size) {
+		arena->buf = malloc(size);
+		if (!arena->buf)
+			return -1;
+	}
+	arena->size = size;
+	return 0;
+}
+
+void
+mem_arena_deinit(struct mem_arena *arena)
+{
+	mem_arena_reset(arena);
+	free(arena->buf);
+	arena->buf = NULL;
+	arena->size = 0;
+}
+
+void *
+mem_arena_alloc(struct mem_arena *arena, size_t size)
+{
+	struct mem_arena_spill *spill;
+	void *ptr;
+
+	size = mem_align(size);
+	if (arena->used + size <= arena->size) {
+		ptr = arena->buf + arena->used;
+		arena->used += size;
+		return ptr;
+	}
+
+	spill = malloc(sizeof(*spill) + size);
+	if (!spill)
+		return NULL;
+	spill->size = size;
+	spill->next = arena->spill;
+	arena->spill = spill;
+	arena->used += size;
+	return spill->data;
+}
+
+void
+mem_arena_reset(struct mem_arena *arena)
+{
+	struct mem_arena_spill *spill;
+	size_t size;
+	char *buf;
+
+	if (!arena->spill) {
+		arena->used = 0;
+		return;
+	}
+
+	while ((spill = arena->spill) != NULL) {
+		arena->spill = spill->next;
+		free(spill);
+	}
+
+	/* make room for what this round needed, on failure keep spilling */
+	size = arena->size ? arena->size : MEM_ARENA_ALIGN;
+	while (size < arena->used)
+		size <<= 1;
+	buf = malloc(size);
+	if (buf) {
+		free(arena->buf);
+		arena->buf = buf;
+		arena->size = size;
+		arena->grows++;
+		pr_dbg("%s: grown to %zu bytes\n", __func__, size);
+	}
+	arena->used = 0;
+}
+
+static inline int
+mem_slab_class(size_t size)
+{
+	int shift = MEM_SLAB_MIN_SHIFT;
+
+	while (((size_t)1 << shift) < size)
+		shift++;
+	return shift - MEM_SLAB_MIN_SHIFT;
+}
+
+int
+mem_slab_init(struct mem_slab *slab)
+{
+	memset(slab, 0, sizeof(*slab));
+	return pthread_mutex_init(&slab->mtx, NULL) ? -1 : 0;
+}
+
+void
+mem_slab_deinit(struct mem_slab *slab)
+{
+	struct mem_slab_chunk *chunk;
+
+	while ((chunk = slab->chunks) != NULL) {
+		slab->chunks = chunk->next;
+		free(chunk);
+	}
+	memset(slab->free, 0, sizeof(slab->free));
+	pthread_mutex_destroy(&slab->mtx);
+}
+
+/* called with the slab locked */
+static int
+mem_slab_refill(struct mem_slab *slab, int cls)
+{
+	struct mem_slab_chunk *chunk;
+	struct mem_slab_free *obj;
+	size_t objsz, n, i;
+
+	objsz = (size_t)1 << (cls + MEM_SLAB_MIN_SHIFT);
+	n = (objsz < MEM_SLAB_CHUNK) ? MEM_SLAB_CHUNK / objsz : 1;
+	chunk = malloc(sizeof(*chunk) + n * objsz);
+	if (!chunk)
+		return -1;
+	chunk->size = n * objsz;
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+	slab->refills++;
+
+	for (i = 0; i < n; i++) {
+		obj = (struct mem_slab_free *)(chunk->data + i * objsz);
+		obj->next = slab->free[cls];
+		slab->free[cls] = obj;
+	}
+	return 0;
+}
+
+void *
+mem_slab_alloc(struct mem_slab *slab, size_t size)
+{
+	struct mem_slab_free *obj;
+	int cls;
+
+	if (size > ((size_t)1 << MEM_SLAB_MAX_SHIFT)) {
+		__atomic_fetch_add(&slab->large, 1, __ATOMIC_RELAXED);
+		return malloc(size);
+	}
+
+	cls = mem_slab_class(size);
+	pthread_mutex_lock(&slab->mtx);
+	if (!slab->free[cls] && mem_slab_refill(slab, cls)) {
+		pthread_mutex_unlock(&slab->mtx);
+		return NULL;
+	}
+	obj = slab->free[cls];
+	slab->free[cls] = obj->next;
+	pthread_mutex_unlock(&slab->mtx);
+	return obj;
+}
+
+void *
+mem_slab_zalloc(struct mem_slab *slab, size_t size)
+{
+	void *ptr = mem_slab_alloc(slab, size);
+
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+void
+mem_slab_free(struct mem_slab *slab, void *ptr, size_t size)
+{
+	struct mem_slab_free *obj = ptr;
+	int cls;
+
+	if (!ptr)
+		return;
+	if (size > ((size_t)1 << MEM_SLAB_MAX_SHIFT)) {
+		free(ptr);
+		return;
+	}
+
+	cls = mem_slab_class(size);
+	pthread_mutex_lock(&slab->mtx);
+	obj->next = slab->free[cls];
+	slab->free[cls] = obj;
+	pthread_mutex_unlock(&slab->mtx);
+}
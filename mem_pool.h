@@ -0,0 +1,65 @@
+#ifndef __BACKENDS_MEM_POOL_H__
+#define __BACKENDS_MEM_POOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Allocators for the device request paths, so that a command in steady
+ * state does not go to malloc.
+ *
+ * A mem_arena is a bump allocator for buffers that only live while one
+ * request is handled: the handler allocates from it and the queue loop
+ * resets it once the chain is released. It has a single user. When it runs
+ * out, the overflow is malloc'ed and freed on reset, and the arena grows to
+ * the peak use at that reset, so the overflow happens only while warming up.
+ *
+ * A mem_slab keeps freed blocks on per size class free lists, for objects
+ * that outlive a request (resources, their backing arrays). Sizes are
+ * rounded up to a power of two between MEM_SLAB_MIN_SHIFT and
+ * MEM_SLAB_MAX_SHIFT; larger blocks go straight to malloc. Memory taken by
+ * a slab is given back only by mem_slab_deinit(). It may be used from any
+ * thread. The caller passes the size of a block back when freeing it.
+ */
+
+#define MEM_ARENA_ALIGN		16
+
+struct mem_arena_spill;
+
+struct mem_arena {
+	char *buf;
+	size_t size;
+	size_t used;			/* including the overflow */
+	struct mem_arena_spill *spill;	/* malloc'ed overflow, freed on reset */
+	uint64_t grows;			/* times the buffer was enlarged */
+};
+
+int mem_arena_init(struct mem_arena *arena, size_t size);
+void mem_arena_deinit(struct mem_arena *arena);
+void *mem_arena_alloc(struct mem_arena *arena, size_t size);
+void mem_arena_reset(struct mem_arena *arena);
+
+#define MEM_SLAB_MIN_SHIFT	5	/* 32 bytes */
+#define MEM_SLAB_MAX_SHIFT	18	/* 256 KiB */
+#define MEM_SLAB_CLASSES	(MEM_SLAB_MAX_SHIFT - MEM_SLAB_MIN_SHIFT + 1)
+#define MEM_SLAB_CHUNK		(64 * 1024)
+
+struct mem_slab_chunk;
+struct mem_slab_free;
+
+struct mem_slab {
+	pthread_mutex_t mtx;
+	struct mem_slab_free *free[MEM_SLAB_CLASSES];
+	struct mem_slab_chunk *chunks;	/* everything taken from malloc */
+	uint64_t refills;		/* chunks allocated */
+	uint64_t large;			/* blocks above the largest class */
+};
+
+int mem_slab_init(struct mem_slab *slab);
+void mem_slab_deinit(struct mem_slab *slab);
+void *mem_slab_alloc(struct mem_slab *slab, size_t size);
+void *mem_slab_zalloc(struct mem_slab *slab, size_t size);
+void mem_slab_free(struct mem_slab *slab, void *ptr, size_t size);
+
+#endif	/* __BACKENDS_MEM_POOL_H__ */
@@ -0,0 +1,361 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Receiver of the remote cast of acrn-virtio-gpu: rebuilds the frames of a
+ * screen from the tiles sent on the control socket, see vdisplay_protocol.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+#include "vdisplay_protocol.h"
+
+#define CAST_PORT		"6999"
+#define CAST_LOG_NS		(5 * 1000000000ULL)
+
+struct cast_fb {
+	struct dpy_cast_surface s;
+	uint32_t cols;
+	uint32_t rows;
+	uint8_t *pixels;
+	uint8_t *raw;
+	size_t raw_cap;
+	uint8_t *z;
+	size_t z_cap;
+};
+
+static volatile sig_atomic_t stop;
+
+static void display_usage(void)
+{
+	printf("acrncast - receiver of the remote cast of acrn-virtio-gpu\n"
+	       "[Usage] acrncast [-a addr] [-p port] [-s scanout] [-f max_fps] [-n frames] [-o file.ppm]\n\n"
+	       "[Options]\n"
+	       "\t-h: print this message\n"
+	       "\t-a: address of the backend, 127.0.0.1 by default\n"
+	       "\t-p: control port of the backend, " CAST_PORT " by default\n"
+	       "\t-s: screen to cast, 0 by default\n"
+	       "\t-f: frame rate cap asked from the backend, 0 for none\n"
+	       "\t-n: stop after this many frames\n"
+	       "\t-o: write the last frame there as a PPM image\n");
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void handle_signal(int sig)
+{
+	stop = 1;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = recv(fd, p, len, 0);
+		if (ret < 0 && errno == EINTR && !stop)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int send_event(int fd, int type, const void *body, int size)
+{
+	struct dpy_evt_header hdr;
+
+	hdr.e_type = type;
+	hdr.e_magic = DISPLAY_MAGIC_CODE;
+	hdr.e_size = size;
+	if (send(fd, &hdr, sizeof(hdr), MSG_NOSIGNAL) != sizeof(hdr))
+		return -1;
+	if (size && send(fd, body, size, MSG_NOSIGNAL) != size)
+		return -1;
+	return 0;
+}
+
+static int reserve(uint8_t **buf, size_t *cap, size_t size)
+{
+	uint8_t *p;
+
+	if (size <= *cap)
+		return 0;
+	p = realloc(*buf, size);
+	if (!p)
+		return -1;
+	*buf = p;
+	*cap = size;
+	return 0;
+}
+
+static int set_surface(struct cast_fb *fb, const struct dpy_cast_surface *s)
+{
+	if (!s->width || !s->height || !s->bpp || !s->tile)
+		return -1;
+	free(fb->pixels);
+	fb->s = *s;
+	fb->cols = (s->width + s->tile - 1) / s->tile;
+	fb->rows = (s->height + s->tile - 1) / s->tile;
+	fb->pixels = calloc((size_t)s->width * s->height, s->bpp);
+	if (!fb->pixels)
+		return -1;
+	printf("screen %u: %ux%u, %u bytes per pixel, format 0x%x\n", s->scanout_id,
+	       s->width, s->height, s->bpp, s->format);
+	return 0;
+}
+
+/* Inflates the tiles of a frame into the frame buffer */
+static int apply_tiles(struct cast_fb *fb, const struct dpy_cast_tiles *t, size_t z_size)
+{
+	uint32_t i, tx, ty, tw, th, y, idx;
+	const uint8_t *src, *end;
+	uLongf raw_size;
+	uint8_t *dst;
+	size_t stride;
+
+	if (!fb->pixels)
+		return -1;
+	raw_size = t->raw_size;
+	if (reserve(&fb->raw, &fb->raw_cap, raw_size) ||
+	    uncompress(fb->raw, &raw_size, fb->z, z_size) != Z_OK ||
+	    raw_size != t->raw_size || (uint64_t)t->count * sizeof(uint32_t) > raw_size)
+		return -1;
+
+	stride = (size_t)fb->s.width * fb->s.bpp;
+	src = fb->raw + t->count * sizeof(uint32_t);
+	end = fb->raw + raw_size;
+	for (i = 0; i < t->count; i++) {
+		memcpy(&idx, fb->raw + i * sizeof(uint32_t), sizeof(idx));
+		if (idx >= fb->cols * fb->rows)
+			return -1;
+		tx = idx % fb->cols;
+		ty = idx / fb->cols;
+		tw = fb->s.width - tx * fb->s.tile;
+		tw = (tw < fb->s.tile ? tw : fb->s.tile) * fb->s.bpp;
+		th = fb->s.height - ty * fb->s.tile;
+		th = th < fb->s.tile ? th : fb->s.tile;
+		if (src + (size_t)tw * th > end)
+			return -1;
+		dst = fb->pixels + (size_t)ty * fb->s.tile * stride + (size_t)tx * fb->s.tile * fb->s.bpp;
+		for (y = 0; y < th; y++, src += tw, dst += stride)
+			memcpy(dst, src, tw);
+	}
+	return 0;
+}
+
+/*
+ * The pixman format has the type in bits 16-21, 3 for ABGR, and the width
+ * of green in bits 4-7. 32 bit pixels are little endian xRGB or xBGR, 16
+ * bit ones RGB565 or xRGB1555.
+ */
+static void put_rgb(FILE *f, const uint8_t *p, uint32_t bpp, uint32_t format)
+{
+	uint16_t v;
+	uint32_t g6;
+
+	if (bpp == 4) {
+		if (((format >> 16) & 0x3f) == 3) {
+			fputc(p[0], f);
+			fputc(p[1], f);
+			fputc(p[2], f);
+		} else {
+			fputc(p[2], f);
+			fputc(p[1], f);
+			fputc(p[0], f);
+		}
+		return;
+	}
+	v = p[0] | (p[1] << 8);
+	g6 = ((format >> 4) & 0xf) == 6;
+	if (g6) {
+		fputc(((v >> 11) & 0x1f) << 3, f);
+		fputc(((v >> 5) & 0x3f) << 2, f);
+	} else {
+		fputc(((v >> 10) & 0x1f) << 3, f);
+		fputc(((v >> 5) & 0x1f) << 3, f);
+	}
+	fputc((v & 0x1f) << 3, f);
+}
+
+static int write_ppm(struct cast_fb *fb, const char *path)
+{
+	const uint8_t *p;
+	uint32_t i, n;
+	FILE *f;
+
+	f = fopen(path, "wb");
+	if (!f)
+		return -1;
+	n = fb->s.width * fb->s.height;
+	if (fb->s.bpp == 4 || fb->s.bpp == 2) {
+		fprintf(f, "P6\n%u %u\n255\n", fb->s.width, fb->s.height);
+		for (i = 0, p = fb->pixels; i < n; i++, p += fb->s.bpp)
+			put_rgb(f, p, fb->s.bpp, fb->s.format);
+	} else {
+		fwrite(fb->pixels, fb->s.bpp, n, f);
+	}
+	fclose(f);
+	return 0;
+}
+
+static int connect_to(const char *addr, const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(addr, port, &hints, &res)) {
+		printf("can not resolve %s\n", addr);
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *addr = "127.0.0.1", *port = CAST_PORT, *out = NULL;
+	struct dpy_cast_req req = { 0, 0 };
+	struct dpy_evt_header hdr;
+	struct cast_fb fb;
+	struct dpy_cast_tiles t;
+	struct dpy_cast_surface s;
+	uint64_t now, log_ns, frames = 0, total = 0, bytes = 0, tiles = 0, limit = 0;
+	uint32_t last_seq = 0;
+	uint8_t skip[256];
+	int fd, opt, ret = 0;
+	size_t z_size;
+
+	while ((opt = getopt(argc, argv, "a:p:s:f:n:o:h")) != -1) {
+		switch (opt) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 's':
+			req.scanout_id = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			req.max_fps = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			limit = strtoull(optarg, NULL, 10);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'h':
+		default:
+			display_usage();
+			return opt == 'h' ? 0 : -EINVAL;
+		}
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	fd = connect_to(addr, port);
+	if (fd < 0) {
+		printf("can not connect to %s:%s\n", addr, port);
+		return -1;
+	}
+	if (send_event(fd, DPY_EVENT_START_CAST, &req, sizeof(req))) {
+		printf("can not start the cast: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	memset(&fb, 0, sizeof(fb));
+	log_ns = now_ns();
+	while (!stop && (!limit || total < limit)) {
+		if (read_all(fd, &hdr, sizeof(hdr)) || hdr.e_magic != DISPLAY_MAGIC_CODE ||
+		    hdr.e_size < 0) {
+			printf("connection lost\n");
+			ret = -1;
+			break;
+		}
+		if (hdr.e_type == DPY_EVENT_CAST_SURFACE && hdr.e_size == sizeof(s)) {
+			if (read_all(fd, &s, sizeof(s)) || set_surface(&fb, &s)) {
+				ret = -1;
+				break;
+			}
+		} else if (hdr.e_type == DPY_EVENT_CAST_TILES && hdr.e_size >= (int)sizeof(t)) {
+			z_size = hdr.e_size - sizeof(t);
+			if (read_all(fd, &t, sizeof(t)) || reserve(&fb.z, &fb.z_cap, z_size) ||
+			    read_all(fd, fb.z, z_size)) {
+				ret = -1;
+				break;
+			}
+			if (apply_tiles(&fb, &t, z_size)) {
+				printf("bad frame %u\n", t.seq);
+				ret = -1;
+				break;
+			}
+			if (last_seq && t.seq != last_seq + 1)
+				printf("frames %u to %u missing\n", last_seq + 1, t.seq - 1);
+			last_seq = t.seq;
+			frames++;
+			total++;
+			tiles += t.count;
+			bytes += sizeof(hdr) + hdr.e_size;
+		} else {
+			/* not for us, skipped */
+			while (hdr.e_size > 0) {
+				z_size = hdr.e_size < (int)sizeof(skip) ? hdr.e_size : sizeof(skip);
+				if (read_all(fd, skip, z_size))
+					break;
+				hdr.e_size -= z_size;
+			}
+		}
+
+		now = now_ns();
+		if (now - log_ns >= CAST_LOG_NS) {
+			printf("%.1f fps, %.1f Mbit/s, %.1f tiles per frame\n",
+			       frames * 1e9 / (now - log_ns), bytes * 8e3 / (now - log_ns),
+			       frames ? (double)tiles / frames : 0.0);
+			frames = bytes = tiles = 0;
+			log_ns = now;
+		}
+	}
+
+	send_event(fd, DPY_EVENT_STOP_CAST, NULL, 0);
+	close(fd);
+	printf("%lu frames received\n", (unsigned long)total);
+	if (out && fb.pixels && write_ppm(&fb, out))
+		printf("can not write %s\n", out);
+	free(fb.pixels);
+	free(fb.raw);
+	free(fb.z);
+	return ret;
+}
@@ -30,8 +30,12 @@ static int exiting = 0;
 
 /* for opt */
 static uint64_t period = 10000;
-static const char optString[] = "i:hcrt:a:";
+static const char optString[] = "i:hcrt:a:p:d";
 static const char dev_prefix[] = "acrn_trace_";
+/* per-thread rings of a process, see trace_ring.h in the backends */
+static const char ring_prefix[] = "/memfd:acrntrace-";
+static pid_t ring_pid = 0;
+static int dump_only = 0;
 
 static uint32_t flags = FLAG_CLEAR_BUF;
 static char trace_file_dir[TRACE_FILE_DIR_LEN];
@@ -44,14 +48,16 @@ static struct bitmask *cpu_bitmask = NULL;
 static void display_usage(void)
 {
 	printf("acrntrace - tool to collect ACRN trace data\n"
-	       "[Usage] acrntrace [-i period] [-t max_time] [-ch]\n\n"
+	       "[Usage] acrntrace [-i period] [-t max_time] [-p pid [-d]] [-ch]\n\n"
 	       "[Options]\n"
 	       "\t-h: print this message\n"
 	       "\t-i: period_in_ms: specify polling interval [1-999]\n"
 	       "\t-t: max time to capture trace data (in second)\n"
 	       "\t-c: clear the buffered old data (deprecated)\n"
 	       "\t-r: capture the buffered old data instead of clearing it\n"
-	       "\t-a: cpu-set: only capture the trace data on these configured cpu-set\n");
+	       "\t-a: cpu-set: only capture the trace data on these configured cpu-set\n"
+	       "\t-p: pid: capture the trace rings of a backend process instead\n"
+	       "\t-d: dump the data buffered in the rings of -p and exit\n");
 }
 
 static void timer_handler(union sigval sv)
@@ -130,6 +136,17 @@ static int parse_opt(int argc, char *argv[])
 		case 'a':
 			cpu_bitmask = numa_parse_cpustring_all(optarg);
 			break;
+		case 'p':
+			ret = strtol(optarg, NULL, 10);
+			if (ret <= 0) {
+				pr_err("'-p' require a process id\n");
+				return -EINVAL;
+			}
+			ring_pid = ret;
+			break;
+		case 'd':
+			dump_only = 1;
+			break;
 		case 'h':
 			display_usage();
 			return -EINVAL;
@@ -166,6 +183,61 @@ static int get_dev_cnt(void)
 	return cnt;
 }
 
+/*
+ * Find the trace rings of ring_pid: memfds named acrntrace-<ring>-<thread>.
+ * Fills dev_name with the path to open and devid with the ring number.
+ */
+static int get_ring_readers(void)
+{
+	char path[DEV_PATH_LEN], link[64];
+	struct dirent *pdir;
+	reader_struct *r;
+	int cnt = 0, max = 0;
+	ssize_t len;
+	DIR *dir;
+
+	if (snprintf(path, sizeof(path), "/proc/%d/fd", ring_pid) >= sizeof(path))
+		return -1;
+	dir = opendir(path);
+	if (!dir) {
+		printf("Error opening %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while ((pdir = readdir(dir)) != NULL) {
+		if (pdir->d_name[0] == '.')
+			continue;
+		if (snprintf(path, sizeof(path), "/proc/%d/fd/%s", ring_pid,
+			     pdir->d_name) >= sizeof(path))
+			continue;
+		len = readlink(path, link, sizeof(link) - 1);
+		if (len <= 0)
+			continue;
+		link[len] = '\0';
+		if (strncmp(link, ring_prefix, strlen(ring_prefix)))
+			continue;
+
+		if (cnt == max) {
+			max = max ? max * 2 : 8;
+			r = realloc(reader, sizeof(reader_struct) * max);
+			if (!r) {
+				closedir(dir);
+				return -1;
+			}
+			reader = r;
+		}
+		memset(&reader[cnt], 0, sizeof(reader_struct));
+		strcpy(reader[cnt].dev_name, path);
+		reader[cnt].param.devid = strtoul(link + strlen(ring_prefix), NULL, 10);
+		pr_info("found ring %u: %s\n", reader[cnt].param.devid, link + 7);
+		cnt++;
+	}
+
+	closedir(dir);
+
+	return cnt;
+}
+
 static int create_trace_file_dir(char *dir)
 {
 	int err = 0, ret;
@@ -246,12 +318,16 @@ static void reader_fn(param_t * param)
 static int create_reader(reader_struct * reader, uint32_t dev_id)
 {
 	char trace_file_name[TRACE_FILE_NAME_LEN];
+	struct stat st;
 
-	if (snprintf(reader->dev_name, DEV_PATH_LEN, "/dev/%s%u", dev_prefix, dev_id)
-			>= DEV_PATH_LEN)
-		printf("WARN: device name is truncated\n");
+	/* the rings of a process are found by get_ring_readers() */
+	if (!ring_pid) {
+		if (snprintf(reader->dev_name, DEV_PATH_LEN, "/dev/%s%u", dev_prefix, dev_id)
+				>= DEV_PATH_LEN)
+			printf("WARN: device name is truncated\n");
 
-	reader->param.devid = dev_id;
+		reader->param.devid = dev_id;
+	}
 
 	reader->dev_fd = open(reader->dev_name, O_RDWR);
 	if (reader->dev_fd < 0) {
@@ -260,7 +336,16 @@ static int create_reader(reader_struct * reader, uint32_t dev_id)
 		return -1;
 	}
 
-	reader->param.sbuf = mmap(NULL, MMAP_SIZE,
+	reader->map_size = MMAP_SIZE;
+	if (ring_pid) {
+		if (fstat(reader->dev_fd, &st) || st.st_size < SBUF_HEAD_SIZE) {
+			pr_err("Bad ring %s\n", reader->dev_name);
+			return -2;
+		}
+		reader->map_size = st.st_size;
+	}
+
+	reader->param.sbuf = mmap(NULL, reader->map_size,
 				  PROT_READ | PROT_WRITE,
 				  MAP_SHARED, reader->dev_fd, 0);
 	if (reader->param.sbuf == MAP_FAILED) {
@@ -269,12 +354,17 @@ static int create_reader(reader_struct * reader, uint32_t dev_id)
 		return -2;
 	}
 
+	if (ring_pid && reader->param.sbuf->magic != SBUF_MAGIC) {
+		pr_err("Ring %s is not initialized\n", reader->dev_name);
+		return -2;
+	}
+
 	pr_dbg("sbuf[%d]:\nmagic_num: %lx\nele_num: %u\n ele_size: %u\n",
 	       dev_id, reader->param.sbuf->magic, reader->param.sbuf->ele_num,
 	       reader->param.sbuf->ele_size);
 
 	if(snprintf(trace_file_name, TRACE_FILE_NAME_LEN, "%s/%d", trace_file_dir,
-		 dev_id) >= TRACE_FILE_NAME_LEN)
+		 reader->param.devid) >= TRACE_FILE_NAME_LEN)
 		printf("WARN: trace file name is truncated\n");
 	reader->param.trace_fd = open(trace_file_name,
 					O_WRONLY | O_CREAT | O_TRUNC, 0644);
@@ -286,6 +376,13 @@ static int create_reader(reader_struct * reader, uint32_t dev_id)
 	pr_info("trace data file %s created for %s\n",
 		trace_file_name, reader->dev_name);
 
+	/* take what is buffered now, without a reader thread */
+	if (dump_only) {
+		while (sbuf_write(reader->param.trace_fd, reader->param.sbuf) > 0)
+			;
+		return 0;
+	}
+
 	if (pthread_create(&reader->thrd, NULL,
 			   (void *)&reader_fn, &reader->param)) {
 		pr_err("failed to create reader thread, %d\n", dev_id);
@@ -306,7 +403,7 @@ static void destory_reader(reader_struct * reader)
 	}
 
 	if (reader->param.sbuf) {
-		munmap(reader->param.sbuf, MMAP_SIZE);
+		munmap(reader->param.sbuf, reader->map_size);
 		reader->param.sbuf = NULL;
 	}
 
@@ -351,10 +448,25 @@ int main(int argc, char *argv[])
 	if (parse_opt(argc, argv))
 		exit(EXIT_FAILURE);
 
-	dev_cnt = get_dev_cnt();
-	if (dev_cnt == 0) {
-		pr_err("Failed to find acrn trace devices, please check whether module acrn_trace is inserted\n");
-		exit(EXIT_FAILURE);
+	if (ring_pid) {
+		dev_cnt = get_ring_readers();
+		if (dev_cnt <= 0) {
+			pr_err("Failed to find trace rings in process %d\n", ring_pid);
+			exit(EXIT_FAILURE);
+		}
+		/* a dump wants the buffered data */
+		if (dump_only)
+			flags &= ~FLAG_CLEAR_BUF;
+	} else {
+		if (dump_only) {
+			pr_err("'-d' requires '-p'\n");
+			exit(EXIT_FAILURE);
+		}
+		dev_cnt = get_dev_cnt();
+		if (dev_cnt == 0) {
+			pr_err("Failed to find acrn trace devices, please check whether module acrn_trace is inserted\n");
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	/* if we don't set the -a option or set it by mistake, capture the trace on all possible dev */
@@ -365,7 +477,8 @@ int main(int argc, char *argv[])
 			numa_bitmask_setbit(cpu_bitmask, dev_id);
 	}
 
-	reader = calloc(1, sizeof(reader_struct) * dev_cnt);
+	if (!reader)
+		reader = calloc(1, sizeof(reader_struct) * dev_cnt);
 	if (!reader) {
 		pr_err("Failed to allocate reader memory\n");
 		exit(EXIT_FAILURE);
@@ -396,6 +509,9 @@ int main(int argc, char *argv[])
 				goto out_free;
 	}
 
+	if (dump_only)
+		goto out_free;
+
 	/* for kill exit handling */
 	signal(SIGTERM, signal_exit_handler);
 	signal(SIGINT, signal_exit_handler);
@@ -20,7 +20,7 @@
 #define TRACE_FILE_NAME_LEN	32
 #define TRACE_FILE_DIR_LEN	(TRACE_FILE_NAME_LEN - 3)
 #define TRACE_FILE_ROOT		"acrntrace/"
-#define DEV_PATH_LEN		20
+#define DEV_PATH_LEN		32
 #define TIME_STR_LEN		16
 #define CMD_MAX_LEN		48
 
@@ -81,6 +81,7 @@ typedef struct {
 typedef struct {
 	int dev_fd;
 	char dev_name[DEV_PATH_LEN];
+	size_t map_size;
 	pthread_t thrd;
 	param_t param;
 } reader_struct;
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <log.h>
+
+#include "trace_ring.h"
+
+#ifdef WITH_TRACE_RING
+
+/* the ring number is 8 bits of trace_entry.id */
+#define TRACE_RING_MAX		64
+#define TRACE_RING_DEFAULT_KB	1024
+
+__thread struct trace_ring_self trace_self;
+
+/*
+ * Rings are never unmapped: a thread that exits hands its ring back and the
+ * next new thread reuses it, so a reader holding the memfd keeps seeing
+ * valid memory.
+ */
+static struct trace_ring {
+	struct trace_sbuf *sbuf;
+	int fd;
+	bool busy;
+} rings[TRACE_RING_MAX];
+static int nr_rings;
+static pthread_mutex_t rings_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t rings_key;
+static pthread_once_t rings_once = PTHREAD_ONCE_INIT;
+
+static void
+trace_ring_release(void *arg)
+{
+	struct trace_ring *ring = arg;
+
+	pthread_mutex_lock(&rings_mtx);
+	ring->busy = false;
+	pthread_mutex_unlock(&rings_mtx);
+}
+
+static void
+trace_ring_key_init(void)
+{
+	if (pthread_key_create(&rings_key, trace_ring_release))
+		pr_err("%s: failed to create the thread key\n", __func__);
+}
+
+static size_t
+trace_ring_size(void)
+{
+	const char *env = getenv("TRACE_RING_KB");
+	long kb = env ? strtol(env, NULL, 0) : TRACE_RING_DEFAULT_KB;
+
+	if (kb <= 0)
+		return 0;
+	if ((size_t)kb * 1024 > TRACE_SBUF_MAX_SIZE)
+		return TRACE_SBUF_MAX_SIZE;
+	return kb * 1024;
+}
+
+static int
+trace_ring_create(struct trace_ring *ring, int n, const char *comm, size_t size)
+{
+	struct trace_sbuf *sb;
+	char name[40];
+	uint32_t num;
+	int fd;
+
+	num = (size - TRACE_SBUF_HEAD_SIZE) / TRACE_ENTRY_SIZE;
+	if (num < 2)
+		return -1;
+	size = TRACE_SBUF_HEAD_SIZE + num * TRACE_ENTRY_SIZE;
+
+	snprintf(name, sizeof(name), "acrntrace-%d-%s", n, comm);
+	fd = memfd_create(name, MFD_CLOEXEC);
+	if (fd < 0) {
+		pr_err("%s: memfd_create failed\n", __func__);
+		return -1;
+	}
+	if (ftruncate(fd, size) < 0) {
+		pr_err("%s: failed to size the ring\n", __func__);
+		close(fd);
+		return -1;
+	}
+	sb = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (sb == MAP_FAILED) {
+		pr_err("%s: failed to map the ring\n", __func__);
+		close(fd);
+		return -1;
+	}
+
+	sb->ele_num = num;
+	sb->ele_size = TRACE_ENTRY_SIZE;
+	sb->size = num * TRACE_ENTRY_SIZE;
+	sb->flags = TRACE_SBUF_OVERWRITE_EN | TRACE_SBUF_OVERRUN_CNT_EN;
+	__atomic_store_n(&sb->magic, TRACE_SBUF_MAGIC, __ATOMIC_RELEASE);
+
+	/* keep the fd open, it is how a reader finds the ring */
+	ring->fd = fd;
+	ring->sbuf = sb;
+	return 0;
+}
+
+/*
+ * First trace point of a thread: give it a free ring, or a new one. On any
+ * failure the thread stays detached and its trace points return right away.
+ */
+void
+trace_ring_attach(void)
+{
+	struct trace_ring *ring = NULL;
+	char comm[16];
+	size_t size;
+	int i;
+
+	trace_self.attached = true;
+	size = trace_ring_size();
+	if (!size)
+		return;
+
+	pthread_once(&rings_once, trace_ring_key_init);
+	if (pthread_getname_np(pthread_self(), comm, sizeof(comm)))
+		snprintf(comm, sizeof(comm), "%d", getpid());
+
+	pthread_mutex_lock(&rings_mtx);
+	for (i = 0; i < nr_rings; i++) {
+		if (!rings[i].busy) {
+			ring = &rings[i];
+			break;
+		}
+	}
+	if (!ring && nr_rings < TRACE_RING_MAX) {
+		if (trace_ring_create(&rings[nr_rings], nr_rings, comm, size) == 0)
+			ring = &rings[nr_rings++];
+	}
+	if (ring)
+		ring->busy = true;
+	pthread_mutex_unlock(&rings_mtx);
+
+	if (!ring)
+		return;
+
+	memcpy(ring->sbuf->comm, comm, sizeof(ring->sbuf->comm));
+	pthread_setspecific(rings_key, ring);
+	trace_self.ring_id = (uint64_t)(ring - rings) << 56;
+	trace_self.sbuf = ring->sbuf;
+}
+
+#endif	/* WITH_TRACE_RING */
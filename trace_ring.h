@@ -0,0 +1,183 @@
+#ifndef __BACKENDS_TRACE_RING_H__
+#define __BACKENDS_TRACE_RING_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+/*
+ * Binary trace points. Each thread writes fixed-size records into its own
+ * ring, laid out like the hypervisor's trace buffers so that acrntrace
+ * (misc/debug_tools/acrn_trace) can read them: a shared_buf_t header, then
+ * trace_ev_t elements. The rings live in memfds named "acrntrace-<n>-<comm>",
+ * which "acrntrace -p <pid>" finds through /proc/<pid>/fd.
+ *
+ * A ring has a single writer, so a record costs a timestamp, a 32 byte store
+ * and a release store of the tail; when it is full the oldest record is
+ * overwritten. Without WITH_TRACE_RING the trace points compile to nothing.
+ * The ring size is TRACE_RING_KB from the environment, 0 turns tracing off.
+ */
+
+/* Event ids, see misc/debug_tools/acrn_trace/scripts/formats */
+#define TRACE_VQ_KICK		0x00100001	/* 4I: queue, avail idx, last_avail */
+#define TRACE_VQ_GETCHAIN	0x00100002	/* 4I: queue, head, descriptors, last_avail */
+#define TRACE_VQ_RELCHAIN	0x00100003	/* 4I: queue, head, iolen */
+#define TRACE_GPU_CMD_BEGIN	0x00100010	/* 4I: command, context, flags */
+#define TRACE_GPU_CMD_END	0x00100011	/* 4I: command, response, bytes */
+#define TRACE_GPU_FENCE		0x00100012	/* 2L: fence id, context */
+#define TRACE_BH_SUBMIT		0x00100020	/* 2L: display handle, bh */
+#define TRACE_BH_RUN		0x00100021	/* 2L: bh, callback */
+#define TRACE_BH_DONE		0x00100022	/* 2L: bh, callback */
+#define TRACE_DPY_SEND		0x00100030	/* 4I: display handle, event, length */
+
+/* Same layout as shared_buf_t in misc/debug_tools/acrn_trace/sbuf.h */
+#define TRACE_SBUF_MAGIC	0x5aa57aa71aa13aa3ULL
+#define TRACE_SBUF_HEAD_SIZE	64
+#define TRACE_SBUF_MAX_SIZE	(1U << 22)
+#define TRACE_SBUF_OVERRUN_CNT_EN	(1ULL << 0)
+#define TRACE_SBUF_OVERWRITE_EN		(1ULL << 1)
+
+struct trace_sbuf {
+	uint64_t magic;
+	uint32_t ele_num;
+	uint32_t ele_size;
+	uint32_t head;		/* offset from the elements, to read */
+	uint32_t tail;		/* offset from the elements, to write */
+	uint64_t flags;
+	uint32_t overrun_cnt;
+	uint32_t size;		/* ele_num * ele_size */
+	char comm[16];		/* name of the writing thread */
+	uint32_t padding[2];
+};
+
+/* Same layout as trace_ev_t in misc/debug_tools/acrn_trace/acrntrace.h */
+struct trace_entry {
+	uint64_t tsc;
+	uint64_t id;		/* event:48, n_data:8, ring:8 */
+	union {
+		struct {
+			uint32_t a, b, c, d;
+		};
+		struct {
+			uint64_t e, f;
+		};
+	};
+};
+
+#define TRACE_ENTRY_SIZE	((uint32_t)sizeof(struct trace_entry))
+
+#ifdef WITH_TRACE_RING
+
+struct trace_ring_self {
+	struct trace_sbuf *sbuf;	/* NULL until attached, or if tracing is off */
+	uint64_t ring_id;		/* ring number, in place for trace_entry.id */
+	bool attached;
+};
+
+extern __thread struct trace_ring_self trace_self;
+
+void trace_ring_attach(void);
+
+static inline uint64_t
+trace_ring_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline uint32_t
+trace_ring_next(struct trace_sbuf *sb, uint32_t pos)
+{
+	pos += TRACE_ENTRY_SIZE;
+	return (pos >= sb->size) ? 0 : pos;
+}
+
+static inline struct trace_entry *
+trace_ring_reserve(uint32_t event, uint64_t n_data)
+{
+	struct trace_sbuf *sb;
+	struct trace_entry *ent;
+	uint32_t head, next;
+
+	if (__builtin_expect(!trace_self.attached, 0))
+		trace_ring_attach();
+	sb = trace_self.sbuf;
+	if (!sb)
+		return NULL;
+
+	next = trace_ring_next(sb, sb->tail);
+	head = __atomic_load_n(&sb->head, __ATOMIC_ACQUIRE);
+	if (next == head) {
+		if (!(sb->flags & TRACE_SBUF_OVERWRITE_EN)) {
+			if (sb->flags & TRACE_SBUF_OVERRUN_CNT_EN)
+				sb->overrun_cnt++;
+			return NULL;
+		}
+		/* drop the oldest record, unless the reader just took it */
+		__atomic_compare_exchange_n(&sb->head, &head, trace_ring_next(sb, head),
+					    false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+		if (sb->flags & TRACE_SBUF_OVERRUN_CNT_EN)
+			sb->overrun_cnt++;
+	}
+
+	ent = (struct trace_entry *)((char *)sb + TRACE_SBUF_HEAD_SIZE + sb->tail);
+	ent->tsc = trace_ring_now();
+	ent->id = trace_self.ring_id | (n_data << 48) | event;
+	return ent;
+}
+
+static inline void
+trace_ring_commit(void)
+{
+	struct trace_sbuf *sb = trace_self.sbuf;
+
+	__atomic_store_n(&sb->tail, trace_ring_next(sb, sb->tail), __ATOMIC_RELEASE);
+}
+
+static inline void
+trace_ring_2l(uint32_t event, uint64_t e, uint64_t f)
+{
+	struct trace_entry *ent = trace_ring_reserve(event, 2);
+
+	if (!ent)
+		return;
+	ent->e = e;
+	ent->f = f;
+	trace_ring_commit();
+}
+
+static inline void
+trace_ring_4i(uint32_t event, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+	struct trace_entry *ent = trace_ring_reserve(event, 4);
+
+	if (!ent)
+		return;
+	ent->a = a;
+	ent->b = b;
+	ent->c = c;
+	ent->d = d;
+	trace_ring_commit();
+}
+
+#define TRACE_2L(event, e, f)		trace_ring_2l(event, e, f)
+#define TRACE_4I(event, a, b, c, d)	trace_ring_4i(event, a, b, c, d)
+
+#else
+
+#define TRACE_2L(event, e, f)		do { } while (0)
+#define TRACE_4I(event, a, b, c, d)	do { } while (0)
+
+#endif	/* WITH_TRACE_RING */
+
+#endif	/* __BACKENDS_TRACE_RING_H__ */
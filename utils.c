@@ -5,16 +5,25 @@
 #include <error.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <errno.h>
 
 #include "utils.h"
 #include "virtio_over_shmem.h"
+#include "mevent.h"
 #include "log.h"
+#include "log_ring.h"
 
-static const char short_options[] = "d:h";
+static const char short_options[] = "d:s:i:p:w:uh";
 
 static const struct option
 long_options[] = {
 	{ "driver", required_argument, NULL, 'd' },
+	{ "device", required_argument, NULL, 's' },
+	{ "irq-max-delay",   required_argument, NULL, 'i' },
+	{ "irq-max-pending", required_argument, NULL, 'p' },
+	{ "worker", required_argument, NULL, 'w' },
+	{ "io-uring", no_argument,     NULL, 'u' },
+	{ "logger_setting", required_argument, NULL, 'l' },
 	{ "help",   no_argument,       NULL, 'h' },
 	{ 0, 0, 0, 0 }
 };
@@ -29,6 +38,11 @@ static struct shmem_ops *shmem_ops[] = {
 	NULL
 };
 
+/* -s devices, served along with the first one */
+#define MAX_SHMEM_DEVICES	8
+static char *shmem_devices[MAX_SHMEM_DEVICES];
+static int nr_shmem_devices;
+
 static bool starts_with(const char *s, const char *prefix)
 {
 	return strncmp(s, prefix, strlen(prefix)) == 0;
@@ -37,13 +51,25 @@ static bool starts_with(const char *s, const char *prefix)
 static void usage(FILE *fp, int argc __attribute__((unused)), char **argv)
 {
 	fprintf(fp,
-		"Usage: %s [options] SHM-DEVICE OPTIONS\n\n"
+		"Usage: %s [options] [SHM-DEVICE [OPTIONS]]\n\n"
 		"Options:\n"
 		"-d | --driver name   Shared memory driver name\n"
+		"-s | --device SHM-DEVICE[:OPTIONS]\n"
+		"                     Serve another device from this process, up to %d\n"
+		"-i | --irq-max-delay us\n"
+		"                     Longest time an interrupt may be held back\n"
+		"-p | --irq-max-pending n\n"
+		"                     Interrupts per vector that force a doorbell\n"
+		"-w | --worker queues=MASK[,vectors=MASK][,cpus=MASK][,prio=N]\n"
+		"                     Serve the given virtqueues on a dedicated thread\n"
+		"-u | --io-uring      Run the event loop on io_uring, falling back to epoll\n"
+		"--logger_setting console,level=N\n"
+		"                     Log messages up to level N (1 error ... 5 debug);\n"
+		"                     debug needs a build with LOG_COMPILE_LEVEL=LOG_DEBUG\n"
 		"-h | --help          Print this message\n"
 		"\n"
 		"Available drivers:",
-		argv[0]);
+		argv[0], MAX_SHMEM_DEVICES);
 
 	for (struct shmem_ops **ops = shmem_ops; *ops != NULL; ops++)
 		fprintf(fp, " %s", (*ops)->name);
@@ -65,6 +91,54 @@ static int infer_shmem_ops(struct virtio_backend_info *info)
 	return 0;
 }
 
+/* queues=MASK[,vectors=MASK][,cpus=MASK][,prio=N] */
+static int parse_worker(struct virtio_backend_info *info, const char *opt)
+{
+	struct vos_worker_config *cfg;
+	char *orig, *str, *elem, *val;
+	int ret = 0;
+
+	if (info->nr_workers >= VOS_MAX_WORKERS) {
+		fprintf(stderr, "At most %d workers are supported\n", VOS_MAX_WORKERS);
+		return -1;
+	}
+	cfg = &info->workers[info->nr_workers];
+	memset(cfg, 0, sizeof(*cfg));
+
+	orig = str = strdup(opt);
+	if (!str)
+		return -1;
+
+	while ((elem = strsep(&str, ",")) != NULL) {
+		val = strchr(elem, '=');
+		if (!val) {
+			ret = -1;
+			break;
+		}
+		*val++ = '\0';
+
+		if (strcmp(elem, "queues") == 0)
+			cfg->queues = strtoul(val, NULL, 0);
+		else if (strcmp(elem, "vectors") == 0)
+			cfg->vectors = strtoul(val, NULL, 0);
+		else if (strcmp(elem, "cpus") == 0)
+			cfg->cpu_mask = strtoull(val, NULL, 0);
+		else if (strcmp(elem, "prio") == 0)
+			cfg->priority = strtol(val, NULL, 0);
+		else {
+			ret = -1;
+			break;
+		}
+	}
+	free(orig);
+
+	if (ret == 0 && cfg->queues == 0)
+		ret = -1;
+	if (ret == 0)
+		info->nr_workers++;
+	return ret;
+}
+
 void parse_shmem_args(struct virtio_backend_info *info, int argc, char *argv[])
 {
 	int c = 0;
@@ -75,17 +149,15 @@ void parse_shmem_args(struct virtio_backend_info *info, int argc, char *argv[])
 				short_options, long_options, NULL);
 
 		if (c < 0) {
-			if (argc < optind + 2) {
+			/* both optional, set_shmem_args() fills in the defaults */
+			if (argc > optind + 2) {
 				usage(stderr, argc, argv);
 				exit(EXIT_FAILURE);
 			}
-
-			info->shmem_devpath = argv[optind];
-			info->opts = argv[optind + 1];
-			if (!info->shmem_ops && (infer_shmem_ops(info) < 0)) {
-				fprintf(stderr, "Failed to infer the shared memory driver. Specify one with -d.\n");
-				exit(EXIT_FAILURE);
-			}
+			if (argc > optind)
+				info->shmem_devpath = argv[optind];
+			if (argc > optind + 1)
+				info->opts = argv[optind + 1];
 			break;
 		}
 
@@ -111,6 +183,37 @@ void parse_shmem_args(struct virtio_backend_info *info, int argc, char *argv[])
 			}
 			break;
 
+		case 's':
+			if (nr_shmem_devices >= MAX_SHMEM_DEVICES) {
+				fprintf(stderr, "At most %d more devices are supported\n\n",
+					MAX_SHMEM_DEVICES);
+				usage(stderr, argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			shmem_devices[nr_shmem_devices++] = optarg;
+			break;
+		case 'i':
+			info->irq_coalesce.max_delay_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			info->irq_coalesce.max_pending = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			if (parse_worker(info, optarg) < 0) {
+				fprintf(stderr, "Invalid worker: %s\n\n", optarg);
+				usage(stderr, argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'u':
+			mevent_set_backend(MEVENT_BACKEND_IO_URING);
+			break;
+		case 'l':
+			if (init_logger_setting(optarg) < 0) {
+				usage(stderr, argc, argv);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'h':
 			usage(stdout, argc, argv);
 			exit(EXIT_SUCCESS);
@@ -120,17 +223,12 @@ void parse_shmem_args(struct virtio_backend_info *info, int argc, char *argv[])
 			exit(EXIT_FAILURE);
 		}
 	}
-
-	pr_info("Backend options:\n"
-	       "Shared memory driver: %s\n"
-	       "Shared memory device path: %s\n"
-	       "Virtual device options: %s\n",
-	       info->shmem_ops->name, info->shmem_devpath, info->opts);
 }
 
 void set_shmem_args(struct virtio_backend_info *info)
 {
-	info->shmem_devpath = "/dev/ivshm0.default";
+	if (!info->shmem_devpath)
+		info->shmem_devpath = "/dev/ivshm0.default";
 	if (!info->shmem_ops && (infer_shmem_ops(info) < 0)) {
 		fprintf(stderr, "Failed to infer the shared memory driver. Specify one with -d.\n");
 		exit(EXIT_FAILURE);
@@ -143,25 +241,73 @@ void set_shmem_args(struct virtio_backend_info *info)
 	       info->shmem_ops->name, info->shmem_devpath, info->opts);
 }
 
-void *run_backend(void *data, int argc __attribute__((unused)), char *argv[] __attribute__((unused)))
+/*
+ * A -s device shares the options of the first one, but for its own
+ * device options after the first ':'.
+ */
+static struct virtio_backend_info *
+dup_backend_info(struct virtio_backend_info *info, char *device)
+{
+	struct virtio_backend_info *dup;
+	char *opts;
+
+	dup = malloc(sizeof(*dup));
+	if (!dup)
+		error(1, ENOMEM, "No memory for device %s.\n", device);
+	*dup = *info;
+
+	opts = strchr(device, ':');
+	if (opts)
+		*opts++ = '\0';
+	dup->shmem_devpath = device;
+	dup->opts = opts;
+	return dup;
+}
+
+void *run_backend(void *data, int argc, char *argv[])
 {
-	int ret;
 	struct virtio_backend_info *info = (struct virtio_backend_info *)data;
+	struct virtio_backend_info *infos[MAX_SHMEM_DEVICES + 1];
+	int i;
 
-	// parse_shmem_args(info, argc, argv);
-	set_shmem_args(info);
+	parse_shmem_args(info, argc, argv);
 
-	if (info->hook_before_init)
-		info->hook_before_init(info);
+	infos[0] = info;
+	for (i = 0; i < nr_shmem_devices; i++)
+		infos[i + 1] = dup_backend_info(info, shmem_devices[i]);
 
-	ret = vos_backend_init(info);
-	if (ret)
-		error(1, ret, "Backend initialization failed.\n");
+	run_backends(infos, nr_shmem_devices + 1);
+
+	for (i = 1; i <= nr_shmem_devices; i++)
+		free(infos[i]);
+	return NULL;
+}
+
+/*
+ * Serve several devices from one process. Each info needs its own
+ * shmem_devpath; all of them share one event loop.
+ */
+void run_backends(struct virtio_backend_info *infos[], int num)
+{
+	int ret, i;
+
+	log_ring_start();
+	for (i = 0; i < num; i++) {
+		set_shmem_args(infos[i]);
+
+		if (infos[i]->hook_before_init)
+			infos[i]->hook_before_init(infos[i]);
+
+		ret = vos_backend_init(infos[i]);
+		if (ret)
+			error(1, ret, "Backend %s initialization failed.\n", infos[i]->shmem_devpath);
+	}
 
 	vos_backend_run();
 
-	vos_backend_deinit(info);
-	return NULL;
+	for (i = num - 1; i >= 0; i--)
+		vos_backend_deinit(infos[i]);
+	log_ring_stop();
 }
 
 void dump_hex(void *base, int size)
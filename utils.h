@@ -15,6 +15,7 @@ int main(int argc, char *argv[]) {		\
 }
 
 void *run_backend(void *info, int argc, char *argv[]);
+void run_backends(struct virtio_backend_info *infos[], int num);
 
 void dump_hex(void *base, int size);
 void dump_desc(volatile struct vring_desc *desc, int idx, bool cond);
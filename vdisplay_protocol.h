@@ -1,6 +1,8 @@
 #ifndef __VDISPLAY_PROTOCOL_H__
 #define __VDISPLAY_PROTOCOL_H__
 
+#include <stdint.h>
+
 enum dpy_evt_type {
     DPY_EVENT_SURFACE_SET   =0x100,
     DPY_EVENT_SURFACE_UPDATE,
@@ -10,7 +12,10 @@ enum dpy_evt_type {
     DPY_EVENT_DISPLAY_INFO,
     DPY_EVENT_HOTPLUG,
     DPY_EVENT_START_CAST,
-    DPY_EVENT_STOP_CAST
+    DPY_EVENT_STOP_CAST,
+    DPY_EVENT_FRAME_DONE,
+    DPY_EVENT_CAST_SURFACE,
+    DPY_EVENT_CAST_TILES
 };
 
 #define DISPLAY_MAGIC_CODE  0x5566
@@ -22,4 +27,75 @@ struct dpy_evt_header {
     int e_size;
 };
 
+/*
+ * Frame tracing. A tagged DPY_EVENT_SURFACE_UPDATE carries a dpy_frame_tag
+ * as its body, a tagged DPY_EVENT_SURFACE_SET has frame_id set in the
+ * surface. The client answers each tagged frame with DPY_EVENT_FRAME_DONE.
+ * Timestamps are CLOCK_MONOTONIC nanoseconds; server and client share a host.
+ */
+struct dpy_frame_tag {
+    uint32_t frame_id;
+    uint32_t scanout_id;
+    uint64_t flush_ns;      /* guest command handled by the backend */
+    uint64_t sent_ns;       /* written to the client socket */
+};
+
+#define DPY_FRAME_SET   (1 << 0)    /* surface set, nothing was presented */
+
+/*
+ * A SURFACE_PIXMAN surface comes with the memfd of its pixels instead of a
+ * dmabuf. Its DPY_EVENT_SURFACE_UPDATE always has a body: the frame tag,
+ * with frame_id 0 if untagged, then the damage in surface coordinates.
+ * An update of a dmabuf has the damage too when the server found it from
+ * tile hashes, see vdisplay_damage.h.
+ */
+struct dpy_damage {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+struct dpy_frame_timing {
+    uint32_t frame_id;
+    uint32_t flags;
+    uint64_t recv_ns;       /* event read by the client */
+    uint64_t draw_ns;       /* copy rendered, or surface imported */
+    uint64_t present_ns;    /* eglSwapBuffers returned */
+};
+
+/*
+ * Remote casting, on the TCP control socket (port 6999). DPY_EVENT_START_CAST
+ * with a dpy_cast_req body asks for the frames of a screen on that socket;
+ * without a body it starts the local display app. DPY_EVENT_STOP_CAST ends
+ * either.
+ *
+ * The server sends DPY_EVENT_CAST_SURFACE when the screen has a new surface,
+ * then DPY_EVENT_CAST_TILES with the tiles that changed since the last ones
+ * sent: a dpy_cast_tiles and raw_size bytes deflated with zlib. Inflated,
+ * that is count uint32_t tile indexes, row * columns + column, then the
+ * pixels of these tiles, row by row, clipped to the surface. A receiver
+ * that reads slowly gets fewer frames, not late ones.
+ */
+struct dpy_cast_req {
+    uint32_t scanout_id;
+    uint32_t max_fps;       /* 0 for as many as the link takes */
+};
+
+struct dpy_cast_surface {
+    uint32_t scanout_id;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bpp;           /* bytes per pixel */
+    uint32_t format;        /* pixman format, 0 if unknown and 32 bit */
+    uint32_t tile;          /* tiles are tile x tile pixels */
+};
+
+struct dpy_cast_tiles {
+    uint32_t scanout_id;
+    uint32_t seq;
+    uint32_t count;
+    uint32_t raw_size;
+};
+
 #endif  /* __VDISPLAY_PROTOCOL_H__ */
@@ -19,6 +19,7 @@
 #include <errno.h>
 #include <error.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,6 +37,9 @@
 
 #include "shmem.h"
 
+#ifndef VIRTIO_F_IN_ORDER
+#define VIRTIO_F_IN_ORDER		35
+#endif
 #ifndef VIRTIO_F_ORDER_PLATFORM
 #define VIRTIO_F_ORDER_PLATFORM		36
 #endif
@@ -70,6 +74,7 @@ static struct stat image_stat;
 static struct virtio_shmem_block *vb;
 static struct vring vring;
 static uint16_t next_idx;
+static uint32_t guest_features[2];
 static void *shmem;
 
 static void wait_for_interrupt(void)
@@ -88,18 +93,14 @@ static void wait_for_interrupt(void)
 	}
 }
 
-static int process_queue(void)
+static uint32_t process_request(int idx)
 {
 	struct virtio_blk_outhdr *req;
 	struct vring_desc *desc;
-	int idx, used_idx, ret;
-	size_t size, len;
+	size_t size;
+	uint32_t len;
 	uint8_t status;
-
-	if (next_idx == vring.avail->idx)
-		return 0;
-
-	idx = vring.avail->ring[next_idx % vring.num];
+	int ret;
 
 	desc = &vring.desc[idx];
 	assert(desc->len == sizeof(*req));
@@ -152,13 +153,48 @@ static int process_queue(void)
 
 	*(uint8_t *)(shmem + desc->addr) = status;
 
-	used_idx = vring.used->idx % vring.num;
-	vring.used->ring[used_idx].id = idx;
-	vring.used->ring[used_idx].len = len;
+	return len;
+}
+
+/*
+ * Requests are completed strictly in order, so drain everything the
+ * driver made available and complete it as one batch.  With
+ * VIRTIO_F_IN_ORDER only the last request of the batch gets a used
+ * element, in the slot of the first; either way the used index and
+ * the doorbell are touched once.
+ */
+static int process_queue(void)
+{
+	bool in_order;
+	uint16_t used_idx, count;
+	uint32_t len;
+	int idx;
+
+	if (next_idx == vring.avail->idx)
+		return 0;
+
+	in_order = guest_features[1] & (1 << (VIRTIO_F_IN_ORDER - 32));
+	used_idx = vring.used->idx;
+	count = 0;
+
+	while (next_idx != vring.avail->idx) {
+		idx = vring.avail->ring[next_idx % vring.num];
+		len = process_request(idx);
+		next_idx++;
+		count++;
+
+		if (!in_order) {
+			vring.used->ring[(uint16_t)(used_idx + count - 1) % vring.num].id = idx;
+			vring.used->ring[(uint16_t)(used_idx + count - 1) % vring.num].len = len;
+		} else if (next_idx == vring.avail->idx) {
+			/* the driver reads it at its last used index */
+			vring.used->ring[used_idx % vring.num].id = idx;
+			vring.used->ring[used_idx % vring.num].len = len;
+		}
+	}
 
 	__sync_synchronize();
-	vring.used->idx++;
-	next_idx++;
+	vring.used->idx = used_idx + count;
 
 	vb->queue_event = 1;
 	__sync_synchronize();
@@ -178,6 +214,7 @@ static int process_write_transaction(void)
 			vb->common_config.device_feature =
 				(1 << (VIRTIO_F_VERSION_1 - 32)) |
 				(1 << (VIRTIO_F_IOMMU_PLATFORM - 32)) |
+				(1 << (VIRTIO_F_IN_ORDER - 32)) |
 				(1 << (VIRTIO_F_ORDER_PLATFORM - 32));
 		} else {
 			vb->common_config.device_feature =
@@ -192,6 +229,9 @@ static int process_write_transaction(void)
 	case VI_REG_OFFSET(guest_feature):
 		printf("guest_features[%d]: 0x%x\n", vb->common_config.guest_feature_select,
 		       vb->common_config.guest_feature);
+		if (vb->common_config.guest_feature_select < 2)
+			guest_features[vb->common_config.guest_feature_select] =
+				vb->common_config.guest_feature;
 		break;
 	case VI_REG_OFFSET(queue_select):
 		printf("queue_sel: %d\n", vb->common_config.queue_select);
@@ -302,6 +342,7 @@ int main(int argc, char *argv[])
 	while (1) {
 		vb = shmem;
 		memset(vb, 0, sizeof(*vb));
+		memset(guest_features, 0, sizeof(guest_features));
 		vb->revision = 1;
 		vb->size = sizeof(*vb);
 		vb->device_id = VIRTIO_ID_BLOCK;
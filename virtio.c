@@ -54,6 +54,7 @@
 #include "vring_size.h"
 
 #include "utils.h"
+#include "trace_ring.h"
 
 /*
  * Functions for dealing with generalized "virtual devices" as
@@ -70,6 +71,15 @@
 static uint8_t virtio_poll_enabled;
 static size_t virtio_poll_interval;
 
+static inline uint64_t
+vq_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 void
 virtio_set_iothread(struct virtio_base *base __attribute__((unused)),
 			  bool is_register __attribute__((unused)))
@@ -141,6 +151,7 @@ virtio_reset_dev(struct virtio_base *base)
 		vq->flags = 0;
 		vq->last_avail = 0;
 		vq->save_used = 0;
+		vq->inorder_cnt = 0;
 		vq->pfn = 0;
 		vq->msix_idx = VIRTIO_MSI_NO_VECTOR;
 		vq->gpa_desc[0] = 0;
@@ -383,6 +394,8 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	ndesc = (uint16_t)((u_int)vq->avail->idx - idx);
 	if (ndesc == 0)
 		return 0;
+	if (vq->batch_start == 0)
+		vq->batch_start = vq_clock_ns();
 	if (ndesc > vq->qsize) {
 		/* XXX need better way to diagnose issues */
 		pr_err("%s: ndesc (%u) out of range, driver confused?\r\n",
@@ -469,8 +482,10 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 				}
 			}
 		}
-		if ((vdir->flags & VRING_DESC_F_NEXT) == 0)
+		if ((vdir->flags & VRING_DESC_F_NEXT) == 0) {
+			TRACE_4I(TRACE_VQ_GETCHAIN, vq->num, *pidx, i, vq->last_avail);
 			return i;
+		}
 	}
 loopy:
 	pr_err("%s: descriptor loop? count > %d - driver confused?\r\n",
@@ -522,6 +537,60 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	vue->id = idx;
 	vue->len = iolen;
 	vuh->idx = uidx;
+	TRACE_4I(TRACE_VQ_RELCHAIN, vq->num, idx, iolen, 0);
+}
+
+/*
+ * Return specified request chain to the guest when the device completes
+ * chains in the order they were made available.
+ *
+ * With VIRTIO_F_IN_ORDER the driver infers that every chain up to the
+ * one named in a used element has been consumed, so only the last chain
+ * of a batch needs a used element.  Remember it here and let
+ * vq_inorder_flush() publish the whole batch from vq_endchains().
+ */
+void
+vq_relchain_inorder(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
+{
+	if ((vq->base->negotiated_caps & (1ULL << VIRTIO_F_IN_ORDER)) == 0) {
+		vq_relchain(vq, idx, iolen);
+		return;
+	}
+
+	vq->inorder_id = idx;
+	vq->inorder_len = iolen;
+	vq->inorder_cnt++;
+	TRACE_4I(TRACE_VQ_RELCHAIN, vq->num, idx, iolen, 0);
+}
+
+/*
+ * Publish the pending in-order batch: one used element for the last
+ * chain, then a single used->idx update covering every chain in it.
+ * The driver looks for that element at its own last used index, which
+ * is the slot of the first chain in the batch.
+ */
+static void
+vq_inorder_flush(struct virtio_vq_info *vq)
+{
+	uint16_t uidx, mask;
+	volatile struct vring_used *vuh;
+	volatile struct vring_used_elem *vue;
+
+	if (vq->inorder_cnt == 0)
+		return;
+
+	mask = vq->qsize - 1;
+	vuh = vq->used;
+
+	uidx = vuh->idx;
+	vue = &vuh->ring[uidx & mask];
+	vue->id = vq->inorder_id;
+	vue->len = vq->inorder_len;
+
+	/* the element must be visible before the index that covers it */
+	atomic_thread_fence();
+	vuh->idx = uidx + vq->inorder_cnt;
+	vq->inorder_cnt = 0;
 }
 
 /*
@@ -549,6 +618,8 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 	if (!vq || !vq->used)
 		return;
 
+	vq_inorder_flush(vq);
+
 	/*
 	 * Interrupt generation: if we're using EVENT_IDX,
 	 * interrupt if we've crossed the event threshold.
@@ -564,6 +635,11 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 	base = vq->base;
 	old_idx = vq->save_used;
 	vq->save_used = new_idx = vq->used->idx;
+	if (new_idx != old_idx) {
+		virtio_stats_batch(vq, new_idx - old_idx,
+				   vq->batch_start ? vq_clock_ns() - vq->batch_start : 0);
+		vq->batch_start = 0;
+	}
 	if (used_all_avail &&
 	    (base->negotiated_caps & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)))
 		intr = 1;
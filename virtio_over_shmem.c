@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stddef.h>
 #include <error.h>
 #include <errno.h>
@@ -14,6 +15,7 @@
 #include <virtio.h>
 #include <log.h>
 #include <mevent.h>
+#include <iothread.h>
 #include <pm.h>
 #include <vmmapi.h>
 #include <unistd.h>
@@ -21,15 +23,21 @@
 #include "virtio_over_shmem.h"
 #include "shmem.h"
 #include "utils.h"
+#include "trace_ring.h"
 
-#define MAX_IRQS    8
-
-struct virtio_shmem_header *virtio_header;
+/*
+ * Worker threads are shared by all instances: the N-th worker of every
+ * instance runs on pool thread N, created with the attributes of the first
+ * instance that asks for it.
+ */
+static struct vos_pool_thread {
+	struct iothread_ctx *ctx;
+	int users;
+} worker_pool[VOS_MAX_WORKERS];
+static pthread_mutex_t worker_pool_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-static struct shmem_info shmem_info;
-static int evt_fds[MAX_IRQS];
-static struct mevent *mevents[MAX_IRQS];
-static struct pci_vdev pci_vdev;
+/* number of live instances sharing the mevent loop */
+static int nr_instances;
 
 static void
 sig_handler_term(int signo __attribute__((unused)))
@@ -39,7 +47,7 @@ sig_handler_term(int signo __attribute__((unused)))
 	mevent_notify();
 }
 
-static void process_queue(struct pci_vdev *dev)
+static void process_queue(struct pci_vdev *dev, uint32_t queues)
 {
 	struct virtio_base *base = dev->arg;
 	struct virtio_ops *vops = base->vops;
@@ -58,9 +66,10 @@ static void process_queue(struct pci_vdev *dev)
 	 */
         for (i = base->vops->nvq - 1; i >= 0; i--) {
 		vq = &base->queues[i];
-		if(!vq_ring_ready(vq))
+		if (!(queues & (1U << i)) || !vq_ring_ready(vq))
 			continue;
 
+		TRACE_4I(TRACE_VQ_KICK, i, vq->avail->idx, vq->last_avail, 0);
 		if (vq->notify)
 			(*vq->notify)((void *)base, vq);
 		else if (vops->qnotify)
@@ -70,26 +79,29 @@ static void process_queue(struct pci_vdev *dev)
 	}
 }
 
-static void process_write_transaction(struct pci_vdev *dev)
+/*
+ * Apply one register write whose new value the frontend has already stored
+ * at write_offset in the header.
+ */
+static void apply_write(struct vos_instance *vi, uint16_t write_offset, uint16_t write_size)
 {
+	struct virtio_shmem_header *virtio_header = vi->header;
+	struct pci_vdev *dev = &vi->pci_vdev;
 	void *new_value_p;
 	uint64_t new_value;
 	uint32_t offset;
 
-	if (virtio_header->write_transaction == 0)
-		return;
-
-	new_value_p = (void*)((char*)virtio_header + virtio_header->write_offset);
+	new_value_p = (void*)((char*)virtio_header + write_offset);
 	new_value =
-		(virtio_header->write_size == 1) ? (*(uint8_t  *)new_value_p) :
-		(virtio_header->write_size == 2) ? (*(uint16_t *)new_value_p) :
-		(virtio_header->write_size == 4) ? (*(uint32_t *)new_value_p) :
+		(write_size == 1) ? (*(uint8_t  *)new_value_p) :
+		(write_size == 2) ? (*(uint16_t *)new_value_p) :
+		(write_size == 4) ? (*(uint32_t *)new_value_p) :
 		0xffffffff;
 
-	if (virtio_header->write_offset >= offsetof(struct virtio_shmem_header, common_config) &&
-	    virtio_header->write_offset < offsetof(struct virtio_shmem_header, config)) {
-		offset = virtio_header->write_offset - offsetof(struct virtio_shmem_header, common_config);
-		virtio_common_cfg_write(dev, offset, virtio_header->write_size, new_value);
+	if (write_offset >= offsetof(struct virtio_shmem_header, common_config) &&
+	    write_offset < offsetof(struct virtio_shmem_header, config)) {
+		offset = write_offset - offsetof(struct virtio_shmem_header, common_config);
+		virtio_common_cfg_write(dev, offset, write_size, new_value);
 
 		/* Handle side effects */
 		switch (offset) {
@@ -117,114 +129,856 @@ static void process_write_transaction(struct pci_vdev *dev)
 			virtio_header->common_config.queue_used_hi = virtio_common_cfg_read(dev, VIRTIO_PCI_COMMON_Q_USEDHI, 4);
 			break;
 		}
-	} else if (virtio_header->write_offset >= offsetof(struct virtio_shmem_header, config)) {
+	} else if (write_offset >= offsetof(struct virtio_shmem_header, config)) {
 		struct virtio_base *base = dev->arg;
-		offset = virtio_header->write_offset - offsetof(struct virtio_shmem_header, config);
-		base->vops->cfgwrite(dev, offset, virtio_header->write_size, new_value);
+		offset = write_offset - offsetof(struct virtio_shmem_header, config);
+		base->vops->cfgwrite(dev, offset, write_size, new_value);
 	}
+}
+
+static void process_write_transaction(struct vos_instance *vi)
+{
+	struct virtio_shmem_header *virtio_header = vi->header;
+
+	if (virtio_header->write_transaction == 0)
+		return;
+
+	apply_write(vi, virtio_header->write_offset, virtio_header->write_size);
+	VOS_STAT_ADD(vi, write_transactions, 1);
 
 	__sync_synchronize();
 	virtio_header->write_transaction = 0;
 }
 
-static void handle_requests(int fd, enum ev_type t __attribute__((unused)), void *arg __attribute__((unused)))
+/*
+ * Drain the batched write ring (revision 2 frontends). Each entry carries
+ * its own value, so repeated writes to the same register, e.g. queue_select
+ * followed by the per-queue registers, are replayed in order by mirroring
+ * the value into the header before applying it.
+ */
+static void process_write_ring(struct vos_instance *vi)
+{
+	struct virtio_shmem_write_ring *ring = vi->write_ring;
+	struct virtio_shmem_write_entry *entry;
+	uint32_t head, tail;
+	uint16_t offset, size;
+
+	if (!ring)
+		return;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = ring->tail;
+	if (head - tail > VIRTIO_SHMEM_WRITE_RING_SIZE) {
+		pr_err("%s: corrupted write ring head %u tail %u\n", __func__, head, tail);
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+		return;
+	}
+
+	for (; tail != head; tail++) {
+		entry = &ring->entries[tail % VIRTIO_SHMEM_WRITE_RING_SIZE];
+		offset = entry->offset;
+		size = entry->size;
+
+		if ((size != 1 && size != 2 && size != 4) ||
+		    offset < offsetof(struct virtio_shmem_header, common_config) ||
+		    offset + size > vi->cfg_end) {
+			pr_err("%s: invalid write offset 0x%x size %u\n", __func__, offset, size);
+			VOS_STAT_ADD(vi, write_errors, 1);
+			continue;
+		}
+
+		memcpy((char *)vi->header + offset, &entry->value, size);
+		apply_write(vi, offset, size);
+		VOS_STAT_ADD(vi, write_transactions, 1);
+	}
+
+	/* Let the frontend know every queued write has taken effect */
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+
+static bool queues_have_descs(struct pci_vdev *dev, uint32_t queues)
+{
+	struct virtio_base *base = dev->arg;
+	struct virtio_vq_info *vq;
+	int i;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		if ((queues & (1U << i)) && vq_ring_ready(vq) && vq_has_descs(vq))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * The frontend may ring any vector for any queue, so a doorbell that finds
+ * work on queues owned by another thread passes it on.
+ */
+static void kick_other_groups(struct vos_instance *vi, uint32_t own_queues)
 {
-	eventfd_t val;
-	eventfd_read(fd, &val);
+	int i;
 
-	if ((shmem_info.peer_id == -1) && (virtio_header->frontend_flags != 0)) {
-		shmem_info.peer_id = virtio_header->frontend_id;
-		pr_info("Frontend peer id: %d\n", shmem_info.peer_id);
+	for (i = 0; i < vi->nr_workers; i++) {
+		if (vi->workers[i].queues != own_queues &&
+		    queues_have_descs(&vi->pci_vdev, vi->workers[i].queues))
+			eventfd_write(vi->workers[i].kick_fd, 1);
 	}
 
-        process_write_transaction(&pci_vdev);
-	if (virtio_header->common_config.device_status == 0xf)
-		process_queue(&pci_vdev);
+	if (vi->default_kick_fd >= 0 && vi->default_queues != own_queues &&
+	    queues_have_descs(&vi->pci_vdev, vi->default_queues))
+		eventfd_write(vi->default_kick_fd, 1);
+}
+
+static void handle_doorbell(struct vos_instance *vi, uint32_t queues)
+{
+	struct virtio_shmem_header *virtio_header = vi->header;
+
+	if ((vi->shmem_info.peer_id == -1) && (virtio_header->frontend_flags != 0)) {
+		vi->shmem_info.peer_id = virtio_header->frontend_id;
+		pr_info("Frontend peer id: %d\n", vi->shmem_info.peer_id);
+	}
+
+	irq_coalesce_begin_pass(&vi->irqc);
+
+	if (virtio_header->write_transaction ||
+	    (vi->write_ring && vi->write_ring->head != vi->write_ring->tail)) {
+		pthread_rwlock_wrlock(&vi->cfg_lock);
+		process_write_ring(vi);
+		process_write_transaction(vi);
+		vos_checkpoint_save(vi, false);
+		pthread_rwlock_unlock(&vi->cfg_lock);
+	}
+
+	pthread_rwlock_rdlock(&vi->cfg_lock);
+	if (virtio_header->common_config.device_status == 0xf) {
+		process_queue(&vi->pci_vdev, queues);
+		if (vi->nr_workers)
+			kick_other_groups(vi, queues);
+	}
+	pthread_rwlock_unlock(&vi->cfg_lock);
+
+	irq_coalesce_end_pass(&vi->irqc);
+}
+
+/* EVF_COUNTER: mevent has already drained the eventfd */
+static void handle_requests(int fd, enum ev_type t __attribute__((unused)), void *arg)
+{
+	struct vos_instance *vi = arg;
+	int i;
+
+	/* Kicks from the workers are not doorbells */
+	for (i = 0; i < VOS_MAX_IRQS; i++) {
+		if (vi->evt_fds[i] == fd) {
+			VOS_STAT_ADD(vi, doorbells_received[i], 1);
+			break;
+		}
+	}
+
+	handle_doorbell(vi, vi->default_queues);
+}
+
+/* iothread has already drained the eventfd */
+static void handle_worker_requests(void *arg)
+{
+	struct vos_worker *worker = arg;
+
+	handle_doorbell(worker->vi, worker->queues);
+}
+
+static void handle_worker_doorbell(void *arg)
+{
+	struct vos_vector_event *evt = arg;
+
+	VOS_STAT_ADD(evt->worker->vi, doorbells_received[evt->vector], 1);
+	handle_doorbell(evt->worker->vi, evt->worker->queues);
+}
+
+static bool vector_owned_by_worker(struct virtio_backend_info *info, int vector)
+{
+	int i;
+
+	for (i = 0; i < info->nr_workers; i++)
+		if (info->workers[i].vectors & (1U << vector))
+			return true;
+	return false;
+}
+
+static struct iothread_ctx *get_pool_thread(int idx, struct vos_worker_config *cfg)
+{
+	struct vos_pool_thread *pt = &worker_pool[idx];
+	struct iothread_attr attr;
+	char name[16];
+
+	pthread_mutex_lock(&worker_pool_mtx);
+	if (!pt->ctx) {
+		snprintf(name, sizeof(name), "vos_worker%d", idx);
+		attr.name = name;
+		attr.cpu_mask = cfg->cpu_mask;
+		attr.priority = cfg->priority;
+		pt->ctx = iothread_create(&attr);
+	}
+	if (pt->ctx)
+		pt->users++;
+	pthread_mutex_unlock(&worker_pool_mtx);
+
+	return pt->ctx;
+}
+
+static void put_pool_thread(int idx)
+{
+	struct vos_pool_thread *pt = &worker_pool[idx];
+
+	pthread_mutex_lock(&worker_pool_mtx);
+	if (pt->ctx && --pt->users == 0) {
+		iothread_destroy(pt->ctx);
+		pt->ctx = NULL;
+	}
+	pthread_mutex_unlock(&worker_pool_mtx);
+}
+
+static int setup_workers(struct vos_instance *vi, struct virtio_backend_info *info)
+{
+	struct iothread_ctx *ctx;
+	struct vos_worker *worker;
+	struct vos_worker_config *cfg;
+	uint32_t vectors = 0;
+	int i, v;
+
+	if (info->nr_workers > VOS_MAX_WORKERS) {
+		pr_err("%s: at most %d workers are supported\n", __func__, VOS_MAX_WORKERS);
+		return -1;
+	}
+
+	for (i = 0; i < info->nr_workers; i++) {
+		cfg = &info->workers[i];
+		worker = &vi->workers[i];
+
+		if ((cfg->queues & ~vi->default_queues) || (cfg->vectors & vectors)) {
+			pr_err("%s: worker %d overlaps with another worker\n", __func__, i);
+			return -1;
+		}
+		vi->default_queues &= ~cfg->queues;
+		vectors |= cfg->vectors;
+
+		ctx = get_pool_thread(i, cfg);
+		if (!ctx)
+			return -1;
+		worker->vi = vi;
+		worker->pool_idx = i;
+		worker->queues = cfg->queues;
+		worker->kick_fd = -1;
+		vi->nr_workers++;
+
+		worker->kick_fd = eventfd(0, EFD_NONBLOCK);
+		if (worker->kick_fd < 0)
+			return -1;
+		worker->kick_mevt.run = handle_worker_requests;
+		worker->kick_mevt.arg = worker;
+		worker->kick_mevt.fd = worker->kick_fd;
+		if (iothread_ctx_add(ctx, worker->kick_fd, &worker->kick_mevt) < 0)
+			return -1;
+
+		for (v = 0; v < vi->shmem_info.nr_vecs && v < VOS_MAX_IRQS; v++) {
+			if (!(cfg->vectors & (1U << v)))
+				continue;
+			worker->vec_evts[v].worker = worker;
+			worker->vec_evts[v].vector = v;
+			worker->vec_evts[v].mevt.run = handle_worker_doorbell;
+			worker->vec_evts[v].mevt.arg = &worker->vec_evts[v];
+			worker->vec_evts[v].mevt.fd = vi->evt_fds[v];
+			if (iothread_ctx_add(ctx, vi->evt_fds[v], &worker->vec_evts[v].mevt) < 0)
+				return -1;
+		}
+
+		pr_info("Worker %d: queues 0x%x, vectors 0x%x, cpus 0x%llx, priority %d\n",
+			i, cfg->queues, cfg->vectors, (unsigned long long)cfg->cpu_mask, cfg->priority);
+	}
+
+	if (vi->nr_workers) {
+		vi->default_kick_fd = eventfd(0, EFD_NONBLOCK);
+		if (vi->default_kick_fd < 0)
+			return -1;
+		vi->default_kick_mevent = mevent_add(vi->default_kick_fd, EVF_COUNTER, handle_requests, vi, NULL, NULL);
+		if (!vi->default_kick_mevent)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void teardown_workers(struct vos_instance *vi)
+{
+	struct vos_worker *worker;
+	struct iothread_ctx *ctx;
+	int i, v;
+
+	for (i = 0; i < vi->nr_workers; i++) {
+		worker = &vi->workers[i];
+		ctx = worker_pool[worker->pool_idx].ctx;
+
+		/* The pool thread may outlive this instance */
+		if (worker->kick_fd >= 0) {
+			iothread_ctx_del(ctx, worker->kick_fd);
+			close(worker->kick_fd);
+		}
+		for (v = 0; v < VOS_MAX_IRQS; v++)
+			if (worker->vec_evts[v].mevt.run)
+				iothread_ctx_del(ctx, worker->vec_evts[v].mevt.fd);
+
+		put_pool_thread(worker->pool_idx);
+		memset(worker, 0, sizeof(*worker));
+	}
+	vi->nr_workers = 0;
+
+	if (vi->default_kick_mevent) {
+		mevent_delete(vi->default_kick_mevent);
+		vi->default_kick_mevent = NULL;
+	}
+	if (vi->default_kick_fd >= 0) {
+		close(vi->default_kick_fd);
+		vi->default_kick_fd = -1;
+	}
+	vi->default_queues = ~0U;
+}
+
+void vos_stats_batch(struct vos_instance *vi, int queue, uint16_t chains, uint64_t ns)
+{
+	struct vos_stats_queue *q;
+	int bucket;
+
+	if (!vi->stats || queue >= VOS_STATS_MAX_QUEUES)
+		return;
+
+	q = &vi->stats->queues[queue];
+	bucket = 31 - __builtin_clz(chains);
+	if (bucket >= VOS_STATS_BATCH_BUCKETS)
+		bucket = VOS_STATS_BATCH_BUCKETS - 1;
+
+	__atomic_fetch_add(&q->chains, chains, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&q->batches, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&q->busy_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&q->batch_hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/* Room for the device's own statistics, after the transport's */
+void *vos_stats_dev_area(struct vos_instance *vi, size_t size)
+{
+	if (!vi->stats || size > VOS_STATS_DEV_SIZE)
+		return NULL;
+
+	vi->stats->dev_size = size;
+	__sync_synchronize();
+	vi->stats->dev_offset = VOS_STATS_DEV_OFFSET;
+	return (char *)vi->stats + VOS_STATS_DEV_OFFSET;
+}
+
+/* Called by the device while it initializes, before the layout is set */
+int vos_shm_region_request(struct vos_instance *vi, uint8_t id, uint64_t size, uint64_t align)
+{
+	struct vos_shm_region *r;
+
+	if (vi->nr_shm_regions >= VIRTIO_SHMEM_MAX_SHM_REGIONS || size == 0 ||
+	    align == 0 || (align & (align - 1)) || (size & (align - 1))) {
+		pr_err("%s: cannot place region %u of 0x%lx bytes\n", __func__,
+		       id, (unsigned long)size);
+		return -1;
+	}
+
+	r = &vi->shm_regions[vi->nr_shm_regions++];
+	r->id = id;
+	r->size = size;
+	r->align = align;
+	r->offset = 0;
+	return 0;
+}
+
+void *vos_shm_region(struct vos_instance *vi, uint8_t id, uint64_t *offset, uint64_t *size)
+{
+	struct vos_shm_region *r;
+	int i;
+
+	for (i = 0; i < vi->nr_shm_regions; i++) {
+		r = &vi->shm_regions[i];
+		if (r->id != id || !r->offset)
+			continue;
+		*offset = r->offset;
+		*size = r->size;
+		return (char *)vi->shmem_info.mem_base + r->offset;
+	}
+	return NULL;
+}
+
+/*
+ * Transport state is cheap to save and only changes on config writes; the
+ * device part is only rewritten when the device asks for it (see
+ * virtio_checkpoint()), from the thread that owns that state.
+ */
+void vos_checkpoint_save(struct vos_instance *vi, bool device)
+{
+	struct vos_checkpoint *ck = vi->checkpoint;
+	struct virtio_base *base = vi->pci_vdev.arg;
+	struct vos_checkpoint_vq *cvq;
+	struct virtio_vq_info *vq;
+	int i, n;
+
+	if (!ck)
+		return;
+
+	pthread_mutex_lock(&vi->checkpoint_mtx);
+	ck->seq++;
+	__sync_synchronize();
+
+	ck->negotiated_caps = base->negotiated_caps;
+	ck->status = base->status;
+	ck->msix_cfg_idx = base->msix_cfg_idx;
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		cvq = &ck->vqs[i];
+		cvq->qsize = vq->qsize;
+		cvq->msix_idx = vq->msix_idx;
+		cvq->enabled = vq->enabled;
+		memcpy(cvq->gpa_desc, vq->gpa_desc, sizeof(cvq->gpa_desc));
+		memcpy(cvq->gpa_avail, vq->gpa_avail, sizeof(cvq->gpa_avail));
+		memcpy(cvq->gpa_used, vq->gpa_used, sizeof(cvq->gpa_used));
+	}
+
+	if (base->status == 0) {
+		/* Reset: none of the device state survives */
+		ck->dev_size = 0;
+	} else if (device && base->vops->checkpoint) {
+		n = base->vops->checkpoint(base, ck->dev_state, ck->dev_capacity);
+		if (n < 0) {
+			/* Larger than dev_capacity, which also fails validation */
+			pr_err("%s: device state does not fit, restart will reset the device\n", __func__);
+			ck->dev_size = UINT32_MAX;
+		} else {
+			ck->dev_size = n;
+		}
+	}
+
+	__sync_synchronize();
+	ck->seq++;
+	pthread_mutex_unlock(&vi->checkpoint_mtx);
+}
+
+static bool vos_checkpoint_valid(struct vos_instance *vi, const struct vos_checkpoint *ck,
+				 uint32_t size, uint32_t capacity)
+{
+	struct virtio_shmem_header *virtio_header = vi->header;
+	struct virtio_base *base = vi->pci_vdev.arg;
+	const struct vos_checkpoint_vq *cvq;
+	uint64_t desc, avail, used;
+	int i;
+
+	if (virtio_header->revision < VIRTIO_SHMEM_REVISION_CHECKPOINT ||
+	    virtio_header->size != size || virtio_header->frontend_flags == 0)
+		return false;
+
+	if (ck->magic != VOS_CHECKPOINT_MAGIC || (ck->seq & 1) ||
+	    ck->device_id != pci_get_cfgdata16(&vi->pci_vdev, PCIR_SUBDEV_0) ||
+	    ck->nvq != (uint32_t)base->vops->nvq ||
+	    ck->dev_capacity != capacity || ck->dev_size > capacity ||
+	    !(ck->status & VIRTIO_CONFIG_S_DRIVER_OK))
+		return false;
+
+	/* The frontend can write here as well; check what will be trusted */
+	for (i = 0; i < base->vops->nvq; i++) {
+		cvq = &ck->vqs[i];
+		if (!cvq->enabled)
+			continue;
+		if (cvq->qsize == 0 || (cvq->qsize & (cvq->qsize - 1)))
+			return false;
+
+		desc = ((uint64_t)cvq->gpa_desc[1] << 32) | cvq->gpa_desc[0];
+		avail = ((uint64_t)cvq->gpa_avail[1] << 32) | cvq->gpa_avail[0];
+		used = ((uint64_t)cvq->gpa_used[1] << 32) | cvq->gpa_used[0];
+		if (desc + vring_size(cvq->qsize, 1) > vi->shmem_info.mem_size ||
+		    avail + vring_size(cvq->qsize, 1) > vi->shmem_info.mem_size ||
+		    used + vring_size(cvq->qsize, 1) > vi->shmem_info.mem_size)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Bring the freshly initialized device back to the checkpointed state by
+ * replaying the frontend's register writes, so the same checks apply as
+ * when the frontend made them.
+ */
+static int vos_checkpoint_restore(struct vos_instance *vi, const struct vos_checkpoint *ck,
+				  const void *dev_state)
+{
+	struct virtio_shmem_header *virtio_header = vi->header;
+	struct pci_vdev *dev = &vi->pci_vdev;
+	struct virtio_base *base = dev->arg;
+	const struct vos_checkpoint_vq *cvq;
+	struct virtio_vq_info *vq;
+	int i;
+
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_GFSELECT, 4, 0);
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_GF, 4, ck->negotiated_caps & 0xffffffff);
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_GFSELECT, 4, 1);
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_GF, 4, ck->negotiated_caps >> 32);
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_MSIX, 2, ck->msix_cfg_idx);
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		cvq = &ck->vqs[i];
+		if (!cvq->enabled)
+			continue;
+
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_SELECT, 2, i);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_SIZE, 2, cvq->qsize);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_MSIX, 2, cvq->msix_idx);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_DESCLO, 4, cvq->gpa_desc[0]);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_DESCHI, 4, cvq->gpa_desc[1]);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_AVAILLO, 4, cvq->gpa_avail[0]);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_AVAILHI, 4, cvq->gpa_avail[1]);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_USEDLO, 4, cvq->gpa_used[0]);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_USEDHI, 4, cvq->gpa_used[1]);
+		virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_ENABLE, 2, 1);
+
+		vq = &base->queues[i];
+		if (!(vq->flags & VQ_ALLOC))
+			return -1;
+
+		/*
+		 * Chains the old backend took but never returned are taken
+		 * again; everything before used->idx has been completed.
+		 */
+		vq->last_avail = vq->save_used = vq->used->idx;
+	}
+
+	if (base->vops->restore &&
+	    base->vops->restore(base, dev_state, ck->dev_size) < 0)
+		return -1;
+
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_STATUS, 1, ck->status);
+
+	/* Selectors as the frontend last left them */
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_DFSELECT, 4,
+				virtio_header->common_config.device_feature_select);
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_GFSELECT, 4,
+				virtio_header->common_config.guest_feature_select);
+	virtio_common_cfg_write(dev, VIRTIO_PCI_COMMON_Q_SELECT, 2,
+				virtio_header->common_config.queue_select);
+
+	return 0;
+}
+
+/*
+ * Take over a live device. Returns true when the old backend's checkpoint
+ * was usable; on false the device is left reset and the caller starts over.
+ */
+static bool vos_checkpoint_resume(struct vos_instance *vi, uint32_t size, uint32_t capacity)
+{
+	struct vos_checkpoint ck;
+	void *dev_state = NULL;
+	bool resumed = false;
+
+	/* Work on a copy, the frontend could change it under us */
+	memcpy(&ck, vi->checkpoint, sizeof(ck));
+	__sync_synchronize();
+	if (!vos_checkpoint_valid(vi, &ck, size, capacity))
+		return false;
+
+	if (ck.dev_size) {
+		dev_state = malloc(ck.dev_size);
+		if (!dev_state)
+			return false;
+		memcpy(dev_state, vi->checkpoint->dev_state, ck.dev_size);
+	}
+
+	/* Nothing may have changed while copying */
+	__sync_synchronize();
+	if (vi->checkpoint->seq == ck.seq) {
+		if (vos_checkpoint_restore(vi, &ck, dev_state) == 0)
+			resumed = true;
+		else
+			virtio_common_cfg_write(&vi->pci_vdev, VIRTIO_PCI_COMMON_STATUS, 1, 0);
+	}
+
+	free(dev_state);
+	return resumed;
+}
+
+/*
+ * Room for the device state, as much as the device says it needs. It must
+ * come out the same for the next backend, which checks it on resume.
+ */
+static uint32_t vos_checkpoint_capacity(struct virtio_base *base)
+{
+	size_t capacity;
+
+	if (!base->vops->checkpoint)
+		return 0;
+	if (!base->vops->checkpoint_size)
+		return VOS_CHECKPOINT_DEV_SIZE;
+
+	capacity = (base->vops->checkpoint_size(base) + 4095) & ~4095UL;
+	return capacity < UINT32_MAX ? capacity : UINT32_MAX & ~4095U;
+}
+
+/* Catch up on doorbells and interrupts lost while no backend was running */
+static void vos_resume_kick(struct vos_instance *vi)
+{
+	struct virtio_base *base = vi->pci_vdev.arg;
+	int i;
+
+	for (i = 0; i < base->vops->nvq; i++)
+		if (vq_ring_ready(&base->queues[i]))
+			vq_interrupt(base, &base->queues[i]);
+
+	for (i = 0; i < vi->shmem_info.nr_vecs && i < VOS_MAX_IRQS; i++)
+		eventfd_write(vi->evt_fds[i], 1);
+}
+
+static void close_evt_fds(struct vos_instance *vi)
+{
+	int i;
+
+	for (i = 0; i < VOS_MAX_IRQS; i++) {
+		if (vi->mevents[i]) {
+			mevent_delete(vi->mevents[i]);
+			vi->mevents[i] = NULL;
+		}
+		if (vi->evt_fds[i] > 0) {
+			close(vi->evt_fds[i]);
+			vi->evt_fds[i] = 0;
+		}
+	}
 }
 
 int vos_backend_init(struct virtio_backend_info *info)
 {
 	int ret = -1, i;
-//	struct epoll_event ev = {0};
+	struct vos_instance *vi;
+	struct virtio_shmem_header *virtio_header;
 	struct virtio_base *base;
+	struct virtio_shmem_regions *regions;
+	struct vos_shm_region *r;
+	uint32_t ckpt_offset, ckpt_capacity, stats_offset, size, nr_regions = 0;
+	uint64_t offset;
+	bool resumed = false;
 
-	ret = mevent_init();
-	if (ret < 0) {
-		pr_err("%s mevent_init fail\n", __func__);
-		return ret;
+	vi = calloc(1, sizeof(*vi));
+	if (!vi) {
+		pr_err("%s: out of memory\n", __func__);
+		return -ENOMEM;
+	}
+	vi->info = info;
+	vi->default_queues = ~0U;
+	vi->default_kick_fd = -1;
+	pthread_rwlock_init(&vi->cfg_lock, NULL);
+	pthread_mutex_init(&vi->checkpoint_mtx, NULL);
+
+	/* The event loop is shared by every instance of this process */
+	if (nr_instances == 0) {
+		ret = mevent_init();
+		if (ret < 0) {
+			pr_err("%s mevent_init fail\n", __func__);
+			goto free_instance;
+		}
 	}
+	nr_instances++;
 
-	for (i = 0; i < MAX_IRQS; i++) {
-		evt_fds[i] = eventfd(0, EFD_NONBLOCK);
-		if (evt_fds[i] < 0) {
+	for (i = 0; i < VOS_MAX_IRQS; i++) {
+		vi->evt_fds[i] = eventfd(0, EFD_NONBLOCK);
+		if (vi->evt_fds[i] < 0) {
 			pr_err("%s\n", __func__);
+			vi->evt_fds[i] = 0;
 			ret = errno;
 			goto close_evt_fds;
 		}
 	}
 
-	ret = info->shmem_ops->open(info->shmem_devpath, &shmem_info, evt_fds, MAX_IRQS);
+	ret = info->shmem_ops->open(info->shmem_devpath, &vi->shmem_info, vi->evt_fds, VOS_MAX_IRQS);
 	if (ret < 0) {
 		pr_err("%s\n", __func__);
 		ret = errno;
 		goto close_evt_fds;
 	}
 
-	pr_info("Shared memory size: 0x%lx\n", (unsigned long)shmem_info.mem_size);
-	pr_info("Number of interrupt vectors: %d\n", shmem_info.nr_vecs);
-	pr_info("This ID: %d\n", shmem_info.this_id);
+	pr_info("Shared memory %s size: 0x%lx\n", info->shmem_devpath, (unsigned long)vi->shmem_info.mem_size);
+	pr_info("Number of interrupt vectors: %d\n", vi->shmem_info.nr_vecs);
+	pr_info("This ID: %d\n", vi->shmem_info.this_id);
+
+	irq_coalesce_init(&vi->irqc, &vi->shmem_info, &info->irq_coalesce);
 
-	for (i = 0; i < MAX_IRQS; i++) {
-		if (i < shmem_info.nr_vecs) {
-			mevents[i] = mevent_add(evt_fds[i], EVF_READ, handle_requests, NULL, NULL, NULL);
-			if (mevents[i] == NULL)
+	for (i = 0; i < VOS_MAX_IRQS; i++) {
+		if (i < vi->shmem_info.nr_vecs) {
+			if (vector_owned_by_worker(info, i))
+				continue;
+			vi->mevents[i] = mevent_add(vi->evt_fds[i], EVF_COUNTER, handle_requests, vi, NULL, NULL);
+			if (vi->mevents[i] == NULL)
 				goto deregister_mevents;
 		} else {
-			close(evt_fds[i]);
-			evt_fds[i] = 0;
+			close(vi->evt_fds[i]);
+			vi->evt_fds[i] = 0;
 		}
 	}
 
-	virtio_header = shmem_info.mem_base;
-	memset(virtio_header, 0, sizeof(struct virtio_shmem_header));
-	virtio_header->backend_status = (shmem_info.this_id << 16) | BACKEND_FLAG_PRESENT;
-	virtio_header->revision = 1;
+	/*
+	 * The header is left alone until we know whether a live device is
+	 * being taken over from a previous backend.
+	 */
+	vi->header = virtio_header = vi->shmem_info.mem_base;
 
-	pci_vdev.vmctx = (struct vmctx *)&shmem_info;
-	pci_vdev.dev_ops = info->pci_vdev_ops;
-	if (pci_vdev.dev_ops->vdev_init(pci_vdev.vmctx, &pci_vdev, info->opts)) {
+	vi->pci_vdev.vmctx = (struct vmctx *)vi;
+	vi->pci_vdev.dev_ops = info->pci_vdev_ops;
+	if (vi->pci_vdev.dev_ops->vdev_init(vi->pci_vdev.vmctx, &vi->pci_vdev, info->opts)) {
 		pr_err("%s\n", __func__);
 		ret = -1;
 		goto deregister_mevents;
 	}
 	info->vdev_inited = true;
+	vi->pci_vdev.msix.enabled = 1;
 
-	virtio_header->device_id = pci_get_cfgdata16(&pci_vdev, PCIR_SUBDEV_0);
-	virtio_header->vendor_id = pci_get_cfgdata16(&pci_vdev, PCIR_SUBVEND_0);
+	base = vi->pci_vdev.arg;
+	vi->cfg_end = sizeof(struct virtio_shmem_header) + base->vops->cfgsize;
 
-	base = pci_vdev.arg;
-	virtio_header->size = sizeof(struct virtio_shmem_header) + base->vops->cfgsize;
-	base->vops->cfgread(base, 0, base->vops->cfgsize, (void *)virtio_header->config);
+	/*
+	 * The write ring, the checkpoint and the statistics follow the device
+	 * config and are covered by size, so revision 1 frontends, which place
+	 * their vrings after size, never overlap them.
+	 */
+	vi->write_ring = (void *)((char *)virtio_header +
+			VIRTIO_SHMEM_WRITE_RING_OFFSET(base->vops->cfgsize));
+	size = VIRTIO_SHMEM_WRITE_RING_OFFSET(base->vops->cfgsize) +
+		sizeof(struct virtio_shmem_write_ring);
+	ckpt_offset = VIRTIO_SHMEM_CHECKPOINT_OFFSET(base->vops->cfgsize);
+	ckpt_capacity = vos_checkpoint_capacity(base);
+	if (base->vops->nvq <= VOS_CHECKPOINT_MAX_VQS &&
+	    ckpt_offset + sizeof(struct vos_checkpoint) + ckpt_capacity <= vi->shmem_info.mem_size) {
+		vi->checkpoint = (void *)((char *)virtio_header + ckpt_offset);
+		size = ckpt_offset + sizeof(struct vos_checkpoint) + ckpt_capacity;
+	} else if (ckpt_capacity) {
+		pr_err("No room for a checkpoint of 0x%x bytes, restart will reset the device\n",
+		       ckpt_capacity);
+	}
+	stats_offset = (size + 4095) & ~4095UL;
+	if (stats_offset + VOS_STATS_DEV_OFFSET + VOS_STATS_DEV_SIZE <= vi->shmem_info.mem_size &&
+	    (stats_offset >> 12) <= UINT16_MAX) {
+		vi->stats = (void *)((char *)virtio_header + stats_offset);
+		memset(vi->stats, 0, VOS_STATS_DEV_OFFSET + VOS_STATS_DEV_SIZE);
+		vi->stats->version = VOS_STATS_VERSION;
+		vi->stats->nr_vectors = vi->shmem_info.nr_vecs;
+		vi->stats->nr_queues = base->vops->nvq;
+		__sync_synchronize();
+		vi->stats->magic = VOS_STATS_MAGIC;
+		vi->irqc.rung = vi->stats->doorbells_sent;
+		size = stats_offset + VOS_STATS_DEV_OFFSET + VOS_STATS_DEV_SIZE;
+	}
+
+	/*
+	 * Device shared memory regions come last. Revision 4 includes
+	 * revision 3, so they are only offered along with the checkpoint.
+	 */
+	regions = (void *)((char *)virtio_header +
+			VIRTIO_SHMEM_REGIONS_OFFSET(base->vops->cfgsize));
+	for (i = 0; i < vi->nr_shm_regions; i++) {
+		r = &vi->shm_regions[i];
+		offset = (size + r->align - 1) & ~(r->align - 1);
+		if (!vi->checkpoint || VIRTIO_SHMEM_REGIONS_OFFSET(base->vops->cfgsize) +
+		    sizeof(*regions) > ckpt_offset ||
+		    offset + r->size > vi->shmem_info.mem_size || offset + r->size > UINT32_MAX) {
+			pr_err("No room for shared memory region %u of 0x%lx bytes\n",
+			       r->id, (unsigned long)r->size);
+			continue;
+		}
+		r->offset = offset;
+		size = offset + r->size;
+		nr_regions++;
+		pr_info("Shared memory region %u at 0x%lx, 0x%lx bytes\n", r->id,
+			(unsigned long)r->offset, (unsigned long)r->size);
+	}
+
+	if (vi->checkpoint)
+		resumed = vos_checkpoint_resume(vi, size, ckpt_capacity);
+
+	if (resumed) {
+		pr_info("Resumed live device from checkpoint\n");
+		vi->shmem_info.peer_id = virtio_header->frontend_id;
+		virtio_header->backend_status = (vi->shmem_info.this_id << 16) | BACKEND_FLAG_PRESENT;
+		base->vops->cfgread(base, 0, base->vops->cfgsize, (void *)virtio_header->config);
+	} else {
+		memset(virtio_header, 0, sizeof(struct virtio_shmem_header));
+		virtio_header->backend_status = (vi->shmem_info.this_id << 16) | BACKEND_FLAG_PRESENT;
+		virtio_header->revision = 1;
+
+		virtio_header->device_id = pci_get_cfgdata16(&vi->pci_vdev, PCIR_SUBDEV_0);
+		virtio_header->vendor_id = pci_get_cfgdata16(&vi->pci_vdev, PCIR_SUBVEND_0);
+		base->vops->cfgread(base, 0, base->vops->cfgsize, (void *)virtio_header->config);
+
+		memset(vi->write_ring, 0, sizeof(*vi->write_ring));
+		if (nr_regions) {
+			memset(regions, 0, sizeof(*regions));
+			for (i = 0; i < vi->nr_shm_regions; i++) {
+				r = &vi->shm_regions[i];
+				if (!r->offset)
+					continue;
+				regions->regions[regions->nr].id = r->id;
+				regions->regions[regions->nr].offset = r->offset;
+				regions->regions[regions->nr].length = r->size;
+				regions->nr++;
+			}
+		}
+		if (vi->checkpoint) {
+			memset(vi->checkpoint, 0, sizeof(struct vos_checkpoint));
+			vi->checkpoint->magic = VOS_CHECKPOINT_MAGIC;
+			vi->checkpoint->device_id = virtio_header->device_id;
+			vi->checkpoint->nvq = base->vops->nvq;
+			vi->checkpoint->dev_capacity = ckpt_capacity;
+			vos_checkpoint_save(vi, false);
+		}
+		virtio_header->size = size;
+		virtio_header->stats_page = vi->stats ? stats_offset >> 12 : 0;
+		__sync_synchronize();
+		if (nr_regions)
+			virtio_header->revision = VIRTIO_SHMEM_REVISION_SHM_REGIONS;
+		else
+			virtio_header->revision = vi->checkpoint ?
+				VIRTIO_SHMEM_REVISION_CHECKPOINT : VIRTIO_SHMEM_REVISION_WRITE_RING;
+	}
 
-	pci_vdev.msix.enabled = 1;
+	/*
+	 * The worker threads run as soon as their fds are added, so they
+	 * only start once the header and the device are set up.
+	 */
+	if (setup_workers(vi, info) < 0) {
+		pr_err("%s: failed to set up queue workers\n", __func__);
+		ret = -1;
+		goto stop_workers;
+	}
+	if (resumed)
+		vos_resume_kick(vi);
 
+	info->instance = vi;
 	return 0;
 
+stop_workers:
+	teardown_workers(vi);
+	virtio_header->backend_status = 0;
+	info->vdev_inited = false;
+	if (vi->pci_vdev.dev_ops->vdev_deinit)
+		vi->pci_vdev.dev_ops->vdev_deinit(vi->pci_vdev.vmctx, &vi->pci_vdev, NULL);
+
 deregister_mevents:
-	for (i = 0; i < MAX_IRQS; i++) {
-		if (mevents[i])
-			mevent_delete(mevents[i]);
-	}
+	irq_coalesce_deinit(&vi->irqc);
 
 //close_shmem:
-//	info->shmem_ops->close(&shmem_info);
+//	info->shmem_ops->close(&vi->shmem_info);
 
 close_evt_fds:
-	for (i = 0; i < MAX_IRQS; i++) {
-		if (evt_fds[i])
-			close(evt_fds[i]);
-	}
+	close_evt_fds(vi);
+	if (--nr_instances == 0)
+		mevent_deinit();
 
+free_instance:
+	pthread_mutex_destroy(&vi->checkpoint_mtx);
+	pthread_rwlock_destroy(&vi->cfg_lock);
+	free(vi);
 	return ret;
 }
 /*
@@ -251,19 +1005,29 @@ void vos_backend_run(void)
 
 void vos_backend_deinit(struct virtio_backend_info *info)
 {
-	int i;
+	struct vos_instance *vi = info->instance;
 
 	info->vdev_inited = false;
 	info->vdev_termed = true;
 
-	for (i = 0; i < 2; i++) {
-		mevent_delete(mevents[i]);
-		close(evt_fds[i]);
-	}
-	shmem_info.ops->close(&shmem_info);
-	mevent_deinit();
+	if (!vi)
+		return;
+	info->instance = NULL;
+
+	teardown_workers(vi);
+	close_evt_fds(vi);
+	vi->write_ring = NULL;
 
-	if (pci_vdev.dev_ops->vdev_deinit) {
-		pci_vdev.dev_ops->vdev_deinit(pci_vdev.vmctx, &pci_vdev, NULL);
+	if (vi->pci_vdev.dev_ops->vdev_deinit) {
+		vi->pci_vdev.dev_ops->vdev_deinit(vi->pci_vdev.vmctx, &vi->pci_vdev, NULL);
 	}
+
+	irq_coalesce_deinit(&vi->irqc);
+	vi->shmem_info.ops->close(&vi->shmem_info);
+	if (--nr_instances == 0)
+		mevent_deinit();
+
+	pthread_mutex_destroy(&vi->checkpoint_mtx);
+	pthread_rwlock_destroy(&vi->cfg_lock);
+	free(vi);
 }
@@ -6,8 +6,27 @@
 #include <linux/virtio_pci.h>
 
 #include <pci_core.h>
+#include <iothread.h>
 
 #include "shmem.h"
+#include "irq_coalesce.h"
+
+#define VOS_MAX_WORKERS		4
+
+/*
+ * A group of virtqueues served by a dedicated worker thread instead of the
+ * mevent loop. Doorbell vectors listed in vectors are polled by the worker
+ * directly; a doorbell on any other vector that finds work on these queues
+ * kicks the worker.
+ */
+struct vos_worker_config {
+	uint32_t queues;	/* bit N: virtqueue N */
+	uint32_t vectors;	/* bit N: doorbell vector N */
+	uint64_t cpu_mask;	/* bit N: CPU N, 0 for no affinity */
+	int priority;		/* SCHED_FIFO priority, 0 for default */
+};
+
+struct vos_instance;
 
 struct virtio_backend_info {
 	// init at runtime
@@ -15,6 +34,9 @@ struct virtio_backend_info {
 	const char *shmem_devpath;
 
 	char *opts;
+	struct irq_coalesce_params irq_coalesce;
+	struct vos_worker_config workers[VOS_MAX_WORKERS];
+	int nr_workers;
 
 	pthread_t tid;
 	void *native_window;
@@ -25,6 +47,8 @@ struct virtio_backend_info {
 	struct pci_vdev_ops *pci_vdev_ops;
 
 	void (*hook_before_init)(struct virtio_backend_info *info);
+
+	struct vos_instance *instance;
 };
 
 #define BACKEND_FLAG_PRESENT   0x0001
@@ -44,7 +68,7 @@ struct virtio_shmem_header {
 	};
 	uint8_t config_event;
 	uint8_t queue_event;
-	uint8_t __rsvd[2];
+	uint16_t stats_page;	/* struct vos_stats offset in 4K pages, 0 if none */
 	union {
 		uint32_t frontend_status;
 		struct {
@@ -64,14 +88,223 @@ struct virtio_shmem_header {
 	char config[];
 };
 
+/*
+ * Header revisions:
+ *  1 - register writes go through the single write_transaction slot
+ *  2 - additionally, a ring of pending register writes follows the device
+ *      config (see struct virtio_shmem_write_ring); the frontend may queue
+ *      several writes and ring the doorbell once for all of them
+ */
+#define VIRTIO_SHMEM_REVISION_WRITE_RING	2
+/*
+ *  3 - additionally, a backend checkpoint follows the write ring (see
+ *      struct vos_checkpoint); a restarted backend resumes from it, so the
+ *      frontend keeps the device running across a backend restart
+ */
+#define VIRTIO_SHMEM_REVISION_CHECKPOINT	3
+/*
+ *  4 - additionally, a table of device shared memory regions follows the
+ *      write ring (see struct virtio_shmem_regions)
+ */
+#define VIRTIO_SHMEM_REVISION_SHM_REGIONS	4
+
+#define VIRTIO_SHMEM_WRITE_RING_SIZE	32
+
+struct virtio_shmem_write_entry {
+	uint16_t offset;	/* register offset in the header */
+	uint16_t size;		/* 1, 2 or 4 */
+	uint32_t value;
+};
+
+struct virtio_shmem_write_ring {
+	uint32_t head;		/* produced by the frontend */
+	uint32_t tail;		/* consumed by the backend */
+	struct virtio_shmem_write_entry entries[VIRTIO_SHMEM_WRITE_RING_SIZE];
+};
+
+#define VIRTIO_SHMEM_WRITE_RING_OFFSET(cfgsize) \
+	((sizeof(struct virtio_shmem_header) + (cfgsize) + 63) & ~63UL)
+
+/*
+ * Shared memory regions of the device, the counterpart of the
+ * VIRTIO_PCI_CAP_SHARED_MEMORY_CFG capabilities of virtio-pci. They follow
+ * the statistics, aligned as the device asked (to huge pages, typically),
+ * and are covered by size like the rest of the backend layout. The
+ * frontend treats them as device memory: what lives where inside a region
+ * is up to the device protocol.
+ */
+#define VIRTIO_SHMEM_MAX_SHM_REGIONS	4
+
+struct virtio_shmem_region {
+	uint8_t id;		/* device specific shmid */
+	uint8_t __rsvd[7];
+	uint64_t offset;	/* from the start of the shared memory */
+	uint64_t length;
+};
+
+struct virtio_shmem_regions {
+	uint32_t nr;
+	uint32_t __rsvd;
+	struct virtio_shmem_region regions[VIRTIO_SHMEM_MAX_SHM_REGIONS];
+};
+
+#define VIRTIO_SHMEM_REGIONS_OFFSET(cfgsize) \
+	((VIRTIO_SHMEM_WRITE_RING_OFFSET(cfgsize) + \
+	  sizeof(struct virtio_shmem_write_ring) + 63) & ~63UL)
+
+/*
+ * Backend state needed to resume a live device. Only the backend writes it;
+ * seq is odd while an update is in progress, so a backend that dies halfway
+ * leaves a checkpoint its successor ignores. Virtqueue indices are not
+ * saved: a resumed backend continues from used->idx and replays whatever
+ * the frontend made available after it.
+ */
+#define VOS_CHECKPOINT_MAGIC		0x54504b43	/* "CKPT" */
+#define VOS_CHECKPOINT_MAX_VQS		8
+#define VOS_CHECKPOINT_DEV_SIZE		(256 * 1024)	/* without checkpoint_size */
+
+struct vos_checkpoint_vq {
+	uint16_t qsize;
+	uint16_t msix_idx;
+	uint16_t enabled;
+	uint16_t __rsvd;
+	uint32_t gpa_desc[2];
+	uint32_t gpa_avail[2];
+	uint32_t gpa_used[2];
+};
+
+struct vos_checkpoint {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t device_id;
+	uint32_t nvq;
+	uint64_t negotiated_caps;
+	uint32_t status;
+	uint32_t msix_cfg_idx;
+	struct vos_checkpoint_vq vqs[VOS_CHECKPOINT_MAX_VQS];
+	uint32_t dev_size;	/* bytes of dev_state in use */
+	uint32_t dev_capacity;
+	uint8_t dev_state[];	/* virtio_ops checkpoint/restore format */
+};
+
+#define VIRTIO_SHMEM_CHECKPOINT_OFFSET(cfgsize) \
+	((VIRTIO_SHMEM_WRITE_RING_OFFSET(cfgsize) + \
+	  sizeof(struct virtio_shmem_write_ring) + 4095) & ~4095UL)
+
+/*
+ * Transport statistics, placed on its own page after the rest of the
+ * layout. Counters are only written by the backend, with relaxed atomic
+ * adds, so a host tool mapping the region or the frontend can read them at
+ * any time without coordinating with the backend. Counters start from zero
+ * whenever a backend starts.
+ */
+#define VOS_STATS_MAGIC			0x54415453	/* "STAT" */
+#define VOS_STATS_VERSION		2
+#define VOS_STATS_MAX_VECTORS		8
+#define VOS_STATS_MAX_QUEUES		8
+#define VOS_STATS_BATCH_BUCKETS		8
+#define VOS_STATS_DEV_SIZE		(16 * 1024)
+
+struct vos_stats_queue {
+	uint64_t chains;	/* descriptor chains completed */
+	uint64_t batches;	/* vq_endchains() calls that completed any */
+	uint64_t busy_ns;	/* first chain taken to batch completed, summed */
+	/* chains per batch: 1, 2-3, 4-7, ..., 128 and more */
+	uint64_t batch_hist[VOS_STATS_BATCH_BUCKETS];
+};
+
+struct vos_stats {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nr_vectors;
+	uint32_t nr_queues;
+	uint64_t doorbells_received[VOS_STATS_MAX_VECTORS];	/* per vector, from the frontend */
+	uint64_t irqs_raised[VOS_STATS_MAX_VECTORS];	/* per vector, before coalescing */
+	uint64_t doorbells_sent[VOS_STATS_MAX_VECTORS];	/* per vector, to the frontend */
+	uint64_t write_transactions;	/* register writes from the slot or the ring */
+	uint64_t write_errors;		/* register writes rejected */
+	struct vos_stats_queue queues[VOS_STATS_MAX_QUEUES];
+	/* device statistics, in a device specific format; 0 if none */
+	uint32_t dev_offset;		/* from the start of this struct */
+	uint32_t dev_size;
+};
+
+#define VOS_STATS_DEV_OFFSET	((sizeof(struct vos_stats) + 63) & ~63UL)
+
+#define VOS_STAT_ADD(vi, counter, n) do {					\
+	if ((vi)->stats)							\
+		__atomic_fetch_add(&(vi)->stats->counter, (n), __ATOMIC_RELAXED); \
+} while (0)
+
 #define VI_REG_OFFSET(reg) \
 	__builtin_offsetof(struct shmem_virtio_header, reg)
 
-extern struct virtio_shmem_header *virtio_header;
+#define VOS_MAX_IRQS		8
+
+struct vos_worker {
+	struct vos_instance *vi;
+	int pool_idx;
+	uint32_t queues;
+	int kick_fd;
+	struct iothread_mevent kick_mevt;
+	struct vos_vector_event {
+		struct iothread_mevent mevt;
+		struct vos_worker *worker;
+		int vector;
+	} vec_evts[VOS_MAX_IRQS];
+};
+
+/*
+ * One shared memory region and the device behind it. A process may serve
+ * several of them from the same mevent loop and worker threads.
+ *
+ * shmem_info must stay first: the device's vmctx points at the instance and
+ * the helpers in dm_helpers.c use it as a struct shmem_info.
+ */
+struct vos_instance {
+	struct shmem_info shmem_info;
+	struct virtio_backend_info *info;
+
+	struct virtio_shmem_header *header;
+	struct virtio_shmem_write_ring *write_ring;
+	uint32_t cfg_end;
+
+	int evt_fds[VOS_MAX_IRQS];
+	struct mevent *mevents[VOS_MAX_IRQS];
+	struct pci_vdev pci_vdev;
+	struct irq_coalesce irqc;
+
+	struct vos_worker workers[VOS_MAX_WORKERS];
+	int nr_workers;
+	/* queues left to the mevent loop, and the fd other threads kick it with */
+	uint32_t default_queues;
+	int default_kick_fd;
+	struct mevent *default_kick_mevent;
+	/* config writes exclude queue processing running on other threads */
+	pthread_rwlock_t cfg_lock;
+
+	struct vos_checkpoint *checkpoint;
+	struct vos_stats *stats;
+	pthread_mutex_t checkpoint_mtx;
+
+	/* asked for by the device while it initializes, placed afterwards */
+	struct vos_shm_region {
+		uint8_t id;
+		uint64_t size;
+		uint64_t align;
+		uint64_t offset;	/* 0 if it did not fit */
+	} shm_regions[VIRTIO_SHMEM_MAX_SHM_REGIONS];
+	int nr_shm_regions;
+};
 
 int vos_backend_init(struct virtio_backend_info *info);
 void vos_backend_run(void);
 void vos_backend_deinit(struct virtio_backend_info *info);
+void vos_checkpoint_save(struct vos_instance *vi, bool device);
+void vos_stats_batch(struct vos_instance *vi, int queue, uint16_t chains, uint64_t ns);
+void *vos_stats_dev_area(struct vos_instance *vi, size_t size);
+int vos_shm_region_request(struct vos_instance *vi, uint8_t id, uint64_t size, uint64_t align);
+void *vos_shm_region(struct vos_instance *vi, uint8_t id, uint64_t *offset, uint64_t *size);
 
 //void write_config(struct virtio_base *base,int offset,int size);
 